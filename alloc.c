@@ -1,283 +1,1412 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "alloc.h"
+#include "global.h"
+#include "symtab.h"
 #include "types.h"
 
-struct heap_item global_heap_start = { NULL, 0, NULL, };
-struct heap_item *global_heap = &global_heap_start;
+/*
+ * Blocks of up to SLAB_CLASS_MAX bytes come from slabs, one size class per
+ * power of two from SLAB_CLASS_MIN. Each class hands out freed blocks first,
+ * then carves the rest of its newest slab. Slabs are never given back.
+ */
+#define SLAB_SIZE               ((size_t)64 << 10)
+#define SLAB_ALIGN              64              /* A cache line. */
+#define SLAB_CLASS_MIN          ((size_t)16)
+#define SLAB_CLASS_MAX          ((size_t)4096)
+#define NUM_SLAB_CLASSES        9
 
 /*
- * TODO:
- *  - We should consider a way to reduce the number of allocations we make for
- *    the heap items as much as possible.
- *  - Fix error handling (for now we just return null).
+ * Chunks start small, as most calls allocate little or nothing, and double
+ * up to ARENA_CHUNK_MAX. The smallest ones are slab allocated, so that a call
+ * that allocates costs no malloc() in the common case.
  */
+#define ARENA_CHUNK_MIN         SLAB_CLASS_MAX
+#define ARENA_CHUNK_MAX         ((size_t)1 << 20)
 
-struct value *
-alloc_value(struct heap_item **heap)
+struct slab_class {
+	void                    *free;          /* Freed blocks, linked. */
+	char                    *next, *end;    /* Uncarved part of a slab. */
+	size_t                  slabs;
+	size_t                  carved, used;   /* Blocks. */
+};
+
+struct arena_chunk {
+	struct arena_chunk      *next;
+	size_t                  size;           /* Including this header. */
+	char                    data[];
+};
+
+struct arena_owned {
+	struct vector           *vector;
+	struct arena_owned      *next;
+};
+
+struct arena global_arena = ARENA_INIT;
+__thread size_t alloc_stats[Num_alloc_stats];
+size_t alloc_pause_ns;
+
+/* Each thread has slabs of its own. */
+static __thread struct slab_class slab_classes[NUM_SLAB_CLASSES];
+static __thread size_t large_used;
+
+/*
+ * The functions the compiler made that have not been freed yet. The top level
+ * is collected once there are twice as many as were kept the last time.
+ */
+#define COMPILED_MIN            ((size_t)256)
+
+static struct func **compiled;
+static size_t num_compiled, compiled_cap;
+static size_t compiled_limit = COMPILED_MIN;
+static bool *compiled_marks;    /* While collecting the top level. */
+
+/*
+ * The pairs of the constant pool, interned by their car and cdr.
+ */
+static int const_cmp(void *, void *);
+static size_t const_hash(void *);
+
+static struct space constants;
+static struct map interned = { 0, 0, NULL, &const_cmp, &const_hash, NULL };
+
+/*
+ * Collection pauses, by the power of two of microseconds that they stayed
+ * under.
+ */
+#define NUM_PAUSE_BUCKETS       24
+
+static __thread size_t pause_buckets[NUM_PAUSE_BUCKETS];
+
+/*
+ * What the threads that flushed their counters counted, which the reports
+ * add to those of the thread that prints them.
+ */
+static size_t flushed_stats[Num_alloc_stats];
+static size_t flushed_pauses[NUM_PAUSE_BUCKETS];
+static struct slab_class flushed_classes[NUM_SLAB_CLASSES];
+static size_t flushed_large;
+static pthread_mutex_t flushed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *alloc_stat_names[Num_alloc_stats] = {
+	[Pairs_stat] = "pairs",
+	[Pair_bytes_stat] = "pair bytes",
+	[Vectors_stat] = "vectors",
+	[Vector_bytes_stat] = "vector bytes",
+	[Slices_stat] = "slices",
+	[Slice_bytes_stat] = "slice bytes",
+	[Functions_stat] = "functions",
+	[Function_bytes_stat] = "function bytes",
+	[Closures_stat] = "closures",
+	[Evacuated_stat] = "evacuated",
+	[Promoted_stat] = "promoted",
+	[Released_bytes_stat] = "released bytes",
+	[Minor_collections_stat] = "minor collections",
+	[Major_collections_stat] = "major collections",
+	[Collection_ns_stat] = "collection ns",
+	[Collection_steps_stat] = "collection steps",
+	[Max_pause_ns_stat] = "max pause ns",
+	[Top_collections_stat] = "top collections",
+	[Freed_functions_stat] = "freed functions",
+	[Constant_pairs_stat] = "constant pairs",
+	[Matrices_stat] = "matrices",
+};
+
+static void
+out_of_memory(void)
 {
-	struct value *v;
-	(*heap)->next = malloc(sizeof (struct heap_item));
-	if ((*heap)->next == NULL)
-		return NULL;
-	if ((v = malloc(sizeof (struct value))) == NULL)
-		return NULL;
-	memset(v, 0, sizeof (struct value));
-	(*heap)->data = v;
-	(*heap)->next->data = (*heap)->next->next = NULL;
-	(*heap)->next->locality = 0;
-	*heap = (*heap)->next;
-	return v;
+	fprintf(stderr, "Out of memory.\n");
+	abort();
 }
 
-struct func *
-alloc_func(struct heap_item **heap)
+static inline struct slab_class *
+slab_class_of(size_t size)
 {
-	struct func *f;
-	(*heap)->next = malloc(sizeof (struct heap_item));
-	if ((*heap)->next == NULL)
-		return NULL;
-	if ((f = malloc(sizeof (struct func))) == NULL)
-		return NULL;
-	memset(f, 0, sizeof (struct func));
-	(*heap)->data = f;
-	(*heap)->next->data = (*heap)->next->next = NULL;
-	(*heap)->next->locality = 0;
-	*heap = (*heap)->next;
-	f->args = alloc_vector(heap, 1);
-	return f;
+	if (size <= SLAB_CLASS_MIN)
+		return &slab_classes[0];
+	return &slab_classes[(sizeof(long) * 8 - __builtin_clzl(size - 1)) -
+			     __builtin_ctzl(SLAB_CLASS_MIN)];
 }
 
-struct pair *
-alloc_pair(struct heap_item **heap)
+static inline size_t
+slab_class_size(struct slab_class *c)
 {
-	struct pair *p;
-	(*heap)->next = malloc(sizeof (struct heap_item));
-	if ((*heap)->next == NULL)
-		return NULL;
-	if ((p = malloc(sizeof (struct pair))) == NULL)
+	return SLAB_CLASS_MIN << (c - slab_classes);
+}
+
+/*
+ * Returns a block of at least size bytes, which must be given back with
+ * slab_free() and the same size. Zero bytes are NULL.
+ */
+void *
+slab_alloc(size_t size)
+{
+	struct slab_class *c;
+	void *p;
+
+	if (size == 0)
 		return NULL;
-	memset(p, 0, sizeof (struct pair));
-	(*heap)->data = p;
-	(*heap)->next->data = (*heap)->next->next = NULL;
-	(*heap)->next->locality = 0;
-	*heap = (*heap)->next;
+	if (size > SLAB_CLASS_MAX) {
+		if ((p = malloc(size)) == NULL)
+			out_of_memory();
+		large_used++;
+		return p;
+	}
+
+	c = slab_class_of(size);
+	if ((p = c->free) != NULL)
+		c->free = *(void **)p;
+	else {
+		if (c->next == c->end) {
+			c->next = aligned_alloc(SLAB_ALIGN, SLAB_SIZE);
+			if (c->next == NULL)
+				out_of_memory();
+			c->end = c->next + SLAB_SIZE;
+			c->slabs++;
+		}
+		p = c->next;
+		c->next += slab_class_size(c);
+		c->carved++;
+	}
+	c->used++;
 	return p;
 }
 
-struct vector *
-alloc_vector(struct heap_item **heap, size_t min_cap)
+void
+slab_free(void *p, size_t size)
 {
-	struct vector *v;
-	(*heap)->next = malloc(sizeof (struct heap_item));
-	if ((*heap)->next == NULL)
-		return NULL;
-	if ((v = malloc(sizeof (struct vector))) == NULL)
-		return NULL;
-	v->len = 0;
-	v->cap = min_cap;
-	if ((v->items = calloc(min_cap, sizeof(struct value))) == NULL)
-		return NULL;
-	(*heap)->data = v;
-	(*heap)->next->data = (*heap)->next->next = NULL;
-	(*heap)->next->locality = 0;
-	*heap = (*heap)->next;
-	return v;
+	struct slab_class *c;
+
+	if (p == NULL)
+		return;
+	if (size > SLAB_CLASS_MAX) {
+		free(p);
+		large_used--;
+		return;
+	}
+	c = slab_class_of(size);
+	*(void **)p = c->free;
+	c->free = p;
+	c->used--;
 }
 
-struct slice *
-alloc_slice(struct heap_item **heap)
+void *
+slab_realloc(void *p, size_t old_size, size_t size)
 {
-	struct slice *s;
-	(*heap)->next = malloc(sizeof (struct heap_item));
-	if ((*heap)->next == NULL)
-		return NULL;
-	if ((s = malloc(sizeof (struct slice))) == NULL)
-		return NULL;
-	s->len = 0;
-	s->start = NULL;
-	(*heap)->data = s;
-	(*heap)->next->data = (*heap)->next->next = NULL;
-	(*heap)->next->locality = 0;
-	*heap = (*heap)->next;
-	return s;
+	void *q;
+
+	if (p != NULL && old_size > SLAB_CLASS_MAX && size > SLAB_CLASS_MAX) {
+		if ((q = realloc(p, size)) == NULL)
+			out_of_memory();
+		return q;
+	}
+	if (p != NULL && old_size <= SLAB_CLASS_MAX && size <= SLAB_CLASS_MAX &&
+	    size != 0 && slab_class_of(old_size) == slab_class_of(size))
+		return p;
+
+	q = slab_alloc(size);
+	if (p != NULL)
+		memcpy(q, p, old_size < size ? old_size : size);
+	slab_free(p, old_size);
+	return q;
 }
 
 /*
- * Free the entire heap.
+ * Add what this thread counted to flushed_stats and start counting anew.
  */
 void
-clear_heap(struct heap_item *curr_item)
+alloc_stats_flush(void)
 {
-	while (curr_item != NULL && curr_item->data != NULL) {
-		void *f1 = curr_item, *f2 = curr_item->data;
-		curr_item = curr_item->next;
-		free(f1);
-		free(f2);
+	size_t i;
+
+	pthread_mutex_lock(&flushed_lock);
+	for (i = 0; i < Num_alloc_stats; i++)
+		if (i == Max_pause_ns_stat) {
+			if (alloc_stats[i] > flushed_stats[i])
+				flushed_stats[i] = alloc_stats[i];
+		} else
+			flushed_stats[i] += alloc_stats[i];
+	for (i = 0; i < NUM_PAUSE_BUCKETS; i++)
+		flushed_pauses[i] += pause_buckets[i];
+	/* What one thread frees, another may have allocated. */
+	for (i = 0; i < NUM_SLAB_CLASSES; i++) {
+		flushed_classes[i].slabs += slab_classes[i].slabs;
+		flushed_classes[i].carved += slab_classes[i].carved;
+		flushed_classes[i].used += slab_classes[i].used;
+		slab_classes[i].slabs = slab_classes[i].carved = 0;
+		slab_classes[i].used = 0;
 	}
-	free(curr_item);
+	flushed_large += large_used;
+	pthread_mutex_unlock(&flushed_lock);
+	memset(alloc_stats, 0, sizeof(alloc_stats));
+	memset(pause_buckets, 0, sizeof(pause_buckets));
+	large_used = 0;
 }
 
 /*
- * Removes an item from the heap.
+ * The counters of this thread along with those flushed by the others.
  */
-static struct heap_item *
-remove_item(struct heap_item *heap_start, void *item)
+static void
+all_stats(size_t *stats, size_t *pauses)
 {
-	struct heap_item *p, **prevp;
+	size_t i;
 
-	/*
-	 * Check if the item is the first in the heap. If it is we'll need to
-	 * reclaim some new space for its return value.
-	 */
-	if (heap_start->data == item) {
-		struct heap_item saved = *heap_start;
-		p = heap_start->next;
-		*heap_start = *p;
-		*p = saved;
-		return p;
+	pthread_mutex_lock(&flushed_lock);
+	for (i = 0; i < Num_alloc_stats; i++)
+		if (i == Max_pause_ns_stat)
+			stats[i] = (alloc_stats[i] > flushed_stats[i])
+				? alloc_stats[i] : flushed_stats[i];
+		else
+			stats[i] = alloc_stats[i] + flushed_stats[i];
+	for (i = 0; i < NUM_PAUSE_BUCKETS; i++)
+		pauses[i] = pause_buckets[i] + flushed_pauses[i];
+	pthread_mutex_unlock(&flushed_lock);
+}
+
+void
+alloc_stats_sum(size_t *stats)
+{
+	size_t pauses[NUM_PAUSE_BUCKETS];
+
+	all_stats(stats, pauses);
+}
+
+/*
+ * Print how full the slabs of each size class are, those of this thread along
+ * with those that the others flushed. The difference between the blocks in
+ * use and the blocks carved out of the slabs is fragmentation.
+ */
+void
+alloc_report(void)
+{
+	struct slab_class *c, *f;
+	size_t slabs, carved, used, stats[Num_alloc_stats],
+	    pauses[NUM_PAUSE_BUCKETS];
+
+	all_stats(stats, pauses);
+	fprintf(stderr, "%-8s %8s %10s %10s %10s\n",
+		"class", "slabs", "in use", "free", "occupancy");
+	pthread_mutex_lock(&flushed_lock);
+	for (c = slab_classes, f = flushed_classes;
+	     c < slab_classes + NUM_SLAB_CLASSES; c++, f++) {
+		if ((slabs = c->slabs + f->slabs) == 0)
+			continue;
+		carved = c->carved + f->carved;
+		used = c->used + f->used;
+		fprintf(stderr, "%-8zu %8zu %10zu %10zu %9.1f%%\n",
+			slab_class_size(c), slabs, used, carved - used,
+			100.0 * used * slab_class_size(c) /
+			(slabs * SLAB_SIZE));
 	}
+	fprintf(stderr, "%-8s %8s %10zu\n", "large", "-",
+		large_used + flushed_large);
+	pthread_mutex_unlock(&flushed_lock);
+	fprintf(stderr, "%zu minor and %zu major collections\n",
+		stats[Minor_collections_stat],
+		stats[Major_collections_stat]);
+}
 
-	prevp = &heap_start->next;
-	for (p = *prevp; p->data != NULL; prevp = &p->next, p = p->next)
-		if (p->data == (void *)item) {
-			*prevp = p->next;
-			return p;
+void
+alloc_stats_report(void)
+{
+	char name[32];
+	size_t i, stats[Num_alloc_stats], pauses[NUM_PAUSE_BUCKETS];
+
+	all_stats(stats, pauses);
+	for (i = 0; i < Num_alloc_stats; i++)
+		fprintf(stderr, "%-20s %12zu\n", alloc_stat_names[i],
+			stats[i]);
+	for (i = 0; i < NUM_PAUSE_BUCKETS; i++) {
+		if (pauses[i] == 0)
+			continue;
+		snprintf(name, sizeof(name), "pauses < %zuus",
+			 (size_t)1 << i);
+		fprintf(stderr, "%-20s %12zu\n", name, pauses[i]);
+	}
+}
+
+/*
+ * Start a new chunk that fits at least size bytes and allocate from it.
+ */
+void *
+space_alloc_slow(struct space *s, size_t size)
+{
+	struct arena_chunk *c;
+	size_t chunk_size;
+	void *p;
+
+	chunk_size = ARENA_CHUNK_MIN;
+	if (s->chunks != NULL && s->chunks->size < ARENA_CHUNK_MAX)
+		chunk_size = s->chunks->size * 2;
+	else if (s->chunks != NULL)
+		chunk_size = ARENA_CHUNK_MAX;
+	while (chunk_size - sizeof(struct arena_chunk) < size)
+		chunk_size *= 2;
+
+	c = slab_alloc(chunk_size);
+	c->size = chunk_size;
+	c->next = s->chunks;
+	s->chunks = c;
+	if (c->next == NULL)
+		s->last = c;
+	s->size += chunk_size;
+
+	p = c->data;
+	s->free = c->data + size;
+	s->limit = (char *)c + chunk_size;
+	return p;
+}
+
+static inline uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Free what the space holds until there is nothing left or, if deadline is
+ * not 0, the clock has passed it. Returns whether nothing is left, in which
+ * case the space is empty again.
+ */
+static bool
+space_sweep(struct space *s, uint64_t deadline)
+{
+	struct arena_chunk *c;
+	struct arena_owned *o;
+	size_t n;
+
+	s->hit = NULL;
+	/* Vectors that were evacuated took their items along. */
+	for (n = 1; (o = s->owned) != NULL; n++) {
+		if ((s->owned = o->next) == NULL)
+			s->owned_last = NULL;
+		if (forwarded(o->vector) == NULL) {
+			alloc_stats[Released_bytes_stat] +=
+				items_size(o->vector);
+			slab_free(o->vector->items, items_size(o->vector));
 		}
-	return NULL;
+		if (deadline != 0 && n % 64 == 0 && now_ns() >= deadline)
+			return false;
+	}
+	while ((c = s->chunks) != NULL) {
+		if ((s->chunks = c->next) == NULL)
+			s->last = NULL;
+		alloc_stats[Released_bytes_stat] += c->size;
+		slab_free(c, c->size);
+		if (deadline != 0 && now_ns() >= deadline)
+			return false;
+	}
+	*s = (struct space)SPACE_INIT;
+	return true;
 }
 
-static struct heap_item *
-remove_nonlocals(struct heap_item *heap_start)
+static void
+space_release(struct space *s)
 {
-	struct heap_item *p, *saved = NULL;
+	space_sweep(s, 0);
+}
 
-	if (heap_start == NULL)
-		return NULL;
-	while (heap_start->locality > 0) {
-		struct heap_item curr = *heap_start;
-		curr.locality--;
-		p = heap_start->next;
-		*heap_start = *heap_start->next;
-		*p = curr;
-		p->next = saved;
-		saved = p;
+/*
+ * Move the chunks and vectors of t into s, which goes on allocating from the
+ * rest of its newest chunk.
+ */
+static void
+space_append(struct space *s, struct space *t)
+{
+	if (t->chunks != NULL) {
+		t->last->next = s->chunks;
+		if (s->chunks == NULL)
+			s->last = t->last;
+		s->chunks = t->chunks;
+	}
+	if (t->owned != NULL) {
+		t->owned_last->next = s->owned;
+		if (s->owned == NULL)
+			s->owned_last = t->owned_last;
+		s->owned = t->owned;
 	}
+	s->size += t->size;
+	*t = (struct space)SPACE_INIT;
+}
 
-	return saved;
+/*
+ * The slots of copies that may still point into the spaces being collected,
+ * the pairs whose cdr is left to copy, and, when the top level is collected,
+ * the functions whose code is left to trace.
+ */
+struct grey {
+	struct value    **slots;
+	struct pair     **pairs;
+	struct func     **funcs;
+	size_t          nslots, slots_cap;
+	size_t          npairs, pairs_cap;
+	size_t          nfuncs, funcs_cap;
+};
+
+struct arena_cycle {
+	struct space    from;           /* Frozen. */
+	struct grey     grey;
+	bool            major;
+};
+
+static void
+grey_free(struct grey *g)
+{
+	free(g->slots);
+	free(g->pairs);
+	free(g->funcs);
+	*g = (struct grey){ NULL, NULL, NULL, 0, 0, 0, 0, 0, 0 };
+}
+
+static void
+cycle_free(struct arena *a)
+{
+	space_release(&a->cycle->from);
+	grey_free(&a->cycle->grey);
+	free(a->cycle);
+	a->cycle = NULL;
+	a->collect_at = ARENA_NURSERY_SIZE;
 }
 
+/*
+ * Free everything allocated from the arena, and leave it empty.
+ */
 void
-make_nonlocal(struct heap_item *heap_start, void *item, size_t walk)
+arena_release(struct arena *a)
 {
-	struct heap_item *p, **prevp;
+	if (a->cycle != NULL)
+		cycle_free(a);
+	space_release(&a->nursery);
+	space_release(&a->tenured);
+	a->tenured_limit = ARENA_TENURED_MIN;
+}
 
-	if (heap_start->data == item) {
-		if (heap_start->locality < walk)
-			heap_start->locality = walk;
-		return;
+/*
+ * Give the objects of from, the arena of a call that returns, to to, the
+ * arena of its caller, without copying them. Nothing of to points into from,
+ * but from may point into the nursery of to, so that is tenured along with
+ * the tenured space of from, and the nursery of from becomes that of to. What
+ * of it is garbage is left to the next major collection, which is made due
+ * once the tenured space has grown past the larger of their limits, so that
+ * what is handed up a deep recursion is not collected at every level. Returns
+ * false, having done nothing, if a collection under way in either arena keeps
+ * it from being done, or if from fits in one chunk: what it returns is then
+ * cheaper to copy than the nursery of to is to tenure.
+ */
+bool
+arena_adopt(struct arena *to, struct arena *from)
+{
+	if (arena_is_empty(to)) {
+		*to = *from;
+		*from = (struct arena)ARENA_INIT;
+		return true;
 	}
-	prevp = &heap_start->next;
-	for (p = *prevp; p != NULL; prevp = &p->next, p = p->next)
-		if (p->data == item && p->locality < walk) {
-			struct heap_item saved;
-
-			p->locality = walk;
-			/*
-			 * Move the nonlocal to the front so that they are easy
-			 * to pick off.
-			 */
-			*prevp = p->next;
-			saved = *heap_start;
-			*heap_start = *p;
-			heap_start->next = p;
-			*p = saved;
-			return;
+	if (to->cycle != NULL || from->cycle != NULL ||
+	    from->nursery.size + from->tenured.size <= ARENA_CHUNK_MIN)
+		return false;
+	space_append(&to->tenured, &to->nursery);
+	space_append(&to->tenured, &from->tenured);
+	to->nursery = from->nursery;
+	from->nursery = (struct space)SPACE_INIT;
+	if (to->tenured_limit < from->tenured_limit)
+		to->tenured_limit = from->tenured_limit;
+	if (to->tenured.size >= to->tenured_limit)
+		to->collect_at = 0;
+	return true;
+}
+
+static inline bool
+in_chunk(struct arena_chunk *c, void *p)
+{
+	return (char *)p >= c->data && (char *)p < (char *)c + c->size;
+}
+
+/*
+ * Objects that are copied together were mostly allocated together, so the
+ * chunk the last one was found in is looked at first.
+ */
+static bool
+in_space(struct space *s, void *p)
+{
+	struct arena_chunk *c;
+
+	if (s->hit != NULL && in_chunk(s->hit, p))
+		return true;
+	for (c = s->chunks; c != NULL; c = c->next)
+		if (in_chunk(c, p)) {
+			s->hit = c;
+			return true;
 		}
+	return false;
+}
+
+bool
+arena_in_nursery(struct arena *a, void *p)
+{
+	return in_space(&a->nursery, p);
+}
+
+static inline void **
+forward_of(void *p)
+{
+	return (void **)p - 1;
 }
 
 /*
- * Finds and returns a vector of values that must be saved on the heap should
- * some value be retained. Items that must be saved are removed from the heap
- * and are put in a vector.
+ * The size of a function along with the values it captured.
  */
-struct heap_item *
-mark_heap(struct heap_item *heap_start, struct value retained)
+static inline size_t
+func_size(struct func *f)
+{
+	return sizeof(struct func) + sizeof(struct value) * f->ncaptures;
+}
+
+static void
+own_vector(struct space *s, struct vector *v)
+{
+	struct arena_owned *o;
+
+	o = space_alloc(s, sizeof(struct arena_owned));
+	o->vector = v;
+	if ((o->next = s->owned) == NULL)
+		s->owned_last = o;
+	s->owned = o;
+}
+
+/*
+ * Copying out of some spaces into another. Objects that are not in
+ * them are left where they are, along with everything they point to. Each
+ * object is copied shallowly, and the slots of the copy that may still point
+ * into the from spaces are greyed, so that neither long nor deep structures
+ * recurse. Only the parents of functions are followed directly, as they are
+ * linked through struct func pointers. An object that was copied to another
+ * from space, by a collection that is under way, is copied from there.
+ */
+struct evacuation {
+	struct space    *to, **from;
+	struct space    *spaces[3];     /* Unless from is larger. */
+	size_t          nfrom;
+	struct grey     *grey;
+	size_t          chain;          /* Most pairs of a list to copy. */
+	size_t          copied;         /* Objects. */
+	bool            follow;         /* Whether copies may be in from. */
+	bool            code;           /* Whether to grey functions. */
+};
+
+#define CYCLE_CHAIN             ((size_t)64)
+
+static __thread struct grey worklist;
+
+/* Frozen spaces of finished collections, which are released in steps. */
+static __thread struct space dead;
+
+static void
+grow(void **p, size_t *cap, size_t size)
+{
+	*cap = *cap ? *cap * 2 : 256;
+	if ((*p = realloc(*p, size * *cap)) == NULL)
+		out_of_memory();
+}
+
+/*
+ * Anything stored into a slot later is never in the from spaces, so a slot
+ * that holds no object yet can be left alone.
+ */
+static inline void
+push_slot(struct evacuation *e, struct value *slot)
+{
+	struct grey *g = e->grey;
+
+	if (!is_heap_allocated(*slot))
+		return;
+	if (g->nslots == g->slots_cap)
+		grow((void **)&g->slots, &g->slots_cap,
+		     sizeof(struct value *));
+	g->slots[g->nslots++] = slot;
+}
+
+static inline void
+push_pair(struct evacuation *e, struct pair *p)
+{
+	struct grey *g = e->grey;
+
+	if (g->npairs == g->pairs_cap)
+		grow((void **)&g->pairs, &g->pairs_cap,
+		     sizeof(struct pair *));
+	g->pairs[g->npairs++] = p;
+}
+
+static inline void
+push_func(struct evacuation *e, struct func *f)
+{
+	struct grey *g = e->grey;
+
+	if (g->nfuncs == g->funcs_cap)
+		grow((void **)&g->funcs, &g->funcs_cap,
+		     sizeof(struct func *));
+	g->funcs[g->nfuncs++] = f;
+}
+
+static inline bool
+in_from(struct evacuation *e, void *p)
 {
 	size_t i;
-	struct value next;
-	struct heap_item *r, *p = NULL;
 
-	switch (retained.type) {
-	case Pair_type:
-		if (retained.p == NULL)
-			break;
-		if ((r = remove_item(heap_start, retained.p)) != NULL) {
-			r->next = NULL;
-			p = r;
-		}
-		if ((r = mark_heap(heap_start, retained.p->car)) != NULL) {
-			r->next = p;
-			p = r;
+	for (i = 0; i < e->nfrom; i++)
+		if (in_space(e->from[i], p))
+			return true;
+	return false;
+}
+
+/*
+ * The newest copy of p, an object in the from spaces, that is still in them.
+ */
+static inline void *
+follow(struct evacuation *e, void *p)
+{
+	void *q;
+
+	while (e->follow && (q = *forward_of(p)) != NULL && in_from(e, q))
+		p = q;
+	return p;
+}
+
+static struct pair *
+copy_pairs(struct evacuation *e, struct pair *p)
+{
+	struct pair *head, **tail, *q, *last = NULL;
+	size_t n;
+
+	for (tail = &head, n = 0;
+	     p != NULL && in_from(e, p);
+	     p = p->cdr, n++) {
+		p = follow(e, p);
+		if ((q = *forward_of(p)) != NULL) {
+			*tail = q;
+			return head;
 		}
-		next.type = Pair_type;
-		next.p = retained.p->cdr;
-		if (retained.p->cdr != NULL &&
-		    (r = mark_heap(heap_start, next)) != NULL) {
-			r->next = p;
-			p = r;
+		if (n == e->chain) {
+			/* The rest of the list is for later. */
+			push_pair(e, last);
+			break;
 		}
-		break;
+		q = space_alloc(e->to, sizeof(struct pair));
+		*forward_of(p) = q;
+		e->copied++;
+		q->car = p->car;
+		push_slot(e, &q->car);
+		*tail = last = q;
+		tail = &q->cdr;
+	}
+	*tail = p;
+	return head;
+}
 
-	case Function_type:
-		if ((r = remove_item(heap_start, retained.f)) != NULL) {
-			r->next = NULL;
-			p = r;
-		}
-		if ((r = remove_item(heap_start, retained.f->args)) != NULL) {
-			r->next = p;
-			p = r;
+static struct vector *
+copy_vector(struct evacuation *e, struct vector *v)
+{
+	struct vector *w;
+	size_t i;
+
+	if (v == NULL || !in_from(e, v))
+		return v;
+	v = follow(e, v);
+	if ((w = *forward_of(v)) != NULL)
+		return w;
+	w = space_alloc(e->to, sizeof(struct vector));
+	*forward_of(v) = w;
+	e->copied++;
+	*w = *v;
+	own_vector(e->to, w);
+	if (w->elem == Value_elem)
+		for (i = 0; i < w->len; i++)
+			push_slot(e, &w->items[i]);
+	return w;
+}
+
+static struct func *
+copy_funcs(struct evacuation *e, struct func *f)
+{
+	struct func *head, **tail, *g;
+	struct value *p;
+	size_t i;
+
+	for (tail = &head; f != NULL && in_from(e, f); f = f->parent) {
+		f = follow(e, f);
+		if ((g = *forward_of(f)) != NULL) {
+			*tail = g;
+			return head;
 		}
+		g = space_alloc(e->to, func_size(f));
+		*forward_of(f) = g;
+		e->copied++;
+		memcpy(g, f, func_size(f));
+		if (e->code)
+			push_func(e, g);
+		g->args = copy_vector(e, f->args);
+		if (g->ncaptures > 0)
+			g->captures = (struct value *)(g + 1);
+		for (i = 0; i < g->ncaptures; i++)
+			push_slot(e, &g->captures[i]);
+		/*
+		 * The only functions allocated at run time are closures,
+		 * whose contexts are their own copies of the variables they
+		 * closed over.
+		 */
+		if (g->rt_context != NULL)
+			for (p = g->rt_context->local_start;
+			     p < g->rt_context->local_end;
+			     p++)
+				push_slot(e, p);
+		*tail = g;
+		tail = &g->parent;
+	}
+	if (e->code && f != NULL)
+		push_func(e, f);
+	*tail = f;
+	return head;
+}
+
+static struct slice *
+copy_slice(struct evacuation *e, struct slice *s)
+{
+	struct slice *t;
+
+	if (!in_from(e, s))
+		return s;
+	s = follow(e, s);
+	if ((t = *forward_of(s)) != NULL)
+		return t;
+	t = space_alloc(e->to, sizeof(struct slice));
+	*forward_of(s) = t;
+	e->copied++;
+	*t = *s;
+	/* The items stay where they are, along with the vector. */
+	t->parent = copy_vector(e, s->parent);
+	return t;
+}
+
+static struct matrix *
+copy_matrix(struct evacuation *e, struct matrix *m)
+{
+	struct matrix *t;
+
+	if (!in_from(e, m))
+		return m;
+	m = follow(e, m);
+	if ((t = *forward_of(m)) != NULL)
+		return t;
+	t = space_alloc(e->to, sizeof(struct matrix));
+	*forward_of(m) = t;
+	e->copied++;
+	*t = *m;
+	t->data = copy_vector(e, m->data);
+	return t;
+}
+
+static void
+evacuate_slot(struct evacuation *e, struct value *slot)
+{
+	switch (type_of(*slot)) {
+	case Pair_type:
+		*slot = pair_value(copy_pairs(e, pair_of(*slot)));
 		break;
 
 	case Vector_type:
-		if ((r = remove_item(heap_start, retained.v)) != NULL) {
-			r->next = NULL;
-			p = r;
-		}
-		for (i = 0; i < retained.v->len; i++) {
-			r = mark_heap(heap_start, retained.v->items[i]);
-			if (r != NULL) {
-				r->next = p;
-				p = r;
-			}
-		}
+		*slot = vector_value(copy_vector(e, vector_of(*slot)));
 		break;
 
 	case Slice_type:
-		if ((r = remove_item(heap_start, retained.slice)) != NULL) {
-			r->next = NULL;
-			p = r;
-		}
-		for (i = 0; i < retained.slice->len; i++) {
-			r = mark_heap(heap_start, retained.slice->start[i]);
-			if (r != NULL) {
-				r->next = p;
-				p = r;
-			}
-		}
+		*slot = slice_value(copy_slice(e, slice_of(*slot)));
+		break;
+
+	case Function_type:
+		*slot = func_value(copy_funcs(e, func_of(*slot)));
+		break;
+
+	case Matrix_type:
+		*slot = matrix_value(copy_matrix(e, matrix_of(*slot)));
 		break;
 
 	default:
 		break;
 	}
+}
+
+/*
+ * Copy what the grey slots and pairs reach, until there is nothing left or,
+ * if deadline is not 0, the clock has passed it. Returns whether nothing is
+ * left.
+ */
+static bool
+drain(struct evacuation *e, uint64_t deadline)
+{
+	struct grey *g = e->grey;
+	struct pair *p;
+	size_t n;
+
+	for (n = 1; g->nslots > 0 || g->npairs > 0; n++) {
+		if (g->npairs > 0) {
+			p = g->pairs[--g->npairs];
+			p->cdr = copy_pairs(e, p->cdr);
+		} else
+			evacuate_slot(e, g->slots[--g->nslots]);
+		if (deadline != 0 && n % 16 == 0 && now_ns() >= deadline)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Evacuate the slots from roots to end, and everything they reach.
+ */
+static void
+evacuate(struct evacuation *e, struct value *roots, struct value *end)
+{
+	for (; roots < end; roots++)
+		evacuate_slot(e, roots);
+	drain(e, 0);
+}
+
+/*
+ * Copy everything that v reaches in any of the n arenas at from into to, and
+ * return the copy of v. The objects left in from must not be used afterwards,
+ * other than by releasing from or by following where they went.
+ */
+struct value
+arena_evacuate_all(struct arena *to, struct arena **from, size_t n,
+		   struct value v)
+{
+	static __thread struct space **spaces;
+	static __thread size_t cap;
+	struct evacuation e;
+	struct arena *a;
+	size_t i;
+
+	e.nfrom = 0;
+	e.follow = false;
+	for (i = 0; i < n; i++) {
+		if ((a = from[i]) == to || arena_is_empty(a))
+			continue;
+		while (e.nfrom + 3 > cap)
+			grow((void **)&spaces, &cap, sizeof(struct space *));
+		if (a->nursery.chunks != NULL)
+			spaces[e.nfrom++] = &a->nursery;
+		if (a->tenured.chunks != NULL)
+			spaces[e.nfrom++] = &a->tenured;
+		if (a->cycle != NULL) {
+			spaces[e.nfrom++] = &a->cycle->from;
+			e.follow = true;
+		}
+	}
+	if (e.nfrom == 0)
+		return v;
+	e.to = &to->nursery;
+	e.from = spaces;
+	e.code = false;
+	e.grey = &worklist;
+	e.chain = SIZE_MAX;
+	e.copied = 0;
+	evacuate(&e, &v, &v + 1);
+	alloc_stats[Evacuated_stat] += e.copied;
+	return v;
+}
+
+struct value
+arena_evacuate(struct arena *to, struct arena *from, struct value v)
+{
+	return arena_evacuate_all(to, &from, 1, v);
+}
+
+/*
+ * Freeze the nursery, along with the tenured space for a major collection if
+ * none is under way yet, and copy the objects the roots point to. The roots
+ * are left as they are. Nothing that is frozen can become reachable other
+ * than through the roots, so once what they reached has been copied, only
+ * what was allocated since the last freeze remains.
+ */
+static void
+cycle_freeze(struct arena *a, struct value *roots, struct value *end)
+{
+	struct arena_cycle *c;
+	struct evacuation e;
+	struct value v;
+
+	if ((c = a->cycle) == NULL) {
+		if ((c = calloc(1, sizeof(struct arena_cycle))) == NULL)
+			out_of_memory();
+		c->major = a->tenured.size >= a->tenured_limit;
+		if (c->major)
+			space_append(&c->from, &a->tenured);
+		a->cycle = c;
+	}
+	space_append(&c->from, &a->nursery);
+
+	e.to = &a->tenured;
+	e.from = e.spaces;
+	e.from[0] = &c->from;
+	e.nfrom = 1;
+	e.grey = &c->grey;
+	e.chain = CYCLE_CHAIN;
+	e.copied = 0;
+	e.follow = false;
+	e.code = false;
+	for (; roots < end; roots++) {
+		v = *roots;
+		evacuate_slot(&e, &v);
+	}
+	alloc_stats[Promoted_stat] += e.copied;
+}
+
+/*
+ * Copy out of the frozen spaces until the deadline. Returns whether all that
+ * was reachable from them has been copied.
+ */
+static bool
+cycle_step(struct arena *a, uint64_t deadline)
+{
+	struct evacuation e;
+	bool done;
+
+	e.to = &a->tenured;
+	e.from = e.spaces;
+	e.from[0] = &a->cycle->from;
+	e.nfrom = 1;
+	e.grey = &a->cycle->grey;
+	e.chain = CYCLE_CHAIN;
+	e.copied = 0;
+	e.follow = false;
+	e.code = false;
+	done = drain(&e, deadline);
+	alloc_stats[Promoted_stat] += e.copied;
+	alloc_stats[Collection_steps_stat]++;
+	return done;
+}
+
+/*
+ * Copy what the roots reach that was not copied yet, which was either
+ * allocated since the collection started or is still in the frozen spaces,
+ * and release both.
+ */
+static void
+cycle_finish(struct arena *a, struct value *roots, struct value *end)
+{
+	struct evacuation e;
+
+	e.to = &a->tenured;
+	/* Most of what is left to copy is in the nursery. */
+	e.from = e.spaces;
+	e.from[0] = &a->nursery;
+	e.from[1] = &a->cycle->from;
+	e.nfrom = 2;
+	e.grey = &a->cycle->grey;
+	e.chain = SIZE_MAX;
+	e.copied = 0;
+	e.follow = false;
+	e.code = false;
+	evacuate(&e, roots, end);
+	alloc_stats[Promoted_stat] += e.copied;
+	space_release(&a->nursery);
+	space_append(&dead, &a->cycle->from);
+	if (a->cycle->major) {
+		a->tenured_limit = 2 * a->tenured.size > ARENA_TENURED_MIN
+			? 2 * a->tenured.size : ARENA_TENURED_MIN;
+		alloc_stats[Major_collections_stat]++;
+	} else
+		alloc_stats[Minor_collections_stat]++;
+	cycle_free(a);
+}
+
+static void
+record_pause(uint64_t ns)
+{
+	size_t i;
+	uint64_t us = ns / 1000;
+
+	for (i = 0; i < NUM_PAUSE_BUCKETS - 1 && us > 0; i++)
+		us >>= 1;
+	pause_buckets[i]++;
+	alloc_stats[Collection_ns_stat] += ns;
+	if (ns > alloc_stats[Max_pause_ns_stat])
+		alloc_stats[Max_pause_ns_stat] = ns;
+}
+
+/*
+ * Collect the arena of a function, whose values are the slots from roots to
+ * end, or take the next step of collecting it.
+ */
+void
+arena_collect(struct arena *a, struct value *roots, struct value *end)
+{
+	struct evacuation e;
+	struct space tenured = SPACE_INIT;
+	uint64_t start;
+
+	start = now_ns();
+	if (alloc_pause_ns != 0) {
+		space_sweep(&dead, start + alloc_pause_ns);
+		/* Do not leave too much for the last step. */
+		if (a->cycle == NULL || a->nursery.size >= ARENA_NURSERY_SIZE)
+			cycle_freeze(a, roots, end);
+		if (cycle_step(a, start + alloc_pause_ns))
+			cycle_finish(a, roots, end);
+		else
+			a->collect_at = a->nursery.size + ARENA_STEP_SIZE;
+		record_pause(now_ns() - start);
+		return;
+	}
+
+	e.from = e.spaces;
+	e.grey = &worklist;
+	e.chain = SIZE_MAX;
+	e.copied = 0;
+	e.follow = false;
+	e.code = false;
+	if (a->tenured.size < a->tenured_limit) {
+		e.to = &a->tenured;
+		e.from[0] = &a->nursery;
+		e.nfrom = 1;
+		evacuate(&e, roots, end);
+		space_release(&a->nursery);
+		alloc_stats[Minor_collections_stat]++;
+	} else {
+		e.to = &tenured;
+		e.from[0] = &a->nursery;
+		e.from[1] = &a->tenured;
+		e.nfrom = 2;
+		evacuate(&e, roots, end);
+		space_release(&a->nursery);
+		space_release(&a->tenured);
+		a->tenured = tenured;
+		a->tenured_limit = 2 * tenured.size > ARENA_TENURED_MIN
+			? 2 * tenured.size : ARENA_TENURED_MIN;
+		alloc_stats[Major_collections_stat]++;
+	}
+	a->collect_at = ARENA_NURSERY_SIZE;
+	alloc_stats[Promoted_stat] += e.copied;
+	record_pause(now_ns() - start);
+}
+
+static int
+cmp_code(const void *a, const void *b)
+{
+	const void *ca = (*(struct func *const *)a)->prog.code;
+	const void *cb = (*(struct func *const *)b)->prog.code;
+
+	return (ca > cb) - (ca < cb);
+}
+
+/*
+ * The index of the function the compiler made that f was made from, which
+ * shares its code, or num_compiled if there is none. compiled must be sorted
+ * by cmp_code().
+ */
+static size_t
+find_compiled(struct func *f)
+{
+	size_t lo = 0, hi = num_compiled, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((void *)compiled[mid]->prog.code == (void *)f->prog.code)
+			return mid;
+		if ((void *)compiled[mid]->prog.code < (void *)f->prog.code)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return num_compiled;
+}
+
+/*
+ * Grey the functions that the immediates of prog refer to.
+ */
+static void
+trace_prog(struct evacuation *e, struct progm prog)
+{
+	const char *args;
+
+	for (prog.ip = 0; prog.ip < prog.len; )
+		for (args = inst_args(NEXT_INST(prog)); *args != '\0'; args++)
+			if (*args == 'f')
+				push_func(e, NEXT_IMM_FUNC(prog));
+			else
+				prog.ip += (*args == 'n' || *args == 'c')
+					? 2 : 1;
+}
+
+/*
+ * Keep the function the compiler made that f was made from, if there is one,
+ * and what its code and its parent refer to.
+ */
+static void
+trace_func(struct evacuation *e, struct func *f)
+{
+	struct func *c;
+	size_t i;
 
-	if ((r = remove_nonlocals(heap_start)) != NULL) {
-		r->next = p;
-		p = r;
+	if ((i = find_compiled(f)) == num_compiled || compiled_marks[i])
+		return;
+	compiled_marks[i] = true;
+	c = compiled[i];
+	c->parent = copy_funcs(e, c->parent);
+	trace_prog(e, c->prog);
+}
+
+#ifndef PROFILE
+static void
+free_compiled(struct func *f)
+{
+	code_reset(&f->prog);
+	free(f->prog.code);
+	if (f->locals != NULL) {
+		symtab_clear(f->locals);
+		free(f->locals);
 	}
+	slab_free(f->args->items, f->args->cap * sizeof(struct value));
+	free(f->args);
+	free(f);
+	alloc_stats[Freed_functions_stat]++;
+}
+#endif
+
+bool
+top_level_wants_collection(void)
+{
+	return global_arena.nursery.size + global_arena.tenured.size >=
+		global_arena.tenured_limit || num_compiled >= compiled_limit;
+}
+
+/*
+ * Collect global_arena, and free the functions the compiler made that are
+ * not referred to any more. Nothing may be running. The function of the top
+ * level is top, whose values are the slots from roots to end. Inline caches
+ * may hold what was moved or freed, so they are all invalidated.
+ */
+void
+collect_top_level(struct func *top, struct value *roots, struct value *end)
+{
+	struct evacuation e;
+	struct space tenured = SPACE_INIT;
+	struct arena *a = &global_arena;
+	uint64_t start;
+	size_t i, n;
 
+	start = now_ns();
+	if (num_compiled > 0)
+		qsort(compiled, num_compiled, sizeof(struct func *),
+		      &cmp_code);
+	if ((compiled_marks = calloc(num_compiled + 1, sizeof(bool))) == NULL)
+		out_of_memory();
+
+	e.to = &tenured;
+	e.from = e.spaces;
+	e.from[0] = &a->nursery;
+	e.from[1] = &a->tenured;
+	e.nfrom = 2;
+	e.grey = &worklist;
+	e.chain = SIZE_MAX;
+	e.copied = 0;
+	e.follow = false;
+	e.code = true;
+	/* Native code cannot be traced, but its bytecode can. */
+	for (i = 0; i < num_compiled; i++)
+		if (compiled[i]->native != NULL)
+			push_func(&e, compiled[i]);
+	top->args = copy_vector(&e, top->args);
+	trace_prog(&e, top->prog);
+	evacuate(&e, global_cells, global_cells + num_global_cells);
+	evacuate(&e, roots, end);
+	while (worklist.nfuncs > 0) {
+		trace_func(&e, worklist.funcs[--worklist.nfuncs]);
+		drain(&e, 0);
+	}
+	space_release(&a->nursery);
+	space_release(&a->tenured);
+	a->tenured = tenured;
+	a->tenured_limit = 2 * tenured.size > ARENA_TENURED_MIN
+		? 2 * tenured.size : ARENA_TENURED_MIN;
+
+	for (i = n = 0; i < num_compiled; i++)
+		if (compiled_marks[i])
+			compiled[n++] = compiled[i];
+#ifndef PROFILE
+		else
+			free_compiled(compiled[i]);
+#endif
+	num_compiled = n;
+	compiled_limit = 2 * n > COMPILED_MIN ? 2 * n : COMPILED_MIN;
+	free(compiled_marks);
+	compiled_marks = NULL;
+	global_version++;
+
+	alloc_stats[Top_collections_stat]++;
+	alloc_stats[Promoted_stat] += e.copied;
+	alloc_stats[Collection_ns_stat] += now_ns() - start;
+}
+
+static int
+const_cmp(void *a1, void *a2)
+{
+	struct pair *p = a1, *q = a2;
+
+	return type_of(p->car) != type_of(q->car) ||
+		payload_of(p->car) != payload_of(q->car) || p->cdr != q->cdr;
+}
+
+static size_t
+const_hash(void *a)
+{
+	struct pair *p = a;
+
+	return (payload_of(p->car) * 31 + type_of(p->car)) * 2654435761u ^
+		(uintptr_t)p->cdr * 2654435761u;
+}
+
+/*
+ * The pair of the constant pool that holds car and cdr, which must be
+ * constants themselves.
+ */
+struct pair *
+const_pair(struct value car, struct pair *cdr)
+{
+	struct pair key = { car, cdr }, *p;
+
+	if (interned.len > 0 && map_exists(&interned, &key))
+		return *map_get(&interned, &key);
+	p = space_alloc(&constants, sizeof(struct pair));
+	*p = key;
+	*map_get(&interned, p) = p;
+	alloc_stats[Constant_pairs_stat]++;
 	return p;
 }
+
+struct value *
+alloc_value(struct arena *a)
+{
+	struct value *v;
+
+	v = arena_alloc(a, sizeof(struct value));
+	memset(v, 0, sizeof(struct value));
+	return v;
+}
+
+/*
+ * A function for the compiler to make, along with its list of arguments.
+ */
+struct func *
+alloc_func(void)
+{
+	struct func *f;
+
+	if (num_compiled == compiled_cap)
+		grow((void **)&compiled, &compiled_cap,
+		     sizeof(struct func *));
+	if ((f = calloc(1, sizeof(struct func))) == NULL ||
+	    (f->args = calloc(1, sizeof(struct vector))) == NULL)
+		out_of_memory();
+	f->args->cap = 1;
+	f->args->items = slab_alloc(sizeof(struct value));
+	compiled[num_compiled++] = f;
+	alloc_stats[Functions_stat]++;
+	alloc_stats[Function_bytes_stat] += sizeof(struct func);
+	return f;
+}
+
+/*
+ * A copy of f that captures ncaptures values. The values f captured are
+ * copied along, if it has any; otherwise they are left to the caller.
+ */
+struct func *
+alloc_closure(struct arena *a, struct func *f, size_t ncaptures)
+{
+	struct func *c;
+
+	c = arena_alloc(a, sizeof(struct func) +
+			sizeof(struct value) * ncaptures);
+	*c = *f;
+	alloc_stats[Functions_stat]++;
+	alloc_stats[Closures_stat]++;
+	alloc_stats[Function_bytes_stat] += sizeof(struct func) +
+		sizeof(struct value) * ncaptures;
+	c->ncaptures = ncaptures;
+	c->captures = (ncaptures > 0) ? (struct value *)(c + 1) : NULL;
+	if (f->captures != NULL)
+		memcpy(c->captures, f->captures,
+		       sizeof(struct value) * ncaptures);
+	return c;
+}
+
+struct pair *
+alloc_pair(struct arena *a)
+{
+	struct pair *p;
+
+	p = arena_alloc(a, sizeof(struct pair));
+	alloc_stats[Pairs_stat]++;
+	alloc_stats[Pair_bytes_stat] += sizeof(struct pair);
+	p->car = type_value(Error_type);
+	p->cdr = NULL;
+	return p;
+}
+
+struct vector *
+alloc_vector(struct arena *a, size_t min_cap)
+{
+	return alloc_typed_vector(a, Value_elem, min_cap);
+}
+
+struct vector *
+alloc_typed_vector(struct arena *a, enum elem_type elem, size_t min_cap)
+{
+	struct vector *v;
+
+	v = arena_alloc(a, sizeof(struct vector));
+	v->len = 0;
+	v->cap = min_cap;
+	v->elem = elem;
+	v->items = slab_alloc(items_size(v));
+	if (min_cap != 0)
+		memset(v->items, 0, items_size(v));
+	own_vector(&a->nursery, v);
+	alloc_stats[Vectors_stat]++;
+	alloc_stats[Vector_bytes_stat] += sizeof(struct vector) +
+		items_size(v);
+	return v;
+}
+
+struct slice *
+alloc_slice(struct arena *a)
+{
+	struct slice *s;
+
+	s = arena_alloc(a, sizeof(struct slice));
+	alloc_stats[Slices_stat]++;
+	alloc_stats[Slice_bytes_stat] += sizeof(struct slice);
+	s->len = 0;
+	s->start = NULL;
+	s->parent = NULL;
+	return s;
+}
+
+struct matrix *
+alloc_matrix(struct arena *a)
+{
+	struct matrix *m;
+
+	m = arena_alloc(a, sizeof(struct matrix));
+	alloc_stats[Matrices_stat]++;
+	m->rows = m->cols = 0;
+	m->row_stride = m->col_stride = 0;
+	m->start = NULL;
+	m->data = NULL;
+	return m;
+}
@@ -2,48 +2,243 @@
 #define _ALLOC_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "types.h"
 
 /*
- * Whenever an item is allocated, it is added to a singularly linked list that
- * we call the heap. A new heap should be created every function call, and at
- * the end of the call all items in the heap will be scanned and freed if they
- * can be.
- * The first heap_item in the heap list must be stack allocated. The garbage
- * collection algorithms will assume this.
+ * Objects are allocated from arenas. Every function call gets its own arena,
+ * whose objects are bump allocated from a list of chunks. When the call
+ * returns an object, the caller takes the chunks of the callee over, so that
+ * what is returned stays where it is (see arena_adopt()). Otherwise, or when
+ * that cannot be done, the objects reachable from the returned value are
+ * evacuated (copied) into the arena of the caller, and the chunks of the
+ * callee are released whole. Nothing is ever freed individually.
+ *
+ * An arena has two spaces. Objects are allocated in the nursery. Once the
+ * nursery has grown to ARENA_NURSERY_SIZE, the function collects its arena
+ * with the values it holds on the stack as roots: a minor collection copies
+ * what is reachable in the nursery to the tenured space and releases the
+ * nursery, and once the tenured space has doubled since the last major
+ * collection, a major one copies both spaces to a new tenured space. Nothing
+ * older ever points to anything younger, as the only objects that are ever
+ * mutated are the boxes of captured variables, and values stored into boxes
+ * outside of the nursery are evacuated to global_arena first. So a minor
+ * collection need not look at the tenured space, and no other function can
+ * point into the arena: values stored into globals or variables of other
+ * functions are evacuated to global_arena as well. As such a value may reach
+ * what the callers of the function that stores it made, it is evacuated from
+ * the arenas of every function that is running.
+ *
+ * Each object is preceded by a word that holds its new address once it has
+ * been evacuated, so that shared structure stays shared. Vector items are
+ * allocated apart, as vectors may grow; each space keeps a list of the
+ * vectors it owns to free their items, which move along with the vector.
+ * The items of numeric vectors are not values and are never looked at.
+ *
+ * With alloc_pause_ns set, collections are incremental. One that is due
+ * freezes the spaces it collects and gives the function a new nursery. The
+ * objects that the frozen spaces hold are then copied a step at a time, each
+ * taking at most alloc_pause_ns, whenever the new nursery has grown by
+ * ARENA_STEP_SIZE. The function keeps on using the frozen objects meanwhile,
+ * which is sound as they are never mutated: boxes are always read and written
+ * through their forwarding words, and stores into them evacuate to
+ * global_arena, as do stores into other functions' variables. The nursery is
+ * frozen as well whenever it fills up meanwhile. Once nothing is left to copy,
+ * the roots and what they reach in the nursery are copied in one final step,
+ * and the frozen spaces are released by the steps that follow.
+ *
+ * Vector items and the chunks of arenas come from a slab allocator with a
+ * size class for each power of two up to a page. Anything larger is left to
+ * malloc(). Each thread has slabs of its own, and only ever allocates in its
+ * own arenas, but for global_arena, which it must hold a lock to allocate in
+ * while other threads run (see eval.c).
  */
 
-struct heap_item {
-	void                    *data;
-	size_t                  locality;
-	struct heap_item        *next;
+struct arena_chunk;
+struct arena_owned;
+struct arena_cycle;
+
+#define ARENA_NURSERY_SIZE      ((size_t)256 << 10)
+#define ARENA_TENURED_MIN       ((size_t)1 << 20)
+#define ARENA_STEP_SIZE         ((size_t)64 << 10)
+
+struct space {
+	char                    *free, *limit;  /* Rest of the newest chunk. */
+	struct arena_chunk      *chunks, *last;  /* Newest first. */
+	struct arena_chunk      *hit;           /* Last one found in. */
+	struct arena_owned      *owned;         /* Vectors to free items of. */
+	struct arena_owned      *owned_last;
+	size_t                  size;           /* Of all chunks. */
+};
+
+struct arena {
+	struct space            nursery, tenured;
+	size_t                  tenured_limit;  /* When to collect both. */
+	size_t                  collect_at;     /* Nursery size to act at. */
+	struct arena_cycle      *cycle;         /* An incremental collection. */
 };
 
-// This is a bad idea; Do fix.
-extern struct heap_item global_heap_start, *global_heap;
+#define SPACE_INIT { NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, }
+#define ARENA_INIT { SPACE_INIT, SPACE_INIT, ARENA_TENURED_MIN,		\
+		     ARENA_NURSERY_SIZE, NULL, }
+
+/*
+ * The arena of the top level. It is collected between inputs by
+ * collect_top_level(), with the globals, the values of the top level and the
+ * functions the compiler made as roots.
+ *
+ * Those functions are allocated apart from any arena, as bytecode and native
+ * code point to them, and never move. They are freed by collect_top_level()
+ * along with their code once nothing refers to them: no value reached from
+ * the roots, no closure made from them, no immediate of the code of another
+ * function that is kept, and no native code. A profiled build keeps them all
+ * for the report.
+ */
+extern struct arena global_arena;
 
 struct vector;
 struct slice;
+struct matrix;
 struct func;
 struct value;
 
-struct value *alloc_value(struct heap_item **);
-struct func *alloc_func(struct heap_item **);
-struct pair *alloc_pair(struct heap_item **);
-struct vector *alloc_vector(struct heap_item **, size_t min_cap);
-struct slice *alloc_slice(struct heap_item **);
+/*
+ * Counters kept since startup by each thread, in the order (memory-stats)
+ * lists them. A thread other than the first adds them to what the reports
+ * print with alloc_stats_flush(), and alloc_stats_sum() gives those along with
+ * the counters of the thread.
+ * Objects evacuated when a call returns and objects promoted to the tenured
+ * space of an arena are counted apart. Bytes released are those of the chunks
+ * and vector items given back when a space is released, whatever they held.
+ */
+enum alloc_stat {
+	Pairs_stat = 0,
+	Pair_bytes_stat,
+	Vectors_stat,
+	Vector_bytes_stat,      /* Along with their first items. */
+	Slices_stat,
+	Slice_bytes_stat,
+	Functions_stat,
+	Function_bytes_stat,
+	Closures_stat,          /* Also counted as functions. */
+	Evacuated_stat,
+	Promoted_stat,
+	Released_bytes_stat,
+	Minor_collections_stat,
+	Major_collections_stat,
+	Collection_ns_stat,     /* Time spent in arena_collect(). */
+	Collection_steps_stat,  /* Incremental ones. */
+	Max_pause_ns_stat,
+	Top_collections_stat,   /* By collect_top_level(). */
+	Freed_functions_stat,   /* Made by the compiler. */
+	Constant_pairs_stat,    /* See const_pair(). */
+	Matrices_stat,
+
+	Num_alloc_stats,        /* Not really a counter. */
+};
+
+extern __thread size_t alloc_stats[Num_alloc_stats];
+
+/*
+ * The longest an incremental collection step may take, or 0 to collect
+ * everything at once.
+ */
+extern size_t alloc_pause_ns;
 
-void clear_heap(struct heap_item *curr_item);
+void *slab_alloc(size_t);
+void *slab_realloc(void *, size_t old_size, size_t);
+void slab_free(void *, size_t);
+void alloc_report(void);
+void alloc_stats_report(void);
+void alloc_stats_flush(void);
+void alloc_stats_sum(size_t *);
 
-void make_nonlocal(struct heap_item *, void *, size_t);
-struct heap_item *mark_heap(struct heap_item *, struct value);
+void *space_alloc_slow(struct space *, size_t);
+
+/*
+ * Returns size bytes from the space, preceded by a cleared forwarding word.
+ */
+static inline void *
+space_alloc(struct space *s, size_t size)
+{
+	void **p = (void **)s->free;
+
+	size = sizeof(void *) + ((size + 7) & ~(size_t)7);
+	if (__builtin_expect((size_t)(s->limit - s->free) < size, 0))
+		p = space_alloc_slow(s, size);
+	else
+		s->free += size;
+	*p = NULL;
+	return p + 1;
+}
+
+static inline void *
+arena_alloc(struct arena *a, size_t size)
+{
+	return space_alloc(&a->nursery, size);
+}
+
+static inline bool
+arena_is_empty(struct arena *a)
+{
+	return a->nursery.chunks == NULL && a->tenured.chunks == NULL &&
+		a->cycle == NULL;
+}
+
+static inline bool
+arena_wants_collection(struct arena *a)
+{
+	return __builtin_expect(a->nursery.size >= a->collect_at, 0);
+}
+
+/*
+ * Where the object at p has been evacuated to, or NULL if it has not been.
+ */
+static inline void *
+forwarded(void *p)
+{
+	return ((void **)p)[-1];
+}
+
+bool arena_in_nursery(struct arena *, void *);
+void arena_release(struct arena *);
+bool arena_adopt(struct arena *to, struct arena *from);
+struct value arena_evacuate(struct arena *to, struct arena *from,
+			    struct value);
+struct value arena_evacuate_all(struct arena *to, struct arena **from,
+				size_t n, struct value);
+void arena_collect(struct arena *, struct value *roots, struct value *end);
+bool top_level_wants_collection(void);
+void collect_top_level(struct func *top, struct value *roots,
+		       struct value *end);
+
+/*
+ * Constants, quoted data and lists of constants, are built by the compiler in
+ * a pool of their own that is never collected nor released. They only ever
+ * point to other constants, so collections leave them where they are without
+ * looking inside them. Constants are never written to, and equal pairs are
+ * one and the same, so that equal constants are shared.
+ */
+struct pair *const_pair(struct value car, struct pair *cdr);
+
+struct value *alloc_value(struct arena *);
+struct func *alloc_func(void);
+struct func *alloc_closure(struct arena *, struct func *, size_t ncaptures);
+struct pair *alloc_pair(struct arena *);
+struct vector *alloc_vector(struct arena *, size_t min_cap);
+struct vector *alloc_typed_vector(struct arena *, enum elem_type,
+				  size_t min_cap);
+struct slice *alloc_slice(struct arena *);
+struct matrix *alloc_matrix(struct arena *);
 
 static inline bool
 is_heap_allocated(struct value v)
 {
-	return v.type == Vector_type || v.type == Pair_type ||
-		v.type == Slice_type ||	v.type == Function_type;
+	enum type t = type_of(v);
+
+	return t == Vector_type || t == Pair_type ||
+		t == Slice_type || t == Function_type || t == Matrix_type;
 }
 
 #endif
@@ -0,0 +1,198 @@
+/*
+ * Tests of the barriers on stores that outlive the function that makes them.
+ * A value stored into a global, a box, a vector or a variable of an enclosing
+ * function may reach objects that the callers of the function that stores it
+ * made, and must survive their returns. Each test runs its inputs at the top
+ * level as the interpreter would, building a long list before the last one so
+ * that the chunks those calls released are used again, and checks what the
+ * last one gives. The tests are run with every collector and in register
+ * mode.
+ *
+ * Build it with the objects of ucalc other than main.o:
+ *
+ *	make && gcc -g3 arena-test.c $(ls *.o | grep -v main.o) -lm \
+ *	    -lpthread -o arena-test && ./arena-test
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "types.h"
+#include "lex.h"
+#include "parse.h"
+#include "comp.h"
+#include "eval.h"
+#include "opt.h"
+#include "stack.h"
+#include "builtin.h"
+#include "simd.h"
+#include "parallel.h"
+#include "profile.h"
+#include "jit.h"
+
+#define MAX_INPUTS      8
+
+struct test {
+	const char      *name;
+	const char      *inputs[MAX_INPUTS];
+	int64_t         expect;         /* Of the last input. */
+};
+
+static const char *const setup[] = {
+	"(define (rbuild n) (if (= n 0) 0 (cons n (rbuild (- n 1)))))",
+	"(define (sto x) (set! gl x))",
+	"(define gl 0)",
+	"(define setter 0)",
+	"(define getter 0)",
+	"(define gv 0)",
+	NULL,
+};
+
+static const struct test tests[] = {
+	{ "global set by a callee", {
+		"(define (outer n) (sto (list n (+ n 1))) 0)",
+		"(outer 7)",
+		"(car (cdr gl))",
+	}, 8 },
+
+	{ "global set two calls down", {
+		"(define (mid l) (sto (list 1 l)) 0)",
+		"(define (outer n) (mid (list n (+ n 1))) 0)",
+		"(outer 7)",
+		"(car (cdr (car (cdr gl))))",
+	}, 8 },
+
+	{ "box set by a callee", {
+		"(define (mkbox) (define c 0) "
+		    "(set! setter (lambda (x) (set! c x))) "
+		    "(set! getter (lambda () c)) 0)",
+		"(mkbox)",
+		"(define (outer n) (setter (list n (+ n 1))) 0)",
+		"(outer 7)",
+		"(car (cdr (getter)))",
+	}, 8 },
+
+	{ "vector item set by a callee", {
+		"(set! gv (make-vector 1 0))",
+		"(define (store x) (vector-set! gv 0 x))",
+		"(define (outer n) (store (list n (+ n 1))) 0)",
+		"(outer 5)",
+		"(car (cdr (vector-ref gv 0)))",
+	}, 6 },
+
+	{ "enclosing variable set by a callee", {
+		"(define (outer n) (define acc 0) "
+		    "(define (put x) (set! acc x)) "
+		    "(define (mk m) (put (list m (+ m 1))) 0) "
+		    "(mk n) (rbuild 3000) (car (cdr acc)))",
+		"(outer 7)",
+	}, 8 },
+};
+
+struct func global;
+static struct context global_context;
+static struct source_mapping srcmap;
+static char *input;
+
+/*
+ * As the interpreter lexes its input, without reading more lines.
+ */
+static struct token
+next_token(void)
+{
+	size_t ws = 0;
+	char *prev = input;
+	struct token tok;
+
+	tok.id = lex_token(&input, &ws);
+	if (tok.id == Number_tok || tok.id == Identifier_tok) {
+		prev += ws;
+		tok.src = strndup(prev, input - prev);
+	}
+	return tok;
+}
+
+/*
+ * Run one input at the top level and return what it left on the stack.
+ */
+static struct value
+run(const char *src)
+{
+	struct vector code;
+	struct value v;
+	char *line;
+
+	input = line = strdup(src);
+	code = parse(&next_token, &srcmap, &comp_arena);
+	global.rt_context->local_end = global.rt_context->local_start +
+		global.locals->len + global.args->len;
+	if (compile(&global.prog, vector_of(code.items[0])) == Error_type) {
+		fprintf(stderr, "Cannot compile %s\n", src);
+		exit(1);
+	}
+	code_inst(&global.prog, Halt_opcode);
+	eval(&global, &global.prog, &global_arena);
+	v = (stackp != &stack[0]) ? stackp[-1] : type_value(Nil_type);
+	global.prog.len--;
+	code_reset(&global.prog);
+	slab_free(code.items, code.cap * sizeof(struct value));
+	if (top_level_wants_collection())
+		collect_top_level(&global, stack, stackp);
+	free(line);
+	return v;
+}
+
+static bool
+run_test(const struct test *t)
+{
+	struct value v;
+	size_t i;
+
+	for (i = 0; i < MAX_INPUTS && t->inputs[i + 1] != NULL; i++)
+		(void)run(t->inputs[i]);
+	(void)run("(rbuild 3000)");
+	v = run(t->inputs[i]);
+	return type_of(v) == Integer_type && int_of(v) == t->expect;
+}
+
+int
+main(void)
+{
+	static const char *const modes[] = {
+		"generational", "incremental", "registers",
+	};
+	size_t i, m;
+	int failed = 0;
+
+	stack_init(STACK_DEFAULT_DEPTH);
+	global.args = alloc_vector(&global_arena, 1);
+	global.rt_context = &global_context;
+	global_context.local_start = &stack[0];
+	set_compiler_global_context(&global);
+	prof_register(&global.prog, "top level");
+	init_builtins();
+	simd_init();
+	parallel_init();
+#ifdef JIT
+	jit_init();
+#endif
+
+	for (i = 0; setup[i] != NULL; i++)
+		(void)run(setup[i]);
+	for (m = 0; m < sizeof(modes) / sizeof(*modes); m++) {
+		alloc_pause_ns = (m == 1) ? 50000 : 0;
+		compile_registers = (m == 2);
+		for (i = 0; i < sizeof(tests) / sizeof(*tests); i++) {
+			if (run_test(tests + i))
+				continue;
+			printf("FAIL: %s (%s)\n", tests[i].name, modes[m]);
+			failed = 1;
+		}
+	}
+	if (!failed)
+		printf("All tests passed.\n");
+	return failed;
+}
@@ -0,0 +1,4 @@
+(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))
+(define (sum l n acc) (if (= n 0) acc (sum (car (cdr l)) (- n 1) (+ acc (car l)))))
+(define (round i acc) (if (= i 0) acc (round (- i 1) (+ acc (sum (build 50 0) 50 0)))))
+(round 40000 0)
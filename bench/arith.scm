@@ -0,0 +1,2 @@
+(define (arith i acc) (if (= i 0) acc (arith (- i 1) (+ acc (- (* i 3) (+ i i))))))
+(arith 10000000 0)
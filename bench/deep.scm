@@ -0,0 +1,6 @@
+(define (sum n) (if (= n 0) 0 (+ n (sum (- n 1)))))
+(sum 100000)
+(sum 100000)
+(sum 100000)
+(sum 100000)
+(sum 100000)
@@ -0,0 +1,17 @@
+#!/bin/sh
+#
+# Writes a large source file to standard output for timing the compiler: n
+# function definitions, full of branches, closures and assignments, of which
+# only a few are called.
+#
+# usage: bench/gen-compile.sh [n]
+
+awk -v n="${1:-20000}" 'BEGIN {
+	for (i = 0; i < n; i++)
+		printf "(define (f%d a b) (define x (+ a %d)) " \
+		    "(define k (lambda (y) (set! x (+ x y)) x)) " \
+		    "(if (< a b) (if (= a 0) (k b) (- x (* b 2))) " \
+		    "(if (> b %d) (+ (* a b) x) (k (+ a b)))))\n", i, i, i
+	for (i = 0; i < n; i += n / 10 + 1)
+		printf "(f%d %d %d)\n", i, i % 7, i % 5
+}'
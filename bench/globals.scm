@@ -0,0 +1,3 @@
+(define (inc n) (+ n 1))
+(define (count i n) (if (= i n) i (count (inc i) n)))
+(count 0 3000000)
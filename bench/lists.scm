@@ -0,0 +1,2 @@
+(define (walk n acc) (if (= n 0) acc (walk (- n 1) (+ acc (car (cdr (list n (+ n 1) (* n 2))))))))
+(walk 2000000 0)
@@ -0,0 +1,9 @@
+(define (make-rows rows i n) (if (= i n) rows (make-rows (vector-set! rows i (make-vector n 0)) (+ i 1) n)))
+(define (fill-row r i j n) (if (= j n) r (fill-row (vector-set! r j (+ i (* j 0.5))) i (+ j 1) n)))
+(define (fill rows i n) (if (= i n) rows (fill (vector-set! rows i (fill-row (vector-ref rows i) i 0 n)) (+ i 1) n)))
+(define a 0)
+(set! a (fill (make-rows (make-vector 120 0) 0 120) 0 120))
+(define (dot a b i j k n acc) (if (= k n) acc (dot a b i j (+ k 1) n (+ acc (* (vector-ref (vector-ref a i) k) (vector-ref (vector-ref b j) k))))))
+(define (row a b i j n acc) (if (= j n) acc (row a b i (+ j 1) n (+ acc (dot a b i j 0 n 0)))))
+(define (mul a b i n acc) (if (= i n) acc (mul a b (+ i 1) n (+ acc (row a b i 0 n 0)))))
+(mul a a 0 120 0)
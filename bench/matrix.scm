@@ -0,0 +1,7 @@
+(define a 0)
+(set! a (make-matrix 400 400 0))
+(define (fill-row m i j) (if (= j 400) m (fill-row (matrix-set! m i j (+ i (* j 0.5))) i (+ j 1))))
+(define (fill m i) (if (= i 400) m (fill (fill-row m i 0) (+ i 1))))
+(fill a 0)
+(define (loop k acc) (if (= k 0) acc (loop (- k 1) (+ acc (f64vector-sum (matrix->f64vector (matrix-mul a (matrix-transpose a))))))))
+(loop 10 0)
@@ -0,0 +1,6 @@
+(define v 0)
+(set! v (make-f64vector 1000000 0))
+(define (fill v i n) (if (= i n) v (fill (vector-set! v i (* i 0.5)) (+ i 1) n)))
+(define (sum v i n acc) (if (= i n) acc (sum v (+ i 1) n (+ acc (vector-ref v i)))))
+(define (loop k acc) (if (= k 0) acc (loop (- k 1) (+ acc (sum (fill v 0 1000000) 0 1000000 0)))))
+(loop 5 0)
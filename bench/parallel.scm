@@ -0,0 +1,3 @@
+(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(define (add a b) (+ a b))
+(parallel-reduce add 0 (parallel-for-range 0 64 (lambda (i) (+ i (fib 28)))))
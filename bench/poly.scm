@@ -0,0 +1,2 @@
+(define (poly i acc) (if (= i 0) acc (poly (- i 1) (+ acc (- (+ (* (* i i) 5) (* i 3) 7) (* (- i 1) (+ i 2)))))))
+(poly 5000000 0)
@@ -0,0 +1,6 @@
+(define (rbuild n) (if (= n 0) 0 (cons n (rbuild (- n 1)))))
+(define (pbuild n) (if (= n 0) 0 (cons (list n n) (pbuild (- n 1)))))
+(car (rbuild 10000))
+(car (rbuild 20000))
+(car (car (pbuild 10000)))
+(car (car (pbuild 20000)))
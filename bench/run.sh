@@ -0,0 +1,22 @@
+#!/usr/bin/env bash
+#
+# Times every benchmark in this directory. Each benchmark is a file of
+# expressions that is fed to the interpreter on standard input, except for
+# compile, which is a large source file written by gen-compile.sh.
+#
+# usage: bench/run.sh [ucalc] [args...]
+
+UCALC=${1:-./ucalc}
+shift
+TIMEFORMAT='%3Us user %3Ss sys'
+
+for f in "$(dirname "$0")"/*.scm; do
+	printf '%-24s' "$(basename "$f")"
+	time "$UCALC" "$@" < "$f" > /dev/null 2>&1 || true
+done
+
+src=$(mktemp)
+"$(dirname "$0")"/gen-compile.sh > "$src"
+printf '%-24s' "compile"
+time "$UCALC" "$@" < "$src" > /dev/null 2>&1 || true
+rm -f "$src"
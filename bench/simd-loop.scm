@@ -0,0 +1,9 @@
+(define a 0)
+(set! a (make-f64vector 1000000 0.5))
+(define b 0)
+(set! b (make-f64vector 1000000 2))
+(define (dot i n acc) (if (= i n) acc (dot (+ i 1) n (+ acc (* (vector-ref a i) (vector-ref b i))))))
+(define (fma v i n) (if (= i n) v (fma (vector-set! v i (+ (* (vector-ref a i) (vector-ref b i)) (vector-ref a i))) (+ i 1) n)))
+(define (sum v i n acc) (if (= i n) acc (sum v (+ i 1) n (+ acc (vector-ref v i)))))
+(define (loop k acc) (if (= k 0) acc (loop (- k 1) (+ acc (dot 0 1000000 0) (sum (fma (make-f64vector 1000000 0) 0 1000000) 0 1000000 0)))))
+(loop 20 0)
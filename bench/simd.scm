@@ -0,0 +1,6 @@
+(define a 0)
+(set! a (make-f64vector 1000000 0.5))
+(define b 0)
+(set! b (make-f64vector 1000000 2))
+(define (loop k acc) (if (= k 0) acc (loop (- k 1) (+ acc (f64vector-dot a b) (f64vector-sum (f64vector-fma a b a))))))
+(loop 20 0)
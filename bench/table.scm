@@ -0,0 +1,6 @@
+(define (look t k) (if (= (car t) k) (car (cdr t)) (look (cdr (cdr t)) k)))
+(define (day n) (look '(0 sun 1 mon 2 tue 3 wed 4 thu 5 fri 6 sat) n))
+(define (width n) (look (list 0 1 1 3 2 5 3 7 4 9 5 11 6 13) n))
+(define (next d) (if (= d 6) 0 (+ d 1)))
+(define (loop i d acc) (if (= i 0) acc (loop (- i 1) (next d) (if (= (day d) 'sat) (+ acc (width d)) (- acc (width d))))))
+(loop 2000000 0 0)
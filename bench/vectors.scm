@@ -0,0 +1,6 @@
+(define v 0)
+(set! v (make-vector 1000000 3))
+(define (sum s acc) (if (= (vector-length s) 0) acc (sum (cdr s) (+ acc (car s)))))
+(define (dot s t acc) (if (= (vector-length s) 0) acc (dot (cdr s) (cdr t) (+ acc (* (car s) (car t))))))
+(define (loop i acc) (if (= i 0) acc (loop (- i 1) (+ acc (sum v 0) (dot v v 0)))))
+(loop 10 0)
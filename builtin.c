@@ -13,16 +13,53 @@ init_builtins(void)
 		"cdr",
 		"cons",
 		"=",
+		"f32vector->vector",
+		"f64vector-add",
+		"f64vector-div",
+		"f64vector-dot",
+		"f64vector-fma",
+		"f64vector-max",
+		"f64vector-min",
+		"f64vector-mul",
+		"f64vector-norm",
+		"f64vector-sub",
+		"f64vector-sum",
+		"f64vector->matrix",
+		"f64vector->vector",
 		">",
+		"i64vector->vector",
 		"if",
 		"lambda",
 		"<",
 		"let",
 		"list",
+		"make-f32vector",
+		"make-f64vector",
+		"make-i64vector",
+		"make-matrix",
+		"make-vector",
+		"matrix-cols",
+		"matrix-mul",
+		"matrix-ref",
+		"matrix-rows",
+		"matrix-set!",
+		"matrix->f64vector",
+		"matrix-transpose",
+		"memory-stats",
 		"*",
+		"parallel-for-range",
+		"parallel-map",
+		"parallel-reduce",
 		"'",
 		"set!",
-		"-"
+		"-",
+		"vector",
+		"vector-length",
+		"vector-ref",
+		"vector-set!",
+		"vector->f32vector",
+		"vector->f64vector",
+		"vector->i64vector",
 	};
 	size_t i;
 
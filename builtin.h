@@ -14,16 +14,53 @@ enum builtin {
 	Cdr_builtin,
 	Cons_builtin,
 	Equal_builtin,
+	F32vector_to_vector_builtin,
+	F64vector_add_builtin,
+	F64vector_div_builtin,
+	F64vector_dot_builtin,
+	F64vector_fma_builtin,
+	F64vector_max_builtin,
+	F64vector_min_builtin,
+	F64vector_mul_builtin,
+	F64vector_norm_builtin,
+	F64vector_sub_builtin,
+	F64vector_sum_builtin,
+	F64vector_to_matrix_builtin,
+	F64vector_to_vector_builtin,
 	Greater_builtin,
+	I64vector_to_vector_builtin,
 	If_builtin,
 	Lambda_builtin,
 	Less_builtin,
 	Let_builtin,
 	List_builtin,
+	Make_f32vector_builtin,
+	Make_f64vector_builtin,
+	Make_i64vector_builtin,
+	Make_matrix_builtin,
+	Make_vector_builtin,
+	Matrix_cols_builtin,
+	Matrix_mul_builtin,
+	Matrix_ref_builtin,
+	Matrix_rows_builtin,
+	Matrix_set_builtin,
+	Matrix_to_f64vector_builtin,
+	Matrix_transpose_builtin,
+	Memory_stats_builtin,
 	Mul_builtin,
+	Parallel_for_range_builtin,
+	Parallel_map_builtin,
+	Parallel_reduce_builtin,
 	Quote_builtin,
 	Set_builtin,
 	Sub_builtin,
+	Vector_builtin,
+	Vector_length_builtin,
+	Vector_ref_builtin,
+	Vector_set_builtin,
+	Vector_to_f32vector_builtin,
+	Vector_to_f64vector_builtin,
+	Vector_to_i64vector_builtin,
 
 	Num_builtins,   /* Not really a builtin. */
 };
@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "ident.h"
+#include "profile.h"
 #include "bytecode.h"
 
 static inline void
@@ -13,6 +16,11 @@ expand_if_needed(struct progm *prog)
 	else
 		prog->cap <<= 1;
 	prog->code = realloc(prog->code, sizeof(union op_or_imm) * prog->cap);
+#ifdef PROFILE
+	prog->prof = realloc(prog->prof, sizeof(struct prof_count) * prog->cap);
+	memset(prog->prof + prog->len, 0,
+	       sizeof(struct prof_count) * (prog->cap - prog->len));
+#endif
 }
 
 size_t
@@ -47,6 +55,22 @@ code_f(struct progm *prog, float imm)
 	return prog->len++;
 }
 
+size_t
+code_bi(struct progm *prog, int64_t imm)
+{
+	expand_if_needed(prog);
+	prog->code[prog->len].bi = imm;
+	return prog->len++;
+}
+
+size_t
+code_br(struct progm *prog, double imm)
+{
+	expand_if_needed(prog);
+	prog->code[prog->len].br = imm;
+	return prog->len++;
+}
+
 size_t
 code_sym(struct progm *prog, size_t imm)
 {
@@ -63,6 +87,14 @@ code_func(struct progm *prog, struct func *imm)
 	return prog->len++;
 }
 
+size_t
+code_const(struct progm *prog, struct value *imm)
+{
+	expand_if_needed(prog);
+	prog->code[prog->len].cell = imm;
+	return prog->len++;
+}
+
 size_t
 code_symtab(struct progm *prog, symtab *imm)
 {
@@ -71,94 +103,285 @@ code_symtab(struct progm *prog, symtab *imm)
 	return prog->len++;
 }
 
+/*
+ * Empty prog to be coded again, freeing the symbol tables of its lets.
+ */
+void
+code_reset(struct progm *prog)
+{
+	enum opcode inst;
+	symtab *locals;
+
+	for (prog->ip = 0; prog->ip < prog->len; )
+		if ((inst = NEXT_INST(*prog)) != Let_opcode) {
+			prog->ip += inst_imms(inst);
+		} else if ((locals = NEXT_IMM_SYMTAB(*prog)) != NULL) {
+			symtab_clear(locals);
+			free(locals);
+		}
+#ifdef PROFILE
+	memset(prog->prof, 0, sizeof(struct prof_count) * prog->len);
+#endif
+	prog->ip = prog->len = 0;
+}
+
+/*
+ * Argument string explanation:
+ *      j       - branch destination
+ *      d       - signed integer
+ *      u       - unsigned integer
+ *      i       - 64-bit signed integer
+ *      r       - real
+ *      o       - offset
+ *      l       - local variable offset
+ *      n       - nonlocal variable, a walk followed by an offset
+ *      s       - symbol
+ *      c       - inline cache, two immediates
+ *      f       - function
+ *      k       - constant
+ */
 static struct inst_info {
 	char *opcode, *args;
 } opcodes[] = {
 	[Add2_opcode] = { "add2", "" },
 	[Add_imm_si_opcode] = { "add", "d" },
+	[Add_local_imm_si_opcode] = { "add", "ld" },
+	[Add_local_local_opcode] = { "add", "ll" },
+	[Add_reg_opcode] = { "add", "lll" },
+	[Add_reg_imm_si_opcode] = { "add", "lld" },
 	[Alloc_list_opcode] = { "alloc_list", "" },
-	[Alloc_stack_opcode] = { "alloc_stack" , "" },
+	[Alloc_stack_opcode] = { "alloc_stack", "no" },
+	[Box_opcode] = { "box", "" },
 	[Call_opcode] = { "call", "o" },
 	[Call_current_opcode] = { "call_current", "o" },
 	[Call_imm_func_opcode] = { "call", "of" },
 	[Call_imm_local_opcode] = { "call", "ol" },
 	[Call_imm_nonlocal_opcode] = { "call", "on" },
-	[Call_imm_sym_opcode] = { "call", "oo" },
+	[Call_imm_sym_opcode] = { "call", "osc" },
 	[Car_opcode] = { "car" , "" },
 	[Cdr_opcode] = { "cdr" , "" },
+	[Cdr_advance_opcode] = { "cdr_advance" , "ll" },
 	[Clear_opcode] = { "clear", "" },
+	[Convert_vector_opcode] = { "convert_vector", "o" },
 	[Div2_opcode] = { "div2", "" },
 	[Div_imm_si_opcode] = { "div", "d" },
+	[Div_reg_opcode] = { "div", "lll" },
+	[Div_reg_imm_si_opcode] = { "div", "lld" },
 	[Drop_opcode] = { "drop", "" },
 	[Dup_opcode] = { "dup", "" },
 	[Halt_opcode] = { "halt", "" },
-	[Jmp_opcode] = { "jmp", "d" },
-	[Jmp_eq_opcode] = { "jmp_eq", "d" },
-	[Jmp_ne_opcode] = { "jmp_ne", "d" },
-	[Lambda_opcode] = { "lambda", "" },
+	[Jmp_opcode] = { "jmp", "j" },
+	[Jmp_eq_opcode] = { "jmp_eq", "j" },
+	[Jmp_eq_imm_si_opcode] = { "jmp_eq", "jd" },
+	[Jmp_eq_imm_ui_opcode] = { "jmp_eq", "ju" },
+	[Jmp_eq_local_imm_si_opcode] = { "jmp_eq", "jld" },
+	[Jmp_eq_local_local_opcode] = { "jmp_eq", "jll" },
+	[Jmp_false_opcode] = { "jmp_false", "j" },
+	[Jmp_gt_opcode] = { "jmp_gt", "j" },
+	[Jmp_gt_imm_si_opcode] = { "jmp_gt", "jd" },
+	[Jmp_gt_imm_ui_opcode] = { "jmp_gt", "ju" },
+	[Jmp_gt_local_imm_si_opcode] = { "jmp_gt", "jld" },
+	[Jmp_gt_local_local_opcode] = { "jmp_gt", "jll" },
+	[Jmp_lt_opcode] = { "jmp_lt", "j" },
+	[Jmp_lt_imm_si_opcode] = { "jmp_lt", "jd" },
+	[Jmp_lt_imm_ui_opcode] = { "jmp_lt", "ju" },
+	[Jmp_lt_local_imm_si_opcode] = { "jmp_lt", "jld" },
+	[Jmp_lt_local_local_opcode] = { "jmp_lt", "jll" },
+	[Jmp_ne_opcode] = { "jmp_ne", "j" },
+	[Jmp_ne_imm_si_opcode] = { "jmp_ne", "jd" },
+	[Jmp_ne_imm_ui_opcode] = { "jmp_ne", "ju" },
+	[Jmp_ne_local_imm_si_opcode] = { "jmp_ne", "jld" },
+	[Jmp_ne_local_local_opcode] = { "jmp_ne", "jll" },
+	[Jmp_true_opcode] = { "jmp_true", "j" },
+	[Lambda_opcode] = { "lambda", "of" },
 	[Let_opcode] = { "let", "o" },
 	[Load_opcode] = { "load", "" },
+	[Load_imm_closure_opcode] = { "load_closure", "n" },
 	[Load_imm_local_opcode] = { "load", "l" },
 	[Load_imm_nonlocal_opcode] = { "load", "n" },
-	[Load_imm_sym_opcode] = { "load", "s" },
+	[Load_imm_sym_opcode] = { "load", "sc" },
 	[Make_list_opcode] = { "list", "o" },
+	[Make_pair_opcode] = { "pair", "" },
+	[Make_vector_opcode] = { "vector", "o" },
+	[Make_vector_fill_opcode] = { "make_vector", "o" },
+	[Matrix_opcode] = { "matrix", "o" },
+	[Memory_stats_opcode] = { "memory_stats", "" },
 	[Mul2_opcode] = { "mul2", "" },
 	[Mul_imm_si_opcode] = { "mul", "d" },
+	[Mul_local_imm_si_opcode] = { "mul", "ld" },
+	[Mul_local_local_opcode] = { "mul", "ll" },
+	[Mul_reg_opcode] = { "mul", "lll" },
+	[Mul_reg_imm_si_opcode] = { "mul", "lld" },
+	[Parallel_opcode] = { "parallel", "o" },
+	[Push_const_opcode] = { "push", "k" },
+	[Push_imm_bi_opcode] = { "push", "i" },
+	[Push_imm_br_opcode] = { "push", "r" },
 	[Push_imm_func_opcode] = { "push", "f" },
 	[Push_imm_si_opcode] = { "push", "d" },
 	[Ret_opcode] = { "ret", "" },
+	[Simd_opcode] = { "simd", "o" },
+	[Sto_box_opcode] = { "sto_box", "" },
 	[Sto_imm_local_opcode] = { "sto", "l" },
 	[Sto_imm_local_func_opcode] = { "sto", "lf" },
+	[Sto_imm_local_jmp_opcode] = { "sto_jmp", "jl" },
 	[Sto_imm_local_si_opcode] = { "sto", "ld" },
 	[Sto_imm_nonlocal_opcode] = { "sto", "n" },
 	[Sto_imm_nonlocal_func_opcode] = { "sto", "nf" },
+	[Sto_imm_sym_opcode] = { "sto", "s" },
+	[Sto_imm_sym_func_opcode] = { "sto", "sf" },
+	[Sto_imm_sym_si_opcode] = { "sto", "sd" },
 	[Sub2_opcode] = { "sub2", "" },
 	[Sub_imm_si_opcode] = { "sub", "d" },
+	[Sub_local_imm_si_opcode] = { "sub", "ld" },
+	[Sub_local_local_opcode] = { "sub", "ll" },
+	[Sub_reg_opcode] = { "sub", "lll" },
+	[Sub_reg_imm_si_opcode] = { "sub", "lld" },
+	[Unbox_opcode] = { "unbox", "" },
+	[Vector_length_opcode] = { "vector_length", "" },
+	[Vector_ref_opcode] = { "vector_ref", "" },
+	[Vector_set_opcode] = { "vector_set", "" },
 	[Yield_opcode] = { "yield", "" },
+	[Yield_jmp_opcode] = { "yield_jmp", "j" },
 };
 
+/*
+ * Returns the number of immediates that follow an instruction.
+ */
+size_t
+inst_imms(enum opcode inst)
+{
+	size_t n;
+	char *args;
+
+	for (n = 0, args = opcodes[inst].args; *args != '\0'; args++)
+		n += (*args == 'n' || *args == 'c') ? 2 : 1;
+	return n;
+}
+
+/*
+ * Returns true if the first immediate of the instruction is a branch
+ * destination.
+ */
+bool
+inst_branches(enum opcode inst)
+{
+	return opcodes[inst].args[0] == 'j';
+}
+
+const char *
+inst_name(enum opcode inst)
+{
+	return opcodes[inst].opcode;
+}
+
+const char *
+inst_args(enum opcode inst)
+{
+	return opcodes[inst].args;
+}
+
+/*
+ * Print the instruction at prog->ip and move past it.
+ */
+static void
+print_inst(FILE *out, struct progm *prog)
+{
+	size_t ip = prog->ip;
+	struct inst_info inst = opcodes[NEXT_INST(*prog)];
+	char *args = inst.args;
+
+	fprintf(out, "%zu:\t%s\t", ip, inst.opcode);
+	for (;*args != '\0';args++)
+		switch (*args) {
+		case 'd':
+			fprintf(out, "%d\t", NEXT_IMM_SI(*prog));
+			break;
+
+		case 'i':
+			fprintf(out, "%lld\t", (long long)NEXT_IMM_BI(*prog));
+			break;
+
+		case 'r':
+			fprintf(out, "%g\t", NEXT_IMM_BR(*prog));
+			break;
+
+		case 'u':
+			fprintf(out, "%u\t", NEXT_IMM_UI(*prog));
+			break;
+
+		case 'j':
+		case 'o':
+			fprintf(out, "%zu\t", NEXT_IMM_OFFSET(*prog));
+			break;
+
+		case 'l':
+			fprintf(out, "loc(%zu)\t", NEXT_IMM_OFFSET(*prog));
+			break;
+
+		case 'n':
+		{
+			size_t walk, offset;
+
+			walk = NEXT_IMM_OFFSET(*prog);
+			offset = NEXT_IMM_OFFSET(*prog);
+			fprintf(out, "nonl(%zu, %zu)\t", walk, offset);
+			break;
+		}
+
+		case 's':
+			fprintf(out, "%s\t",
+				ident_strings[NEXT_IMM_SYMBOL(*prog)]);
+			break;
+
+		case 'c':
+			prog->ip += 2;
+			break;
+
+		case 'f':
+			(void)NEXT_IMM_FUNC(*prog);
+			fprintf(out, "func\t");
+			break;
+
+		case 'k':
+			(void)NEXT_IMM_CONST(*prog);
+			fprintf(out, "const\t");
+			break;
+
+		default:
+			break;
+		}
+	fprintf(out, "\n");
+}
+
 void
 disassemble(struct progm prog)
 {
+	prog.ip = 0;
+	while (prog.ip < prog.len)
+		print_inst(stdout, &prog);
+}
+
+#ifdef PROFILE
+/*
+ * Disassemble to stderr with the hits of every instruction and its share of
+ * total_cycles.
+ */
+void
+disassemble_profile(struct progm prog, uint64_t total_cycles)
+{
+	struct prof_count *c;
+
 	prog.ip = 0;
 	while (prog.ip < prog.len) {
-		size_t ip = prog.ip;
-		struct inst_info inst = opcodes[NEXT_INST(prog)];
-		char *args = inst.args;
-		printf("%zu:\t%s\t", ip, inst.opcode);
-		for (;*args != '\0';args++)
-			switch (*args) {
-			case 'd':
-				printf("%d\t", NEXT_IMM_SI(prog));
-				break;
-
-			case 'o':
-				printf("%zu\t", NEXT_IMM_OFFSET(prog));
-				break;
-
-			case 'l':
-				printf("loc(%zu)\t", NEXT_IMM_OFFSET(prog));
-				break;
-
-			case 'n':
-			{
-				size_t walk, offset;
-
-				walk = NEXT_IMM_OFFSET(prog);
-				offset = NEXT_IMM_OFFSET(prog);
-				printf("nonl(%zu, %zu)\t", walk, offset);
-				break;
-			}
-
-			case 'f':
-				(void)NEXT_IMM_FUNC(prog);
-				printf("func\t");
-				break;
-
-			default:
-				break;
-			}
-		printf("\n");
+		c = prog.prof + prog.ip;
+		if (c->hits == 0)
+			fprintf(stderr, "%12s%9s  ", "", "");
+		else
+			fprintf(stderr, "%12llu%8.2f%%  ",
+				(unsigned long long)c->hits,
+				100.0 * c->cycles / total_cycles);
+		print_inst(stderr, &prog);
 	}
 }
+#endif
 
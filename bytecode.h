@@ -2,6 +2,7 @@
 #define _BYTECODE_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "symtab.h"
 
@@ -16,16 +17,30 @@
  * elegence in internals.
  */
 
+/*
+ * The *_local_imm_si, *_local_local, Sto_imm_local_jmp and Yield_jmp
+ * instructions are superinstructions. The compiler never emits them; they are
+ * produced from common sequences by the optimizer (see opt.c).
+ *
+ * The *_reg instructions are three address instructions of the register mode
+ * of the compiler. They operate on local variables, used as registers, and
+ * store their result to the local named by their first immediate.
+ */
+
 /*
  * Immediate suffix explanation:
- *      bi      - big integer
- *      br      - big real
+ *      bi      - big integer, 64 bits
+ *      br      - big real, a double
  *      ui      - unsigned 32-bit integer
  *      si      - signed 32-bit integer
  *      sym     - symbol
  *      f       - 32-bit float
  *      func    - pointer to a struct func.
+ *      const   - pointer to a constant.
  *      symtab  - pointer to a symbol table.
+ *      sym     - global variable; instructions that read globals are followed
+ *                by two immediates for an inline cache of the global (see
+ *                global.h).
  *
  * These suffixes are inconsistent and must be made consistent.
  */
@@ -42,10 +57,26 @@ enum opcode {
 	/*
 	Add_imm_ui_opcode,
 	*/
+	Add_local_imm_si_opcode,
+	Add_local_local_opcode,
+	Add_reg_opcode,
+	Add_reg_imm_si_opcode,
 
 	Alloc_list_opcode,
+	/*
+	 * Alloc_stack walk offset n builds a list of the top n values in the
+	 * variables of a frame, starting at offset, instead of in the arena.
+	 */
 	Alloc_stack_opcode,
 
+	/*
+	 * Variables that closures capture and that are assigned to are kept in
+	 * boxes. Box puts the value at the top of the stack in a new box,
+	 * Unbox replaces a box with its value, and Sto_box pops a box and
+	 * stores the value below it into it.
+	 */
+	Box_opcode,
+
 	/*
 	 * All call instructions have at least one argument that specifies the
 	 * number of arguments being passed to the function.
@@ -56,13 +87,25 @@ enum opcode {
 	Call_imm_func_opcode,
 	Call_imm_local_opcode,
 	Call_imm_nonlocal_opcode,
-	Call_imm_sym_opcode,
+	Call_imm_sym_opcode,    /* Followed by an inline cache. */
 
 	Car_opcode,
 	Cdr_opcode,
+	/*
+	 * Cdr_advance var tmp is the cdr of the variable var. If var holds the
+	 * slice that the instruction last pushed, which it keeps in the
+	 * temporary tmp, the slice is advanced in place (see comp.c).
+	 */
+	Cdr_advance_opcode,
 
 	Clear_opcode,
 
+	/*
+	 * Convert_vector elem copies a vector into a new one whose items have
+	 * the type elem.
+	 */
+	Convert_vector_opcode,
+
 	Div2_opcode,
 	/*
 	DivN_opcode,
@@ -74,6 +117,8 @@ enum opcode {
 	/*
 	Div_imm_ui_opcode,
 	*/
+	Div_reg_opcode,
+	Div_reg_imm_si_opcode,
 
 	Drop_opcode,
 	Dup_opcode,     /* Duplicate the item at the top of the stack. */
@@ -88,24 +133,41 @@ enum opcode {
 	 * Bytecode addresses are context dependent. That is to say, a
 	 * function's bytecode address 0 is different from a disparate
 	 * function's bytecode address 0. Beware of this!
+	 *
+	 * Conditional branches pop the values they compare; the first value
+	 * pushed is the left hand side. The *_imm_* forms compare the top of the
+	 * stack with their second immediate, and the *_local_* forms compare
+	 * local variables without touching the stack.
 	 */
 	Jmp_opcode,     /* Unconditional jump. */
 	Jmp_eq_opcode,
 	Jmp_eq_imm_si_opcode,
 	Jmp_eq_imm_ui_opcode,
+	Jmp_eq_local_imm_si_opcode,
+	Jmp_eq_local_local_opcode,
 	Jmp_false_opcode,
 	Jmp_gt_opcode,
 	Jmp_gt_imm_si_opcode,
 	Jmp_gt_imm_ui_opcode,
+	Jmp_gt_local_imm_si_opcode,
+	Jmp_gt_local_local_opcode,
 	Jmp_lt_opcode,
 	Jmp_lt_imm_si_opcode,
 	Jmp_lt_imm_ui_opcode,
+	Jmp_lt_local_imm_si_opcode,
+	Jmp_lt_local_local_opcode,
 	Jmp_ne_opcode,
 	Jmp_ne_imm_si_opcode,
 	Jmp_ne_imm_ui_opcode,
+	Jmp_ne_local_imm_si_opcode,
+	Jmp_ne_local_local_opcode,
 	Jmp_true_opcode,
 
-	Lambda_opcode,  /* Possibly useless? */
+	/*
+	 * Lambda n func pops the n values a closure of func captures and
+	 * pushes the closure.
+	 */
+	Lambda_opcode,
 
 	/*
 	 * Let requires a symbol table as its only argument.
@@ -113,12 +175,27 @@ enum opcode {
 	Let_opcode,     /* Creates a new anonymous stack frame. */
 
 	Load_opcode,
+	Load_imm_closure_opcode,        /* A walk and an index of a capture. */
 	Load_imm_local_opcode,
 	Load_imm_nonlocal_opcode,
-	Load_imm_sym_opcode,
+	Load_imm_sym_opcode,    /* Followed by an inline cache. */
 
 	Make_list_opcode,
 	Make_pair_opcode,
+	Make_vector_opcode,
+	/*
+	 * Make_vector_fill elem pops the fill, then the length, of a vector
+	 * whose items have the type elem.
+	 */
+	Make_vector_fill_opcode,
+
+	/*
+	 * Matrix op pops the values of the matrix_op op and pushes its result
+	 * (see matrix.h).
+	 */
+	Matrix_opcode,
+
+	Memory_stats_opcode,    /* Pushes a list of the alloc_stats. */
 
 	Mul2_opcode,
 	/*
@@ -131,10 +208,25 @@ enum opcode {
 	/*
 	Mul_imm_ui_opcode,
 	*/
+	Mul_local_imm_si_opcode,
+	Mul_local_local_opcode,
+	Mul_reg_opcode,
+	Mul_reg_imm_si_opcode,
+
+	/*
+	 * Parallel op pops the values of the parallel_op op and pushes its
+	 * result (see parallel.h).
+	 */
+	Parallel_opcode,
 
 	/*
+	 * Push_const pushes a constant, such as quoted data, from the constant
+	 * pool (see const_pair() in alloc.h).
+	 */
+	Push_const_opcode,
 	Push_imm_bi_opcode,
 	Push_imm_br_opcode,
+	/*
 	Push_imm_f_opcode,
 	*/
 	Push_imm_func_opcode,
@@ -146,9 +238,16 @@ enum opcode {
 
 	Ret_opcode,
 
+	/*
+	 * Simd op pops the vectors of the simd_op op and pushes its result
+	 * (see simd.h).
+	 */
+	Simd_opcode,
+
 	/*
 	Sto_opcode,
 	*/
+	Sto_box_opcode,
 	Sto_imm_local_opcode,
 	/*
 	Sto_imm_local_bi_opcode,
@@ -156,6 +255,7 @@ enum opcode {
 	Sto_imm_local_f_opcode,
 	*/
 	Sto_imm_local_func_opcode,
+	Sto_imm_local_jmp_opcode,
 	Sto_imm_local_si_opcode,
 	/*
 	Sto_imm_local_sym_opcode,
@@ -172,12 +272,16 @@ enum opcode {
 	/*
 	Sto_imm_nonlocal_sym_opcode,
 	Sto_imm_nonlocal_ui_opcode,
+	*/
 	Sto_imm_sym_opcode,
+	/*
 	Sto_imm_sym_bi_opcode,
 	Sto_imm_sym_br_opcode,
 	Sto_imm_sym_f_opcode,
+	*/
 	Sto_imm_sym_func_opcode,
 	Sto_imm_sym_si_opcode,
+	/*
 	Sto_imm_sym_sym_opcode,
 	Sto_imm_sym_ui_opcode,
 	*/
@@ -193,11 +297,31 @@ enum opcode {
 	/*
 	Sub_imm_ui_opcode,
 	*/
+	Sub_local_imm_si_opcode,
+	Sub_local_local_opcode,
+	Sub_reg_opcode,
+	Sub_reg_imm_si_opcode,
+
+	Unbox_opcode,
+
+	/*
+	 * Vector_set pops a value, an index and a vector and stores the value
+	 * into the vector, or into a copy of it if it is a slice. It pushes the
+	 * vector it stored into.
+	 */
+	Vector_length_opcode,
+	Vector_ref_opcode,
+	Vector_set_opcode,
 
 	Yield_opcode,
+	Yield_jmp_opcode,
+
+	Num_opcodes     /* Not an instruction. */
 };
 
 struct func;
+struct value;
+struct prof_count;
 
 struct progm {
 	union op_or_imm {
@@ -207,28 +331,36 @@ struct progm {
 		/* Immediate values:    */
 		uint32_t        ui;
 		int32_t         si;
+		int64_t         bi;
+		double          br;
 		float           f;
 		size_t          sym;
 		size_t          o;
 		symtab          *symtab;
 		struct func     *func;
+		struct value    *cell;
 
 	}       *code;
 	size_t  ip;
 	size_t  len;
 	size_t  cap;
-
+#ifdef PROFILE
+	struct prof_count *prof;        /* One for each of code. */
+#endif
 };
 
 #define NEXT_INST(progm)        ((enum opcode)(progm).code[(progm).ip++].inst)
 
 #define NEXT_IMM_F(progm)       ((float)(progm).code[(progm).ip++].f)
+#define NEXT_IMM_BI(progm)      ((int64_t)(progm).code[(progm).ip++].bi)
+#define NEXT_IMM_BR(progm)      ((double)(progm).code[(progm).ip++].br)
 #define NEXT_IMM_SI(progm)      ((int32_t)(progm).code[(progm).ip++].si)
 #define NEXT_IMM_UI(progm)      ((uint32_t)(progm).code[(progm).ip++].ui)
 #define NEXT_IMM_SYMBOL(progm)  ((size_t)(progm).code[(progm).ip++].sym)
 #define NEXT_IMM_OFFSET(progm)  ((size_t)(progm).code[(progm).ip++].o)
 #define NEXT_IMM_FUNC(progm)    ((struct func *)(progm).code[(progm).ip++].func)
 #define NEXT_IMM_SYMTAB(progm)  ((symtab *)(progm).code[(progm).ip++].func)
+#define NEXT_IMM_CONST(progm)   ((struct value *)(progm).code[(progm).ip++].cell)
 
 /*
  * Each code function returns the index of the added intermmediate/instruction
@@ -236,12 +368,15 @@ struct progm {
  */
 
 size_t code_f(struct progm *, float);
+size_t code_bi(struct progm *, int64_t);
+size_t code_br(struct progm *, double);
 size_t code_sym(struct progm *, size_t);
 size_t code_si(struct progm *, int32_t);
 size_t code_ui(struct progm *, uint32_t);
 size_t code_symtab(struct progm *, symtab *);
 size_t code_inst(struct progm *, enum opcode);
 size_t code_func(struct progm *, struct func *);
+size_t code_const(struct progm *, struct value *);
 
 static inline size_t
 code_offset(struct progm *prog, size_t offset)
@@ -249,6 +384,27 @@ code_offset(struct progm *prog, size_t offset)
 	return code_sym(prog, offset);
 }
 
+/*
+ * Add an empty inline cache. Returns the index of its first immediate.
+ */
+static inline size_t
+code_cache(struct progm *prog)
+{
+	size_t at = code_sym(prog, 0);
+	code_sym(prog, 0);
+	return at;
+}
+
+void code_reset(struct progm *);
+
+size_t inst_imms(enum opcode);
+bool inst_branches(enum opcode);
+const char *inst_name(enum opcode);
+const char *inst_args(enum opcode);
+
 void disassemble(struct progm prog);
+#ifdef PROFILE
+void disassemble_profile(struct progm prog, uint64_t total_cycles);
+#endif
 
 #endif
@@ -1,9 +1,17 @@
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
+#include "num.h"
+#include "opt.h"
+#include "ident.h"
 #include "alloc.h"
 #include "types.h"
 #include "symtab.h"
+#include "profile.h"
+#include "simd.h"
+#include "matrix.h"
+#include "parallel.h"
 #include "builtin.h"
 #include "bytecode.h"
 
@@ -28,22 +36,92 @@ static struct scope {
 	struct list     *local_funcs;
 	struct func     *fdat;
 	struct scope    *parent;
+	size_t          temps;          /* Register temporaries in use. */
+
+	/*
+	 * The variables of enclosing functions that a lambda captures, in the
+	 * order of its closures' captures, and the variables of a function
+	 * that are kept in boxes (see compile_lambda()).
+	 */
+	struct capture  *captures;
+	size_t          ncaptures;
+	symtab          *boxed;
+
+	/*
+	 * The temporary of each argument of a function that tail calls advance
+	 * in place, or 0 (see find_advanced()).
+	 */
+	size_t          *advance_temps;
 } global;
 
+struct capture {
+	size_t          sym;
+	bool            boxed;
+};
+
 struct var_loc {
 	size_t          walk;
-	size_t          offset;
+	size_t          offset;         /* Or the index of a capture. */
 	struct scope    *scope;
+	bool            captured;
+	bool            boxed;
 };
 
+struct arena comp_arena = ARENA_INIT;
+
+static void *
+comp_alloc(size_t size)
+{
+	void *p = arena_alloc(&comp_arena, size);
+
+	memset(p, 0, size);
+	return p;
+}
+
+static symtab *
+new_symtab(void)
+{
+	symtab *p = arena_alloc(&comp_arena, sizeof(symtab));
+
+	symtab_init(p);
+	p->alloc = &comp_alloc;
+	return p;
+}
+
+/*
+ * Once a function or a let scope has been compiled, only the number of its
+ * variables is ever looked at, so that is all that is kept of its symbol
+ * table. The copy has no buckets to look symbols up in.
+ */
+static symtab *
+keep_symtab(symtab *p)
+{
+	symtab *q = malloc(sizeof(symtab));
+
+	symtab_init(q);
+	q->len = p->len;
+	return q;
+}
+
+/*
+ * True if the variable sym of the scope curr is kept in a box.
+ */
+static bool
+is_boxed(struct scope *curr, size_t sym)
+{
+	while (curr->fdat == NULL)
+		curr = curr->parent;
+	return curr->boxed != NULL && sym_exists(curr->boxed, sym);
+}
+
 /*
  * Finds the variable. If no variable was found, the scope is set to NULL.
  */
 static struct var_loc
 find_var_loc(struct scope *curr, size_t sym)
 {
-	size_t walk;
-	struct var_loc var = { 0, 0, NULL };
+	size_t i, walk;
+	struct var_loc var = { 0, 0, NULL, false, false };
 
 	walk = 0;
 	while (curr != NULL) {
@@ -51,8 +129,18 @@ find_var_loc(struct scope *curr, size_t sym)
 			var.walk = walk;
 			var.scope = curr;
 			var.offset = sym_offset(curr->locals, sym);
+			var.boxed = is_boxed(curr, sym);
 			return var;
 		}
+		for (i = 0; i < curr->ncaptures; i++)
+			if (curr->captures[i].sym == sym) {
+				var.walk = walk;
+				var.scope = curr;
+				var.offset = i;
+				var.captured = true;
+				var.boxed = curr->captures[i].boxed;
+				return var;
+			}
 		walk++;
 		curr = curr->parent;
 	}
@@ -60,6 +148,833 @@ find_var_loc(struct scope *curr, size_t sym)
 	return var;
 }
 
+/*
+ * True if the value is an integer that fits in a signed immediate.
+ */
+static inline bool
+is_si(struct value *vp)
+{
+	return type_of(*vp) == Integer_type &&
+	       int_of(*vp) >= INT32_MIN && int_of(*vp) <= INT32_MAX;
+}
+
+/*
+ * Register mode.
+ *
+ * Arithmetic whose operands are all small integers, variables of the current
+ * frame or more such arithmetic is compiled into the three address *_reg
+ * instructions. Their operands are slots of the frame, "registers": variables
+ * are used in place and intermediate results go to temporaries, hidden
+ * variables that are added to the frame's symbol table. Results that are
+ * needed on the stack are left to a final stack instruction, which the
+ * optimizer fuses with the loads of its operands.
+ */
+bool compile_registers = false;
+
+/*
+ * Temporaries are named by symbols that no identifier will ever have.
+ */
+#define TEMP_SYM(n)     (SIZE_MAX - (n))
+
+static const struct {
+	enum opcode     stack, imm, reg, reg_imm;
+	bool            commutes;
+} arith_ops[] = {
+	[Add_builtin] = {
+		Add2_opcode, Add_imm_si_opcode,
+		Add_reg_opcode, Add_reg_imm_si_opcode, true
+	},
+	[Sub_builtin] = {
+		Sub2_opcode, Sub_imm_si_opcode,
+		Sub_reg_opcode, Sub_reg_imm_si_opcode, false
+	},
+	[Mul_builtin] = {
+		Mul2_opcode, Mul_imm_si_opcode,
+		Mul_reg_opcode, Mul_reg_imm_si_opcode, true
+	},
+	[Div_builtin] = {
+		Div2_opcode, Div_imm_si_opcode,
+		Div_reg_opcode, Div_reg_imm_si_opcode, false
+	},
+};
+
+/*
+ * An operand of a register instruction.
+ */
+struct operand {
+	bool            imm;
+	int32_t         si;
+	size_t          reg;
+};
+
+/*
+ * The scope whose frame the evaluator runs env in. Let scopes without
+ * variables are not given frames of their own.
+ */
+static struct scope *
+frame_scope(struct scope *env)
+{
+	while (env->fdat == NULL && env->locals->len == 0)
+		env = env->parent;
+	return env;
+}
+
+static bool
+use_registers(struct scope *env)
+{
+	/* Temporaries are not kept for the top level. */
+	return compile_registers && frame_scope(env) != &global;
+}
+
+static size_t
+alloc_temp(struct scope *fs)
+{
+	return sym_offset(fs->locals, TEMP_SYM(fs->temps++));
+}
+
+static bool
+is_arith(struct value *vp)
+{
+	if (type_of(*vp) != Vector_type || vector_of(*vp)->len < 3 ||
+	    type_of(*vector_of(*vp)->items) != Symbol_type)
+		return false;
+	switch (sym_of(*vector_of(*vp)->items)) {
+	case Add_builtin:
+	case Sub_builtin:
+	case Mul_builtin:
+	case Div_builtin:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/*
+ * True if vp can be computed without the stack.
+ */
+static bool
+is_reg_operand(struct scope *env, struct value *vp)
+{
+	size_t i;
+	struct vector *lp;
+	struct var_loc loc;
+
+	if (is_si(vp))
+		return true;
+	if (type_of(*vp) == Symbol_type) {
+		loc = find_var_loc(env, sym_of(*vp));
+		return loc.scope == frame_scope(env) && !loc.captured &&
+		       !loc.boxed;
+	}
+	if (!is_arith(vp))
+		return false;
+	lp = vector_of(*vp);
+	for (i = 1; i < lp->len; i++)
+		if (!is_reg_operand(env, lp->items + i))
+			return false;
+	return true;
+}
+
+static void
+code_push_operand(struct progm *prog, struct operand *op)
+{
+	if (op->imm) {
+		code_inst(prog, Push_imm_si_opcode);
+		code_si(prog, op->si);
+	} else {
+		code_inst(prog, Load_imm_local_opcode);
+		code_offset(prog, op->reg);
+	}
+}
+
+static void compile_operand(struct scope *, struct progm *, struct value *,
+			    struct operand *);
+
+/*
+ * Compile the operation of lp on its first n - 1 operands into dst. The
+ * operands of lp must satisfy is_reg_operand().
+ */
+static void
+compile_arith_reg(struct scope *env, struct progm *prog, struct vector *lp,
+		  size_t n, size_t dst)
+{
+	size_t i, temps, acc;
+	struct operand a, b, t;
+	struct scope *fs = frame_scope(env);
+	enum builtin sym = sym_of(*lp->items);
+
+	temps = fs->temps;
+	acc = SIZE_MAX;
+	compile_operand(env, prog, lp->items + 1, &a);
+	for (i = 2; i < n; i++) {
+		compile_operand(env, prog, lp->items + i, &b);
+		if (a.imm && !b.imm && arith_ops[sym].commutes) {
+			t = a;
+			a = b;
+			b = t;
+		} else if (a.imm) {
+			/* The left operand must be a register. */
+			a.imm = false;
+			a.reg = alloc_temp(fs);
+			code_inst(prog, Sto_imm_local_si_opcode);
+			code_offset(prog, a.reg);
+			code_si(prog, a.si);
+		}
+		if (i == n - 1)
+			acc = dst;
+		else if (acc == SIZE_MAX)
+			acc = alloc_temp(fs);
+		code_inst(prog, b.imm ? arith_ops[sym].reg_imm
+				      : arith_ops[sym].reg);
+		code_offset(prog, acc);
+		code_offset(prog, a.reg);
+		if (b.imm)
+			code_si(prog, b.si);
+		else
+			code_offset(prog, b.reg);
+		a.reg = acc;
+	}
+	fs->temps = temps;
+}
+
+/*
+ * Make vp, which must satisfy is_reg_operand(), an operand. Temporaries
+ * allocated for it are in use until the caller releases them.
+ */
+static void
+compile_operand(struct scope *env, struct progm *prog, struct value *vp,
+		struct operand *op)
+{
+	struct vector *lp;
+
+	op->imm = is_si(vp);
+	if (op->imm) {
+		op->si = int_of(*vp);
+	} else if (type_of(*vp) == Symbol_type) {
+		op->reg = find_var_loc(env, sym_of(*vp)).offset;
+	} else {
+		lp = vector_of(*vp);
+		op->reg = alloc_temp(frame_scope(env));
+		compile_arith_reg(env, prog, lp, lp->len, op->reg);
+	}
+}
+
+/*
+ * Compile arithmetic whose result is pushed.
+ */
+static void
+compile_arith_push(struct scope *env, struct progm *prog, struct vector *lp)
+{
+	size_t temps;
+	struct operand a, b;
+	struct scope *fs = frame_scope(env);
+	enum builtin sym = sym_of(*lp->items);
+
+	temps = fs->temps;
+	if (lp->len > 3) {
+		a.imm = false;
+		a.reg = alloc_temp(fs);
+		compile_arith_reg(env, prog, lp, lp->len - 1, a.reg);
+	} else {
+		compile_operand(env, prog, lp->items + 1, &a);
+	}
+	compile_operand(env, prog, lp->items + lp->len - 1, &b);
+	code_push_operand(prog, &a);
+	if (b.imm) {
+		code_inst(prog, arith_ops[sym].imm);
+		code_si(prog, b.si);
+	} else {
+		code_push_operand(prog, &b);
+		code_inst(prog, arith_ops[sym].stack);
+	}
+	fs->temps = temps;
+}
+
+
+/*
+ * Escape analysis.
+ *
+ * Lists built by list or cons that cannot outlive the call they are built in
+ * are built in its frame, in temporaries of the function, rather than in its
+ * arena. Such lists are only ever taken apart: they are the operand of car,
+ * vector-ref or vector-length, or of cdrs whose results are taken apart in
+ * turn, or they are the value of a variable defined in the body of a
+ * function whose later uses all are. Any other use may return, store, pass
+ * or close over the list.
+ *
+ * The forms found are kept until the function they are in has been compiled.
+ * Nested functions are analyzed as they are compiled.
+ */
+static struct vector **stack_sites;
+static size_t stack_sites_len, stack_sites_cap;
+
+static void
+add_stack_site(struct vector *lp)
+{
+	if (stack_sites_len == stack_sites_cap) {
+		stack_sites_cap = stack_sites_cap ? stack_sites_cap * 2 : 16;
+		stack_sites = realloc(stack_sites,
+				      sizeof(struct vector *) * stack_sites_cap);
+	}
+	stack_sites[stack_sites_len++] = lp;
+}
+
+static bool
+is_stack_site(struct vector *lp)
+{
+	size_t i;
+
+	for (i = stack_sites_len; i > 0; i--)
+		if (stack_sites[i - 1] == lp)
+			return true;
+	return false;
+}
+
+/*
+ * The builtin applied by the form vp, or Num_builtins if there is none.
+ */
+static enum builtin
+form_builtin(struct value *vp)
+{
+	struct vector *lp;
+
+	if (type_of(*vp) != Vector_type)
+		return Num_builtins;
+	lp = vector_of(*vp);
+	if (lp->len == 0 || type_of(*lp->items) != Symbol_type ||
+	    sym_of(*lp->items) >= Num_builtins)
+		return Num_builtins;
+	return sym_of(*lp->items);
+}
+
+static bool
+is_list_form(struct value *vp)
+{
+	switch (form_builtin(vp)) {
+	case List_builtin:
+		return vector_of(*vp)->len >= 2;
+	case Cons_builtin:
+		return vector_of(*vp)->len == 3;
+	default:
+		return false;
+	}
+}
+
+/*
+ * True if the form vp is compiled apart from the function it is in, or not
+ * compiled at all.
+ */
+static bool
+is_opaque(struct value *vp)
+{
+	switch (form_builtin(vp)) {
+	case Lambda_builtin:
+	case Quote_builtin:
+		return true;
+	case Define_builtin:
+		return vector_of(*vp)->len > 1 &&
+		       type_of(vector_of(*vp)->items[1]) == Vector_type;
+	default:
+		return false;
+	}
+}
+
+static bool
+mentions(struct value *vp, size_t sym)
+{
+	size_t i;
+	struct vector *lp;
+
+	if (type_of(*vp) == Symbol_type)
+		return sym_of(*vp) == sym;
+	if (type_of(*vp) != Vector_type || form_builtin(vp) == Quote_builtin)
+		return false;
+	lp = vector_of(*vp);
+	for (i = 0; i < lp->len; i++)
+		if (mentions(lp->items + i, sym))
+			return true;
+	return false;
+}
+
+/*
+ * Find the lists built in vp that are taken apart right away. The value of vp
+ * is taken apart if consumed is true.
+ */
+static void
+find_stack_sites(struct value *vp, bool consumed)
+{
+	size_t i;
+	struct vector *lp;
+
+	if (type_of(*vp) != Vector_type || is_opaque(vp))
+		return;
+	lp = vector_of(*vp);
+	switch (form_builtin(vp)) {
+	case Car_builtin:
+		consumed = true;
+		/* FALLTHROUGH */
+	case Cdr_builtin:
+		if (lp->len == 2)
+			find_stack_sites(lp->items + 1, consumed);
+		return;
+
+	case List_builtin:
+	case Cons_builtin:
+		if (consumed && is_list_form(vp))
+			add_stack_site(lp);
+		break;
+
+	default:
+		break;
+	}
+	for (i = 0; i < lp->len; i++)
+		find_stack_sites(lp->items + i, false);
+}
+
+/*
+ * True if every use of the variable sym in vp takes it apart.
+ */
+static bool
+is_taken_apart(struct value *vp, size_t sym, bool consumed)
+{
+	size_t i;
+	struct vector *lp;
+
+	if (type_of(*vp) == Symbol_type)
+		return sym_of(*vp) != sym || consumed;
+	if (type_of(*vp) != Vector_type)
+		return true;
+	if (is_opaque(vp))
+		return !mentions(vp, sym);
+	lp = vector_of(*vp);
+	switch (form_builtin(vp)) {
+	case Car_builtin:
+		consumed = true;
+		/* FALLTHROUGH */
+	case Cdr_builtin:
+		if (lp->len == 2)
+			return is_taken_apart(lp->items + 1, sym, consumed);
+		break;
+
+	case Vector_length_builtin:
+	case Vector_ref_builtin:
+		if (lp->len < 2 || !is_taken_apart(lp->items + 1, sym, true))
+			return false;
+		for (i = 2; i < lp->len; i++)
+			if (!is_taken_apart(lp->items + i, sym, false))
+				return false;
+		return true;
+
+	default:
+		break;
+	}
+	for (i = 0; i < lp->len; i++)
+		if (!is_taken_apart(lp->items + i, sym, false))
+			return false;
+	return true;
+}
+
+/*
+ * Find the stack sites of the body of a function, the forms from body up to
+ * end.
+ */
+static void
+find_body_stack_sites(struct value *body, struct value *end)
+{
+	struct value *vp, *use;
+	struct vector *lp;
+
+	if (opt_level < 1)
+		return;
+	for (vp = body; vp < end; vp++) {
+		find_stack_sites(vp, false);
+		if (form_builtin(vp) != Define_builtin)
+			continue;
+		lp = vector_of(*vp);
+		if (lp->len != 3 || type_of(lp->items[1]) != Symbol_type ||
+		    !is_list_form(lp->items + 2))
+			continue;
+		for (use = vp + 1; use < end; use++)
+			if (!is_taken_apart(use, sym_of(lp->items[1]), false))
+				break;
+		if (use == end)
+			add_stack_site(vector_of(lp->items[2]));
+	}
+}
+
+static bool
+is_cdr_of(struct value *vp, size_t sym)
+{
+	struct vector *lp;
+
+	if (form_builtin(vp) != Cdr_builtin)
+		return false;
+	lp = vector_of(*vp);
+	return lp->len == 2 && type_of(lp->items[1]) == Symbol_type &&
+	       sym_of(lp->items[1]) == sym;
+}
+
+/*
+ * True if every use of the argument sym in vp takes it apart, or passes its
+ * cdr as the same argument, the kth, of a call of the function fsym. Sets
+ * *passed if there is such a call.
+ */
+static bool
+is_advanced(struct value *vp, size_t sym, size_t fsym, size_t k,
+	    bool *passed)
+{
+	size_t i;
+	struct vector *lp;
+
+	if (is_taken_apart(vp, sym, false))
+		return true;
+	if (type_of(*vp) != Vector_type || is_opaque(vp))
+		return false;
+	switch (form_builtin(vp)) {
+	case Car_builtin:
+	case Cdr_builtin:
+	case Vector_length_builtin:
+	case Vector_ref_builtin:
+		return false;
+	default:
+		break;
+	}
+	lp = vector_of(*vp);
+	for (i = 0; i < lp->len; i++)
+		if (i == k + 1 && type_of(*lp->items) == Symbol_type &&
+		    sym_of(*lp->items) == fsym &&
+		    is_cdr_of(lp->items + i, sym))
+			*passed = true;
+		else if (!is_advanced(lp->items + i, sym, fsym, k, passed))
+			return false;
+	return true;
+}
+
+/*
+ * Tail calls of a function to itself that pass the cdr of one of its
+ * arguments as that same argument are loops over a list or a vector. A cdr
+ * of a vector is a slice, which would be allocated anew on every iteration.
+ * If the argument is only ever taken apart or passed on that way, nothing
+ * but the frame refers to the slice, and such calls advance the slice that
+ * the frame made in place instead (see Cdr_advance in eval.c). The frame
+ * keeps it in a temporary as well, to tell it from a slice it was passed.
+ *
+ * Returns the temporaries of the function fs, or NULL if it has none.
+ */
+static size_t *
+find_advanced(struct scope *fs, struct value *body, struct value *end)
+{
+	size_t k, *temps;
+	bool passed;
+	struct value *vp;
+	struct vector *args = fs->fdat->args;
+
+	if (opt_level < 1 || fs->fdat->flags.variadic)
+		return NULL;
+	temps = NULL;
+	for (k = 0; k < args->len; k++) {
+		passed = false;
+		for (vp = body; vp < end; vp++)
+			if (!is_advanced(vp, sym_of(args->items[k]),
+					 fs->func_sym, k, &passed))
+				break;
+		if (vp < end || !passed)
+			continue;
+		if (temps == NULL)
+			temps = comp_alloc(sizeof(size_t) * args->len);
+		temps[k] = alloc_temp(fs);
+	}
+	return temps;
+}
+
+/*
+ * True if the self tail call lp advances its ith argument, counting from 1,
+ * in place.
+ */
+static bool
+is_advanced_arg(struct scope *env, struct vector *lp, size_t i)
+{
+	size_t sym;
+	struct scope *fs;
+	struct vector *args;
+
+	for (fs = env; fs->fdat == NULL; fs = fs->parent)
+		;
+	if (fs->advance_temps == NULL ||
+	    type_of(*lp->items) != Symbol_type ||
+	    sym_of(*lp->items) != fs->func_sym)
+		return false;
+	args = fs->fdat->args;
+	if (lp->len - 1 != args->len || fs->advance_temps[i - 1] == 0)
+		return false;
+	sym = sym_of(args->items[i - 1]);
+	return is_cdr_of(lp->items + i, sym) &&
+	       find_var_loc(env, sym).scope == fs;
+}
+
+/*
+ * Build the list whose items lp has pushed in the frame of the function if
+ * it does not escape. Returns false if it must be built in the arena.
+ */
+static bool
+code_stack_list(struct scope *env, struct progm *prog, struct vector *lp)
+{
+	size_t i, n, walk, offset;
+	struct scope *fs;
+
+	if (!is_stack_site(lp))
+		return false;
+	for (walk = 0, fs = env; fs->fdat == NULL; fs = fs->parent)
+		walk++;
+	if (fs == &global)
+		return false;
+
+	/*
+	 * The pairs take consecutive slots, so skip the temporaries register
+	 * code has used and let go of.
+	 */
+	while (sym_exists(fs->locals, TEMP_SYM(fs->temps)))
+		fs->temps++;
+	n = lp->len - 1;
+	offset = alloc_temp(fs);
+	for (i = 1; i < n * PAIR_SLOTS; i++)
+		alloc_temp(fs);
+
+	code_inst(prog, Alloc_stack_opcode);
+	code_offset(prog, walk);
+	code_offset(prog, offset);
+	code_offset(prog, n);
+	return true;
+}
+
+/*
+ * Closures.
+ *
+ * Lambdas are flat closures. When a lambda is made, it captures the variables
+ * of enclosing functions that its body mentions, and its closures reach them
+ * through their captures instead of through the frames of those functions,
+ * which may be gone by the time they are called. Functions made by define
+ * still reach the frames of their parents (see close_over() in eval.c).
+ *
+ * Captured values are copies, so a variable that is assigned to is kept in a
+ * box that the function and its closures share. The variables of a function
+ * that are boxed are those that are assigned to somewhere in it and that some
+ * lambda in it mentions.
+ */
+static void
+find_assigned(struct value *vp, symtab *assigned)
+{
+	size_t i;
+	struct vector *lp;
+
+	if (type_of(*vp) != Vector_type || form_builtin(vp) == Quote_builtin)
+		return;
+	lp = vector_of(*vp);
+	if (form_builtin(vp) == Set_builtin && lp->len == 3 &&
+	    type_of(lp->items[1]) == Symbol_type)
+		sym_offset(assigned, sym_of(lp->items[1]));
+	for (i = 0; i < lp->len; i++)
+		find_assigned(lp->items + i, assigned);
+}
+
+static void
+find_captured(struct value *vp, symtab *assigned, symtab *boxed,
+	      bool in_lambda)
+{
+	size_t i;
+	struct vector *lp;
+
+	if (type_of(*vp) == Symbol_type) {
+		if (in_lambda && sym_exists(assigned, sym_of(*vp)))
+			sym_offset(boxed, sym_of(*vp));
+		return;
+	}
+	if (type_of(*vp) != Vector_type || form_builtin(vp) == Quote_builtin)
+		return;
+	lp = vector_of(*vp);
+	in_lambda |= form_builtin(vp) == Lambda_builtin;
+	for (i = 0; i < lp->len; i++)
+		find_captured(lp->items + i, assigned, boxed, in_lambda);
+}
+
+/*
+ * The variables of the function body from body up to end to keep in boxes,
+ * or NULL if there are none.
+ */
+static symtab *
+find_boxed(struct value *body, struct value *end)
+{
+	struct value *vp;
+	symtab assigned, *boxed;
+
+	symtab_init(&assigned);
+	assigned.alloc = &comp_alloc;
+	for (vp = body; vp < end; vp++)
+		find_assigned(vp, &assigned);
+	if (assigned.len == 0)
+		return NULL;
+
+	boxed = new_symtab();
+	for (vp = body; vp < end; vp++)
+		find_captured(vp, &assigned, boxed, false);
+	return (boxed->len > 0) ? boxed : NULL;
+}
+
+/*
+ * Add the variables that vp mentions and that are bound outside of the
+ * lambda of scope ls, which is made in env, to its captures. Globals are
+ * looked up by name and need not be captured.
+ */
+static void
+find_captures(struct scope *env, struct scope *ls, struct value *vp)
+{
+	size_t i, sym;
+	struct var_loc loc;
+	struct vector *lp;
+	struct capture *captures;
+
+	if (form_builtin(vp) == Quote_builtin)
+		return;
+	if (type_of(*vp) == Vector_type) {
+		lp = vector_of(*vp);
+		for (i = 0; i < lp->len; i++)
+			find_captures(env, ls, lp->items + i);
+		return;
+	}
+	if (type_of(*vp) != Symbol_type)
+		return;
+	sym = sym_of(*vp);
+	if (sym_exists(ls->locals, sym))
+		return;
+	for (i = 0; i < ls->ncaptures; i++)
+		if (ls->captures[i].sym == sym)
+			return;
+	if ((loc = find_var_loc(env, sym)).scope == NULL)
+		return;
+	/* The captures double whenever their number is a power of two. */
+	if ((ls->ncaptures & (ls->ncaptures - 1)) == 0) {
+		captures = arena_alloc(&comp_arena, sizeof(struct capture) *
+				       (ls->ncaptures ? 2 * ls->ncaptures : 1));
+		if (ls->ncaptures != 0)
+			memcpy(captures, ls->captures,
+			       sizeof(struct capture) * ls->ncaptures);
+		ls->captures = captures;
+	}
+	ls->captures[ls->ncaptures].sym = sym;
+	ls->captures[ls->ncaptures].boxed = loc.boxed;
+	ls->ncaptures++;
+}
+
+/*
+ * Box the arguments of the function of fs that are kept in boxes, as it
+ * starts.
+ */
+static void
+code_box_args(struct scope *fs, struct progm *prog)
+{
+	size_t i, offset;
+	struct vector *args = fs->fdat->args;
+
+	if (fs->boxed == NULL)
+		return;
+	for (i = 0; i < args->len; i++) {
+		if (!sym_exists(fs->boxed, sym_of(args->items[i])))
+			continue;
+		offset = sym_offset(fs->locals, sym_of(args->items[i]));
+		code_inst(prog, Load_imm_local_opcode);
+		code_offset(prog, offset);
+		code_inst(prog, Box_opcode);
+		code_inst(prog, Sto_imm_local_opcode);
+		code_offset(prog, offset);
+	}
+}
+
+/*
+ * Constants.
+ *
+ * Quoted data, and lists built by list or cons out of constants alone, are
+ * built once by the compiler in the constant pool. Push_const pushes them
+ * from there whenever they are evaluated, so that they allocate nothing at
+ * run time.
+ */
+static bool
+is_constant(struct value *vp)
+{
+	size_t i;
+	struct vector *lp;
+
+	switch (form_builtin(vp)) {
+	case Quote_builtin:
+		return vector_of(*vp)->len == 2;
+
+	case List_builtin:
+	case Cons_builtin:
+		if (!is_list_form(vp))
+			return false;
+		lp = vector_of(*vp);
+		for (i = 1; i < lp->len; i++)
+			if (!is_constant(lp->items + i))
+				return false;
+		return true;
+
+	default:
+		return type_of(*vp) == Integer_type ||
+		       type_of(*vp) == Real_type;
+	}
+}
+
+/*
+ * The constant that the quoted datum v stands for.
+ */
+static struct value
+quoted(struct value v)
+{
+	size_t i;
+	struct pair *p = NULL;
+	struct vector *lp;
+
+	if (type_of(v) != Vector_type)
+		return v;
+	lp = vector_of(v);
+	for (i = lp->len; i > 0; i--)
+		p = const_pair(quoted(lp->items[i - 1]), p);
+	return pair_value(p);
+}
+
+/*
+ * The value of vp, for which is_constant() holds.
+ */
+static struct value
+constant_of(struct value *vp)
+{
+	size_t i;
+	struct pair *p = NULL;
+	struct vector *lp;
+
+	if (type_of(*vp) != Vector_type)
+		return *vp;
+	lp = vector_of(*vp);
+	if (form_builtin(vp) == Quote_builtin)
+		return quoted(lp->items[1]);
+	for (i = lp->len; i > 1; i--)
+		p = const_pair(constant_of(lp->items + i - 1), p);
+	return pair_value(p);
+}
+
+/*
+ * Push the constant vp. Its value is pushed from the car of the list that
+ * holds only it, which is a constant as well.
+ */
+static enum type
+code_constant(struct progm *prog, struct value *vp)
+{
+	struct value v = constant_of(vp);
+
+	code_inst(prog, Push_const_opcode);
+	code_const(prog, &const_pair(v, NULL)->car);
+	return type_of(v);
+}
 
 void
 set_compiler_global_context(struct func *env)
@@ -77,8 +992,9 @@ set_compiler_global_context(struct func *env)
 enum type compile_vector(struct scope *, struct progm *, struct vector *, bool);
 enum type compile_builtin(struct scope *, struct progm *, struct vector *,
 			  enum builtin, bool);
+enum type compile_cmp(struct scope *, struct progm *, struct vector *);
 enum type compile_if(struct scope *, struct progm *, struct vector *, bool);
-enum type compile_let(struct scope *, struct progm *, struct vector *);
+enum type compile_let(struct scope *, struct progm *, struct vector *, bool);
 enum type compile_set(struct scope *, struct progm *, struct vector *);
 enum type compile_funcall(struct scope *, struct progm *, struct vector *, bool);
 enum type compile_item(struct scope *, struct progm *, struct value *, bool);
@@ -87,55 +1003,196 @@ enum type compile_lambda(struct scope *, struct progm *, struct vector *);
 enum type compile_var_def(struct scope *, struct progm *, struct vector *);
 enum type compile_func_def(struct scope *, struct progm *, struct vector *);
 
-enum type
-compile(struct progm *prog, struct vector *lp)
+enum type
+compile(struct progm *prog, struct vector *lp)
+{
+	enum type ret_type;
+
+	ret_type = compile_vector(&global, prog, lp, false);
+	arena_release(&comp_arena);
+	return ret_type;
+}
+
+/*
+ * Compile a vector in place, converting it into a format that the compiler can
+ * run. The value returned is the inferred type of the expression.
+ */
+enum type
+compile_vector(struct scope *env, struct progm *prog, struct vector *lp,
+	     bool tailcall)
+{
+	if (lp->len == 0)
+		return Error_type; /* I don't know what to do here. */
+
+	switch (type_of(*lp->items)) {
+	case Nil_type:
+		/* ERROR: how the hell would this happen?? */
+		return Error_type;
+
+	case Integer_type:
+	case Real_type:
+		/* ERROR: numeric types cannot be called. */
+		return Error_type;
+
+	case Symbol_type:
+		return ((sym_of(*lp->items) < Num_builtins)
+			? compile_builtin(env, prog, lp, sym_of(*lp->items),
+					  tailcall)
+			: compile_funcall(env, prog, lp, tailcall));
+
+	default:
+		return compile_funcall(env, prog, lp, tailcall);
+	}
+}
+
+/*
+ * The type of the items of the vectors the builtin makes.
+ */
+static enum elem_type
+elem_of_builtin(enum builtin sym)
+{
+	switch (sym) {
+	case Make_f32vector_builtin:
+	case Vector_to_f32vector_builtin:
+		return F32_elem;
+
+	case Make_f64vector_builtin:
+	case Vector_to_f64vector_builtin:
+		return F64_elem;
+
+	case Make_i64vector_builtin:
+	case Vector_to_i64vector_builtin:
+		return I64_elem;
+
+	default:
+		return Value_elem;
+	}
+}
+
+static enum simd_op
+simd_op_of_builtin(enum builtin sym)
 {
-	return compile_vector(&global, prog, lp, false);
+	static const enum simd_op ops[] = {
+		[F64vector_add_builtin] = Simd_add,
+		[F64vector_div_builtin] = Simd_div,
+		[F64vector_dot_builtin] = Simd_dot,
+		[F64vector_fma_builtin] = Simd_fma,
+		[F64vector_max_builtin] = Simd_max,
+		[F64vector_min_builtin] = Simd_min,
+		[F64vector_mul_builtin] = Simd_mul,
+		[F64vector_norm_builtin] = Simd_norm,
+		[F64vector_sub_builtin] = Simd_sub,
+		[F64vector_sum_builtin] = Simd_sum,
+	};
+
+	return ops[sym];
 }
 
-/*
- * Compile a vector in place, converting it into a format that the compiler can
- * run. The value returned is the inferred type of the expression.
- */
-enum type
-compile_vector(struct scope *env, struct progm *prog, struct vector *lp,
-	     bool tailcall)
+static enum type
+compile_simd(struct scope *env, struct progm *prog, struct vector *lp,
+	     enum simd_op op)
 {
-	if (lp->len == 0)
-		return Error_type; /* I don't know what to do here. */
+	size_t i;
 
-	switch (lp->items->type) {
-	case Nil_type:
-		/* ERROR: how the hell would this happen?? */
+	if (lp->len != simd_arity[op] + 1)
 		return Error_type;
+	for (i = 1; i < lp->len; i++)
+		if (compile_item(env, prog, lp->items + i, false) == Error_type)
+			return Error_type;
+	code_inst(prog, Simd_opcode);
+	code_offset(prog, op);
+	switch (op) {
+	case Simd_sum:
+	case Simd_dot:
+	case Simd_norm:
+		return Real_type;
 
-	case Integer_type:
-	case Real_type:
-		/* ERROR: numeric types cannot be called. */
+	default:
+		return Vector_type;
+	}
+}
+
+static enum matrix_op
+matrix_op_of_builtin(enum builtin sym)
+{
+	static const enum matrix_op ops[] = {
+		[F64vector_to_matrix_builtin] = Matrix_from_vector,
+		[Make_matrix_builtin] = Matrix_make,
+		[Matrix_cols_builtin] = Matrix_cols,
+		[Matrix_mul_builtin] = Matrix_mul,
+		[Matrix_ref_builtin] = Matrix_ref,
+		[Matrix_rows_builtin] = Matrix_rows,
+		[Matrix_set_builtin] = Matrix_set,
+		[Matrix_to_f64vector_builtin] = Matrix_to_vector,
+		[Matrix_transpose_builtin] = Matrix_transpose,
+	};
+
+	return ops[sym];
+}
+
+static enum type
+compile_matrix(struct scope *env, struct progm *prog, struct vector *lp,
+	       enum matrix_op op)
+{
+	size_t i;
+
+	if (lp->len != matrix_arity[op] + 1)
 		return Error_type;
+	for (i = 1; i < lp->len; i++)
+		if (compile_item(env, prog, lp->items + i, false) == Error_type)
+			return Error_type;
+	code_inst(prog, Matrix_opcode);
+	code_offset(prog, op);
+	switch (op) {
+	case Matrix_to_vector:
+		return Vector_type;
 
-	case Symbol_type:
-		return ((lp->items->sym < Num_builtins)
-			? compile_builtin(env, prog, lp, lp->items->sym,
-					  tailcall)
-			: compile_funcall(env, prog, lp, tailcall));
+	case Matrix_rows:
+	case Matrix_cols:
+		return Integer_type;
+
+	case Matrix_ref:
+		return Real_type;
 
 	default:
-		return compile_funcall(env, prog, lp, tailcall);
+		return Matrix_type;
 	}
 }
 
+static enum parallel_op
+parallel_op_of_builtin(enum builtin sym)
+{
+	static const enum parallel_op ops[] = {
+		[Parallel_for_range_builtin] = Parallel_for_range,
+		[Parallel_map_builtin] = Parallel_map,
+		[Parallel_reduce_builtin] = Parallel_reduce,
+	};
+
+	return ops[sym];
+}
+
+static enum type
+compile_parallel(struct scope *env, struct progm *prog, struct vector *lp,
+		 enum parallel_op op)
+{
+	size_t i;
+
+	if (lp->len != parallel_arity[op] + 1)
+		return Error_type;
+	for (i = 1; i < lp->len; i++)
+		if (compile_item(env, prog, lp->items + i, false) == Error_type)
+			return Error_type;
+	code_inst(prog, Parallel_opcode);
+	code_offset(prog, op);
+	return (op == Parallel_reduce) ? Nil_type : Vector_type;
+}
+
 enum type
 compile_builtin(struct scope *env, struct progm *prog, struct vector *lp,
 		enum builtin sym, bool tailcall)
 {
 	size_t i;
-	enum opcode mtab[][2] = {
-		[Add_builtin] = { Add2_opcode, Add_imm_si_opcode },
-		[Sub_builtin] = { Sub2_opcode, Sub_imm_si_opcode },
-		[Mul_builtin] = { Mul2_opcode, Mul_imm_si_opcode },
-		[Div_builtin] = { Div2_opcode, Div_imm_si_opcode },
-	};
+	struct value v = vector_value(lp);
 
 	switch (sym) {
 	case Add_builtin:
@@ -148,21 +1205,28 @@ compile_builtin(struct scope *env, struct progm *prog, struct vector *lp,
 			 */
 			return Error_type;
 		}
+		if (use_registers(env) && is_reg_operand(env, &v)) {
+			compile_arith_push(env, prog, lp);
+			return Integer_type;
+		}
 		/* Compile the first item. */
 		if (compile_item(env, prog, lp->items + 1, false) == Error_type)
 			return Error_type;
 		for (i = 2; i < lp->len; i++)
-			switch (lp->items[i].type) {
+			switch (type_of(lp->items[i])) {
 			case Integer_type:
-				code_inst(prog, mtab[sym][1]);
-				code_si(prog, lp->items[i].i);
+				if (!is_si(lp->items + i))
+					goto full;
+				code_inst(prog, arith_ops[sym].imm);
+				code_si(prog, int_of(lp->items[i]));
 				break;
 
+			full:
 			default:
 				if (compile_item(env, prog, lp->items + i, false)
 				    == Error_type)
 					return Error_type;
-				code_inst(prog, mtab[sym][0]);
+				code_inst(prog, arith_ops[sym].stack);
 				break;
 			}
 		return Integer_type;
@@ -187,14 +1251,22 @@ compile_builtin(struct scope *env, struct progm *prog, struct vector *lp,
 	case Cons_builtin:
 		if (lp->len != 3)
 			return Error_type;
+		if (is_constant(&v))
+			return code_constant(prog, &v);
 		compile_item(env, prog, lp->items + 1, false);
 		compile_item(env, prog, lp->items + 2, false);
-		code_inst(prog, Make_pair_opcode);
+		if (!code_stack_list(env, prog, lp))
+			code_inst(prog, Make_pair_opcode);
 		return Pair_type;
 
 	case If_builtin:
 		return compile_if(env, prog, lp, tailcall);
 
+	case Equal_builtin:
+	case Greater_builtin:
+	case Less_builtin:
+		return compile_cmp(env, prog, lp);
+
 	case Set_builtin:
 		return compile_set(env, prog, lp);
 
@@ -208,25 +1280,134 @@ compile_builtin(struct scope *env, struct progm *prog, struct vector *lp,
 		if (lp->len < 2) {
 			return Error_type;
 		}
+		if (is_constant(&v))
+			return code_constant(prog, &v);
+		for (i = 1; i < lp->len; i++)
+			if (compile_item(env, prog, lp->items + i, false)
+			    == Error_type)
+				return Error_type;
+		if (!code_stack_list(env, prog, lp)) {
+			code_inst(prog, Make_list_opcode);
+			code_offset(prog, lp->len - 1);
+		}
+		return Vector_type;
+
+	case Make_f32vector_builtin:
+	case Make_f64vector_builtin:
+	case Make_i64vector_builtin:
+	case Make_vector_builtin:
+		if (lp->len != 3)
+			return Error_type;
+		for (i = 1; i < lp->len; i++)
+			if (compile_item(env, prog, lp->items + i, false)
+			    == Error_type)
+				return Error_type;
+		code_inst(prog, Make_vector_fill_opcode);
+		code_offset(prog, elem_of_builtin(sym));
+		return Vector_type;
+
+	case Memory_stats_builtin:
+		if (lp->len != 1)
+			return Error_type;
+		code_inst(prog, Memory_stats_opcode);
+		return Pair_type;
+
+	case Quote_builtin:
+		if (lp->len != 2)
+			return Error_type;
+		return code_constant(prog, &v);
+
+	case Vector_builtin:
 		for (i = 1; i < lp->len; i++)
 			if (compile_item(env, prog, lp->items + i, false)
 			    == Error_type)
 				return Error_type;
-		code_inst(prog, Make_list_opcode);
+		code_inst(prog, Make_vector_opcode);
 		code_offset(prog, lp->len - 1);
 		return Vector_type;
 
+	case F32vector_to_vector_builtin:
+	case F64vector_to_vector_builtin:
+	case I64vector_to_vector_builtin:
+	case Vector_to_f32vector_builtin:
+	case Vector_to_f64vector_builtin:
+	case Vector_to_i64vector_builtin:
+		if (lp->len != 2 ||
+		    compile_item(env, prog, lp->items + 1, false) == Error_type)
+			return Error_type;
+		code_inst(prog, Convert_vector_opcode);
+		code_offset(prog, elem_of_builtin(sym));
+		return Vector_type;
+
+	case F64vector_add_builtin:
+	case F64vector_div_builtin:
+	case F64vector_dot_builtin:
+	case F64vector_fma_builtin:
+	case F64vector_max_builtin:
+	case F64vector_min_builtin:
+	case F64vector_mul_builtin:
+	case F64vector_norm_builtin:
+	case F64vector_sub_builtin:
+	case F64vector_sum_builtin:
+		return compile_simd(env, prog, lp, simd_op_of_builtin(sym));
+
+	case F64vector_to_matrix_builtin:
+	case Make_matrix_builtin:
+	case Matrix_cols_builtin:
+	case Matrix_mul_builtin:
+	case Matrix_ref_builtin:
+	case Matrix_rows_builtin:
+	case Matrix_set_builtin:
+	case Matrix_to_f64vector_builtin:
+	case Matrix_transpose_builtin:
+		return compile_matrix(env, prog, lp, matrix_op_of_builtin(sym));
+
+	case Parallel_for_range_builtin:
+	case Parallel_map_builtin:
+	case Parallel_reduce_builtin:
+		return compile_parallel(env, prog, lp,
+					parallel_op_of_builtin(sym));
+
+	case Vector_length_builtin:
+		if (lp->len != 2 ||
+		    compile_item(env, prog, lp->items + 1, false) == Error_type)
+			return Error_type;
+		code_inst(prog, Vector_length_opcode);
+		return Integer_type;
+
+	case Vector_ref_builtin:
+	case Vector_set_builtin:
+		if (lp->len != (sym == Vector_ref_builtin ? 3 : 4))
+			return Error_type;
+		for (i = 1; i < lp->len; i++)
+			if (compile_item(env, prog, lp->items + i, false)
+			    == Error_type)
+				return Error_type;
+		if (sym == Vector_ref_builtin) {
+			code_inst(prog, Vector_ref_opcode);
+			return Integer_type;
+		}
+		code_inst(prog, Vector_set_opcode);
+		return Vector_type;
+
 	default:
 		return Error_type;
 	}
 }
 
+/*
+ * The values of a let are found in its scope before any of its variables is
+ * bound, and stored once they are all on the stack. A let always has a frame
+ * of its own, so that register temporaries and the stack cleared between the
+ * forms of its body stay inside it.
+ */
 enum type
 compile_let(struct scope *env, struct progm *prog, struct vector *lp,
 	    bool tailcall)
 {
-	size_t i;
-	struct vector *args;
+	size_t i, sym, localtab;
+	enum type ret_type;
+	struct vector *args, *binding;
 	struct scope scope = {
 		.func_sym = 0,
 		.fdat = NULL,
@@ -234,17 +1415,201 @@ compile_let(struct scope *env, struct progm *prog, struct vector *lp,
 		.parent = env,
 	};
 
-	args = lp->items[1].v;
+	if (lp->len < 3 || type_of(lp->items[1]) != Vector_type)
+		/* ERROR: let takes bindings and a body. */
+		return Error_type;
+	args = vector_of(lp->items[1]);
+	for (i = 0; i < args->len; i++) {
+		if (type_of(args->items[i]) != Vector_type)
+			return Error_type;
+		binding = vector_of(args->items[i]);
+		if (binding->len != 2 ||
+		    type_of(binding->items[0]) != Symbol_type)
+			/* ERROR: a binding is a variable and a value. */
+			return Error_type;
+	}
+	for (i = 2; i < lp->len; i++)
+		if (form_builtin(lp->items + i) == Define_builtin &&
+		    vector_of(lp->items[i])->len > 1 &&
+		    type_of(vector_of(lp->items[i])->items[1]) == Vector_type)
+			/*
+			 * ERROR: functions reach the variables around them
+			 * through their parent function, which has no frame
+			 * for the let.
+			 */
+			return Error_type;
+
+	scope.locals = new_symtab();
+	(void)alloc_temp(&scope);
+	code_inst(prog, Let_opcode);
+	localtab = code_symtab(prog, NULL);
+	for (i = 0; i < args->len; i++)
+		if (compile_item(&scope, prog,
+				 vector_of(args->items[i])->items + 1,
+				 false) == Error_type)
+			return Error_type;
 	for (i = 0; i < args->len; i++) {
+		sym = sym_of(vector_of(args->items[i])->items[0]);
+		if (sym_exists(scope.locals, sym))
+			/* ERROR: the variable is bound twice. */
+			return Error_type;
+		sym_add(scope.locals, sym);
+	}
+	for (i = args->len; i > 0; i--) {
+		sym = sym_of(vector_of(args->items[i - 1])->items[0]);
+		if (is_boxed(&scope, sym))
+			code_inst(prog, Box_opcode);
+		code_inst(prog, Sto_imm_local_opcode);
+		code_offset(prog, sym_offset(scope.locals, sym));
+	}
+
+	ret_type = Nil_type;
+	for (i = 2; i < lp->len; i++) {
+		ret_type = compile_item(&scope, prog, lp->items + i,
+					tailcall && i == lp->len - 1);
+		if (ret_type == Error_type)
+			return Error_type;
+		if (i < lp->len - 1)
+			code_inst(prog, Clear_opcode);
+	}
+	prog->code[localtab].symtab = keep_symtab(scope.locals);
+	code_inst(prog, Yield_opcode);
+	return ret_type;
+}
+
+/*
+ * Conditional branches for each comparison builtin. The branch is taken when
+ * the comparison's result is on_true. The swapped form is used when the
+ * literal is the left hand side.
+ */
+static const struct {
+	enum opcode     jmp, jmp_imm, jmp_imm_swapped;
+	bool            on_true;
+} cmp_tab[] = {
+	[Equal_builtin] = {
+		Jmp_ne_opcode, Jmp_ne_imm_si_opcode, Jmp_ne_imm_si_opcode, false
+	},
+	[Greater_builtin] = {
+		Jmp_gt_opcode, Jmp_gt_imm_si_opcode, Jmp_lt_imm_si_opcode, true
+	},
+	[Less_builtin] = {
+		Jmp_lt_opcode, Jmp_lt_imm_si_opcode, Jmp_gt_imm_si_opcode, true
+	},
+};
+
+/*
+ * Compile a comparison into a single conditional branch. The location of the
+ * branch's destination is stored in dest and is left for the caller to fill
+ * in. The branch is taken if the result of the comparison is on_true.
+ */
+static enum type
+compile_cmp_jmp(struct scope *env, struct progm *prog, struct vector *lp,
+		size_t *dest, bool *on_true)
+{
+	enum builtin sym = sym_of(*lp->items);
+
+	if (lp->len != 3)
+		/* Error: comparisons take exactly two arguments. */
+		return Error_type;
+
+	*on_true = cmp_tab[sym].on_true;
+	if (use_registers(env) &&
+	    (is_arith(lp->items + 1) || is_arith(lp->items + 2)) &&
+	    is_reg_operand(env, lp->items + 1) &&
+	    is_reg_operand(env, lp->items + 2)) {
+		struct operand a, b;
+		struct scope *fs = frame_scope(env);
+		size_t temps = fs->temps;
+
+		/* Leave the loads for the optimizer to fuse. */
+		compile_operand(env, prog, lp->items + 1, &a);
+		compile_operand(env, prog, lp->items + 2, &b);
+		if (b.imm) {
+			code_push_operand(prog, &a);
+			code_inst(prog, cmp_tab[sym].jmp_imm);
+			*dest = code_offset(prog, 0);
+			code_si(prog, b.si);
+		} else if (a.imm) {
+			code_push_operand(prog, &b);
+			code_inst(prog, cmp_tab[sym].jmp_imm_swapped);
+			*dest = code_offset(prog, 0);
+			code_si(prog, a.si);
+		} else {
+			code_push_operand(prog, &a);
+			code_push_operand(prog, &b);
+			code_inst(prog, cmp_tab[sym].jmp);
+			*dest = code_offset(prog, 0);
+		}
+		fs->temps = temps;
+	} else if (is_si(lp->items + 2)) {
+		if (compile_item(env, prog, lp->items + 1, false) == Error_type)
+			return Error_type;
+		code_inst(prog, cmp_tab[sym].jmp_imm);
+		*dest = code_offset(prog, 0);
+		code_si(prog, int_of(lp->items[2]));
+	} else if (is_si(lp->items + 1)) {
+		if (compile_item(env, prog, lp->items + 2, false) == Error_type)
+			return Error_type;
+		code_inst(prog, cmp_tab[sym].jmp_imm_swapped);
+		*dest = code_offset(prog, 0);
+		code_si(prog, int_of(lp->items[1]));
+	} else {
+		if (compile_item(env, prog, lp->items + 1, false) == Error_type ||
+		    compile_item(env, prog, lp->items + 2, false) == Error_type)
+			return Error_type;
+		code_inst(prog, cmp_tab[sym].jmp);
+		*dest = code_offset(prog, 0);
+	}
+	return Integer_type;
+}
+
+static bool
+is_cmp(struct value *vp)
+{
+	if (type_of(*vp) != Vector_type || vector_of(*vp)->len == 0 ||
+	    type_of(*vector_of(*vp)->items) != Symbol_type)
+		return false;
+	switch (sym_of(*vector_of(*vp)->items)) {
+	case Equal_builtin:
+	case Greater_builtin:
+	case Less_builtin:
+		return true;
+
+	default:
+		return false;
 	}
 }
 
+/*
+ * Comparisons used as values produce 1 or 0.
+ */
 enum type
-compile_if(struct scope *env, struct progm *prog, struct vector *lp,
-	   bool tailcall)
+compile_cmp(struct scope *env, struct progm *prog, struct vector *lp)
+{
+	bool on_true;
+	size_t dest, end;
+
+	if (compile_cmp_jmp(env, prog, lp, &dest, &on_true) == Error_type)
+		return Error_type;
+	code_inst(prog, Push_imm_si_opcode);
+	code_si(prog, !on_true);
+	code_inst(prog, Jmp_opcode);
+	end = code_offset(prog, 0);
+	prog->code[dest].o = code_inst(prog, Push_imm_si_opcode);
+	code_si(prog, on_true);
+	prog->code[end].o = prog->len;
+	return Integer_type;
+}
+
+/*
+ * Compile one branch of a conditional in its own scope.
+ */
+static enum type
+compile_branch(struct scope *env, struct progm *prog, struct value *vp,
+	       bool tailcall)
 {
+	size_t localtab;
 	enum type ret_type;
-	struct var_loc loc;
 	struct scope scope = {
 		.func_sym = 0,
 		.fdat = NULL,
@@ -252,107 +1617,82 @@ compile_if(struct scope *env, struct progm *prog, struct vector *lp,
 		.parent = env,
 	};
 
-	switch (lp->items[1].type) {
+	scope.locals = new_symtab();
+	code_inst(prog, Let_opcode);
+	localtab = code_symtab(prog, NULL); /* Let(NULL) is valid. */
+	ret_type = (vp != NULL)
+		? compile_item(&scope, prog, vp, tailcall)
+		: Nil_type;
+	if (scope.locals->len > 0)
+		prog->code[localtab].symtab = keep_symtab(scope.locals);
+	code_inst(prog, Yield_opcode);
+	return ret_type;
+}
+
+enum type
+compile_if(struct scope *env, struct progm *prog, struct vector *lp,
+	   bool tailcall)
+{
+	bool on_true;
+	size_t dest, end;
+	enum type ret_type;
+	struct value *when_true, *when_false, *first, *second;
+
+	if (lp->len < 3 || lp->len > 4)
+		/* Error: if takes a test, a consequent and an alternative. */
+		return Error_type;
+	when_true = lp->items + 2;
+	when_false = (lp->len == 4) ? lp->items + 3 : NULL;
+
+	switch (type_of(lp->items[1])) {
 	case Error_type:
 		return Error_type;
 
 	case Integer_type:
-	{
-		size_t localtab;
-
-		scope.locals = malloc(sizeof(symtab));
-		symtab_init(scope.locals);
-		code_inst(prog, Let_opcode);
-		localtab = code_symtab(prog, NULL); /* Let(NULL) is valid. */
-		ret_type = compile_item(&scope, prog,
-					&lp->items[lp->items[0].i ? 2 : 3],
-					tailcall);
-		if (scope.locals->len > 0)
-			prog->code[localtab].symtab = scope.locals;
-		else
-			free(scope.locals);
-		code_inst(prog, Ret_opcode);
-		return ret_type;
-	}
+	case Real_type:
+		/* The test is constant. */
+		return compile_branch(env, prog,
+				      is_true(lp->items[1])
+				      ? when_true : when_false,
+				      tailcall);
 
 	case Function_type:
 		return Error_type;
 
 	case Vector_type:
-	{
-		size_t localtab;
-		size_t offset1, offset2;
-		enum opcode jmp_op = Jmp_true_opcode;
-
-		/*
-		 * Todo: optimize here.
-		 */
-		switch (lp->items[1].v->items->sym) {
-		case Equal_builtin:
-			jmp_op = Jmp_ne_opcode;
-			compile_item(env, prog, lp->items[1].v->items + 1,
-				     false);
-			compile_item(env, prog, lp->items[1].v->items + 2,
-				     false);
-			break;
-
-		default:
-			compile_item(env, prog, lp->items + 1, false);
-		}
-		goto no_var_lookup;
-
 	case Symbol_type:
-		jmp_op = Jmp_true_opcode;
-		loc = find_var_loc(env, lp->items[1].sym);
-		if (loc.scope == NULL) {
-			return Error_type;
-		}
-		if (loc.walk == 0) {
-			/* Local type. */
-			code_inst(prog, Load_imm_local_opcode);
-			code_offset(prog, loc.offset);
+		/* Compile the test into a single branch. */
+		if (is_cmp(lp->items + 1)) {
+			if (compile_cmp_jmp(env, prog, vector_of(lp->items[1]),
+					    &dest,
+					    &on_true) == Error_type)
+				return Error_type;
 		} else {
-			/* Non local type. */
-			code_inst(prog, Load_imm_nonlocal_opcode);
-			code_offset(prog, loc.walk);
-			code_offset(prog, loc.offset);
+			if (compile_item(env, prog, lp->items + 1, false)
+			    == Error_type)
+				return Error_type;
+			on_true = false;
+			code_inst(prog, Jmp_false_opcode);
+			dest = code_offset(prog, 0);
 		}
 
-	no_var_lookup:
-		scope.locals = malloc(sizeof(symtab));
-		symtab_init(scope.locals);
-
-		/* Conditional test. */
-		code_inst(prog, jmp_op);
-		offset1 = code_offset(prog, 0);
+		/*
+		 * Whichever body the branch does not take us to follows
+		 * directly.
+		 */
+		first = on_true ? when_false : when_true;
+		second = on_true ? when_true : when_false;
 
-		/* True body. */
-		code_inst(prog, Let_opcode);
-		localtab = code_symtab(prog, NULL);
-		ret_type = compile_item(&scope, prog, lp->items + 2, tailcall);
-		if (scope.locals->len > 0)
-			prog->code[localtab].symtab = scope.locals;
-		else
-			free(scope.locals);
-		code_inst(prog, Yield_opcode);
+		ret_type = compile_branch(env, prog, first, tailcall);
 		code_inst(prog, Jmp_opcode);
-		offset2 = code_offset(prog, 0);
-		prog->code[offset1].o = offset2 + 1;
-
-		/* False body. */
-		scope.locals = malloc(sizeof(symtab));
-		symtab_init(scope.locals);
-		code_inst(prog, Let_opcode);
-		localtab = code_symtab(prog, NULL);
-		compile_item(&scope, prog, lp->items + 3, tailcall);
-		if (scope.locals->len > 0)
-			prog->code[localtab].symtab = scope.locals;
+		end = code_offset(prog, 0);
+		prog->code[dest].o = prog->len;
+		if (on_true)
+			ret_type = compile_branch(env, prog, second, tailcall);
 		else
-			free(scope.locals);
-		offset1 = code_inst(prog, Yield_opcode);
-		prog->code[offset2].o = offset1 + 1;
+			compile_branch(env, prog, second, tailcall);
+		prog->code[end].o = prog->len;
 		return ret_type;
-	}
 
 	default:
 		break;
@@ -360,23 +1700,75 @@ compile_if(struct scope *env, struct progm *prog, struct vector *lp,
 	return Error_type;
 }
 
+/*
+ * Push the variable sym. The box of a boxed variable is pushed if raw is
+ * true, and its value otherwise.
+ */
+static void
+code_load(struct scope *env, struct progm *prog, size_t sym, bool raw)
+{
+	struct var_loc loc = find_var_loc(env, sym);
+
+	if (loc.scope == NULL) {
+		/* Could not find variable, it must be a global. */
+		code_inst(prog, Load_imm_sym_opcode);
+		code_sym(prog, sym);
+		code_cache(prog);
+	} else if (loc.captured) {
+		code_inst(prog, Load_imm_closure_opcode);
+		code_offset(prog, loc.walk);
+		code_offset(prog, loc.offset);
+	} else if (loc.scope == env) {
+		/* Local variable. */
+		code_inst(prog, Load_imm_local_opcode);
+		code_offset(prog, loc.offset);
+	} else {
+		/* Non-local variable. */
+		code_inst(prog, Load_imm_nonlocal_opcode);
+		code_offset(prog, loc.walk);
+		code_offset(prog, loc.offset);
+	}
+	if (loc.boxed && !raw)
+		code_inst(prog, Unbox_opcode);
+}
+
 enum type
 compile_set(struct scope *env, struct progm *prog, struct vector *lp)
 {
 	enum type ret_val;
+	struct var_loc loc;
+
+	if (use_registers(env) && type_of(lp->items[1]) == Symbol_type &&
+	    is_arith(lp->items + 2) && is_reg_operand(env, lp->items + 2)) {
+		loc = find_var_loc(env, sym_of(lp->items[1]));
+		if (loc.scope == frame_scope(env) && !loc.captured &&
+		    !loc.boxed) {
+			compile_arith_reg(env, prog, vector_of(lp->items[2]),
+					  vector_of(lp->items[2])->len,
+					  loc.offset);
+			return Integer_type;
+		}
+	}
 
 	if ((ret_val = compile_item(env, prog, lp->items + 2, false))
 	    == Error_type)
 		return Error_type;
 
-	switch (lp->items[1].type) {
+	switch (type_of(lp->items[1])) {
 	case Symbol_type:
 	{
-		struct var_loc loc = find_var_loc(env, lp->items[1].sym);
+		struct var_loc loc = find_var_loc(env, sym_of(lp->items[1]));
 
-		if (loc.scope == NULL) {
-			/* FUCK */
+		if (loc.boxed) {
+			code_load(env, prog, sym_of(lp->items[1]), true);
+			code_inst(prog, Sto_box_opcode);
+		} else if (loc.captured) {
+			/* Captured variables that are assigned are boxed. */
 			return Error_type;
+		} else if (loc.scope == NULL) {
+			/* Not found, so it must be a global. */
+			code_inst(prog, Sto_imm_sym_opcode);
+			code_sym(prog, sym_of(lp->items[1]));
 		} else if (loc.walk != 0) {
 			/* Value is non-local. */
 			code_inst(prog, Sto_imm_nonlocal_opcode);
@@ -403,17 +1795,20 @@ compile_funcall(struct scope *env, struct progm *prog, struct vector *lp,
 	size_t i;
 
 	/*
-	 * Compile all of the arguments.
+	 * Compile all of the arguments. Those a self tail call advances in
+	 * place are left for last, as the others may take apart what they
+	 * have yet to advance.
 	 */
 	for (i = 1; i < lp->len; i++)
-		if (compile_item(env, prog, lp->items + i, false) == Error_type)
+		if (!(tailcall && is_advanced_arg(env, lp, i)) &&
+		    compile_item(env, prog, lp->items + i, false) == Error_type)
 			/* ERROR */
 			return Error_type;
 
 	/*
 	 * Compile the function call.
 	 */
-	switch (lp->items->type) {
+	switch (type_of(*lp->items)) {
 	case Vector_type:
 		if (compile_item(env, prog, lp->items, false) == Error_type) {
 			return Error_type;
@@ -426,7 +1821,7 @@ compile_funcall(struct scope *env, struct progm *prog, struct vector *lp,
 	{
 		size_t ascopes;
 		struct scope *curr;
-		struct var_loc loc = find_var_loc(env, lp->items->sym);
+		struct var_loc loc = find_var_loc(env, sym_of(*lp->items));
 
 		/*
 		 * Determine if the call is recursive.
@@ -437,7 +1832,7 @@ compile_funcall(struct scope *env, struct progm *prog, struct vector *lp,
 		     curr != NULL && curr->fdat == NULL;
 		     curr = curr->parent, ascopes++)
 			;
-		if (curr != NULL && curr->func_sym == lp->items->sym) {
+		if (curr != NULL && curr->func_sym == sym_of(*lp->items)) {
 			/* We have found a recursive call. */
 			if (tailcall) {
 				/* We have found a tail call. */
@@ -446,10 +1841,26 @@ compile_funcall(struct scope *env, struct progm *prog, struct vector *lp,
 					code_inst(prog, Yield_opcode);
 					ascopes--;
 				}
-				for (i = 0; i < lp->len - 1; i++) {
-					code_inst(prog, Sto_imm_local_opcode);
-					code_offset(prog, lp->len - i - 2);
-				}
+				for (i = 1; i < lp->len; i++)
+					if (is_advanced_arg(env, lp, i)) {
+						code_inst(prog,
+							  Cdr_advance_opcode);
+						code_offset(prog, i - 1);
+						code_offset(prog,
+						    curr->advance_temps[i - 1]);
+					}
+				for (i = lp->len - 1; i > 0; i--)
+					if (is_advanced_arg(env, lp, i)) {
+						code_inst(prog,
+							  Sto_imm_local_opcode);
+						code_offset(prog, i - 1);
+					}
+				for (i = lp->len - 1; i > 0; i--)
+					if (!is_advanced_arg(env, lp, i)) {
+						code_inst(prog,
+							  Sto_imm_local_opcode);
+						code_offset(prog, i - 1);
+					}
 				code_inst(prog, Jmp_opcode);
 				code_offset(prog, 0);
 			} else {
@@ -460,7 +1871,12 @@ compile_funcall(struct scope *env, struct progm *prog, struct vector *lp,
 			/* Could not find the symbol. */
 			code_inst(prog, Call_imm_sym_opcode);
 			code_offset(prog, lp->len - 1);
-			code_sym(prog, lp->items->sym);
+			code_sym(prog, sym_of(*lp->items));
+			code_cache(prog);
+		} else if (loc.captured || loc.boxed) {
+			code_load(env, prog, sym_of(*lp->items), false);
+			code_inst(prog, Call_opcode);
+			code_offset(prog, lp->len - 1);
 		} else if (loc.walk != 0) {
 			/* Function is nonlocal. */
 			code_inst(prog, Call_imm_nonlocal_opcode);
@@ -488,41 +1904,34 @@ enum type
 compile_item(struct scope *env, struct progm *prog, struct value *vp,
 	     bool tailcall)
 {
-	switch (vp->type) {
+	switch (type_of(*vp)) {
 	case Error_type:
 	case Nil_type:
-	case Real_type:
 	case Function_type:
 		/* Nothing to do here. */
 		break;
 
 	case Integer_type:
-		code_inst(prog, Push_imm_si_opcode);
-		code_si(prog, vp->i);
+		if (is_si(vp)) {
+			code_inst(prog, Push_imm_si_opcode);
+			code_si(prog, int_of(*vp));
+		} else {
+			code_inst(prog, Push_imm_bi_opcode);
+			code_bi(prog, int_of(*vp));
+		}
 		return Integer_type;
 
+	case Real_type:
+		code_inst(prog, Push_imm_br_opcode);
+		code_br(prog, real_of(*vp));
+		return Real_type;
+
 	case Symbol_type:
-	{
-		struct var_loc loc = find_var_loc(env, vp->sym);
-		if (loc.scope == NULL) {
-			/* Could not find variable, leave a symbol? */
-			break;
-		}
-		if (loc.scope == env) {
-			/* Local variable. */
-			code_inst(prog, Load_imm_local_opcode);
-			code_offset(prog, loc.offset);
-		} else {
-			/* Non-local variable. */
-			code_inst(prog, Load_imm_nonlocal_opcode);
-			code_offset(prog, loc.walk);
-			code_offset(prog, loc.offset);
-		}
+		code_load(env, prog, sym_of(*vp), false);
 		return Integer_type;
-	}
 
 	case Vector_type:
-		return compile_vector(env, prog, vp->v, tailcall);
+		return compile_vector(env, prog, vector_of(*vp), tailcall);
 
 	default:
 		/* WTF?? */
@@ -544,12 +1953,12 @@ compile_define(struct scope *env, struct progm *prog, struct vector *lp)
 		return Error_type;
 
 	default: /* lp->len > 3 */
-		if (lp->items[1].type != Vector_type) {
+		if (type_of(lp->items[1]) != Vector_type) {
 			/* ERROR: multiple values for non function defintion. */
 			return Error_type;
 		}
 	case 3:
-		switch (lp->items[1].type) {
+		switch (type_of(lp->items[1])) {
 		case Nil_type:
 		case Integer_type:
 		case Real_type:
@@ -583,37 +1992,72 @@ compile_define(struct scope *env, struct progm *prog, struct vector *lp)
 enum type
 compile_var_def(struct scope *env, struct progm *prog, struct vector *lp)
 {
+	bool boxed;
 	size_t offset;
 	enum type expr_res;
 	struct value var;
 
 	var = lp->items[1];
-	offset = sym_offset(env->locals, var.sym);
+	boxed = env != &global && is_boxed(env, sym_of(var));
 
 	/*
 	if (env->fdat != NULL)
 		append(env->fdat->locals, var);
 	*/
 
-	switch (lp->items[2].type) {
+	switch (type_of(lp->items[2])) {
+	case Integer_type:
+		if (!is_si(lp->items + 2) || boxed)
+			goto full;
+		if (env == &global) {
+			code_inst(prog, Sto_imm_sym_si_opcode);
+			code_sym(prog, sym_of(var));
+		} else {
+			offset = sym_offset(env->locals, sym_of(var));
+			code_inst(prog, Sto_imm_local_si_opcode);
+			code_offset(prog, offset);
+		}
+		code_si(prog, int_of(lp->items[2]));
+		return Integer_type;
+
+	full:
+	case Real_type:
 	case Vector_type:
-		expr_res = compile_vector(env, prog, lp->items[2].v, false);
+		if (compile_registers && env != &global) {
+			/*
+			 * Add the variable first, as it may give a let scope
+			 * a frame, which register code must know about.
+			 */
+			offset = sym_offset(env->locals, sym_of(var));
+			if (use_registers(env) && !boxed &&
+			    is_arith(lp->items + 2) &&
+			    is_reg_operand(env, lp->items + 2)) {
+				compile_arith_reg(env, prog,
+						  vector_of(lp->items[2]),
+						  vector_of(lp->items[2])->len,
+						  offset);
+				return Integer_type;
+			}
+		}
+		expr_res = compile_item(env, prog, lp->items + 2, false);
 		if (expr_res == Nil_type)
 			/*
 			 * ERROR: expression in definiation must return some
 			 * value.
 			 */
 			break;
-		code_inst(prog, Sto_imm_local_opcode);
-		code_offset(prog, offset);
+		if (boxed)
+			code_inst(prog, Box_opcode);
+		if (env == &global) {
+			code_inst(prog, Sto_imm_sym_opcode);
+			code_sym(prog, sym_of(var));
+		} else {
+			offset = sym_offset(env->locals, sym_of(var));
+			code_inst(prog, Sto_imm_local_opcode);
+			code_offset(prog, offset);
+		}
 		return expr_res;
 
-	case Integer_type:
-		code_inst(prog, Sto_imm_local_si_opcode);
-		code_offset(prog, offset);
-		code_si(prog, lp->items[2].i);
-		return Integer_type;
-
 	default:
 		break;
 	}
@@ -624,7 +2068,7 @@ compile_var_def(struct scope *env, struct progm *prog, struct vector *lp)
 enum type
 compile_lambda(struct scope *env, struct progm *prog, struct vector *lp)
 {
-	size_t i;
+	size_t i, sites;
 	int variadic;
 	struct vector *p;
 	enum type ret_type;
@@ -632,42 +2076,55 @@ compile_lambda(struct scope *env, struct progm *prog, struct vector *lp)
 	struct scope lambda_scope;
 
 	variadic = 0;
-	lambda = alloc_func(&global_heap);
+	lambda = alloc_func();
 	lambda_scope.func_sym = 0;
 	lambda_scope.fdat = lambda;
 	lambda_scope.parent = env;
-	lambda->locals = lambda_scope.locals = malloc(sizeof(symtab));
-	symtab_init(lambda->locals);
-	lambda->parent = env->fdat;
+	lambda_scope.temps = 0;
+	lambda_scope.captures = NULL;
+	lambda_scope.ncaptures = 0;
+	lambda_scope.advance_temps = NULL;
+	lambda_scope.locals = new_symtab();
+	/* Everything outside of the lambda is reached through captures. */
+	lambda->parent = NULL;
 	lambda->return_type = Integer_type;     /* TODO: fix. */
 
 	/*
 	 * Add the arguments
 	 */
-	p = lp->items[1].v;
+	p = vector_of(lp->items[1]);
 	for (i = 0; i < p->len; i++)
-		if (p->items[i].sym == Dot_builtin) {
+		if (sym_of(p->items[i]) == Dot_builtin) {
 			variadic = 1;
-		} else if (sym_exists(lambda_scope.locals, p->items[i].sym)) {
+		} else if (sym_exists(lambda_scope.locals,
+				      sym_of(p->items[i]))) {
 			/* Duplicate argument. */
 			return Error_type;
 		} else {
 			append(lambda->args, p->items[i]);
-			sym_add(lambda_scope.locals, p->items[i].sym);
+			sym_add(lambda_scope.locals, sym_of(p->items[i]));
 		}
 
 	lambda->flags.variadic = variadic;
 
+	p = lp;
+	for (i = 2; i < p->len; i++)
+		find_captures(env, &lambda_scope, p->items + i);
+	lambda_scope.boxed = find_boxed(p->items + 2, p->items + p->len);
+	code_box_args(&lambda_scope, &lambda->prog);
+
 	/*
 	 * Compile the body of the function.
 	 * TODO: tail call elimination.
 	 */
-	p = lp;
+	sites = stack_sites_len;
+	find_body_stack_sites(p->items + 2, p->items + p->len);
 	for (i = 2; i < p->len; i++)
 		if ((ret_type = compile_item(&lambda_scope, &lambda->prog,
 					     p->items + i, false))
 		    == Error_type) {
 			/* ERRORROROR */
+			stack_sites_len = sites;
 			return Error_type;
 		} else if (i < p->len - 1) {
 			code_inst(&lambda->prog, Clear_opcode);
@@ -675,8 +2132,21 @@ compile_lambda(struct scope *env, struct progm *prog, struct vector *lp)
 			code_inst(&lambda->prog, Ret_opcode);
 		}
 
+	stack_sites_len = sites;
+	lambda->locals = keep_symtab(lambda_scope.locals);
 	lambda->return_type = ret_type;
-	code_inst(prog, Push_imm_func_opcode);
+	optimize(&lambda->prog);
+	prof_register(&lambda->prog, "lambda");
+
+	/* Boxes are captured themselves, so that they are shared. */
+	for (i = 0; i < lambda_scope.ncaptures; i++)
+		code_load(env, prog, lambda_scope.captures[i].sym, true);
+	if (lambda_scope.ncaptures > 0) {
+		code_inst(prog, Lambda_opcode);
+		code_offset(prog, lambda_scope.ncaptures);
+	} else {
+		code_inst(prog, Push_imm_func_opcode);
+	}
 	code_func(prog, lambda);
 	return Function_type;
 }
@@ -686,28 +2156,31 @@ compile_func_def(struct scope *env, struct progm *prog, struct vector *lp)
 {
 	int variadic;
 	size_t i;
-	size_t offset;
+	size_t offset, sites;
 	enum type ret_type;
 	struct vector *p;
-	struct vector *args;
 //	struct vector *body;
 	struct func *new_func;
 //	struct value local_form;
 	struct scope new_scope;
 
-	p = lp->items[1].v;
-	if (sym_exists(env->locals, p->items[0].sym)) {
+	/* Globals may be redefined, locals may not. */
+	p = vector_of(lp->items[1]);
+	if (env != &global && sym_exists(env->locals, sym_of(p->items[0]))) {
 		/* ERROR: cannot redefine functions? */
 		return Error_type;
 	}
 
-	new_func = alloc_func(&global_heap);
-	new_scope.func_sym = p->items[0].sym;
+	new_func = alloc_func();
+	new_scope.func_sym = sym_of(p->items[0]);
 	new_scope.fdat = new_func;
 	new_scope.parent = env;
-	new_scope.locals = malloc(sizeof(symtab));
-	symtab_init(new_scope.locals);
-	args = alloc_vector(&global_heap, p->len - 1);
+	new_scope.temps = 0;
+	new_scope.captures = NULL;
+	new_scope.ncaptures = 0;
+	new_scope.boxed = NULL;
+	new_scope.advance_temps = NULL;
+	new_scope.locals = new_symtab();
 	variadic = 0;
 	for (i = 1; i < p->len; i++)
 		/*
@@ -716,28 +2189,24 @@ compile_func_def(struct scope *env, struct progm *prog, struct vector *lp)
 		 * most only one is the '.' symbol, and if the dot symbol does
 		 * exist it is not the last entry.
 		 */
-		if (p->items[i].sym == Dot_builtin) {
+		if (sym_of(p->items[i]) == Dot_builtin) {
 			variadic = 1;
-		} else if (sym_exists(new_scope.locals, p->items[i].sym)) {
+		} else if (sym_exists(new_scope.locals, sym_of(p->items[i]))) {
 			/*
 			 * We cannot assume that there are no duplicate entries, 
 			 * however.
 			 */
 			/* ERROR: duplicate entries in argument vector. */
-			free(args);
-			free(new_func);
-			free(new_scope.locals);
 			return Error_type;
 		} else {
 			append(new_func->args, p->items[i]);
-			sym_add(new_scope.locals, p->items[i].sym);
+			sym_add(new_scope.locals, sym_of(p->items[i]));
  		}
 
 
 	new_func->parent = env->fdat;
 	new_func->flags.variadic = variadic ? 1 : 0;    /* Redundant. */
 	new_func->return_type = Integer_type;
-	new_func->locals = new_scope.locals;
 
 	/*
 	 * Add the function to the scope of its parent so that it can call
@@ -745,7 +2214,9 @@ compile_func_def(struct scope *env, struct progm *prog, struct vector *lp)
 	append(env->fdat->locals, lp->items[1].l->items[0]);
 	 */
 
-	offset = sym_add(env->locals, p->items[0].sym);
+	offset = (env != &global)
+		? sym_add(env->locals, sym_of(p->items[0]))
+		: 0;
 //	local_form.type = Function_type;
 //	local_form.f = new_func;
 //	append(env->fdat->local_funcs, local_form);
@@ -754,15 +2225,18 @@ compile_func_def(struct scope *env, struct progm *prog, struct vector *lp)
 	 * Compile the body of the function that is not returned.
 	 */
 	p = lp;
+	new_scope.boxed = find_boxed(p->items + 2, p->items + p->len);
+	code_box_args(&new_scope, &new_func->prog);
+	sites = stack_sites_len;
+	find_body_stack_sites(p->items + 2, p->items + p->len);
+	new_scope.advance_temps = find_advanced(&new_scope, p->items + 2,
+						p->items + p->len);
 	for (i = 2; i < p->len - 1 ; i++)
 		if (compile_item(&new_scope, &new_func->prog, p->items + i,
 				 false)
 		    == Error_type) {
-			/* Error. Todo: cleanup. */
-			free(args);
-			free(new_func);
-			symtab_clear(new_scope.locals);
-			free(new_scope.locals);
+			/* Error. */
+			stack_sites_len = sites;
 			return Error_type;
 		} else {
 			code_inst(&new_func->prog, Clear_opcode);
@@ -773,16 +2247,33 @@ compile_func_def(struct scope *env, struct progm *prog, struct vector *lp)
 	 */
 	if ((ret_type = compile_item(&new_scope, &new_func->prog, p->items + i,
 				     true)) == Error_type) {
-		/* Error. Todo: cleanup. */
+		/* Error. */
+		stack_sites_len = sites;
 		return Error_type;
 	}
+	stack_sites_len = sites;
+	new_func->locals = keep_symtab(new_scope.locals);
 
 	code_inst(&new_func->prog, Ret_opcode);
+	optimize(&new_func->prog);
+	prof_register(&new_func->prog, ident_strings[new_scope.func_sym]);
 
 	new_func->return_type = ret_type;
-	code_inst(prog, Sto_imm_local_func_opcode);
-	code_offset(prog, offset);
+	if (env == &global) {
+		code_inst(prog, Sto_imm_sym_func_opcode);
+		code_sym(prog, sym_of(vector_of(lp->items[1])->items[0]));
+	} else {
+		code_inst(prog, Sto_imm_local_func_opcode);
+		code_offset(prog, offset);
+	}
 	code_func(prog, new_func);
+	if (env != &global && is_boxed(env, new_scope.func_sym)) {
+		code_inst(prog, Load_imm_local_opcode);
+		code_offset(prog, offset);
+		code_inst(prog, Box_opcode);
+		code_inst(prog, Sto_imm_local_opcode);
+		code_offset(prog, offset);
+	}
 
 //	disassemble(new_func->prog);
 
@@ -1,8 +1,24 @@
 #ifndef _COMP_H_
 #define _COMP_H_
 
+#include <stdbool.h>
+
 #include "types.h"
 
+struct arena;
+
+/*
+ * Compile arithmetic into register instructions (see comp.c).
+ */
+extern bool compile_registers;
+
+/*
+ * What is only needed while a top level form is compiled, its parse tree as
+ * well as the scopes and symbol tables of the compiler, is allocated from
+ * comp_arena, which compile() releases once it is done.
+ */
+extern struct arena comp_arena;
+
 enum type compile(struct progm *, struct vector *);
 void set_compiler_global_context(struct func *);
 
@@ -1,26 +1,69 @@
+#include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "eval.h"
 #include "alloc.h"
+#include "ident.h"
+#include "map.h"
 #include "types.h"
+#include "num.h"
+#include "jit.h"
+#include "global.h"
+#include "stack.h"
+#include "profile.h"
+#include "simd.h"
+#include "matrix.h"
+#include "parallel.h"
 #include "builtin.h"
 #include "bytecode.h"
 
-#define STACK_SIZE  0x100000
-
-struct value stack[STACK_SIZE];
-struct value *stackp = &stack[0];
+/*
+ * r = a op b, where op is add, sub or mul. Two integers that do not overflow
+ * are handled here, everything else by num_arith().
+ */
+#define ARITH(r, a, b, op, arith_op) do {				\
+		int64_t res_;						\
+									\
+		if (__builtin_expect(type_of(a) == Integer_type &&	\
+				     type_of(b) == Integer_type &&	\
+				     !__builtin_##op##_overflow(int_of(a), \
+					int_of(b), &res_) &&		\
+				     int_fits(res_), 1))		\
+			(r) = int_value(res_);				\
+		else							\
+			(r) = num_arith((arith_op), (a), (b));		\
+	} while (0)
+
+/*
+ * Compare a and b with op, or cmp_op when they are not both integers.
+ */
+#define CMP(a, b, op, cmp_op)						\
+	(__builtin_expect(type_of(a) == Integer_type &&			\
+			  type_of(b) == Integer_type, 1)		\
+	 ? int_of(a) op int_of(b)					\
+	 : num_cmp((cmp_op), (a), (b)))
 
 #define TOP() (stackp - 1)
 #define POP() (*--stackp)
 #define PUSH(d) (*stackp++ = (d))
 
+static inline size_t let_ignored_walks(struct func *);
+
+/*
+ * The scope walk scopes up from env. Walks count the scopes of branches even
+ * when, having no variables, they were ignored, and so have no place among the
+ * parents of a let scope.
+ */
 static inline struct func *
 walk_env(struct func *env, size_t walk)
 {
-	while (walk-- > 0)
-		env = env->parent;
+	for (; walk > 0; walk--, env = env->parent)
+		if (env->args == NULL)
+			walk -= let_ignored_walks(env);
 	return env;
 }
 
@@ -44,6 +87,243 @@ nonlocal(struct func *env, size_t walk, size_t offset)
 		: local(env, offset);
 }
 
+/*
+ * Whether the variables walk scopes up belong to another function than env.
+ * Let scopes have no arguments.
+ */
+static inline bool
+walk_leaves_func(struct func *env, size_t walk)
+{
+	for (; walk > 0; walk--, env = env->parent) {
+		if (env->args != NULL)
+			return true;
+		walk -= let_ignored_walks(env);
+	}
+	return false;
+}
+
+/*
+ * Where the locals of the function that env, which may be a let scope, is in
+ * start on the stack.
+ */
+static inline struct value *
+func_locals(struct func *env)
+{
+	while (env->args == NULL)
+		env = env->parent;
+	return env->rt_context->local_start;
+}
+
+/*
+ * The box v holds. A box that a store into a global or a variable of another
+ * function has evacuated, or that a collection under way has copied, is still
+ * referred to where it was, so the box is followed to where it went.
+ */
+static inline struct pair *
+box_of(struct value v)
+{
+	struct pair *p, *q;
+
+	for (p = pair_of(v); (q = forwarded(p)) != NULL; p = q)
+		;
+	return p;
+}
+
+/*
+ * The items of v, which must be a vector of values or a slice.
+ */
+static inline struct slice
+vector_items(struct value v)
+{
+	if (type_of(v) != Vector_type && type_of(v) != Slice_type) {
+		fprintf(stderr, "type error: not vector\n");
+		abort();
+	}
+	if (type_of(v) == Vector_type && vector_of(v)->elem != Value_elem) {
+		fprintf(stderr, "type error: numeric vector\n");
+		abort();
+	}
+	return items_of(v);
+}
+
+/*
+ * The length of v, which must be a vector of any type or a slice.
+ */
+static inline size_t
+vector_length(struct value v)
+{
+	if (type_of(v) == Vector_type)
+		return vector_of(v)->len;
+	return vector_items(v).len;
+}
+
+static inline size_t
+vector_index(struct value i, size_t len)
+{
+	if (type_of(i) != Integer_type || int_of(i) < 0 ||
+	    (size_t)int_of(i) >= len) {
+		fprintf(stderr, "Index out of range.\n");
+		abort();
+	}
+	return int_of(i);
+}
+
+/*
+ * A slice of all but the first item of v, a vector or a slice. It shares
+ * the items of v.
+ */
+static struct value
+vector_cdr(struct arena *arena, struct value v)
+{
+	struct slice s = vector_items(v), *t;
+
+	if (s.len == 0) {
+		fprintf(stderr, "Cannot take the cdr of an empty vector.\n");
+		abort();
+	}
+	t = alloc_slice(arena);
+	t->len = s.len - 1;
+	t->start = s.start + 1;
+	t->parent = s.parent;
+	return slice_value(t);
+}
+
+/*
+ * Collect the arena of the running function once its nursery is full. Its
+ * values are all on the stack, from its locals up, at the start of an
+ * instruction. The arena eval() was given belongs to the top level, which is
+ * collected between inputs, or to native code, and is never collected here.
+ */
+#define MAYBE_COLLECT() do {						\
+		if (arena_wants_collection(arena) &&			\
+		    arena != base_arena)				\
+			arena_collect(arena, func_locals(env), stackp);	\
+	} while (0)
+
+/*
+ * A function holds the runtime context of its calls, so threads other than
+ * the first, which run calls for parallel_apply(), call clones of functions in
+ * their place. Such a thread has one clone of each function that it calls or
+ * that is the parent of one it calls, and the parent of a clone is a clone,
+ * so that the scopes the thread walks are those of its own calls. A clone
+ * starts out with a copy of the runtime context of its function, which the
+ * first thread leaves alone meanwhile. Unless a call of it is running, a
+ * clone is made anew whenever it is used, as the function may have changed,
+ * but for a parent that the thread gave it (see Sto_imm_local_func).
+ */
+struct clone {
+	struct func     func;
+	struct func     *origin;
+	size_t          running;        /* Calls. */
+	struct func     *parent;        /* Given by the thread, or NULL. */
+	struct context  context;
+	struct clone    *next;          /* Made by the same thread. */
+};
+
+static int clone_cmp(void *, void *);
+static size_t clone_hash(void *);
+
+/*
+ * What a thread other than the first evaluates with, from
+ * eval_thread_begin() to eval_thread_end().
+ */
+static __thread struct {
+	bool            on;
+	struct map      clones;         /* By the function they are of. */
+	struct clone    *made;
+	struct arena    *base;          /* See evacuate_global(). */
+	struct arena    **shared;
+	size_t          nshared;
+} thread = { false, { 0, 0, NULL, &clone_cmp, &clone_hash, NULL }, };
+
+/*
+ * Held by threads other than the first while they store into global_arena
+ * and the globals.
+ */
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+clone_cmp(void *a1, void *a2)
+{
+	return a1 != a2;
+}
+
+static size_t
+clone_hash(void *a)
+{
+	return (uintptr_t)a / sizeof(void *) * 2654435761u;
+}
+
+static inline struct clone *
+clone_from(struct func *f)
+{
+	return (struct clone *)((char *)f - offsetof(struct clone, func));
+}
+
+/*
+ * The function f is a clone of, or f if it is not one.
+ */
+static inline struct func *
+origin_of(struct func *f)
+{
+	return (f != NULL && f->flags.clone) ? clone_from(f)->origin : f;
+}
+
+/*
+ * The clone of f that the thread calls in its place, or f in the first thread.
+ */
+static struct func *
+clone_of(struct func *f)
+{
+	struct clone *c, **slot;
+
+	if (!thread.on || f == NULL || f->flags.clone)
+		return f;
+	slot = (struct clone **)map_get(&thread.clones, f);
+	if (slot == NULL) {
+		fprintf(stderr, "Out of memory for clones.\n");
+		abort();
+	}
+	if ((c = *slot) == NULL) {
+		if ((c = malloc(sizeof(struct clone))) == NULL) {
+			fprintf(stderr, "Out of memory for clones.\n");
+			abort();
+		}
+		c->origin = f;
+		c->running = 0;
+		c->parent = NULL;
+		c->next = thread.made;
+		thread.made = c;
+		*slot = c;
+	} else if (c->running > 0)
+		return &c->func;
+
+	c->func = *f;
+	c->func.flags.clone = 1;
+	c->func.native = NULL;
+	if (f->rt_context != NULL) {
+		c->context = *f->rt_context;
+		c->func.rt_context = &c->context;
+	}
+	c->func.parent = (c->parent != NULL) ? c->parent : clone_of(f->parent);
+	return &c->func;
+}
+
+/*
+ * Make parent the parent of f, or only of its clone in a thread other than
+ * the first.
+ */
+static void
+set_parent(struct func *f, struct func *parent)
+{
+	if (!thread.on) {
+		f->parent = parent;
+		return;
+	}
+	f = clone_of(f);
+	f->parent = clone_from(f)->parent = parent;
+}
+
 static inline struct func *
 find_nearest_descendent(struct func *env, struct func *child)
 {
@@ -52,46 +332,367 @@ find_nearest_descendent(struct func *env, struct func *child)
 	return child;
 }
 
-struct heap_item
-eval(struct func *env, struct progm *prog)
+/*
+ * If the function value f was defined somewhere inside of env, turn it into a
+ * closure over a copy of env's current local variables. The value that should
+ * be used in place of f is returned. Lambdas capture what they use when they
+ * are made and have no parent, so this is only ever done for functions made
+ * by define.
+ * TODO: figure out what assumptions we can make to speed this up.
+ * TODO: error checking.
+ */
+static struct func *
+close_over(struct func *env, struct func *f, struct arena *arena)
+{
+	struct value *p;
+	struct func *new_func, *descendent, *self = clone_of(f);
+
+	if ((descendent = find_nearest_descendent(env, self)) == NULL)
+		return f;
+
+	f->flags.closure = 1;
+	new_func = alloc_closure(arena, env, env->ncaptures);
+	/* It may outlive the thread, which only made a copy of env. */
+	new_func->flags.clone = 0;
+	new_func->parent = origin_of(new_func->parent);
+	new_func->rt_context = malloc(sizeof(struct context));
+	new_func->rt_context->local_start =
+		malloc(sizeof(struct value) * new_func->locals->len);
+	new_func->rt_context->local_end = new_func->rt_context->local_start;
+	for (p = env->rt_context->local_start;
+	     p < env->rt_context->local_end;
+	     p++) {
+		/*
+		 * TODO: figure out what to copy and what to duplicate.
+		 */
+		*new_func->rt_context->local_end = *p;
+		new_func->rt_context->local_end++;
+	}
+	new_func->flags.closure = 1;
+	if (descendent == self) {
+		/* Copy the descendent */
+		descendent = alloc_closure(arena, f, f->ncaptures);
+		descendent->rt_context = NULL;
+		f = descendent;
+	} else if (descendent->flags.clone) {
+		clone_from(descendent)->parent = new_func;
+		clone_from(descendent)->origin->parent = new_func;
+	}
+	descendent->parent = new_func;
+	return f;
+}
+
+/*
+ * Frames record the state of the evaluator that must be restored once a
+ * function call or a let scope finishes. They are kept on their own stack
+ * instead of the C stack, so that calls do not recurse into eval and deep
+ * recursion only costs us memory.
+ */
+struct frame {
+	struct func             *env;           /* Environment to return to. */
+	struct progm            prog;           /* Holds the return ip. */
+	size_t                  ignored_walks;
+	struct arena            *ret_arena;     /* Arena to return to. */
+
+	/*
+	 * The function that was called, or NULL if the frame belongs to a let
+	 * scope.
+	 */
+	struct func             *call;
+
+	/*
+	 * For calls, the saved runtime context of the called function. If the
+	 * function had no runtime context, this is lent to it for the duration
+	 * of the call. For let scopes, this is the context of the scope.
+	 */
+	struct context          context;
+	struct arena            arena;          /* Of the called function. */
+	struct func             scope;          /* Let scopes only. */
+};
+
+/*
+ * The ignored scopes between the let scope and its parent, which the frame of
+ * the let saved.
+ */
+static inline size_t
+let_ignored_walks(struct func *scope)
+{
+	return ((struct frame *)((char *)scope -
+				 offsetof(struct frame, scope)))->ignored_walks;
+}
+
+/*
+ * The frame stack grows in chunks that are never moved, as frames are pointed
+ * to by runtime contexts and the arenas. Chunks are kept around once allocated.
+ * Each thread has a frame stack of its own, which starts out empty once the
+ * thread first evaluates.
+ */
+#define FRAME_CHUNK_LEN 256
+
+struct frame_chunk {
+	struct frame_chunk      *prev, *next;
+	struct frame            frames[FRAME_CHUNK_LEN];
+};
+
+static __thread struct frame_chunk frame_chunk_start;
+static __thread struct frame_chunk *frame_chunk;
+static __thread struct frame *framep;
+
+static inline void
+frames_init(void)
+{
+	if (__builtin_expect(framep == NULL, 0)) {
+		frame_chunk = &frame_chunk_start;
+		framep = &frame_chunk_start.frames[0];
+	}
+}
+
+static inline struct frame *
+push_frame(void)
+{
+	if (framep == frame_chunk->frames + FRAME_CHUNK_LEN) {
+		if (frame_chunk->next == NULL) {
+			frame_chunk->next = malloc(sizeof(struct frame_chunk));
+			if (frame_chunk->next == NULL) {
+				fprintf(stderr, "Out of memory for frames.\n");
+				abort();
+			}
+			frame_chunk->next->prev = frame_chunk;
+			frame_chunk->next->next = NULL;
+		}
+		frame_chunk = frame_chunk->next;
+		framep = frame_chunk->frames;
+	}
+	return framep++;
+}
+
+static inline struct frame *
+pop_frame(void)
+{
+	if (framep == frame_chunk->frames) {
+		frame_chunk = frame_chunk->prev;
+		framep = frame_chunk->frames + FRAME_CHUNK_LEN;
+	}
+	return --framep;
+}
+
+static inline struct frame *
+top_frame(void)
+{
+	return (framep == frame_chunk->frames)
+		? frame_chunk->prev->frames + FRAME_CHUNK_LEN - 1
+		: framep - 1;
+}
+
+/*
+ * Abandon every frame after an evaluation was cut short by a stack overflow,
+ * giving the functions that were running their runtime contexts back.
+ */
+void
+eval_reset(void)
+{
+	struct frame *fp;
+
+	frames_init();
+	while (framep != &frame_chunk_start.frames[0]) {
+		fp = pop_frame();
+		if (fp->call == NULL)
+			continue;
+		if (fp->call->rt_context == &fp->context)
+			fp->call->rt_context = NULL;
+		else
+			*fp->call->rt_context = fp->context;
+		arena_release(&fp->arena);
+	}
+	stackp = stack;
+	prof_stop();
+}
+
+/*
+ * The arenas of the functions that are running, for evacuate_global().
+ */
+static __thread struct arena **live_arenas;
+static __thread size_t live_arenas_len, live_arenas_cap;
+
+static void
+add_live_arena(struct arena *a)
+{
+	if (live_arenas_len == live_arenas_cap) {
+		live_arenas_cap = live_arenas_cap
+			? 2 * live_arenas_cap : FRAME_CHUNK_LEN;
+		live_arenas = realloc(live_arenas, sizeof(struct arena *) *
+				      live_arenas_cap);
+		if (live_arenas == NULL) {
+			fprintf(stderr, "Out of memory for frames.\n");
+			abort();
+		}
+	}
+	live_arenas[live_arenas_len++] = a;
+}
+
+/*
+ * Find the arenas of the functions that are running, starting with arena,
+ * that of the one that runs.
+ */
+static void
+find_live_arenas(struct arena *arena)
+{
+	struct frame_chunk *c;
+	struct frame *fp, *end;
+
+	/* The running function made most of what they hold. */
+	frames_init();
+	live_arenas_len = 0;
+	add_live_arena(arena);
+	for (c = &frame_chunk_start; ; c = c->next) {
+		end = (c == frame_chunk) ? framep : c->frames + FRAME_CHUNK_LEN;
+		for (fp = c->frames; fp < end; fp++)
+			if (fp->call != NULL && &fp->arena != arena &&
+			    !arena_is_empty(&fp->arena))
+				add_live_arena(&fp->arena);
+		if (c == frame_chunk)
+			break;
+	}
+}
+
+struct arena **
+eval_arenas(struct arena *arena, size_t *n)
+{
+	find_live_arenas(arena);
+	*n = live_arenas_len;
+	return live_arenas;
+}
+
+void
+eval_thread_begin(struct arena *base, struct arena **shared, size_t n)
+{
+	thread.on = true;
+	thread.base = base;
+	thread.shared = shared;
+	thread.nshared = n;
+}
+
+void
+eval_thread_end(void)
+{
+	struct clone *c;
+
+	while ((c = thread.made) != NULL) {
+		thread.made = c->next;
+		free(c);
+	}
+	free(thread.clones.buckets);
+	thread.clones.buckets = NULL;
+	thread.clones.len = thread.clones.size = 0;
+	thread.on = false;
+}
+
+/*
+ * Copy v, which is being stored where it outlives the running function, to
+ * global_arena along with what it reaches. It may reach what any of the
+ * functions that are running made, not only the one in arena, so their arenas
+ * are all evacuated from at once. In a thread other than the first, that
+ * includes those of the caller of parallel_apply() and the arena the thread
+ * returns into.
+ */
+static struct value
+evacuate_global(struct arena *arena, struct value v)
+{
+	size_t i;
+
+	find_live_arenas(arena);
+	if (!thread.on)
+		return arena_evacuate_all(&global_arena, live_arenas,
+					  live_arenas_len, v);
+
+	add_live_arena(thread.base);
+	for (i = 0; i < thread.nshared; i++)
+		add_live_arena(thread.shared[i]);
+	pthread_mutex_lock(&shared_lock);
+	v = arena_evacuate_all(&global_arena, live_arenas, live_arenas_len, v);
+	pthread_mutex_unlock(&shared_lock);
+	return v;
+}
+
+/*
+ * global_store(), which threads other than the first do in turn.
+ */
+static void
+store_global(size_t sym, struct value v)
+{
+	if (!thread.on) {
+		global_store(sym, v);
+		return;
+	}
+	pthread_mutex_lock(&shared_lock);
+	global_store(sym, v);
+	pthread_mutex_unlock(&shared_lock);
+}
+
+void
+eval(struct func *env, struct progm *prog, struct arena *arena)
 {
 	size_t ignored_walks;
-	struct func local_func;
+	struct frame *fp, *base_frame;
+	struct arena *const base_arena = arena;
 	struct progm local_prog = *prog;
-	struct context local_context;
-	struct heap_item heap_start = { NULL, 0, NULL, };
-	struct heap_item *curr_heap = &heap_start;
+	const bool cloning = thread.on;
 
 #define INST(n) [n##_opcode] = &&INST_##n
 	static const void *inst_tab[] = {
-		INST(Add2), INST(Add_imm_si), INST(Alloc_list),
-		INST(Alloc_stack), INST(Call), INST(Call_current),
-		INST(Call_imm_func), INST(Call_imm_local),
+		INST(Add2), INST(Add_imm_si), INST(Add_local_imm_si),
+		INST(Add_local_local), INST(Add_reg), INST(Add_reg_imm_si),
+		INST(Alloc_list), INST(Alloc_stack), INST(Box), INST(Call),
+		INST(Call_current), INST(Call_imm_func), INST(Call_imm_local),
 		INST(Call_imm_nonlocal), INST(Call_imm_sym), INST(Car),
-		INST(Cdr), INST(Clear),	INST(Div2), INST(Div_imm_si),
+		INST(Cdr), INST(Cdr_advance), INST(Clear),
+		INST(Convert_vector), INST(Div2), INST(Div_imm_si),
+		INST(Div_reg), INST(Div_reg_imm_si),
 		INST(Drop), INST(Dup), INST(Halt),
 		INST(Jmp), INST(Jmp_eq), INST(Jmp_eq_imm_si),
-		INST(Jmp_eq_imm_ui), INST(Jmp_false), INST(Jmp_gt),
-		INST(Jmp_gt_imm_si), INST(Jmp_gt_imm_ui), INST(Jmp_lt),
-		INST(Jmp_lt_imm_si), INST(Jmp_lt_imm_ui), INST(Jmp_ne),
-		INST(Jmp_ne_imm_si), INST(Jmp_ne_imm_ui), INST(Jmp_true),
-		INST(Lambda), INST(Let), INST(Load), INST(Load_imm_local),
+		INST(Jmp_eq_imm_ui), INST(Jmp_eq_local_imm_si),
+		INST(Jmp_eq_local_local), INST(Jmp_false), INST(Jmp_gt),
+		INST(Jmp_gt_imm_si), INST(Jmp_gt_imm_ui),
+		INST(Jmp_gt_local_imm_si), INST(Jmp_gt_local_local),
+		INST(Jmp_lt), INST(Jmp_lt_imm_si), INST(Jmp_lt_imm_ui),
+		INST(Jmp_lt_local_imm_si), INST(Jmp_lt_local_local),
+		INST(Jmp_ne), INST(Jmp_ne_imm_si), INST(Jmp_ne_imm_ui),
+		INST(Jmp_ne_local_imm_si), INST(Jmp_ne_local_local),
+		INST(Jmp_true),
+		INST(Lambda), INST(Let), INST(Load), INST(Load_imm_closure),
+		INST(Load_imm_local),
 		INST(Load_imm_nonlocal), INST(Load_imm_sym), INST(Make_list),
-		INST(Make_pair), INST(Mul2), INST(Mul_imm_si),
-		INST(Push_imm_func), INST(Push_imm_si), INST(Ret),
-		INST(Sto_imm_local), INST(Sto_imm_local_si),
-		INST(Sto_imm_local_func), INST(Sto_imm_nonlocal),
-		INST(Sto_imm_nonlocal_func), INST(Sub2), INST(Sub_imm_si),
-		INST(Yield),
+		INST(Make_pair), INST(Make_vector), INST(Make_vector_fill),
+		INST(Matrix), INST(Memory_stats), INST(Mul2),
+		INST(Mul_imm_si),
+		INST(Mul_local_imm_si), INST(Mul_local_local),
+		INST(Mul_reg), INST(Mul_reg_imm_si), INST(Parallel),
+		INST(Push_const),
+		INST(Push_imm_bi), INST(Push_imm_br), INST(Push_imm_func),
+		INST(Push_imm_si), INST(Ret), INST(Simd),
+		INST(Sto_box), INST(Sto_imm_local), INST(Sto_imm_local_si),
+		INST(Sto_imm_local_func), INST(Sto_imm_local_jmp),
+		INST(Sto_imm_nonlocal), INST(Sto_imm_nonlocal_func),
+		INST(Sto_imm_sym), INST(Sto_imm_sym_func), INST(Sto_imm_sym_si),
+		INST(Sub2),
+		INST(Sub_imm_si), INST(Sub_local_imm_si), INST(Sub_local_local),
+		INST(Sub_reg), INST(Sub_reg_imm_si), INST(Unbox),
+		INST(Vector_length), INST(Vector_ref), INST(Vector_set),
+		INST(Yield), INST(Yield_jmp),
 	};
 
 #define DEF_INST(n) INST_##n:
-#define RUN_NEXT_INST() do { goto *inst_tab[NEXT_INST(local_prog)]; } while (0)
+#define RUN_NEXT_INST() do {					\
+		prof_next(&local_prog);					\
+		goto *inst_tab[NEXT_INST(local_prog)];			\
+	} while (0)
 
 #define UNIMPLEMENTED_INST(n) INST_##n:					\
 	do { fprintf(stderr, "Instruction " #n " is unsupported\n");	\
 		abort(); } while(0)
 
+	frames_init();
+	base_frame = framep;
 	if (env->rt_context != NULL)
 		stackp = env->rt_context->local_end;
 
@@ -106,30 +707,107 @@ eval(struct func *env, struct progm *prog)
 	 */
 
 	/* Jump to the first instruction. */
-	goto *inst_tab[NEXT_INST(local_prog)];
+	RUN_NEXT_INST();
 
 	/*
 	 * Instruction implementations:
 	 */
 	DEF_INST(Add2) {
 		struct value *a1, a2;
+
 		a2 = POP();
 		a1 = TOP();
-		a1->i += a2.i;
-
+		ARITH(*a1, *a1, a2, add, Arith_add);
 		RUN_NEXT_INST();
 	}
 
 	DEF_INST(Add_imm_si) {
-		struct value *a;
+		struct value *a, imm;
+
 		a = TOP();
-		a->i += NEXT_IMM_SI(local_prog);
+		imm = int_value(NEXT_IMM_SI(local_prog));
+		ARITH(*a, *a, imm, add, Arith_add);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Add_local_imm_si) {
+		struct value a, imm;
+
+		a = *local(env, NEXT_IMM_OFFSET(local_prog));
+		imm = int_value(NEXT_IMM_SI(local_prog));
+		ARITH(a, a, imm, add, Arith_add);
+		PUSH(a);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Add_local_local) {
+		struct value a, b;
 
+		a = *local(env, NEXT_IMM_OFFSET(local_prog));
+		b = *local(env, NEXT_IMM_OFFSET(local_prog));
+		ARITH(a, a, b, add, Arith_add);
+		PUSH(a);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Add_reg) {
+		struct value *d, *a, *b;
+
+		d = local(env, NEXT_IMM_OFFSET(local_prog));
+		a = local(env, NEXT_IMM_OFFSET(local_prog));
+		b = local(env, NEXT_IMM_OFFSET(local_prog));
+		ARITH(*d, *a, *b, add, Arith_add);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Add_reg_imm_si) {
+		struct value *d, *a, imm;
+
+		d = local(env, NEXT_IMM_OFFSET(local_prog));
+		a = local(env, NEXT_IMM_OFFSET(local_prog));
+		imm = int_value(NEXT_IMM_SI(local_prog));
+		ARITH(*d, *a, imm, add, Arith_add);
 		RUN_NEXT_INST();
 	}
 
 	UNIMPLEMENTED_INST(Alloc_list);
-	UNIMPLEMENTED_INST(Alloc_stack);
+
+	/*
+	 * The pairs are laid out PAIR_SLOTS variables apart. Their first slots
+	 * hold the cars, which the collector sees as roots. The cdrs are raw
+	 * pointers to the stack, which never pass for heap allocated values:
+	 * their type bits are zero with NANBOX, and a multiple of the size of
+	 * a value otherwise, as the rest of the slot is cleared first.
+	 */
+	DEF_INST(Alloc_stack) {
+		struct value *slots;
+		struct pair *p, *next;
+		size_t walk, offset, n;
+
+		walk = NEXT_IMM_OFFSET(local_prog) - ignored_walks;
+		offset = NEXT_IMM_OFFSET(local_prog);
+		n = NEXT_IMM_OFFSET(local_prog);
+		slots = nonlocal(env, walk, offset);
+		for (next = NULL; n > 0; next = p) {
+			n--;
+			slots[n * PAIR_SLOTS + 1] = type_value(Nil_type);
+			p = (struct pair *)(slots + n * PAIR_SLOTS);
+			p->car = POP();
+			p->cdr = next;
+		}
+		PUSH(pair_value(next));
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Box) {
+		struct pair *p;
+
+		MAYBE_COLLECT();
+		p = alloc_pair(arena);
+		p->car = *TOP();
+		*TOP() = pair_value(p);
+		RUN_NEXT_INST();
+	}
 
 	/*
 	 * Call instructions.
@@ -138,24 +816,24 @@ eval(struct func *env, struct progm *prog)
 		size_t nargs;
 		size_t req_args;
 		struct func *call;
-		struct func *descendent;
-		struct value popped, returned;
-		struct heap_item heap, *marked;
+		struct value popped;
 
 		DEF_INST(Call) {
 			nargs = NEXT_IMM_OFFSET(local_prog);
 			popped = POP();
-			if (popped.type != Function_type) {
+			if (type_of(popped) != Function_type) {
 				fprintf(stderr, "type error: not function\n");
 				abort();
 			}
-			call = popped.f;
+			call = func_of(popped);
 			goto call_func;
 		}
 
 		DEF_INST(Call_current) {
 			nargs = NEXT_IMM_OFFSET(local_prog);
-			call = env;
+			/* Let scopes have no arguments, their function does. */
+			for (call = env; call->args == NULL; call = call->parent)
+				;
 			goto call_func;
 		}
 
@@ -167,7 +845,8 @@ eval(struct func *env, struct progm *prog)
 
 		DEF_INST(Call_imm_local) {
 			nargs = NEXT_IMM_OFFSET(local_prog);
-			call = local(env, NEXT_IMM_OFFSET(local_prog))->f;
+			call = func_of(*local(env,
+					      NEXT_IMM_OFFSET(local_prog)));
 			goto call_func;
 		}
 
@@ -177,17 +856,47 @@ eval(struct func *env, struct progm *prog)
 			nargs = NEXT_IMM_OFFSET(local_prog);
 			walk = NEXT_IMM_OFFSET(local_prog) - ignored_walks;
 			offset = NEXT_IMM_OFFSET(local_prog);
-			call = nonlocal(env, walk, offset)->f;
+			call = func_of(*nonlocal(env, walk, offset));
 			goto call_func;
 		}
 
-		UNIMPLEMENTED_INST(Call_imm_sym);
+		DEF_INST(Call_imm_sym) {
+			size_t sym, cache;
+			struct value *cell;
+
+			nargs = NEXT_IMM_OFFSET(local_prog);
+			sym = NEXT_IMM_SYMBOL(local_prog);
+			cache = local_prog.ip;
+			local_prog.ip += 2;
+			if (local_prog.code[cache + 1].o == global_version) {
+				call = local_prog.code[cache].func;
+				goto call_func;
+			}
+
+			if ((cell = global_lookup(sym)) == NULL) {
+				fprintf(stderr, "Unbound variable %s.\n",
+					ident_strings[sym]);
+				abort();
+			}
+			if (type_of(*cell) != Function_type) {
+				fprintf(stderr, "%s is not a function.\n",
+					ident_strings[sym]);
+				abort();
+			}
+			call = func_of(*cell);
+			/* The other threads leave the code to the first. */
+			if (!cloning) {
+				local_prog.code[cache].func = call;
+				local_prog.code[cache + 1].o = global_version;
+			}
+			goto call_func;
+		}
 
 	call_func:
-		if (call->rt_context != NULL)
-			local_context = *call->rt_context;
-		else
-			call->rt_context = &local_context;
+		if (__builtin_expect(cloning, 0)) {
+			call = clone_of(call);
+			clone_from(call)->running++;
+		}
 
 		/* Set up the arguments. */
 		req_args = call->args->len - call->flags.variadic;
@@ -208,168 +917,117 @@ eval(struct func *env, struct progm *prog)
 			}
 		}
 
-		call->rt_context->local_start = stackp - nargs;
-		stackp = call->rt_context->local_end =
-			call->rt_context->local_start +
-			call->locals->len;
-
-		heap = eval(call, &call->prog);
-		call->prog.ip = 0;
-
-		if (stackp == call->rt_context->local_end)
-			/* No return value. */
-			returned.type = Nil_type;
-		else
-			returned = *TOP();
-
-		/*
-		 * Determine if we need to make the returned value a
-		 * closure.
-		 * TODO: factor this, it's repeated in a couple of
-		 * different places.
-		 */
-		if (returned.type == Function_type &&
-		    (descendent = find_nearest_descendent(call, returned.f))
-		    != NULL) {
-			struct value *p;
-			struct func *new_func;
-
-			/*
-			 * We need to make the value a closure.
-			 * TODO: figure out what assumptions we can make to
-			 * speed this up.
-			 * TODO: error checking.
-			 */
-			returned.f->flags.closure = 1;
-
-			new_func = alloc_func(&curr_heap);
-			*new_func = *call;
-			new_func->rt_context =
-				malloc(sizeof(struct context));
-			new_func->rt_context->local_start =
-				malloc(sizeof(struct value) *
-				       new_func->locals->len);
-			new_func->rt_context->local_end =
-				new_func->rt_context->local_start;
-			for (p = call->rt_context->local_start;
-			     p < call->rt_context->local_end;
-			     p++) {
-				/*
-				 * TODO: figure out what to copy and
-				 * what to duplicate.
-				 */
-				*new_func->rt_context->local_end = *p;
-				new_func->rt_context->local_end++;
-			}
-			new_func->flags.closure = 1;
-			if (descendent == returned.f) {
-				/* Copy the descendent */
-				descendent = alloc_func(&curr_heap);
-				*descendent = *returned.f;
-				descendent->rt_context = NULL;
-				returned.f = descendent;
-			}
-			descendent->parent = new_func;
+#ifdef JIT
+		if (call->native == NULL && jit_threshold != 0 && !cloning &&
+		    ++call->calls == jit_threshold)
+			(void)jit_compile(call);
+		if (call->native != NULL && jit_stack_ok()) {
+			jit_run(call, arena);
+			RUN_NEXT_INST();
 		}
+#endif
 
-		/* Garbage collect the function. */
-		marked = mark_heap(&heap, returned);
-		/* Free the remaining heap. */
-		if (heap.data != NULL) {
-			free(heap.data);
-			clear_heap(heap.next);
-		}
-		/* Add the marked data into the current heap. */
-		if (marked != NULL) {
-			for (curr_heap->next = marked;
-			     curr_heap->next != NULL;
-			     curr_heap = curr_heap->next)
-				;
-		}
+		/* Save the caller's state. */
+		fp = push_frame();
+		fp->env = env;
+		fp->prog = local_prog;
+		fp->ignored_walks = ignored_walks;
+		fp->ret_arena = arena;
+		fp->call = call;
+		if (call->rt_context != NULL)
+			fp->context = *call->rt_context;
+		else
+			call->rt_context = &fp->context;
 
-		*call->rt_context->local_start = returned;
-		stackp = call->rt_context->local_start + 1;
+		call->rt_context->local_start = stackp - nargs;
+		call->rt_context->local_end =
+			call->rt_context->local_start +
+			call->locals->len;
+		/* The collector must not find stale values in the locals. */
+		while (stackp < call->rt_context->local_end)
+			PUSH(type_value(Nil_type));
 
-		if (call->rt_context == &local_context)
-			call->rt_context = NULL;
-		else
-			*call->rt_context = local_context;
+		arena = &fp->arena;
+		*arena = (struct arena)ARENA_INIT;
 
+		env = call;
+		local_prog = call->prog;
+		local_prog.ip = 0;
+		ignored_walks = 0;
 		RUN_NEXT_INST();
 	}
 
-
 	DEF_INST(Car) {
 		struct value v = POP();
+		struct slice s;
 
-		if (v.type != Pair_type) {
-			// TODO: error here.
+		if (type_of(v) != Pair_type) {
+			s = vector_items(v);
+			if (s.len == 0) {
+				fprintf(stderr, "Cannot take the car of an "
+					"empty vector.\n");
+				abort();
+			}
+			PUSH(s.start[0]);
+			RUN_NEXT_INST();
 		}
-		if (v.p == NULL) {
+		if (pair_of(v) == NULL) {
 			// TODO: error here.
 		}
-		PUSH(v.p->car);
-
-#if 0
-		/*
-		 * TODO: we better make sure we can always assume it's a
-		 * vector.
-		 */
-		switch (v.type) {
-		case Vector_type:
-			PUSH(v.v->items[0]);
-			break;
-
-		case Slice_type:
-			PUSH(v.slice->start[0]);
-			break;
-
-		default:
-			fprintf(stderr, "Cannot car a non-vector type.");
-			break;
-		}
-#endif
+		PUSH(pair_of(v)->car);
 		RUN_NEXT_INST();
 	}
 
 
 	DEF_INST(Cdr) {
-		struct value v = POP();
-		struct value r = { .type = Pair_type, };
+		struct value v = *TOP();
 
-		if (v.type != Pair_type) {
-			// TODO: error here.
+		if (type_of(v) != Pair_type) {
+			MAYBE_COLLECT();
+			*TOP() = vector_cdr(arena, *TOP());
+			RUN_NEXT_INST();
 		}
-		if (v.p == NULL) {
+		if (pair_of(v) == NULL) {
 			// TODO: error here.
 		}
+		*TOP() = pair_value(pair_of(v)->cdr);
+		RUN_NEXT_INST();
+	}
 
-		r.p = v.p->cdr;
-		PUSH(r);
+	DEF_INST(Cdr_advance) {
+		struct value *var, *tmp;
+		struct slice *s;
 
-#if 0
-		s.slice = alloc_slice(&curr_heap);
-		switch (v.type) {
-		case Vector_type:
-			if (v.v->len == 0)
-				break;
-			s.slice->len = v.v->len - 1;
-			s.slice->start = v.v->items + 1;
-			break;
-
-		case Slice_type:
-			if (v.slice->len == 0)
-				break;
-			s.slice->len = v.slice->len - 1;
-			s.slice->start = v.slice->start + 1;
-			break;
+		var = local(env, NEXT_IMM_OFFSET(local_prog));
+		tmp = local(env, NEXT_IMM_OFFSET(local_prog));
+		if (type_of(*var) == Pair_type) {
+			PUSH(pair_value(pair_of(*var)->cdr));
+			RUN_NEXT_INST();
+		}
 
-		default:
-			fprintf(stderr, "Cannot cdr a non-vector type.");
-			break;
+		/*
+		 * Nothing but var and tmp refers to the slice the instruction
+		 * made, which is only ever mutated in the nursery, as that is
+		 * never frozen by a collection under way.
+		 */
+		if (type_of(*var) == Slice_type &&
+		    type_of(*tmp) == Slice_type &&
+		    slice_of(*var) == slice_of(*tmp) &&
+		    arena_in_nursery(arena, slice_of(*var))) {
+			s = slice_of(*var);
+			if (s->len == 0) {
+				fprintf(stderr, "Cannot take the cdr of an "
+					"empty vector.\n");
+				abort();
+			}
+			s->start++;
+			s->len--;
+			PUSH(*var);
+			RUN_NEXT_INST();
 		}
-		PUSH(s);
-#endif
+		MAYBE_COLLECT();
+		*tmp = vector_cdr(arena, *var);
+		PUSH(*tmp);
 		RUN_NEXT_INST();
 	}
 
@@ -380,8 +1038,66 @@ eval(struct func *env, struct progm *prog)
 		RUN_NEXT_INST();
 	}
 
-	UNIMPLEMENTED_INST(Div2);
-	UNIMPLEMENTED_INST(Div_imm_si);
+	DEF_INST(Convert_vector) {
+		struct vector *vp, *from;
+		struct slice s;
+		size_t i, len;
+		enum elem_type elem = NEXT_IMM_OFFSET(local_prog);
+
+		MAYBE_COLLECT();
+		len = vector_length(*TOP());
+		vp = alloc_typed_vector(arena, elem, len);
+		if (type_of(*TOP()) == Slice_type) {
+			s = *slice_of(*TOP());
+			for (i = 0; i < len; i++)
+				vector_put(vp, i, s.start[i]);
+		} else {
+			from = vector_of(*TOP());
+			for (i = 0; i < len; i++)
+				vector_put(vp, i, vector_get(from, i));
+		}
+		vp->len = len;
+		*TOP() = vector_value(vp);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Div2) {
+		struct value *a1, a2;
+
+		a2 = POP();
+		a1 = TOP();
+		*a1 = num_arith(Arith_div, *a1, a2);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Div_imm_si) {
+		struct value *a, imm;
+
+		a = TOP();
+		imm = int_value(NEXT_IMM_SI(local_prog));
+		*a = num_arith(Arith_div, *a, imm);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Div_reg) {
+		struct value *d, *a, *b;
+
+		d = local(env, NEXT_IMM_OFFSET(local_prog));
+		a = local(env, NEXT_IMM_OFFSET(local_prog));
+		b = local(env, NEXT_IMM_OFFSET(local_prog));
+		*d = num_arith(Arith_div, *a, *b);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Div_reg_imm_si) {
+		struct value *d, *a, imm;
+
+		d = local(env, NEXT_IMM_OFFSET(local_prog));
+		a = local(env, NEXT_IMM_OFFSET(local_prog));
+		imm = int_value(NEXT_IMM_SI(local_prog));
+		*d = num_arith(Arith_div, *a, imm);
+		RUN_NEXT_INST();
+	}
 
 	DEF_INST(Drop) {
 		(void)POP();
@@ -398,7 +1114,8 @@ eval(struct func *env, struct progm *prog)
 	DEF_INST(Halt) {
 		*prog = local_prog;
 		prog->ip--;
-		return heap_start;
+		prof_stop();
+		return;
 		RUN_NEXT_INST();
 	}
 
@@ -407,41 +1124,106 @@ eval(struct func *env, struct progm *prog)
 		RUN_NEXT_INST();
 	}
 
-	UNIMPLEMENTED_INST(Jmp_eq);
-	UNIMPLEMENTED_INST(Jmp_eq_imm_si);
-	UNIMPLEMENTED_INST(Jmp_eq_imm_ui);
-	UNIMPLEMENTED_INST(Jmp_false);
-	UNIMPLEMENTED_INST(Jmp_gt);
-	UNIMPLEMENTED_INST(Jmp_gt_imm_si);
-	UNIMPLEMENTED_INST(Jmp_gt_imm_ui);
-	UNIMPLEMENTED_INST(Jmp_lt);
-	UNIMPLEMENTED_INST(Jmp_lt_imm_si);
-	UNIMPLEMENTED_INST(Jmp_lt_imm_ui);
+	/*
+	 * Conditional branches. Each comparison comes in a form that pops both
+	 * sides, forms that compare the top of the stack with an immediate,
+	 * and forms that compare locals with a local or an immediate.
+	 */
+#define DEF_CMP_INSTS(n, op, cmp_op)					\
+	DEF_INST(n) {							\
+		size_t dest;						\
+		struct value a1, a2;					\
+									\
+		dest = NEXT_IMM_OFFSET(local_prog);			\
+		a2 = POP();						\
+		a1 = POP();						\
+		if (CMP(a1, a2, op, cmp_op))				\
+			local_prog.ip = dest;				\
+		RUN_NEXT_INST();					\
+	}								\
+									\
+	DEF_INST(n##_imm_si) {						\
+		size_t dest;						\
+		struct value a, imm;	\
+									\
+		dest = NEXT_IMM_OFFSET(local_prog);			\
+		imm = int_value(NEXT_IMM_SI(local_prog));		\
+		a = POP();						\
+		if (CMP(a, imm, op, cmp_op))				\
+			local_prog.ip = dest;				\
+		RUN_NEXT_INST();					\
+	}								\
+									\
+	DEF_INST(n##_imm_ui) {						\
+		size_t dest;						\
+		struct value a, imm;	\
+									\
+		dest = NEXT_IMM_OFFSET(local_prog);			\
+		imm = int_value(NEXT_IMM_UI(local_prog));		\
+		a = POP();						\
+		if (CMP(a, imm, op, cmp_op))				\
+			local_prog.ip = dest;				\
+		RUN_NEXT_INST();					\
+	}								\
+									\
+	DEF_INST(n##_local_imm_si) {					\
+		size_t dest;						\
+		struct value *a, imm;	\
+									\
+		dest = NEXT_IMM_OFFSET(local_prog);			\
+		a = local(env, NEXT_IMM_OFFSET(local_prog));		\
+		imm = int_value(NEXT_IMM_SI(local_prog));		\
+		if (CMP(*a, imm, op, cmp_op))				\
+			local_prog.ip = dest;				\
+		RUN_NEXT_INST();					\
+	}								\
+									\
+	DEF_INST(n##_local_local) {					\
+		size_t dest;						\
+		struct value *a1, *a2;					\
+									\
+		dest = NEXT_IMM_OFFSET(local_prog);			\
+		a1 = local(env, NEXT_IMM_OFFSET(local_prog));		\
+		a2 = local(env, NEXT_IMM_OFFSET(local_prog));		\
+		if (CMP(*a1, *a2, op, cmp_op))				\
+			local_prog.ip = dest;				\
+		RUN_NEXT_INST();					\
+	}
 
+	DEF_CMP_INSTS(Jmp_eq, ==, Cmp_eq)
+	DEF_CMP_INSTS(Jmp_gt, >, Cmp_gt)
+	DEF_CMP_INSTS(Jmp_lt, <, Cmp_lt)
+	DEF_CMP_INSTS(Jmp_ne, !=, Cmp_ne)
 
-	DEF_INST(Jmp_ne) {
-		struct value a1, a2;
+	DEF_INST(Jmp_false) {
+		size_t dest = NEXT_IMM_OFFSET(local_prog);
 
-		a2 = POP();
-		a1 = POP();
-		if (a1.i != a2.i) {
-			local_prog.ip = local_prog.code[local_prog.ip].o;
-			RUN_NEXT_INST();
-		}
-		(void)NEXT_IMM_OFFSET(local_prog);
+		if (!is_true(POP()))
+			local_prog.ip = dest;
 		RUN_NEXT_INST();
 	}
 
-	UNIMPLEMENTED_INST(Jmp_ne_imm_si);
-	UNIMPLEMENTED_INST(Jmp_ne_imm_ui);
-
 	DEF_INST(Jmp_true) {
-		if (POP().i)
-			local_prog.ip = local_prog.code[local_prog.ip].o;
+		size_t dest = NEXT_IMM_OFFSET(local_prog);
+
+		if (is_true(POP()))
+			local_prog.ip = dest;
 		RUN_NEXT_INST();
 	}
 
-	UNIMPLEMENTED_INST(Lambda);
+	DEF_INST(Lambda) {
+		size_t n;
+		struct func *f;
+
+		MAYBE_COLLECT();
+		n = NEXT_IMM_OFFSET(local_prog);
+		f = alloc_closure(arena, NEXT_IMM_FUNC(local_prog), n);
+		f->flags.closure = 1;
+		stackp -= n;
+		memcpy(f->captures, stackp, sizeof(struct value) * n);
+		PUSH(func_value(f));
+		RUN_NEXT_INST();
+	}
 
 	DEF_INST(Let) {
 		symtab *locals;
@@ -449,25 +1231,39 @@ eval(struct func *env, struct progm *prog)
 		if ((locals = NEXT_IMM_SYMTAB(local_prog)) == NULL) {
 			/* Ignore this walk. */
 			ignored_walks++;
-			local_context.local_end = stackp;
 			RUN_NEXT_INST();
 		}
 
-		local_func.parent = env;
-		local_func.args = NULL;
-		local_func.locals = locals;
-		local_func.rt_context = &local_context;
-		local_context.local_start = stackp;
-		stackp += locals->len;
-		local_context.local_end = stackp;
+		fp = push_frame();
+		fp->env = env;
+		fp->ignored_walks = ignored_walks;
+		fp->call = NULL;
+		fp->scope.parent = env;
+		fp->scope.args = NULL;
+		fp->scope.locals = locals;
+		fp->scope.rt_context = &fp->context;
+		fp->context.local_start = stackp;
+		fp->context.local_end = stackp + locals->len;
+		while (stackp < fp->context.local_end)
+			PUSH(type_value(Nil_type));
 		/* TODO: garbage collection here. */
-		eval(&local_func, &local_prog);
+		env = &fp->scope;
+		ignored_walks = 0;
 		RUN_NEXT_INST();
 	}
 
 
 	UNIMPLEMENTED_INST(Load);
 
+	DEF_INST(Load_imm_closure) {
+		size_t walk, index;
+
+		walk = NEXT_IMM_OFFSET(local_prog) - ignored_walks;
+		index = NEXT_IMM_OFFSET(local_prog);
+		PUSH(walk_env(env, walk)->captures[index]);
+		RUN_NEXT_INST();
+	}
+
 	DEF_INST(Load_imm_local) {
 		struct value *v;
 		v = local(env, NEXT_IMM_OFFSET(local_prog));
@@ -486,88 +1282,321 @@ eval(struct func *env, struct progm *prog)
 		RUN_NEXT_INST();
 	}
 
-	UNIMPLEMENTED_INST(Load_imm_sym);
+	DEF_INST(Load_imm_sym) {
+		size_t sym, cache;
+		struct value *cell;
+
+		sym = NEXT_IMM_SYMBOL(local_prog);
+		cache = local_prog.ip;
+		local_prog.ip += 2;
+		cell = local_prog.code[cache].cell;
+		if (local_prog.code[cache + 1].o != global_version) {
+			if ((cell = global_lookup(sym)) == NULL) {
+				fprintf(stderr, "Unbound variable %s.\n",
+					ident_strings[sym]);
+				abort();
+			}
+			if (!cloning) {
+				local_prog.code[cache].cell = cell;
+				local_prog.code[cache + 1].o = global_version;
+			}
+		}
+		PUSH(*cell);
+		RUN_NEXT_INST();
+	}
 
 	DEF_INST(Make_list) {
 		struct pair *curr, *next;
-		struct value v = { .type = Pair_type, };
 		size_t i, len = NEXT_IMM_OFFSET(local_prog);
 
+		MAYBE_COLLECT();
 		switch (len) {
 		case 0:
-			PUSH(((struct value){ .type = Pair_type, .p = NULL }));
+			PUSH(pair_value(NULL));
 			break;
 
 		case 2:
 			DEF_INST(Make_pair) {
-				struct value p = { .type = Pair_type, };
+				struct pair *p;
 
-				p.p = alloc_pair(&curr_heap);
-				p.p->cdr = alloc_pair(&curr_heap);
-				p.p->cdr->car = POP();
-				p.p->car = POP();
+				MAYBE_COLLECT();
+				p = alloc_pair(arena);
+				p->cdr = alloc_pair(arena);
+				p->cdr->car = POP();
+				p->car = POP();
 
-				PUSH(p);
+				PUSH(pair_value(p));
 				RUN_NEXT_INST();
 			}
 
 		default:
 			next = NULL;
 			for (i = 0; i < len - 1; i++) {
-				curr = alloc_pair(&curr_heap);
+				curr = alloc_pair(arena);
 				curr->car = POP();
 				curr->cdr = next;
 				next = curr;
 			}
-			v.p = alloc_pair(&curr_heap);
-			v.p->car = POP();
-			v.p->cdr = next;
-			PUSH(v);
+			curr = alloc_pair(arena);
+			curr->car = POP();
+			curr->cdr = next;
+			PUSH(pair_value(curr));
 			break;
 		}
 		RUN_NEXT_INST();
 	}
 
+	DEF_INST(Make_vector) {
+		struct vector *vp;
+		size_t len = NEXT_IMM_OFFSET(local_prog);
+
+		MAYBE_COLLECT();
+		vp = alloc_vector(arena, len);
+		stackp -= len;
+		memcpy(vp->items, stackp, len * sizeof(struct value));
+		vp->len = len;
+		PUSH(vector_value(vp));
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Make_vector_fill) {
+		struct vector *vp;
+		struct value fill, len;
+		size_t i;
+		enum elem_type elem = NEXT_IMM_OFFSET(local_prog);
+
+		MAYBE_COLLECT();
+		fill = POP();
+		len = POP();
+		if (type_of(len) != Integer_type || int_of(len) < 0) {
+			fprintf(stderr, "type error: not length\n");
+			abort();
+		}
+		vp = alloc_typed_vector(arena, elem, int_of(len));
+		for (i = 0; i < (size_t)int_of(len); i++)
+			vector_put(vp, i, fill);
+		vp->len = int_of(len);
+		PUSH(vector_value(vp));
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Matrix) {
+		enum matrix_op op = NEXT_IMM_OFFSET(local_prog);
+		struct value v;
+
+		MAYBE_COLLECT();
+		v = matrix_apply(arena, op, stackp - matrix_arity[op]);
+		stackp -= matrix_arity[op];
+		PUSH(v);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Memory_stats) {
+		struct pair *curr, *next;
+		size_t i, stats[Num_alloc_stats];
+
+		MAYBE_COLLECT();
+		/* Before the list itself is counted. */
+		alloc_stats_sum(stats);
+		next = NULL;
+		for (i = Num_alloc_stats; i > 0; i--) {
+			curr = alloc_pair(arena);
+			curr->car = int_value(stats[i - 1]);
+			curr->cdr = next;
+			next = curr;
+		}
+		PUSH(pair_value(next));
+		RUN_NEXT_INST();
+	}
+
 	DEF_INST(Mul2) {
 		struct value *a1, a2;
 
 		a2 = POP();
 		a1 = TOP();
-		a1->i *= a2.i;
-
+		ARITH(*a1, *a1, a2, mul, Arith_mul);
 		RUN_NEXT_INST();
 	}
 
 	DEF_INST(Mul_imm_si) {
-		struct value *a;
+		struct value *a, imm;
 
 		a = TOP();
-		a->i *= NEXT_IMM_SI(local_prog);
-
+		imm = int_value(NEXT_IMM_SI(local_prog));
+		ARITH(*a, *a, imm, mul, Arith_mul);
 		RUN_NEXT_INST();
 	}
 
-	DEF_INST(Push_imm_func) {
-		struct value a;
+	DEF_INST(Mul_local_imm_si) {
+		struct value a, imm;
 
-		a.type = Function_type;
-		a.f = NEXT_IMM_FUNC(local_prog);
+		a = *local(env, NEXT_IMM_OFFSET(local_prog));
+		imm = int_value(NEXT_IMM_SI(local_prog));
+		ARITH(a, a, imm, mul, Arith_mul);
 		PUSH(a);
 		RUN_NEXT_INST();
 	}
 
-	DEF_INST(Push_imm_si) {
-		struct value a;
+	DEF_INST(Mul_local_local) {
+		struct value a, b;
 
-		a.type = Integer_type;
-		a.i = NEXT_IMM_SI(local_prog);
+		a = *local(env, NEXT_IMM_OFFSET(local_prog));
+		b = *local(env, NEXT_IMM_OFFSET(local_prog));
+		ARITH(a, a, b, mul, Arith_mul);
 		PUSH(a);
 		RUN_NEXT_INST();
 	}
 
+	DEF_INST(Mul_reg) {
+		struct value *d, *a, *b;
+
+		d = local(env, NEXT_IMM_OFFSET(local_prog));
+		a = local(env, NEXT_IMM_OFFSET(local_prog));
+		b = local(env, NEXT_IMM_OFFSET(local_prog));
+		ARITH(*d, *a, *b, mul, Arith_mul);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Mul_reg_imm_si) {
+		struct value *d, *a, imm;
+
+		d = local(env, NEXT_IMM_OFFSET(local_prog));
+		a = local(env, NEXT_IMM_OFFSET(local_prog));
+		imm = int_value(NEXT_IMM_SI(local_prog));
+		ARITH(*d, *a, imm, mul, Arith_mul);
+		RUN_NEXT_INST();
+	}
+
+	/*
+	 * The values stay on the stack while the calls run above them.
+	 */
+	DEF_INST(Parallel) {
+		enum parallel_op op = NEXT_IMM_OFFSET(local_prog);
+		struct value v;
+
+		MAYBE_COLLECT();
+		v = parallel_apply(arena, op, stackp - parallel_arity[op]);
+		stackp -= parallel_arity[op];
+		PUSH(v);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Push_const) {
+		PUSH(*NEXT_IMM_CONST(local_prog));
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Push_imm_bi) {
+		PUSH(int_value(NEXT_IMM_BI(local_prog)));
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Push_imm_br) {
+		PUSH(real_value(NEXT_IMM_BR(local_prog)));
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Push_imm_func) {
+		PUSH(func_value(NEXT_IMM_FUNC(local_prog)));
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Push_imm_si) {
+		PUSH(int_value(NEXT_IMM_SI(local_prog)));
+		RUN_NEXT_INST();
+	}
+
 	DEF_INST(Ret) {
-		/* Do not overwrite progm. */
-		return heap_start;
+		struct func *call;
+		struct value returned;
+
+		/* Leave any let scopes the function is still in. */
+		while (framep != base_frame && top_frame()->call == NULL)
+			(void)pop_frame();
+		if (framep == base_frame) {
+			/* Do not overwrite progm. */
+			prof_stop();
+			return;
+		}
+
+		fp = pop_frame();
+		call = fp->call;
+		env = fp->env;
+		local_prog = fp->prog;
+		ignored_walks = fp->ignored_walks;
+		arena = fp->ret_arena;
+
+		if (stackp == call->rt_context->local_end)
+			/* No return value. */
+			returned = type_value(Nil_type);
+		else
+			returned = *TOP();
+
+		/*
+		 * Determine if we need to make the returned value a closure.
+		 * It is made in the arena of the call, so that it is
+		 * evacuated along with the values it closes over.
+		 */
+		if (type_of(returned) == Function_type)
+			returned = func_value(close_over(call,
+							 func_of(returned),
+							 &fp->arena));
+
+		/*
+		 * Keep what the caller can reach and drop the rest. The caller
+		 * takes it over where it is, unless its arena is not collected
+		 * here, as that would keep the garbage of every such call.
+		 */
+		if (!arena_is_empty(&fp->arena)) {
+			if (is_heap_allocated(returned) &&
+			    (arena == base_arena ||
+			     !arena_adopt(arena, &fp->arena)))
+				returned = arena_evacuate(arena, &fp->arena,
+							  returned);
+			arena_release(&fp->arena);
+		}
+
+		*call->rt_context->local_start = returned;
+		stackp = call->rt_context->local_start + 1;
+
+		if (call->rt_context == &fp->context)
+			call->rt_context = NULL;
+		else
+			*call->rt_context = fp->context;
+		if (__builtin_expect(cloning, 0))
+			clone_from(call)->running--;
+
+		/* What was returned may have filled the nursery. */
+		MAYBE_COLLECT();
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Simd) {
+		enum simd_op op = NEXT_IMM_OFFSET(local_prog);
+		struct value v;
+
+		MAYBE_COLLECT();
+		v = simd_apply(arena, op, stackp - simd_arity[op]);
+		stackp -= simd_arity[op];
+		PUSH(v);
+		RUN_NEXT_INST();
+	}
+
+	/*
+	 * A box may be older than the value stored into it, unless it is in
+	 * the nursery of the running function. Older objects must not point
+	 * to younger ones, so the value then goes where it is never released.
+	 */
+	DEF_INST(Sto_box) {
+		struct pair *p;
+		struct value v;
+
+		p = box_of(POP());
+		v = POP();
+		if (is_heap_allocated(v) && !arena_in_nursery(arena, p))
+			v = evacuate_global(arena, v);
+		p->car = v;
+		RUN_NEXT_INST();
 	}
 
 	DEF_INST(Sto_imm_local) {
@@ -582,8 +1611,7 @@ eval(struct func *env, struct progm *prog)
 		struct value *a;
 
 		a = local(env, NEXT_IMM_OFFSET(local_prog));
-		a->type = Integer_type;
-		a->i = NEXT_IMM_SI(local_prog);
+		*a = int_value(NEXT_IMM_SI(local_prog));
 		RUN_NEXT_INST();
 	}
 
@@ -593,67 +1621,46 @@ eval(struct func *env, struct progm *prog)
 
 		a = local(env, NEXT_IMM_OFFSET(local_prog));
 		f = NEXT_IMM_FUNC(local_prog);
-		a->type = Function_type;
-		a->f = f;
+		/*
+		 * Functions defined in a lambda reach its captures through
+		 * their parent, which must be the closure that is running.
+		 */
+		if (env->args != NULL && env->captures != NULL)
+			set_parent(f, env);
+		*a = func_value(f);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Sto_imm_local_jmp) {
+		size_t dest;
+		struct value *a;
+
+		dest = NEXT_IMM_OFFSET(local_prog);
+		a = local(env, NEXT_IMM_OFFSET(local_prog));
+		*a = POP();
+		local_prog.ip = dest;
 		RUN_NEXT_INST();
 	}
 
 	DEF_INST(Sto_imm_nonlocal) {
 		size_t walk, offset;
 		struct value *a1, a2;
-		struct func *descendent;
 
 		walk = NEXT_IMM_OFFSET(local_prog) - ignored_walks;
 		offset = NEXT_IMM_OFFSET(local_prog);
 		a1 = nonlocal(env, walk, offset);
 		a2 = POP();
 
-		if (a2.type == Function_type &&
-		    (descendent = find_nearest_descendent(env, a2.f))
-		    != NULL) {
-			struct value *p;
-			struct func *new_func;
-
-			/*
-			 * We need to make the value a closure.
-			 * TODO: figure out what assumptions we can make
-			 * to speed this up.
-			 * TODO: error checking.
-			 */
-			a2.f->flags.closure = 1;
-			new_func = alloc_func(&curr_heap);
-			*new_func = *env;
-			new_func->rt_context =
-				malloc(sizeof(struct context));
-			new_func->rt_context->local_start =
-				malloc(sizeof(struct value) *
-				       new_func->locals->len);
-			new_func->rt_context->local_end =
-				new_func->rt_context->local_start;
-			for (p = env->rt_context->local_start;
-			     p < env->rt_context->local_end;
-			     p++) {
-				/*
-				 * TODO: figure out what to copy and
-				 * what to duplicate.
-				 */
-				*new_func->rt_context->local_end = *p;
-				new_func->rt_context->local_end++;
-			}
-			new_func->flags.closure = 1;
-			if (descendent == a2.f) {
-				/* Copy the descendent */
-				descendent = alloc_func(&curr_heap);
-				*descendent = *a2.f;
-				descendent->rt_context = NULL;
-				a2.f = descendent;
-			}
-
-			descendent->parent = new_func;
-		}
+		if (type_of(a2) == Function_type)
+			a2 = func_value(close_over(env, func_of(a2), arena));
 
-		if (is_heap_allocated(a2))
-			make_nonlocal(&heap_start, a2.v, walk);
+		/*
+		 * A variable of an enclosing function outlives this call. It
+		 * is not known which call of that function it belongs to, so
+		 * the value goes where it can never be released.
+		 */
+		if (is_heap_allocated(a2) && walk_leaves_func(env, walk))
+			a2 = evacuate_global(arena, a2);
 
 		*a1 = a2;
 		RUN_NEXT_INST();
@@ -668,8 +1675,41 @@ eval(struct func *env, struct progm *prog)
 		offset = NEXT_IMM_OFFSET(local_prog);
 		a = nonlocal(env, walk, offset);
 		f = NEXT_IMM_FUNC(local_prog);
-		a->type = Function_type;
-		a->f = f;
+		*a = func_value(f);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Sto_imm_sym) {
+		struct value a = POP();
+
+		/* Values stored from the top level need no closure. */
+		if (type_of(a) == Function_type && env->parent != NULL)
+			a = func_value(close_over(env, func_of(a), arena));
+
+		if (is_heap_allocated(a))
+			a = evacuate_global(arena, a);
+
+		store_global(NEXT_IMM_SYMBOL(local_prog), a);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Sto_imm_sym_func) {
+		size_t sym;
+		struct func *f;
+
+		sym = NEXT_IMM_SYMBOL(local_prog);
+		f = NEXT_IMM_FUNC(local_prog);
+		store_global(sym, func_value(f));
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Sto_imm_sym_si) {
+		size_t sym;
+		int32_t imm;
+
+		sym = NEXT_IMM_SYMBOL(local_prog);
+		imm = NEXT_IMM_SI(local_prog);
+		store_global(sym, int_value(imm));
 		RUN_NEXT_INST();
 	}
 
@@ -678,32 +1718,150 @@ eval(struct func *env, struct progm *prog)
 
 		a2 = POP();
 		a1 = TOP();
-		a1->i -= a2.i;
+		ARITH(*a1, *a1, a2, sub, Arith_sub);
 		RUN_NEXT_INST();
 	}
 
 	DEF_INST(Sub_imm_si) {
-		struct value *a;
+		struct value *a, imm;
 
 		a = TOP();
-		a->i -= NEXT_IMM_SI(local_prog);
+		imm = int_value(NEXT_IMM_SI(local_prog));
+		ARITH(*a, *a, imm, sub, Arith_sub);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Sub_local_imm_si) {
+		struct value a, imm;
+
+		a = *local(env, NEXT_IMM_OFFSET(local_prog));
+		imm = int_value(NEXT_IMM_SI(local_prog));
+		ARITH(a, a, imm, sub, Arith_sub);
+		PUSH(a);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Sub_local_local) {
+		struct value a, b;
+
+		a = *local(env, NEXT_IMM_OFFSET(local_prog));
+		b = *local(env, NEXT_IMM_OFFSET(local_prog));
+		ARITH(a, a, b, sub, Arith_sub);
+		PUSH(a);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Sub_reg) {
+		struct value *d, *a, *b;
+
+		d = local(env, NEXT_IMM_OFFSET(local_prog));
+		a = local(env, NEXT_IMM_OFFSET(local_prog));
+		b = local(env, NEXT_IMM_OFFSET(local_prog));
+		ARITH(*d, *a, *b, sub, Arith_sub);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Sub_reg_imm_si) {
+		struct value *d, *a, imm;
+
+		d = local(env, NEXT_IMM_OFFSET(local_prog));
+		a = local(env, NEXT_IMM_OFFSET(local_prog));
+		imm = int_value(NEXT_IMM_SI(local_prog));
+		ARITH(*d, *a, imm, sub, Arith_sub);
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Unbox) {
+		*TOP() = box_of(*TOP())->car;
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Vector_length) {
+		*TOP() = int_value(vector_length(*TOP()));
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Vector_ref) {
+		struct value i;
+		struct vector *vp;
+		struct slice s;
+
+		i = POP();
+		if (type_of(*TOP()) == Vector_type) {
+			vp = vector_of(*TOP());
+			*TOP() = vector_get(vp, vector_index(i, vp->len));
+		} else {
+			s = vector_items(*TOP());
+			*TOP() = s.start[vector_index(i, s.len)];
+		}
+		RUN_NEXT_INST();
+	}
+
+	DEF_INST(Vector_set) {
+		struct vector *vp;
+		struct value v, i;
+		size_t len;
+
+		MAYBE_COLLECT();
+		v = POP();
+		i = POP();
+		len = vector_length(*TOP());
+
+		/*
+		 * A slice is copied first. A vector that was evacuated shares
+		 * its items with its copy, which is followed like a box.
+		 */
+		if (type_of(*TOP()) == Slice_type) {
+			vp = make_vector(arena, *slice_of(*TOP()));
+		} else {
+			vp = vector_of(*TOP());
+			while (forwarded(vp) != NULL)
+				vp = forwarded(vp);
+		}
+		if (vp->elem == Value_elem && is_heap_allocated(v) &&
+		    !arena_in_nursery(arena, vp))
+			v = evacuate_global(arena, v);
+		vector_put(vp, vector_index(i, len), v);
+		*TOP() = vector_value(vp);
 		RUN_NEXT_INST();
 	}
 
 	DEF_INST(Yield) {
-		if (ignored_walks == 0) {
+		if (ignored_walks > 0) {
+			/* Leave a scope that was never entered. */
+			ignored_walks--;
+			RUN_NEXT_INST();
+		}
+
+		if (framep == base_frame) {
 			*prog = local_prog;
-			return heap_start;
+			prof_stop();
+			return;
 		}
 
 		/*
-		 * Otherwise, we have have ignored walks we need to
-		 * remove.
+		 * Leave the let scope, dropping its variables from under what
+		 * it left on the stack: its value, or the arguments of a tail
+		 * call.
 		 */
-		ignored_walks--;
+		fp = pop_frame();
+		if (stackp > fp->context.local_end) {
+			memmove(fp->context.local_start, fp->context.local_end,
+				sizeof(struct value) *
+				(stackp - fp->context.local_end));
+			stackp -= fp->context.local_end - fp->context.local_start;
+		} else
+			stackp = fp->context.local_start;
+		env = fp->env;
+		ignored_walks = fp->ignored_walks;
 		RUN_NEXT_INST();
 	}
 
+	DEF_INST(Yield_jmp) {
+		local_prog.ip = local_prog.code[local_prog.ip].o;
+		goto INST_Yield;
+	}
+
 	/* NOTREACHED */
-	return heap_start;
+	return;
 }
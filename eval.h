@@ -1,6 +1,10 @@
 #ifndef _EVAL_H_
 #define _EVAL_H_
 
+#include "alloc.h"
+#include "types.h"
+#include "stack.h"
+
 enum insts {
 	Push_value_inst = 0,
 	Push_local_inst,
@@ -8,4 +12,21 @@ enum insts {
 	Call_inst,
 };
 
+void eval(struct func *, struct progm *, struct arena *);
+void eval_reset(void);
+
+/*
+ * Threads other than the first may evaluate calls for parallel_apply() while
+ * the first waits, between eval_thread_begin() and eval_thread_end(). They
+ * call clones of the functions that they call, which eval_thread_end() frees,
+ * and make what they return in base. What they store into globals may reach
+ * what the caller made, which is in the n arenas at shared that
+ * eval_arenas() found from arena, that of the caller, and which must stay as
+ * they are until then. The array is only valid until the thread that found
+ * it evaluates again.
+ */
+struct arena **eval_arenas(struct arena *arena, size_t *n);
+void eval_thread_begin(struct arena *base, struct arena **shared, size_t n);
+void eval_thread_end(void);
+
 #endif
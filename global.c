@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ident.h"
+#include "types.h"
+#include "global.h"
+
+struct value *global_cells = NULL;
+size_t num_global_cells = 0;
+size_t global_version = 1;
+
+/*
+ * Make room for every identifier known so far, as they are likely to be
+ * defined soon, and for sym.
+ */
+static void
+grow(size_t sym)
+{
+	size_t len;
+
+	len = (num_idents > sym) ? num_idents : sym + 1;
+	global_cells = realloc(global_cells, sizeof(struct value) * len);
+	if (global_cells == NULL) {
+		fprintf(stderr, "Out of memory for globals.\n");
+		abort();
+	}
+	memset(global_cells + num_global_cells, 0,
+	       sizeof(struct value) * (len - num_global_cells));
+	num_global_cells = len;
+}
+
+void
+global_reserve(void)
+{
+	if (num_global_cells < num_idents)
+		grow(num_idents - 1);
+}
+
+void
+global_store(size_t sym, struct value v)
+{
+	if (sym >= num_global_cells)
+		grow(sym);
+	global_cells[sym] = v;
+	global_version++;
+}
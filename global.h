@@ -0,0 +1,39 @@
+#ifndef _GLOBAL_H_
+#define _GLOBAL_H_
+
+#include "types.h"
+
+/*
+ * Global variables are kept in a dense array of cells indexed by their
+ * identifier number. A cell holding an Error_type value is unbound.
+ */
+extern struct value *global_cells;
+extern size_t num_global_cells;
+
+/*
+ * Bumped whenever a global is stored to or the cells are moved. Bytecode keeps
+ * inline caches of globals that are only valid while their stamp matches.
+ * The stamp starts at 1 so that a fresh cache never matches.
+ */
+extern size_t global_version;
+
+void global_store(size_t sym, struct value);
+
+/*
+ * Make a cell for every identifier known so far, so that storing into any of
+ * them does not move the cells.
+ */
+void global_reserve(void);
+
+/*
+ * Returns the cell of a bound global, or NULL if it is unbound.
+ */
+static inline struct value *
+global_lookup(size_t sym)
+{
+	if (sym >= num_global_cells || type_of(global_cells[sym]) == Error_type)
+		return NULL;
+	return global_cells + sym;
+}
+
+#endif
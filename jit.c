@@ -0,0 +1,2090 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include "num.h"
+#include "eval.h"
+#include "ident.h"
+#include "global.h"
+#include "bytecode.h"
+
+unsigned int jit_threshold = 100;
+uintptr_t jit_stack_limit;
+
+/*
+ * Native code keeps the evaluator's stackp in rbx and the local_start of the
+ * running function in r12. Native functions are entered with their arguments
+ * on the stack and leave their return value in place of them, like the
+ * interpreter does. rbx is only written back to stackp around calls into C.
+ * Stencils assume that a struct value is 16 bytes with i at offset 8, and that
+ * Integer_type and Real_type are 2 and 3. Arithmetic and comparisons of two
+ * integers are done inline; reals and overflows call into num.c.
+ *
+ * In the listings of the stencils, holes are written as capital letters:
+ *      A - D   32 bit operands.
+ *      R       64 bit operand, the argument of a helper.
+ *      T       address of a helper.
+ *      Q       &jit_stack_limit.
+ *      S       &stackp.
+ *      U       &global_version.
+ *      J       branch destination.
+ */
+enum hole_kind {
+	Hole_imm32 = 1,
+	Hole_imm64,
+	Hole_addr,      /* Address of a variable of the evaluator. */
+	Hole_cc,        /* Condition code of a jcc rel32. */
+	Hole_branch,    /* rel32 to the bytecode at the operand. */
+	Hole_entry,     /* rel32 to the start of the function. */
+};
+
+enum {
+	Op_a,
+	Op_b,
+	Op_c,
+	Op_d,
+	Op_arg,
+	Op_helper,
+	Op_cc,
+	Op_dest,
+
+	Num_ops
+};
+
+enum {
+	Addr_limit,
+	Addr_stackp,
+	Addr_version,
+};
+
+/*
+ * Condition codes, the second byte of a jcc rel32.
+ */
+enum {
+	Cc_e = 0x84,
+	Cc_ne = 0x85,
+	Cc_l = 0x8c,
+	Cc_g = 0x8f,
+};
+
+#define MAX_HOLES 16
+
+struct hole {
+	uint8_t         at;     /* Never 0, which ends the holes. */
+	uint8_t         kind;
+	uint8_t         op;
+};
+
+struct stencil {
+	const uint8_t   *code;
+	size_t          len;
+	struct hole     holes[MAX_HOLES];
+};
+
+/*
+ *	push r12
+ *	lea r12, [rbx + A]
+ *	lea rbx, [r12 + B]
+ */
+static const uint8_t st_entry_code[] = {
+	0x41, 0x54, 0x4c, 0x8d, 0xa3, 0x11, 0x11, 0x11,
+	0x11, 0x49, 0x8d, 0x9c, 0x24, 0x22, 0x22, 0x22,
+	0x22,
+};
+static const struct stencil st_entry = {
+	st_entry_code, sizeof(st_entry_code), {
+		{ 5, Hole_imm32, Op_a },
+		{ 13, Hole_imm32, Op_b },
+	}
+};
+
+/*
+ *	mov dword ptr [rbx], A
+ *	mov qword ptr [rbx + 8], B
+ *	add rbx, 16
+ */
+static const uint8_t st_push_si_code[] = {
+	0xc7, 0x03, 0x11, 0x11, 0x11, 0x11, 0x48, 0xc7,
+	0x43, 0x08, 0x22, 0x22, 0x22, 0x22, 0x48, 0x83,
+	0xc3, 0x10,
+};
+static const struct stencil st_push_si = {
+	st_push_si_code, sizeof(st_push_si_code), {
+		{ 2, Hole_imm32, Op_a },
+		{ 10, Hole_imm32, Op_b },
+	}
+};
+
+/*
+ *	mov dword ptr [rbx], A
+ *	mov rax, R
+ *	mov [rbx + 8], rax
+ *	add rbx, 16
+ */
+static const uint8_t st_push_imm64_code[] = {
+	0xc7, 0x03, 0x11, 0x11, 0x11, 0x11, 0x48, 0xb8,
+	0x52, 0x52, 0x52, 0x52, 0x52, 0x52, 0x52, 0x52,
+	0x48, 0x89, 0x43, 0x08, 0x48, 0x83, 0xc3, 0x10,
+};
+static const struct stencil st_push_imm64 = {
+	st_push_imm64_code, sizeof(st_push_imm64_code), {
+		{ 2, Hole_imm32, Op_a },
+		{ 8, Hole_imm64, Op_arg },
+	}
+};
+
+/*
+ *	movups xmm0, [r12 + A]
+ *	movups [rbx], xmm0
+ *	add rbx, 16
+ */
+static const uint8_t st_load_local_code[] = {
+	0x41, 0x0f, 0x10, 0x84, 0x24, 0x11, 0x11, 0x11,
+	0x11, 0x0f, 0x11, 0x03, 0x48, 0x83, 0xc3, 0x10,
+};
+static const struct stencil st_load_local = {
+	st_load_local_code, sizeof(st_load_local_code), {
+		{ 5, Hole_imm32, Op_a },
+	}
+};
+
+/*
+ *	sub rbx, 16
+ *	movups xmm0, [rbx]
+ *	movups [r12 + A], xmm0
+ */
+static const uint8_t st_sto_local_code[] = {
+	0x48, 0x83, 0xeb, 0x10, 0x0f, 0x10, 0x03, 0x41,
+	0x0f, 0x11, 0x84, 0x24, 0x11, 0x11, 0x11, 0x11,
+};
+static const struct stencil st_sto_local = {
+	st_sto_local_code, sizeof(st_sto_local_code), {
+		{ 12, Hole_imm32, Op_a },
+	}
+};
+
+/*
+ *	mov dword ptr [r12 + A], C
+ *	mov qword ptr [r12 + B], D
+ */
+static const uint8_t st_sto_local_si_code[] = {
+	0x41, 0xc7, 0x84, 0x24, 0x11, 0x11, 0x11, 0x11,
+	0x33, 0x33, 0x33, 0x33, 0x49, 0xc7, 0x84, 0x24,
+	0x22, 0x22, 0x22, 0x22, 0x44, 0x44, 0x44, 0x44,
+};
+static const struct stencil st_sto_local_si = {
+	st_sto_local_si_code, sizeof(st_sto_local_si_code), {
+		{ 4, Hole_imm32, Op_a },
+		{ 8, Hole_imm32, Op_c },
+		{ 16, Hole_imm32, Op_b },
+		{ 20, Hole_imm32, Op_d },
+	}
+};
+
+/*
+ *	cmp dword ptr [rbx - 32], 2
+ *	jne 1f
+ *	cmp dword ptr [rbx - 16], 2
+ *	jne 1f
+ *	mov rax, [rbx - 24]
+ *	add rax, [rbx - 8]
+ *	jo 1f
+ *	mov [rbx - 24], rax
+ *	sub rbx, 16
+ *	jmp 2f
+ * 1:
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov edi, A
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_add2_code[] = {
+	0x83, 0x7b, 0xe0, 0x02, 0x75, 0x1a, 0x83, 0x7b,
+	0xf0, 0x02, 0x75, 0x14, 0x48, 0x8b, 0x43, 0xe8,
+	0x48, 0x03, 0x43, 0xf8, 0x70, 0x0a, 0x48, 0x89,
+	0x43, 0xe8, 0x48, 0x83, 0xeb, 0x10, 0xeb, 0x37,
+	0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x48, 0x89, 0x1a, 0xbf, 0x11, 0x11,
+	0x11, 0x11, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83,
+	0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0xff, 0xd0, 0x48, 0x89,
+	0xec, 0x5d, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a,
+};
+static const struct stencil st_add2 = {
+	st_add2_code, sizeof(st_add2_code), {
+		{ 34, Hole_addr, Addr_stackp },
+		{ 46, Hole_imm32, Op_a },
+		{ 60, Hole_imm64, Op_helper },
+		{ 76, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	cmp dword ptr [rbx - 16], 2
+ *	jne 1f
+ *	mov rax, [rbx - 8]
+ *	add rax, A
+ *	jo 1f
+ *	mov [rbx - 8], rax
+ *	jmp 2f
+ * 1:
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov edi, B
+ *	mov rsi, A
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_add_si_code[] = {
+	0x83, 0x7b, 0xf0, 0x02, 0x75, 0x12, 0x48, 0x8b,
+	0x43, 0xf8, 0x48, 0x05, 0x11, 0x11, 0x11, 0x11,
+	0x70, 0x06, 0x48, 0x89, 0x43, 0xf8, 0xeb, 0x3e,
+	0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x48, 0x89, 0x1a, 0xbf, 0x22, 0x22,
+	0x22, 0x22, 0x48, 0xc7, 0xc6, 0x11, 0x11, 0x11,
+	0x11, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83, 0xe4,
+	0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0xff, 0xd0, 0x48, 0x89, 0xec,
+	0x5d, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a,
+};
+static const struct stencil st_add_si = {
+	st_add_si_code, sizeof(st_add_si_code), {
+		{ 12, Hole_imm32, Op_a },
+		{ 26, Hole_addr, Addr_stackp },
+		{ 38, Hole_imm32, Op_b },
+		{ 45, Hole_imm32, Op_a },
+		{ 59, Hole_imm64, Op_helper },
+		{ 75, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	cmp dword ptr [r12 + A], 2
+ *	jne 1f
+ *	mov rax, [r12 + B]
+ *	add rax, C
+ *	jo 1f
+ *	mov dword ptr [rbx], 2
+ *	mov [rbx + 8], rax
+ *	add rbx, 16
+ *	jmp 2f
+ * 1:	movups xmm0, [r12 + A]
+ *	movups [rbx], xmm0
+ *	add rbx, 16
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov edi, D
+ *	mov rsi, C
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_add_local_si_code[] = {
+	0x41, 0x83, 0xbc, 0x24, 0x11, 0x11, 0x11, 0x11,
+	0x02, 0x75, 0x20, 0x49, 0x8b, 0x84, 0x24, 0x22,
+	0x22, 0x22, 0x22, 0x48, 0x05, 0x33, 0x33, 0x33,
+	0x33, 0x70, 0x10, 0xc7, 0x03, 0x02, 0x00, 0x00,
+	0x00, 0x48, 0x89, 0x43, 0x08, 0x48, 0x83, 0xc3,
+	0x10, 0xeb, 0x4e, 0x41, 0x0f, 0x10, 0x84, 0x24,
+	0x11, 0x11, 0x11, 0x11, 0x0f, 0x11, 0x03, 0x48,
+	0x83, 0xc3, 0x10, 0x48, 0xba, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x89, 0x1a,
+	0xbf, 0x44, 0x44, 0x44, 0x44, 0x48, 0xc7, 0xc6,
+	0x33, 0x33, 0x33, 0x33, 0x55, 0x48, 0x89, 0xe5,
+	0x48, 0x83, 0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0xff, 0xd0,
+	0x48, 0x89, 0xec, 0x5d, 0x48, 0xba, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x8b,
+	0x1a,
+};
+static const struct stencil st_add_local_si = {
+	st_add_local_si_code, sizeof(st_add_local_si_code), {
+		{ 4, Hole_imm32, Op_a },
+		{ 15, Hole_imm32, Op_b },
+		{ 21, Hole_imm32, Op_c },
+		{ 48, Hole_imm32, Op_a },
+		{ 61, Hole_addr, Addr_stackp },
+		{ 73, Hole_imm32, Op_d },
+		{ 80, Hole_imm32, Op_c },
+		{ 94, Hole_imm64, Op_helper },
+		{ 110, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	cmp dword ptr [r12 + A], 2
+ *	jne 1f
+ *	cmp dword ptr [r12 + B], 2
+ *	jne 1f
+ *	mov rax, [r12 + C]
+ *	add rax, [r12 + D]
+ *	jo 1f
+ *	mov dword ptr [rbx], 2
+ *	mov [rbx + 8], rax
+ *	add rbx, 16
+ *	jmp 2f
+ * 1:	movups xmm0, [r12 + A]
+ *	movups [rbx], xmm0
+ *	movups xmm0, [r12 + B]
+ *	movups [rbx + 16], xmm0
+ *	add rbx, 32
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov rdi, R
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_add_local_local_code[] = {
+	0x41, 0x83, 0xbc, 0x24, 0x11, 0x11, 0x11, 0x11,
+	0x02, 0x75, 0x2d, 0x41, 0x83, 0xbc, 0x24, 0x22,
+	0x22, 0x22, 0x22, 0x02, 0x75, 0x22, 0x49, 0x8b,
+	0x84, 0x24, 0x33, 0x33, 0x33, 0x33, 0x49, 0x03,
+	0x84, 0x24, 0x44, 0x44, 0x44, 0x44, 0x70, 0x10,
+	0xc7, 0x03, 0x02, 0x00, 0x00, 0x00, 0x48, 0x89,
+	0x43, 0x08, 0x48, 0x83, 0xc3, 0x10, 0xeb, 0x59,
+	0x41, 0x0f, 0x10, 0x84, 0x24, 0x11, 0x11, 0x11,
+	0x11, 0x0f, 0x11, 0x03, 0x41, 0x0f, 0x10, 0x84,
+	0x24, 0x22, 0x22, 0x22, 0x22, 0x0f, 0x11, 0x43,
+	0x10, 0x48, 0x83, 0xc3, 0x20, 0x48, 0xba, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48,
+	0x89, 0x1a, 0x48, 0xbf, 0x52, 0x52, 0x52, 0x52,
+	0x52, 0x52, 0x52, 0x52, 0x55, 0x48, 0x89, 0xe5,
+	0x48, 0x83, 0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0xff, 0xd0,
+	0x48, 0x89, 0xec, 0x5d, 0x48, 0xba, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x8b,
+	0x1a,
+};
+static const struct stencil st_add_local_local = {
+	st_add_local_local_code, sizeof(st_add_local_local_code), {
+		{ 4, Hole_imm32, Op_a },
+		{ 15, Hole_imm32, Op_b },
+		{ 26, Hole_imm32, Op_c },
+		{ 34, Hole_imm32, Op_d },
+		{ 61, Hole_imm32, Op_a },
+		{ 73, Hole_imm32, Op_b },
+		{ 87, Hole_addr, Addr_stackp },
+		{ 100, Hole_imm64, Op_arg },
+		{ 118, Hole_imm64, Op_helper },
+		{ 134, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	cmp dword ptr [rbx - 32], 2
+ *	jne 1f
+ *	cmp dword ptr [rbx - 16], 2
+ *	jne 1f
+ *	mov rax, [rbx - 24]
+ *	sub rax, [rbx - 8]
+ *	jo 1f
+ *	mov [rbx - 24], rax
+ *	sub rbx, 16
+ *	jmp 2f
+ * 1:
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov edi, A
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_sub2_code[] = {
+	0x83, 0x7b, 0xe0, 0x02, 0x75, 0x1a, 0x83, 0x7b,
+	0xf0, 0x02, 0x75, 0x14, 0x48, 0x8b, 0x43, 0xe8,
+	0x48, 0x2b, 0x43, 0xf8, 0x70, 0x0a, 0x48, 0x89,
+	0x43, 0xe8, 0x48, 0x83, 0xeb, 0x10, 0xeb, 0x37,
+	0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x48, 0x89, 0x1a, 0xbf, 0x11, 0x11,
+	0x11, 0x11, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83,
+	0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0xff, 0xd0, 0x48, 0x89,
+	0xec, 0x5d, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a,
+};
+static const struct stencil st_sub2 = {
+	st_sub2_code, sizeof(st_sub2_code), {
+		{ 34, Hole_addr, Addr_stackp },
+		{ 46, Hole_imm32, Op_a },
+		{ 60, Hole_imm64, Op_helper },
+		{ 76, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	cmp dword ptr [rbx - 16], 2
+ *	jne 1f
+ *	mov rax, [rbx - 8]
+ *	sub rax, A
+ *	jo 1f
+ *	mov [rbx - 8], rax
+ *	jmp 2f
+ * 1:
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov edi, B
+ *	mov rsi, A
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_sub_si_code[] = {
+	0x83, 0x7b, 0xf0, 0x02, 0x75, 0x12, 0x48, 0x8b,
+	0x43, 0xf8, 0x48, 0x2d, 0x11, 0x11, 0x11, 0x11,
+	0x70, 0x06, 0x48, 0x89, 0x43, 0xf8, 0xeb, 0x3e,
+	0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x48, 0x89, 0x1a, 0xbf, 0x22, 0x22,
+	0x22, 0x22, 0x48, 0xc7, 0xc6, 0x11, 0x11, 0x11,
+	0x11, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83, 0xe4,
+	0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0xff, 0xd0, 0x48, 0x89, 0xec,
+	0x5d, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a,
+};
+static const struct stencil st_sub_si = {
+	st_sub_si_code, sizeof(st_sub_si_code), {
+		{ 12, Hole_imm32, Op_a },
+		{ 26, Hole_addr, Addr_stackp },
+		{ 38, Hole_imm32, Op_b },
+		{ 45, Hole_imm32, Op_a },
+		{ 59, Hole_imm64, Op_helper },
+		{ 75, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	cmp dword ptr [r12 + A], 2
+ *	jne 1f
+ *	mov rax, [r12 + B]
+ *	sub rax, C
+ *	jo 1f
+ *	mov dword ptr [rbx], 2
+ *	mov [rbx + 8], rax
+ *	add rbx, 16
+ *	jmp 2f
+ * 1:	movups xmm0, [r12 + A]
+ *	movups [rbx], xmm0
+ *	add rbx, 16
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov edi, D
+ *	mov rsi, C
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_sub_local_si_code[] = {
+	0x41, 0x83, 0xbc, 0x24, 0x11, 0x11, 0x11, 0x11,
+	0x02, 0x75, 0x20, 0x49, 0x8b, 0x84, 0x24, 0x22,
+	0x22, 0x22, 0x22, 0x48, 0x2d, 0x33, 0x33, 0x33,
+	0x33, 0x70, 0x10, 0xc7, 0x03, 0x02, 0x00, 0x00,
+	0x00, 0x48, 0x89, 0x43, 0x08, 0x48, 0x83, 0xc3,
+	0x10, 0xeb, 0x4e, 0x41, 0x0f, 0x10, 0x84, 0x24,
+	0x11, 0x11, 0x11, 0x11, 0x0f, 0x11, 0x03, 0x48,
+	0x83, 0xc3, 0x10, 0x48, 0xba, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x89, 0x1a,
+	0xbf, 0x44, 0x44, 0x44, 0x44, 0x48, 0xc7, 0xc6,
+	0x33, 0x33, 0x33, 0x33, 0x55, 0x48, 0x89, 0xe5,
+	0x48, 0x83, 0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0xff, 0xd0,
+	0x48, 0x89, 0xec, 0x5d, 0x48, 0xba, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x8b,
+	0x1a,
+};
+static const struct stencil st_sub_local_si = {
+	st_sub_local_si_code, sizeof(st_sub_local_si_code), {
+		{ 4, Hole_imm32, Op_a },
+		{ 15, Hole_imm32, Op_b },
+		{ 21, Hole_imm32, Op_c },
+		{ 48, Hole_imm32, Op_a },
+		{ 61, Hole_addr, Addr_stackp },
+		{ 73, Hole_imm32, Op_d },
+		{ 80, Hole_imm32, Op_c },
+		{ 94, Hole_imm64, Op_helper },
+		{ 110, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	cmp dword ptr [r12 + A], 2
+ *	jne 1f
+ *	cmp dword ptr [r12 + B], 2
+ *	jne 1f
+ *	mov rax, [r12 + C]
+ *	sub rax, [r12 + D]
+ *	jo 1f
+ *	mov dword ptr [rbx], 2
+ *	mov [rbx + 8], rax
+ *	add rbx, 16
+ *	jmp 2f
+ * 1:	movups xmm0, [r12 + A]
+ *	movups [rbx], xmm0
+ *	movups xmm0, [r12 + B]
+ *	movups [rbx + 16], xmm0
+ *	add rbx, 32
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov rdi, R
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_sub_local_local_code[] = {
+	0x41, 0x83, 0xbc, 0x24, 0x11, 0x11, 0x11, 0x11,
+	0x02, 0x75, 0x2d, 0x41, 0x83, 0xbc, 0x24, 0x22,
+	0x22, 0x22, 0x22, 0x02, 0x75, 0x22, 0x49, 0x8b,
+	0x84, 0x24, 0x33, 0x33, 0x33, 0x33, 0x49, 0x2b,
+	0x84, 0x24, 0x44, 0x44, 0x44, 0x44, 0x70, 0x10,
+	0xc7, 0x03, 0x02, 0x00, 0x00, 0x00, 0x48, 0x89,
+	0x43, 0x08, 0x48, 0x83, 0xc3, 0x10, 0xeb, 0x59,
+	0x41, 0x0f, 0x10, 0x84, 0x24, 0x11, 0x11, 0x11,
+	0x11, 0x0f, 0x11, 0x03, 0x41, 0x0f, 0x10, 0x84,
+	0x24, 0x22, 0x22, 0x22, 0x22, 0x0f, 0x11, 0x43,
+	0x10, 0x48, 0x83, 0xc3, 0x20, 0x48, 0xba, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48,
+	0x89, 0x1a, 0x48, 0xbf, 0x52, 0x52, 0x52, 0x52,
+	0x52, 0x52, 0x52, 0x52, 0x55, 0x48, 0x89, 0xe5,
+	0x48, 0x83, 0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0xff, 0xd0,
+	0x48, 0x89, 0xec, 0x5d, 0x48, 0xba, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x8b,
+	0x1a,
+};
+static const struct stencil st_sub_local_local = {
+	st_sub_local_local_code, sizeof(st_sub_local_local_code), {
+		{ 4, Hole_imm32, Op_a },
+		{ 15, Hole_imm32, Op_b },
+		{ 26, Hole_imm32, Op_c },
+		{ 34, Hole_imm32, Op_d },
+		{ 61, Hole_imm32, Op_a },
+		{ 73, Hole_imm32, Op_b },
+		{ 87, Hole_addr, Addr_stackp },
+		{ 100, Hole_imm64, Op_arg },
+		{ 118, Hole_imm64, Op_helper },
+		{ 134, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	cmp dword ptr [rbx - 32], 2
+ *	jne 1f
+ *	cmp dword ptr [rbx - 16], 2
+ *	jne 1f
+ *	mov rax, [rbx - 24]
+ *	imul rax, [rbx - 8]
+ *	jo 1f
+ *	mov [rbx - 24], rax
+ *	sub rbx, 16
+ *	jmp 2f
+ * 1:
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov edi, A
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_mul2_code[] = {
+	0x83, 0x7b, 0xe0, 0x02, 0x75, 0x1b, 0x83, 0x7b,
+	0xf0, 0x02, 0x75, 0x15, 0x48, 0x8b, 0x43, 0xe8,
+	0x48, 0x0f, 0xaf, 0x43, 0xf8, 0x70, 0x0a, 0x48,
+	0x89, 0x43, 0xe8, 0x48, 0x83, 0xeb, 0x10, 0xeb,
+	0x37, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x48, 0x89, 0x1a, 0xbf, 0x11,
+	0x11, 0x11, 0x11, 0x55, 0x48, 0x89, 0xe5, 0x48,
+	0x83, 0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0xff, 0xd0, 0x48,
+	0x89, 0xec, 0x5d, 0x48, 0xba, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a,
+};
+static const struct stencil st_mul2 = {
+	st_mul2_code, sizeof(st_mul2_code), {
+		{ 35, Hole_addr, Addr_stackp },
+		{ 47, Hole_imm32, Op_a },
+		{ 61, Hole_imm64, Op_helper },
+		{ 77, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	cmp dword ptr [rbx - 16], 2
+ *	jne 1f
+ *	mov rax, [rbx - 8]
+ *	imul rax, rax, A
+ *	jo 1f
+ *	mov [rbx - 8], rax
+ *	jmp 2f
+ * 1:
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov edi, B
+ *	mov rsi, A
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_mul_si_code[] = {
+	0x83, 0x7b, 0xf0, 0x02, 0x75, 0x13, 0x48, 0x8b,
+	0x43, 0xf8, 0x48, 0x69, 0xc0, 0x11, 0x11, 0x11,
+	0x11, 0x70, 0x06, 0x48, 0x89, 0x43, 0xf8, 0xeb,
+	0x3e, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x48, 0x89, 0x1a, 0xbf, 0x22,
+	0x22, 0x22, 0x22, 0x48, 0xc7, 0xc6, 0x11, 0x11,
+	0x11, 0x11, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83,
+	0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0xff, 0xd0, 0x48, 0x89,
+	0xec, 0x5d, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a,
+};
+static const struct stencil st_mul_si = {
+	st_mul_si_code, sizeof(st_mul_si_code), {
+		{ 13, Hole_imm32, Op_a },
+		{ 27, Hole_addr, Addr_stackp },
+		{ 39, Hole_imm32, Op_b },
+		{ 46, Hole_imm32, Op_a },
+		{ 60, Hole_imm64, Op_helper },
+		{ 76, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	cmp dword ptr [r12 + A], 2
+ *	jne 1f
+ *	mov rax, [r12 + B]
+ *	imul rax, rax, C
+ *	jo 1f
+ *	mov dword ptr [rbx], 2
+ *	mov [rbx + 8], rax
+ *	add rbx, 16
+ *	jmp 2f
+ * 1:	movups xmm0, [r12 + A]
+ *	movups [rbx], xmm0
+ *	add rbx, 16
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov edi, D
+ *	mov rsi, C
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_mul_local_si_code[] = {
+	0x41, 0x83, 0xbc, 0x24, 0x11, 0x11, 0x11, 0x11,
+	0x02, 0x75, 0x21, 0x49, 0x8b, 0x84, 0x24, 0x22,
+	0x22, 0x22, 0x22, 0x48, 0x69, 0xc0, 0x33, 0x33,
+	0x33, 0x33, 0x70, 0x10, 0xc7, 0x03, 0x02, 0x00,
+	0x00, 0x00, 0x48, 0x89, 0x43, 0x08, 0x48, 0x83,
+	0xc3, 0x10, 0xeb, 0x4e, 0x41, 0x0f, 0x10, 0x84,
+	0x24, 0x11, 0x11, 0x11, 0x11, 0x0f, 0x11, 0x03,
+	0x48, 0x83, 0xc3, 0x10, 0x48, 0xba, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x89,
+	0x1a, 0xbf, 0x44, 0x44, 0x44, 0x44, 0x48, 0xc7,
+	0xc6, 0x33, 0x33, 0x33, 0x33, 0x55, 0x48, 0x89,
+	0xe5, 0x48, 0x83, 0xe4, 0xf0, 0x48, 0xb8, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0xff,
+	0xd0, 0x48, 0x89, 0xec, 0x5d, 0x48, 0xba, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48,
+	0x8b, 0x1a,
+};
+static const struct stencil st_mul_local_si = {
+	st_mul_local_si_code, sizeof(st_mul_local_si_code), {
+		{ 4, Hole_imm32, Op_a },
+		{ 15, Hole_imm32, Op_b },
+		{ 22, Hole_imm32, Op_c },
+		{ 49, Hole_imm32, Op_a },
+		{ 62, Hole_addr, Addr_stackp },
+		{ 74, Hole_imm32, Op_d },
+		{ 81, Hole_imm32, Op_c },
+		{ 95, Hole_imm64, Op_helper },
+		{ 111, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	cmp dword ptr [r12 + A], 2
+ *	jne 1f
+ *	cmp dword ptr [r12 + B], 2
+ *	jne 1f
+ *	mov rax, [r12 + C]
+ *	imul rax, [r12 + D]
+ *	jo 1f
+ *	mov dword ptr [rbx], 2
+ *	mov [rbx + 8], rax
+ *	add rbx, 16
+ *	jmp 2f
+ * 1:	movups xmm0, [r12 + A]
+ *	movups [rbx], xmm0
+ *	movups xmm0, [r12 + B]
+ *	movups [rbx + 16], xmm0
+ *	add rbx, 32
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov rdi, R
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_mul_local_local_code[] = {
+	0x41, 0x83, 0xbc, 0x24, 0x11, 0x11, 0x11, 0x11,
+	0x02, 0x75, 0x2e, 0x41, 0x83, 0xbc, 0x24, 0x22,
+	0x22, 0x22, 0x22, 0x02, 0x75, 0x23, 0x49, 0x8b,
+	0x84, 0x24, 0x33, 0x33, 0x33, 0x33, 0x49, 0x0f,
+	0xaf, 0x84, 0x24, 0x44, 0x44, 0x44, 0x44, 0x70,
+	0x10, 0xc7, 0x03, 0x02, 0x00, 0x00, 0x00, 0x48,
+	0x89, 0x43, 0x08, 0x48, 0x83, 0xc3, 0x10, 0xeb,
+	0x59, 0x41, 0x0f, 0x10, 0x84, 0x24, 0x11, 0x11,
+	0x11, 0x11, 0x0f, 0x11, 0x03, 0x41, 0x0f, 0x10,
+	0x84, 0x24, 0x22, 0x22, 0x22, 0x22, 0x0f, 0x11,
+	0x43, 0x10, 0x48, 0x83, 0xc3, 0x20, 0x48, 0xba,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x48, 0x89, 0x1a, 0x48, 0xbf, 0x52, 0x52, 0x52,
+	0x52, 0x52, 0x52, 0x52, 0x52, 0x55, 0x48, 0x89,
+	0xe5, 0x48, 0x83, 0xe4, 0xf0, 0x48, 0xb8, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0xff,
+	0xd0, 0x48, 0x89, 0xec, 0x5d, 0x48, 0xba, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48,
+	0x8b, 0x1a,
+};
+static const struct stencil st_mul_local_local = {
+	st_mul_local_local_code, sizeof(st_mul_local_local_code), {
+		{ 4, Hole_imm32, Op_a },
+		{ 15, Hole_imm32, Op_b },
+		{ 26, Hole_imm32, Op_c },
+		{ 35, Hole_imm32, Op_d },
+		{ 62, Hole_imm32, Op_a },
+		{ 74, Hole_imm32, Op_b },
+		{ 88, Hole_addr, Addr_stackp },
+		{ 101, Hole_imm64, Op_arg },
+		{ 119, Hole_imm64, Op_helper },
+		{ 135, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov edi, A
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ */
+static const uint8_t st_div2_code[] = {
+	0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x48, 0x89, 0x1a, 0xbf, 0x11, 0x11,
+	0x11, 0x11, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83,
+	0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0xff, 0xd0, 0x48, 0x89,
+	0xec, 0x5d, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a,
+};
+static const struct stencil st_div2 = {
+	st_div2_code, sizeof(st_div2_code), {
+		{ 2, Hole_addr, Addr_stackp },
+		{ 14, Hole_imm32, Op_a },
+		{ 28, Hole_imm64, Op_helper },
+		{ 44, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov edi, B
+ *	mov rsi, A
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ */
+static const uint8_t st_div_si_code[] = {
+	0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x48, 0x89, 0x1a, 0xbf, 0x22, 0x22,
+	0x22, 0x22, 0x48, 0xc7, 0xc6, 0x11, 0x11, 0x11,
+	0x11, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83, 0xe4,
+	0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0xff, 0xd0, 0x48, 0x89, 0xec,
+	0x5d, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a,
+};
+static const struct stencil st_div_si = {
+	st_div_si_code, sizeof(st_div_si_code), {
+		{ 2, Hole_addr, Addr_stackp },
+		{ 14, Hole_imm32, Op_b },
+		{ 21, Hole_imm32, Op_a },
+		{ 35, Hole_imm64, Op_helper },
+		{ 51, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	jmp  J
+ */
+static const uint8_t st_jmp_code[] = {
+	0xe9, 0x7a, 0x7a, 0x7a, 0x7a,
+};
+static const struct stencil st_jmp = {
+	st_jmp_code, sizeof(st_jmp_code), {
+		{ 1, Hole_branch, Op_dest },
+	}
+};
+
+/*
+ *	sub rbx, 16
+ *	cmp dword ptr [rbx], 3
+ *	je 1f
+ *	cmp qword ptr [rbx + 8], 0
+ *	je   J
+ *	jmp 2f
+ * 1:	movsd xmm0, qword ptr [rbx + 8]
+ *	xorpd xmm1, xmm1
+ *	ucomisd xmm0, xmm1
+ *	jp 2f
+ *	je   J
+ * 2:
+ */
+static const uint8_t st_jmp_false_code[] = {
+	0x48, 0x83, 0xeb, 0x10, 0x83, 0x3b, 0x03, 0x74,
+	0x0d, 0x48, 0x83, 0x7b, 0x08, 0x00, 0x0f, 0x84,
+	0x7c, 0x7c, 0x7c, 0x7c, 0xeb, 0x15, 0xf2, 0x0f,
+	0x10, 0x43, 0x08, 0x66, 0x0f, 0x57, 0xc9, 0x66,
+	0x0f, 0x2e, 0xc1, 0x7a, 0x06, 0x0f, 0x84, 0x7c,
+	0x7c, 0x7c, 0x7c,
+};
+static const struct stencil st_jmp_false = {
+	st_jmp_false_code, sizeof(st_jmp_false_code), {
+		{ 16, Hole_branch, Op_dest },
+		{ 39, Hole_branch, Op_dest },
+	}
+};
+
+/*
+ *	sub rbx, 16
+ *	cmp dword ptr [rbx], 3
+ *	je 1f
+ *	cmp qword ptr [rbx + 8], 0
+ *	jne  J
+ *	jmp 2f
+ * 1:	movsd xmm0, qword ptr [rbx + 8]
+ *	xorpd xmm1, xmm1
+ *	ucomisd xmm0, xmm1
+ *	jp   J
+ *	jne  J
+ * 2:
+ */
+static const uint8_t st_jmp_true_code[] = {
+	0x48, 0x83, 0xeb, 0x10, 0x83, 0x3b, 0x03, 0x74,
+	0x0d, 0x48, 0x83, 0x7b, 0x08, 0x00, 0x0f, 0x85,
+	0x7c, 0x7c, 0x7c, 0x7c, 0xeb, 0x19, 0xf2, 0x0f,
+	0x10, 0x43, 0x08, 0x66, 0x0f, 0x57, 0xc9, 0x66,
+	0x0f, 0x2e, 0xc1, 0x0f, 0x8a, 0x7c, 0x7c, 0x7c,
+	0x7c, 0x0f, 0x85, 0x7c, 0x7c, 0x7c, 0x7c,
+};
+static const struct stencil st_jmp_true = {
+	st_jmp_true_code, sizeof(st_jmp_true_code), {
+		{ 16, Hole_branch, Op_dest },
+		{ 37, Hole_branch, Op_dest },
+		{ 43, Hole_branch, Op_dest },
+	}
+};
+
+/*
+ *	sub rbx, 32
+ *	cmp dword ptr [rbx], 2
+ *	jne 1f
+ *	cmp dword ptr [rbx + 16], 2
+ *	jne 1f
+ *	mov rax, [rbx + 8]
+ *	cmp rax, [rbx + 24]
+ *	jcc  J
+ *	jmp 2f
+ * 1:	add rbx, 32
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov rdi, R
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ *	test eax, eax
+ *	jne  J
+ * 2:
+ */
+static const uint8_t st_jcc_code[] = {
+	0x48, 0x83, 0xeb, 0x20, 0x83, 0x3b, 0x02, 0x75,
+	0x16, 0x83, 0x7b, 0x10, 0x02, 0x75, 0x10, 0x48,
+	0x8b, 0x43, 0x08, 0x48, 0x3b, 0x43, 0x18, 0x0f,
+	0x80, 0x7a, 0x7a, 0x7a, 0x7a, 0xeb, 0x48, 0x48,
+	0x83, 0xc3, 0x20, 0x48, 0xba, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x89, 0x1a,
+	0x48, 0xbf, 0x52, 0x52, 0x52, 0x52, 0x52, 0x52,
+	0x52, 0x52, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83,
+	0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0xff, 0xd0, 0x48, 0x89,
+	0xec, 0x5d, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a, 0x85,
+	0xc0, 0x0f, 0x85, 0x7c, 0x7c, 0x7c, 0x7c,
+};
+static const struct stencil st_jcc = {
+	st_jcc_code, sizeof(st_jcc_code), {
+		{ 24, Hole_cc, Op_cc },
+		{ 25, Hole_branch, Op_dest },
+		{ 37, Hole_addr, Addr_stackp },
+		{ 50, Hole_imm64, Op_arg },
+		{ 68, Hole_imm64, Op_helper },
+		{ 84, Hole_addr, Addr_stackp },
+		{ 99, Hole_branch, Op_dest },
+	}
+};
+
+/*
+ *	sub rbx, 16
+ *	cmp dword ptr [rbx], 2
+ *	jne 1f
+ *	cmp qword ptr [rbx + 8], A
+ *	jcc  J
+ *	jmp 2f
+ * 1:	add rbx, 16
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov rdi, R
+ *	mov rsi, A
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ *	test eax, eax
+ *	jne  J
+ * 2:
+ */
+static const uint8_t st_jcc_imm_code[] = {
+	0x48, 0x83, 0xeb, 0x10, 0x83, 0x3b, 0x02, 0x75,
+	0x10, 0x48, 0x81, 0x7b, 0x08, 0x11, 0x11, 0x11,
+	0x11, 0x0f, 0x80, 0x7a, 0x7a, 0x7a, 0x7a, 0xeb,
+	0x4f, 0x48, 0x83, 0xc3, 0x10, 0x48, 0xba, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48,
+	0x89, 0x1a, 0x48, 0xbf, 0x52, 0x52, 0x52, 0x52,
+	0x52, 0x52, 0x52, 0x52, 0x48, 0xc7, 0xc6, 0x11,
+	0x11, 0x11, 0x11, 0x55, 0x48, 0x89, 0xe5, 0x48,
+	0x83, 0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0xff, 0xd0, 0x48,
+	0x89, 0xec, 0x5d, 0x48, 0xba, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a,
+	0x85, 0xc0, 0x0f, 0x85, 0x7c, 0x7c, 0x7c, 0x7c,
+};
+static const struct stencil st_jcc_imm = {
+	st_jcc_imm_code, sizeof(st_jcc_imm_code), {
+		{ 13, Hole_imm32, Op_a },
+		{ 18, Hole_cc, Op_cc },
+		{ 19, Hole_branch, Op_dest },
+		{ 31, Hole_addr, Addr_stackp },
+		{ 44, Hole_imm64, Op_arg },
+		{ 55, Hole_imm32, Op_a },
+		{ 69, Hole_imm64, Op_helper },
+		{ 85, Hole_addr, Addr_stackp },
+		{ 100, Hole_branch, Op_dest },
+	}
+};
+
+/*
+ *	cmp dword ptr [r12 + A], 2
+ *	jne 1f
+ *	cmp qword ptr [r12 + B], C
+ *	jcc  J
+ *	jmp 2f
+ * 1:	movups xmm0, [r12 + A]
+ *	movups [rbx], xmm0
+ *	add rbx, 16
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov rdi, R
+ *	mov rsi, C
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ *	test eax, eax
+ *	jne  J
+ * 2:
+ */
+static const uint8_t st_jcc_local_imm_code[] = {
+	0x41, 0x83, 0xbc, 0x24, 0x11, 0x11, 0x11, 0x11,
+	0x02, 0x75, 0x14, 0x49, 0x81, 0xbc, 0x24, 0x22,
+	0x22, 0x22, 0x22, 0x33, 0x33, 0x33, 0x33, 0x0f,
+	0x80, 0x7a, 0x7a, 0x7a, 0x7a, 0xeb, 0x5b, 0x41,
+	0x0f, 0x10, 0x84, 0x24, 0x11, 0x11, 0x11, 0x11,
+	0x0f, 0x11, 0x03, 0x48, 0x83, 0xc3, 0x10, 0x48,
+	0xba, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x48, 0x89, 0x1a, 0x48, 0xbf, 0x52, 0x52,
+	0x52, 0x52, 0x52, 0x52, 0x52, 0x52, 0x48, 0xc7,
+	0xc6, 0x33, 0x33, 0x33, 0x33, 0x55, 0x48, 0x89,
+	0xe5, 0x48, 0x83, 0xe4, 0xf0, 0x48, 0xb8, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54, 0xff,
+	0xd0, 0x48, 0x89, 0xec, 0x5d, 0x48, 0xba, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48,
+	0x8b, 0x1a, 0x85, 0xc0, 0x0f, 0x85, 0x7c, 0x7c,
+	0x7c, 0x7c,
+};
+static const struct stencil st_jcc_local_imm = {
+	st_jcc_local_imm_code, sizeof(st_jcc_local_imm_code), {
+		{ 4, Hole_imm32, Op_a },
+		{ 15, Hole_imm32, Op_b },
+		{ 19, Hole_imm32, Op_c },
+		{ 24, Hole_cc, Op_cc },
+		{ 25, Hole_branch, Op_dest },
+		{ 36, Hole_imm32, Op_a },
+		{ 49, Hole_addr, Addr_stackp },
+		{ 62, Hole_imm64, Op_arg },
+		{ 73, Hole_imm32, Op_c },
+		{ 87, Hole_imm64, Op_helper },
+		{ 103, Hole_addr, Addr_stackp },
+		{ 118, Hole_branch, Op_dest },
+	}
+};
+
+/*
+ *	cmp dword ptr [r12 + A], 2
+ *	jne 1f
+ *	cmp dword ptr [r12 + B], 2
+ *	jne 1f
+ *	mov rax, [r12 + C]
+ *	cmp rax, [r12 + D]
+ *	jcc  J
+ *	jmp 2f
+ * 1:	movups xmm0, [r12 + A]
+ *	movups [rbx], xmm0
+ *	movups xmm0, [r12 + B]
+ *	movups [rbx + 16], xmm0
+ *	add rbx, 32
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov rdi, R
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ *	test eax, eax
+ *	jne  J
+ * 2:
+ */
+static const uint8_t st_jcc_local_local_code[] = {
+	0x41, 0x83, 0xbc, 0x24, 0x11, 0x11, 0x11, 0x11,
+	0x02, 0x75, 0x23, 0x41, 0x83, 0xbc, 0x24, 0x22,
+	0x22, 0x22, 0x22, 0x02, 0x75, 0x18, 0x49, 0x8b,
+	0x84, 0x24, 0x33, 0x33, 0x33, 0x33, 0x49, 0x3b,
+	0x84, 0x24, 0x44, 0x44, 0x44, 0x44, 0x0f, 0x80,
+	0x7a, 0x7a, 0x7a, 0x7a, 0xeb, 0x61, 0x41, 0x0f,
+	0x10, 0x84, 0x24, 0x11, 0x11, 0x11, 0x11, 0x0f,
+	0x11, 0x03, 0x41, 0x0f, 0x10, 0x84, 0x24, 0x22,
+	0x22, 0x22, 0x22, 0x0f, 0x11, 0x43, 0x10, 0x48,
+	0x83, 0xc3, 0x20, 0x48, 0xba, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x89, 0x1a,
+	0x48, 0xbf, 0x52, 0x52, 0x52, 0x52, 0x52, 0x52,
+	0x52, 0x52, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83,
+	0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0xff, 0xd0, 0x48, 0x89,
+	0xec, 0x5d, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a, 0x85,
+	0xc0, 0x0f, 0x85, 0x7c, 0x7c, 0x7c, 0x7c,
+};
+static const struct stencil st_jcc_local_local = {
+	st_jcc_local_local_code, sizeof(st_jcc_local_local_code), {
+		{ 4, Hole_imm32, Op_a },
+		{ 15, Hole_imm32, Op_b },
+		{ 26, Hole_imm32, Op_c },
+		{ 34, Hole_imm32, Op_d },
+		{ 39, Hole_cc, Op_cc },
+		{ 40, Hole_branch, Op_dest },
+		{ 51, Hole_imm32, Op_a },
+		{ 63, Hole_imm32, Op_b },
+		{ 77, Hole_addr, Addr_stackp },
+		{ 90, Hole_imm64, Op_arg },
+		{ 108, Hole_imm64, Op_helper },
+		{ 124, Hole_addr, Addr_stackp },
+		{ 139, Hole_branch, Op_dest },
+	}
+};
+
+/*
+ *	movups xmm0, [rbx - 16]
+ *	movups [rbx], xmm0
+ *	add rbx, 16
+ */
+static const uint8_t st_dup_code[] = {
+	0x0f, 0x10, 0x43, 0xf0, 0x0f, 0x11, 0x03, 0x48,
+	0x83, 0xc3, 0x10,
+};
+static const struct stencil st_dup = {
+	st_dup_code, sizeof(st_dup_code), {
+	}
+};
+
+/*
+ *	sub rbx, 16
+ */
+static const uint8_t st_drop_code[] = {
+	0x48, 0x83, 0xeb, 0x10,
+};
+static const struct stencil st_drop = {
+	st_drop_code, sizeof(st_drop_code), {
+	}
+};
+
+/*
+ *	lea rbx, [r12 + A]
+ */
+static const uint8_t st_clear_code[] = {
+	0x49, 0x8d, 0x9c, 0x24, 0x11, 0x11, 0x11, 0x11,
+};
+static const struct stencil st_clear = {
+	st_clear_code, sizeof(st_clear_code), {
+		{ 4, Hole_imm32, Op_a },
+	}
+};
+
+/*
+ *	lea rax, [r12 + A]
+ *	cmp rbx, rax
+ *	je 1f
+ *	movups xmm0, [rbx - 16]
+ *	movups [r12], xmm0
+ *	jmp 2f
+ * 1:	mov dword ptr [r12], B
+ * 2:	lea rbx, [r12 + 16]
+ *	pop r12
+ *	ret
+ */
+static const uint8_t st_ret_code[] = {
+	0x49, 0x8d, 0x84, 0x24, 0x11, 0x11, 0x11, 0x11,
+	0x48, 0x39, 0xc3, 0x74, 0x0b, 0x0f, 0x10, 0x43,
+	0xf0, 0x41, 0x0f, 0x11, 0x04, 0x24, 0xeb, 0x08,
+	0x41, 0xc7, 0x04, 0x24, 0x22, 0x22, 0x22, 0x22,
+	0x49, 0x8d, 0x5c, 0x24, 0x10, 0x41, 0x5c, 0xc3,
+};
+static const struct stencil st_ret = {
+	st_ret_code, sizeof(st_ret_code), {
+		{ 4, Hole_imm32, Op_a },
+		{ 28, Hole_imm32, Op_b },
+	}
+};
+
+/*
+ *	mov rax, Q
+ *	cmp rsp, [rax]
+ *	jb 1f
+ *	call entry
+ *	jmp 2f
+ * 1:
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov rdi, R
+ *	mov esi, A
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_call_self_code[] = {
+	0x48, 0xb8, 0x51, 0x51, 0x51, 0x51, 0x51, 0x51,
+	0x51, 0x51, 0x48, 0x3b, 0x20, 0x72, 0x07, 0xe8,
+	0x7b, 0x7b, 0x7b, 0x7b, 0xeb, 0x41, 0x48, 0xba,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x48, 0x89, 0x1a, 0x48, 0xbf, 0x52, 0x52, 0x52,
+	0x52, 0x52, 0x52, 0x52, 0x52, 0xbe, 0x11, 0x11,
+	0x11, 0x11, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x83,
+	0xe4, 0xf0, 0x48, 0xb8, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0x54, 0x54, 0xff, 0xd0, 0x48, 0x89,
+	0xec, 0x5d, 0x48, 0xba, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x48, 0x8b, 0x1a,
+};
+static const struct stencil st_call_self = {
+	st_call_self_code, sizeof(st_call_self_code), {
+		{ 2, Hole_addr, Addr_limit },
+		{ 16, Hole_entry, 0 },
+		{ 24, Hole_addr, Addr_stackp },
+		{ 37, Hole_imm64, Op_arg },
+		{ 46, Hole_imm32, Op_a },
+		{ 60, Hole_imm64, Op_helper },
+		{ 76, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	mov rax, R
+ *	mov rdx, U
+ *	mov rcx, [rdx]
+ *	cmp rcx, [rax]
+ *	jne 1f
+ *	mov rdx, Q
+ *	cmp rsp, [rdx]
+ *	jb 1f
+ *	call qword ptr [rax + 8]
+ *	jmp 2f
+ * 1:
+ *	mov rdx, S
+ *	mov [rdx], rbx
+ *	mov rdi, rax
+ *	push rbp
+ *	mov rbp, rsp
+ *	and rsp, -16
+ *	mov rax, T
+ *	call rax
+ *	mov rsp, rbp
+ *	pop rbp
+ *	mov rdx, S
+ *	mov rbx, [rdx]
+ * 2:
+ */
+static const uint8_t st_call_site_code[] = {
+	0x48, 0xb8, 0x52, 0x52, 0x52, 0x52, 0x52, 0x52,
+	0x52, 0x52, 0x48, 0xba, 0x55, 0x55, 0x55, 0x55,
+	0x55, 0x55, 0x55, 0x55, 0x48, 0x8b, 0x0a, 0x48,
+	0x3b, 0x08, 0x75, 0x14, 0x48, 0xba, 0x51, 0x51,
+	0x51, 0x51, 0x51, 0x51, 0x51, 0x51, 0x48, 0x3b,
+	0x22, 0x72, 0x05, 0xff, 0x50, 0x08, 0xeb, 0x35,
+	0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x48, 0x89, 0x1a, 0x48, 0x89, 0xc7,
+	0x55, 0x48, 0x89, 0xe5, 0x48, 0x83, 0xe4, 0xf0,
+	0x48, 0xb8, 0x54, 0x54, 0x54, 0x54, 0x54, 0x54,
+	0x54, 0x54, 0xff, 0xd0, 0x48, 0x89, 0xec, 0x5d,
+	0x48, 0xba, 0x53, 0x53, 0x53, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x48, 0x8b, 0x1a,
+};
+static const struct stencil st_call_site = {
+	st_call_site_code, sizeof(st_call_site_code), {
+		{ 2, Hole_imm64, Op_arg },
+		{ 12, Hole_addr, Addr_version },
+		{ 30, Hole_addr, Addr_limit },
+		{ 50, Hole_addr, Addr_stackp },
+		{ 74, Hole_imm64, Op_helper },
+		{ 90, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ *	push rbx
+ *	push r12
+ *	push rbp
+ *	mov rax, S
+ *	mov rbx, [rax]
+ *	call rdi
+ *	mov rax, S
+ *	mov [rax], rbx
+ *	pop rbp
+ *	pop r12
+ *	pop rbx
+ *	ret
+ */
+static const uint8_t st_trampoline_code[] = {
+	0x53, 0x41, 0x54, 0x55, 0x48, 0xb8, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x8b,
+	0x18, 0xff, 0xd7, 0x48, 0xb8, 0x53, 0x53, 0x53,
+	0x53, 0x53, 0x53, 0x53, 0x53, 0x48, 0x89, 0x18,
+	0x5d, 0x41, 0x5c, 0x5b, 0xc3,
+};
+static const struct stencil st_trampoline = {
+	st_trampoline_code, sizeof(st_trampoline_code), {
+		{ 6, Hole_addr, Addr_stackp },
+		{ 21, Hole_addr, Addr_stackp },
+	}
+};
+
+/*
+ * The condition of the compare and branch instructions, for the stencil and
+ * for num_cmp().
+ */
+#define CMP_INSTS(n, cc, cmp)						\
+	[n##_opcode] = { cc, cmp },					\
+	[n##_imm_si_opcode] = { cc, cmp },				\
+	[n##_local_imm_si_opcode] = { cc, cmp },			\
+	[n##_local_local_opcode] = { cc, cmp }
+
+static const struct {
+	uint8_t cc, cmp;
+} cmp_tab[Num_opcodes] = {
+	CMP_INSTS(Jmp_eq, Cc_e, Cmp_eq),
+	CMP_INSTS(Jmp_gt, Cc_g, Cmp_gt),
+	CMP_INSTS(Jmp_lt, Cc_l, Cmp_lt),
+	CMP_INSTS(Jmp_ne, Cc_ne, Cmp_ne),
+};
+
+/*
+ * The arithmetic instructions, by the form of their operands. The register
+ * forms are done with the fused stencils followed by a store to the
+ * destination.
+ */
+enum {
+	Form_stack,
+	Form_imm,
+	Form_local_imm,
+	Form_local_local,
+	Form_reg_imm,
+	Form_reg,
+};
+
+static const struct arith_inst {
+	uint8_t                 op;     /* enum arith_op */
+	uint8_t                 form;
+	const struct stencil    *st;
+} arith_tab[Num_opcodes] = {
+	[Add2_opcode] = { Arith_add, Form_stack, &st_add2 },
+	[Add_imm_si_opcode] = { Arith_add, Form_imm, &st_add_si },
+	[Add_local_imm_si_opcode] =
+		{ Arith_add, Form_local_imm, &st_add_local_si },
+	[Add_local_local_opcode] =
+		{ Arith_add, Form_local_local, &st_add_local_local },
+	[Add_reg_imm_si_opcode] =
+		{ Arith_add, Form_reg_imm, &st_add_local_si },
+	[Add_reg_opcode] = { Arith_add, Form_reg, &st_add_local_local },
+	[Sub2_opcode] = { Arith_sub, Form_stack, &st_sub2 },
+	[Sub_imm_si_opcode] = { Arith_sub, Form_imm, &st_sub_si },
+	[Sub_local_imm_si_opcode] =
+		{ Arith_sub, Form_local_imm, &st_sub_local_si },
+	[Sub_local_local_opcode] =
+		{ Arith_sub, Form_local_local, &st_sub_local_local },
+	[Sub_reg_imm_si_opcode] =
+		{ Arith_sub, Form_reg_imm, &st_sub_local_si },
+	[Sub_reg_opcode] = { Arith_sub, Form_reg, &st_sub_local_local },
+	[Mul2_opcode] = { Arith_mul, Form_stack, &st_mul2 },
+	[Mul_imm_si_opcode] = { Arith_mul, Form_imm, &st_mul_si },
+	[Mul_local_imm_si_opcode] =
+		{ Arith_mul, Form_local_imm, &st_mul_local_si },
+	[Mul_local_local_opcode] =
+		{ Arith_mul, Form_local_local, &st_mul_local_local },
+	[Mul_reg_imm_si_opcode] =
+		{ Arith_mul, Form_reg_imm, &st_mul_local_si },
+	[Mul_reg_opcode] = { Arith_mul, Form_reg, &st_mul_local_local },
+	[Div2_opcode] = { Arith_div, Form_stack, &st_div2 },
+	[Div_imm_si_opcode] = { Arith_div, Form_imm, &st_div_si },
+};
+
+/*
+ * A call of a global function from native code. The call_site stencil calls
+ * entry directly while version matches global_version, and call_site()
+ * otherwise.
+ */
+struct jit_site {
+	size_t          version;
+	void            *entry;
+	size_t          sym;
+	size_t          nargs;
+};
+
+/*
+ * Native code being laid out.
+ */
+struct jit_code {
+	uint8_t         *code;
+	size_t          len, cap;
+	size_t          *map;           /* Offset of the code for each ip. */
+
+	struct fixup {
+		size_t  at;
+		size_t  ip;
+	}               *fix;
+	size_t          num_fix, cap_fix;
+};
+
+static void (*trampoline)(void *entry);
+static struct arena *jit_arena;
+
+/*
+ * The environment interpreted calls from native code are made in. It has no
+ * runtime context, so that eval() leaves the stack alone.
+ */
+static struct func jit_env;
+
+/*
+ * stackp is per thread, and native code only ever runs in the one that called
+ * jit_init(), so its address is filled in there.
+ */
+static void *addr_tab[] = {
+	[Addr_limit] = &jit_stack_limit,
+	[Addr_version] = &global_version,
+};
+
+/*
+ * Executable memory is handed out of chunks that are only writable while code
+ * is copied in.
+ */
+#define CHUNK_SIZE      (1 << 20)
+
+static uint8_t *chunk = NULL;
+static size_t chunk_used, chunk_size;
+
+static void *
+exec_alloc(const uint8_t *code, size_t len)
+{
+	void *p;
+
+	if (chunk == NULL || chunk_used + len > chunk_size) {
+		chunk_size = (len > CHUNK_SIZE)
+			? (len + CHUNK_SIZE - 1) & ~(size_t)(CHUNK_SIZE - 1)
+			: CHUNK_SIZE;
+		chunk = mmap(NULL, chunk_size, PROT_READ | PROT_EXEC,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk == MAP_FAILED) {
+			chunk = NULL;
+			return NULL;
+		}
+		chunk_used = 0;
+	}
+
+	if (mprotect(chunk, chunk_size, PROT_READ | PROT_WRITE) != 0)
+		return NULL;
+	p = chunk + chunk_used;
+	memcpy(p, code, len);
+	if (mprotect(chunk, chunk_size, PROT_READ | PROT_EXEC) != 0) {
+		fprintf(stderr, "Cannot make native code executable.\n");
+		abort();
+	}
+	chunk_used += (len + 15) & ~(size_t)15;
+	return p;
+}
+
+static bool
+copy_patch(struct jit_code *jc, const struct stencil *st, const uint64_t *ops)
+{
+	uint8_t *p;
+	int32_t rel;
+	uint32_t imm32;
+	const struct hole *h;
+
+	if (jc->len + st->len > jc->cap) {
+		jc->cap = (jc->cap + st->len) * 2;
+		if ((jc->code = realloc(jc->code, jc->cap)) == NULL)
+			return false;
+	}
+	p = jc->code + jc->len;
+	memcpy(p, st->code, st->len);
+
+	for (h = st->holes; h < st->holes + MAX_HOLES && h->at != 0; h++)
+		switch (h->kind) {
+		case Hole_imm32:
+			imm32 = (uint32_t)ops[h->op];
+			memcpy(p + h->at, &imm32, 4);
+			break;
+
+		case Hole_imm64:
+			memcpy(p + h->at, ops + h->op, 8);
+			break;
+
+		case Hole_addr:
+			memcpy(p + h->at, addr_tab + h->op, 8);
+			break;
+
+		case Hole_cc:
+			p[h->at] = (uint8_t)ops[h->op];
+			break;
+
+		case Hole_branch:
+			if (jc->num_fix == jc->cap_fix) {
+				jc->cap_fix = jc->cap_fix ? jc->cap_fix * 2 : 16;
+				jc->fix = realloc(jc->fix, sizeof(struct fixup) *
+						  jc->cap_fix);
+				if (jc->fix == NULL)
+					return false;
+			}
+			jc->fix[jc->num_fix].at = jc->len + h->at;
+			jc->fix[jc->num_fix].ip = ops[h->op];
+			jc->num_fix++;
+			break;
+
+		case Hole_entry:
+			rel = -(int32_t)(jc->len + h->at + 4);
+			memcpy(p + h->at, &rel, 4);
+			break;
+		}
+
+	jc->len += st->len;
+	return true;
+}
+
+/*
+ * Call f from native code through the interpreter.
+ */
+static void
+call_interp(struct func *f, size_t nargs)
+{
+	union op_or_imm code[4];
+	struct progm stub = { code, 0, 4, 4 };
+
+	code[0].inst = Call_imm_func_opcode;
+	code[1].o = nargs;
+	code[2].func = f;
+	code[3].inst = Halt_opcode;
+	eval(&jit_env, &stub, jit_arena);
+}
+
+static void
+call_site(struct jit_site *site)
+{
+	struct func *f;
+	struct value *cell;
+
+	if ((cell = global_lookup(site->sym)) == NULL) {
+		fprintf(stderr, "Unbound variable %s.\n",
+			ident_strings[site->sym]);
+		abort();
+	}
+	if (type_of(*cell) != Function_type) {
+		fprintf(stderr, "%s is not a function.\n",
+			ident_strings[site->sym]);
+		abort();
+	}
+
+	/* The interpreter checks the arguments and compiles f once hot. */
+	f = func_of(*cell);
+	if (f->native == NULL || f->args->len != site->nargs ||
+	    !jit_stack_ok()) {
+		call_interp(f, site->nargs);
+		return;
+	}
+	site->entry = f->native;
+	site->version = global_version;
+	trampoline(f->native);
+}
+
+/*
+ * Slow paths of the arithmetic stencils, taken for anything but two integers
+ * and on overflow. The operands are on top of the stack.
+ */
+static void
+jit_arith(int op)
+{
+	struct value b = *--stackp;
+
+	stackp[-1] = num_arith(op, stackp[-1], b);
+}
+
+static void
+jit_arith_imm(int op, int64_t imm)
+{
+	stackp[-1] = num_arith(op, stackp[-1], int_value(imm));
+}
+
+/*
+ * Slow paths of the compare and branch stencils. They pop the operands and
+ * return whether to take the branch.
+ */
+static int
+jit_cmp(int op)
+{
+	struct value a, b;
+
+	b = *--stackp;
+	a = *--stackp;
+	return num_cmp(op, a, b);
+}
+
+static int
+jit_cmp_imm(int op, int64_t imm)
+{
+	return num_cmp(op, *--stackp, int_value(imm));
+}
+
+void
+jit_init(void)
+{
+	struct rlimit rl;
+	size_t size = 8 << 20;
+	struct jit_code jc = { NULL, };
+	uint64_t ops[Num_ops] = { 0, };
+
+	if (sizeof(struct value) != 16 || offsetof(struct value, i) != 8 ||
+	    Integer_type != 2 || Real_type != 3) {
+		jit_threshold = 0;
+		return;
+	}
+
+	addr_tab[Addr_stackp] = &stackp;
+
+	/* Leave half of the C stack to the interpreter and whatever it calls. */
+	if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		size = rl.rlim_cur;
+	jit_stack_limit = (uintptr_t)__builtin_frame_address(0) - size / 2;
+
+	if (!copy_patch(&jc, &st_trampoline, ops) ||
+	    (trampoline = exec_alloc(jc.code, jc.len)) == NULL)
+		jit_threshold = 0;
+	free(jc.code);
+}
+
+bool
+jit_compile(struct func *f)
+{
+	size_t i, ip, dst = 0;
+	enum opcode op;
+	struct progm prog;
+	struct jit_site *site;
+	struct jit_code jc = { NULL, };
+	uint64_t ops[Num_ops] = { 0, };
+	const struct stencil *st;
+	const struct arith_inst *ai;
+
+	if (f->native != NULL || f->flags.variadic || f->flags.closure)
+		return f->native != NULL;
+
+	prog = f->prog;
+	if ((jc.map = malloc(sizeof(size_t) * (prog.len + 1))) == NULL)
+		return false;
+
+	ops[Op_a] = -(int64_t)(f->args->len * sizeof(struct value));
+	ops[Op_b] = f->locals->len * sizeof(struct value);
+	if (!copy_patch(&jc, &st_entry, ops))
+		goto fail;
+
+	for (prog.ip = 0; prog.ip < prog.len; ) {
+		ip = prog.ip;
+		jc.map[ip] = jc.len;
+		op = NEXT_INST(prog);
+		memset(ops, 0, sizeof(ops));
+		st = NULL;
+
+		switch (op) {
+		case Add2_opcode:
+		case Add_imm_si_opcode:
+		case Add_local_imm_si_opcode:
+		case Add_local_local_opcode:
+		case Add_reg_opcode:
+		case Add_reg_imm_si_opcode:
+		case Div2_opcode:
+		case Div_imm_si_opcode:
+		case Mul2_opcode:
+		case Mul_imm_si_opcode:
+		case Mul_local_imm_si_opcode:
+		case Mul_local_local_opcode:
+		case Mul_reg_opcode:
+		case Mul_reg_imm_si_opcode:
+		case Sub2_opcode:
+		case Sub_imm_si_opcode:
+		case Sub_local_imm_si_opcode:
+		case Sub_local_local_opcode:
+		case Sub_reg_opcode:
+		case Sub_reg_imm_si_opcode:
+			ai = arith_tab + op;
+			st = ai->st;
+			if (ai->form >= Form_reg_imm)
+				dst = NEXT_IMM_OFFSET(prog) *
+					sizeof(struct value);
+			switch (ai->form) {
+			case Form_stack:
+				ops[Op_a] = ai->op;
+				ops[Op_helper] = (uintptr_t)&jit_arith;
+				break;
+
+			case Form_imm:
+				ops[Op_a] = NEXT_IMM_SI(prog);
+				ops[Op_b] = ai->op;
+				ops[Op_helper] = (uintptr_t)&jit_arith_imm;
+				break;
+
+			case Form_local_imm:
+			case Form_reg_imm:
+				ops[Op_a] = NEXT_IMM_OFFSET(prog) *
+					sizeof(struct value);
+				ops[Op_b] = ops[Op_a] + offsetof(struct value, i);
+				ops[Op_c] = NEXT_IMM_SI(prog);
+				ops[Op_d] = ai->op;
+				ops[Op_helper] = (uintptr_t)&jit_arith_imm;
+				break;
+
+			case Form_local_local:
+			case Form_reg:
+				ops[Op_a] = NEXT_IMM_OFFSET(prog) *
+					sizeof(struct value);
+				ops[Op_b] = NEXT_IMM_OFFSET(prog) *
+					sizeof(struct value);
+				ops[Op_c] = ops[Op_a] + offsetof(struct value, i);
+				ops[Op_d] = ops[Op_b] + offsetof(struct value, i);
+				ops[Op_arg] = ai->op;
+				ops[Op_helper] = (uintptr_t)&jit_arith;
+				break;
+			}
+			if (ai->form >= Form_reg_imm) {
+				if (!copy_patch(&jc, st, ops))
+					goto fail;
+				memset(ops, 0, sizeof(ops));
+				ops[Op_a] = dst;
+				st = &st_sto_local;
+			}
+			break;
+
+		case Div_reg_opcode:
+		case Div_reg_imm_si_opcode:
+			/* There is no fused division, go through the stack. */
+			dst = NEXT_IMM_OFFSET(prog) * sizeof(struct value);
+			ops[Op_a] = NEXT_IMM_OFFSET(prog) *
+				sizeof(struct value);
+			if (!copy_patch(&jc, &st_load_local, ops))
+				goto fail;
+			if (op == Div_reg_opcode) {
+				ops[Op_a] = NEXT_IMM_OFFSET(prog) *
+					sizeof(struct value);
+				if (!copy_patch(&jc, &st_load_local, ops))
+					goto fail;
+				ops[Op_a] = Arith_div;
+				ops[Op_helper] = (uintptr_t)&jit_arith;
+				st = &st_div2;
+			} else {
+				ops[Op_a] = NEXT_IMM_SI(prog);
+				ops[Op_b] = Arith_div;
+				ops[Op_helper] = (uintptr_t)&jit_arith_imm;
+				st = &st_div_si;
+			}
+			if (!copy_patch(&jc, st, ops))
+				goto fail;
+			memset(ops, 0, sizeof(ops));
+			ops[Op_a] = dst;
+			st = &st_sto_local;
+			break;
+
+		case Call_current_opcode:
+			ops[Op_a] = NEXT_IMM_OFFSET(prog);
+			if (ops[Op_a] != f->args->len)
+				/* Leave the error to the interpreter. */
+				goto fail;
+			ops[Op_arg] = (uintptr_t)f;
+			ops[Op_helper] = (uintptr_t)&call_interp;
+			st = &st_call_self;
+			break;
+
+		case Call_imm_sym_opcode:
+			if ((site = malloc(sizeof(struct jit_site))) == NULL)
+				goto fail;
+			site->version = 0;
+			site->entry = NULL;
+			site->nargs = NEXT_IMM_OFFSET(prog);
+			site->sym = NEXT_IMM_SYMBOL(prog);
+			prog.ip += 2;   /* The interpreter's cache. */
+			ops[Op_arg] = (uintptr_t)site;
+			ops[Op_helper] = (uintptr_t)&call_site;
+			st = &st_call_site;
+			break;
+
+		case Clear_opcode:
+			ops[Op_a] = f->locals->len * sizeof(struct value);
+			st = &st_clear;
+			break;
+
+		case Drop_opcode:
+			st = &st_drop;
+			break;
+
+		case Dup_opcode:
+			st = &st_dup;
+			break;
+
+		case Jmp_opcode:
+		case Yield_jmp_opcode:
+			/* Every let is ignored, so yields do nothing. */
+			ops[Op_dest] = NEXT_IMM_OFFSET(prog);
+			st = &st_jmp;
+			break;
+
+		case Jmp_eq_opcode:
+		case Jmp_gt_opcode:
+		case Jmp_lt_opcode:
+		case Jmp_ne_opcode:
+			ops[Op_dest] = NEXT_IMM_OFFSET(prog);
+			ops[Op_cc] = cmp_tab[op].cc;
+			ops[Op_arg] = cmp_tab[op].cmp;
+			ops[Op_helper] = (uintptr_t)&jit_cmp;
+			st = &st_jcc;
+			break;
+
+		case Jmp_eq_imm_si_opcode:
+		case Jmp_gt_imm_si_opcode:
+		case Jmp_lt_imm_si_opcode:
+		case Jmp_ne_imm_si_opcode:
+			ops[Op_dest] = NEXT_IMM_OFFSET(prog);
+			ops[Op_a] = NEXT_IMM_SI(prog);
+			ops[Op_cc] = cmp_tab[op].cc;
+			ops[Op_arg] = cmp_tab[op].cmp;
+			ops[Op_helper] = (uintptr_t)&jit_cmp_imm;
+			st = &st_jcc_imm;
+			break;
+
+		case Jmp_eq_local_imm_si_opcode:
+		case Jmp_gt_local_imm_si_opcode:
+		case Jmp_lt_local_imm_si_opcode:
+		case Jmp_ne_local_imm_si_opcode:
+			ops[Op_dest] = NEXT_IMM_OFFSET(prog);
+			ops[Op_a] = NEXT_IMM_OFFSET(prog) * sizeof(struct value);
+			ops[Op_b] = ops[Op_a] + offsetof(struct value, i);
+			ops[Op_c] = NEXT_IMM_SI(prog);
+			ops[Op_cc] = cmp_tab[op].cc;
+			ops[Op_arg] = cmp_tab[op].cmp;
+			ops[Op_helper] = (uintptr_t)&jit_cmp_imm;
+			st = &st_jcc_local_imm;
+			break;
+
+		case Jmp_eq_local_local_opcode:
+		case Jmp_gt_local_local_opcode:
+		case Jmp_lt_local_local_opcode:
+		case Jmp_ne_local_local_opcode:
+			ops[Op_dest] = NEXT_IMM_OFFSET(prog);
+			ops[Op_a] = NEXT_IMM_OFFSET(prog) * sizeof(struct value);
+			ops[Op_b] = NEXT_IMM_OFFSET(prog) * sizeof(struct value);
+			ops[Op_c] = ops[Op_a] + offsetof(struct value, i);
+			ops[Op_d] = ops[Op_b] + offsetof(struct value, i);
+			ops[Op_cc] = cmp_tab[op].cc;
+			ops[Op_arg] = cmp_tab[op].cmp;
+			ops[Op_helper] = (uintptr_t)&jit_cmp;
+			st = &st_jcc_local_local;
+			break;
+
+		case Jmp_false_opcode:
+			ops[Op_dest] = NEXT_IMM_OFFSET(prog);
+			st = &st_jmp_false;
+			break;
+
+		case Jmp_true_opcode:
+			ops[Op_dest] = NEXT_IMM_OFFSET(prog);
+			st = &st_jmp_true;
+			break;
+
+		case Let_opcode:
+			/* Only lets without variables are supported. */
+			if (NEXT_IMM_SYMTAB(prog) != NULL)
+				goto fail;
+			break;
+
+		case Load_imm_local_opcode:
+			ops[Op_a] = NEXT_IMM_OFFSET(prog) * sizeof(struct value);
+			st = &st_load_local;
+			break;
+
+		case Push_const_opcode:
+		{
+			struct value v = *NEXT_IMM_CONST(prog);
+
+			ops[Op_a] = type_of(v);
+			ops[Op_arg] = payload_of(v);
+			st = &st_push_imm64;
+			break;
+		}
+
+		case Push_imm_bi_opcode:
+			ops[Op_a] = Integer_type;
+			ops[Op_arg] = NEXT_IMM_BI(prog);
+			st = &st_push_imm64;
+			break;
+
+		case Push_imm_br_opcode:
+		{
+			double r = NEXT_IMM_BR(prog);
+
+			ops[Op_a] = Real_type;
+			memcpy(ops + Op_arg, &r, sizeof(r));
+			st = &st_push_imm64;
+			break;
+		}
+
+		case Push_imm_si_opcode:
+			ops[Op_a] = Integer_type;
+			ops[Op_b] = NEXT_IMM_SI(prog);
+			st = &st_push_si;
+			break;
+
+		case Ret_opcode:
+			ops[Op_a] = f->locals->len * sizeof(struct value);
+			ops[Op_b] = Nil_type;
+			st = &st_ret;
+			break;
+
+		case Sto_imm_local_opcode:
+			ops[Op_a] = NEXT_IMM_OFFSET(prog) * sizeof(struct value);
+			st = &st_sto_local;
+			break;
+
+		case Sto_imm_local_jmp_opcode:
+			ops[Op_dest] = NEXT_IMM_OFFSET(prog);
+			ops[Op_a] = NEXT_IMM_OFFSET(prog) * sizeof(struct value);
+			if (!copy_patch(&jc, &st_sto_local, ops))
+				goto fail;
+			st = &st_jmp;
+			break;
+
+		case Sto_imm_local_si_opcode:
+			ops[Op_a] = NEXT_IMM_OFFSET(prog) * sizeof(struct value);
+			ops[Op_b] = ops[Op_a] + offsetof(struct value, i);
+			ops[Op_c] = Integer_type;
+			ops[Op_d] = NEXT_IMM_SI(prog);
+			st = &st_sto_local_si;
+			break;
+
+		case Yield_opcode:
+			break;
+
+		default:
+			/* No stencil, leave the function to the interpreter. */
+			goto fail;
+		}
+
+		if (st != NULL && !copy_patch(&jc, st, ops))
+			goto fail;
+	}
+
+	for (i = 0; i < jc.num_fix; i++) {
+		int32_t rel = jc.map[jc.fix[i].ip] - (jc.fix[i].at + 4);
+
+		memcpy(jc.code + jc.fix[i].at, &rel, 4);
+	}
+	f->native = exec_alloc(jc.code, jc.len);
+
+fail:
+	free(jc.fix);
+	free(jc.map);
+	free(jc.code);
+	return f->native != NULL;
+}
+
+/*
+ * Run the native code of f, with its arguments on the stack. What the
+ * interpreted calls it makes return is kept in arena.
+ */
+void
+jit_run(struct func *f, struct arena *arena)
+{
+	struct arena *saved = jit_arena;
+
+	jit_arena = arena;
+	trampoline(f->native);
+	jit_arena = saved;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+/*
+ * A baseline JIT. Once a function has been called jit_threshold times by the
+ * interpreter, its bytecode is translated to x86-64 by copy and patch: every
+ * instruction has a stencil of machine code with holes for its operands, which
+ * is copied and patched into place. Functions using instructions without a
+ * stencil are left to the interpreter, as are calls once the native code has
+ * used up its share of the C stack. Native code only runs in the first thread,
+ * as the others call clones of functions (see eval.c).
+ * The JIT is left out when profiling the bytecode, and with NaN-boxed values,
+ * which the stencils do not know how to handle.
+ */
+#if defined(__x86_64__) && !defined(PROFILE) && !defined(NANBOX) && \
+    !defined(NO_JIT)
+# define JIT
+#endif
+
+#ifdef JIT
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "alloc.h"
+#include "types.h"
+
+/*
+ * 0 disables the JIT.
+ */
+extern unsigned int jit_threshold;
+extern uintptr_t jit_stack_limit;
+
+void jit_init(void);
+bool jit_compile(struct func *);
+void jit_run(struct func *, struct arena *);
+
+static inline bool
+jit_stack_ok(void)
+{
+	return (uintptr_t)__builtin_frame_address(0) > jit_stack_limit;
+}
+
+#endif
+
+#endif
@@ -12,6 +12,7 @@ static enum token_id identifier_rule(char **);
 static enum token_id paren_op_rule(char **);
 static enum token_id paren_cl_rule(char **);
 static enum token_id newline_rule(char **);
+static enum token_id quote_rule(char **);
 
 /*
  * lex_token advances src until the end of the token or until the null
@@ -46,6 +47,7 @@ lex_token(char **src, size_t *ws)
 		['(']           = &paren_op_rule,
 		[')']           = &paren_cl_rule,
 		['\n']          = &newline_rule,
+		['\'']          = &quote_rule,
 	};
 
 
@@ -78,6 +80,13 @@ number_rule(char **src)
 		case '0' ... '9':
 		case '.':
 			break;
+
+		case 'e':
+		case 'E':
+			/* Exponent of a real, which may carry a sign. */
+			if ((*src)[1] == '+' || (*src)[1] == '-')
+				(*src)++;
+			break;
 		}
 	}
 	/* NOTREACHED */
@@ -139,3 +148,10 @@ newline_rule(char **src)
 	(*src)++;
 	return Newline_tok;
 }
+
+static enum token_id
+quote_rule(char **src)
+{
+	(*src)++;
+	return Quote_tok;
+}
@@ -10,6 +10,7 @@ enum token_id {
 	String_tok,
 	Paren_op_tok,   /* Opening parenthesis. */
 	Paren_cl_tok,   /* Closing paren. */
+	Quote_tok,
 };
 
 enum token_id lex_token(char **, size_t *);
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <histedit.h>
 
 #include "alloc.h"
@@ -7,6 +9,12 @@
 #include "lex.h"
 #include "parse.h"
 #include "comp.h"
+#include "eval.h"
+#include "opt.h"
+#include "jit.h"
+#include "profile.h"
+#include "simd.h"
+#include "parallel.h"
 #include "builtin.h"
 
 /*
@@ -49,6 +57,9 @@ relex:
 		pcount--;
 		break;
 
+	case Quote_tok:
+		break;
+
 	case Empty_tok:
 		if (pcount != 0) {
 			int ignore;
@@ -73,45 +84,147 @@ prompt(EditLine *e)
 
 struct func global;
 
-struct heap_item eval(struct func *, struct progm *);
-extern struct value stack[0x100000];
-extern struct value *stackp;
+/*
+ * Reals are printed with the fewest digits that read back as the same value,
+ * and always with a point or an exponent so they don't look like integers.
+ */
+static void
+print_value(struct value v)
+{
+	int prec;
+	double r;
+	char buf[32];
+
+	switch (type_of(v)) {
+	case Integer_type:
+		printf("%lld", (long long)int_of(v));
+		break;
+
+	case Real_type:
+		r = real_of(v);
+		if (r > -1e17 && r < 1e17 && r == (long long)r) {
+			printf("%.1f", r);
+			break;
+		}
+		for (prec = 1; prec < 17; prec++) {
+			snprintf(buf, sizeof(buf), "%.*g", prec, r);
+			if (strtod(buf, NULL) == r)
+				break;
+		}
+		printf("%.*g", prec, r);
+		break;
+
+	default:
+		printf("#<%s>", type_to_str(type_of(v)));
+		break;
+	}
+}
+
+static void
+usage(char *name)
+{
+	fprintf(stderr, "usage: %s [-mr] [-O level] [-i usec] [-j calls] "
+		"[-p workers] [-s depth]\n", name);
+	exit(1);
+}
 
 int
 main(int argc, char **argv)
 {
+	int c;
 	int ignore;
+	int jumped;
 	char *line;
+	size_t depth = STACK_DEFAULT_DEPTH;
 //	size_t num_vars = 0;
 	struct vector code;
 	struct context local_context;
 	struct source_mapping srcmap = { NULL, 0, 0, 0 };
 
+	while ((c = getopt(argc, argv, "O:i:j:mp:rs:")) != -1)
+		switch (c) {
+		case 'O':
+			opt_level = atoi(optarg);
+			break;
+
+		case 'i':
+			/* Collect incrementally, pausing for at most usec. */
+			alloc_pause_ns = strtoul(optarg, NULL, 0) * 1000;
+			if (alloc_pause_ns == 0)
+				usage(argv[0]);
+			break;
+
+		case 'j':
+#ifdef JIT
+			jit_threshold = atoi(optarg);
+#endif
+			break;
+
+		case 'm':
+			atexit(alloc_report);
+			break;
+
+		case 'p':
+			parallel_workers = strtoul(optarg, NULL, 0);
+			if (parallel_workers == 0)
+				usage(argv[0]);
+			break;
+
+		case 'r':
+			compile_registers = true;
+			break;
+
+		case 's':
+			depth = strtoul(optarg, NULL, 0);
+			if (depth == 0)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+
+	/* Counters of what was allocated and collected, for tracking. */
+	if (getenv("UCALC_MEMORY_STATS") != NULL)
+		atexit(alloc_stats_report);
+
+	stack_init(depth);
+
 	el = el_init(argv[0], stdin, stdout, stderr);
 	el_set(el, EL_PROMPT, &prompt);
 	el_set(el, EL_EDITOR, "emacs");
 
-	global.args = alloc_vector(&global_heap, 1);
+	global.args = alloc_vector(&global_arena, 1);
 	global.prog.ip = global.prog.len = global.prog.cap = 0;
 	global.prog.code = NULL;
 	global.rt_context = &local_context;
 	local_context.local_start = &stack[0];
 
 	set_compiler_global_context(&global);
+	prof_register(&global.prog, "top level");
+#ifdef PROFILE
+	atexit(prof_report);
+#endif
 
 	init_builtins();
+	simd_init();
+	parallel_init();
+#ifdef JIT
+	jit_init();
+#endif
 
 	for (;;) {
 		line = el_gets(el, &ignore);
 		if (line == NULL || ignore <= 0)
 			return 1;
 		input = line;
-		code = parse(&get_next_token, &srcmap);
+		code = parse(&get_next_token, &srcmap, &comp_arena);
 		global.rt_context->local_end =
 			global.rt_context->local_start +
 			global.locals->len + global.args->len;
 
-		if (compile(&global.prog, code.items->v) == Error_type) {
+		if (compile(&global.prog, vector_of(code.items[0]))
+		    == Error_type) {
 			fprintf(stderr, "There was an error!\n");
 		}
 /*		while (num_vars < global.locals->len) {
@@ -120,16 +233,29 @@ main(int argc, char **argv)
 			num_vars++;
 			} */
 		code_inst(&global.prog, Halt_opcode);
-		eval(&global, &global.prog);
-		if (stackp != &stack[0])
-			printf("stackp = %d\n", (stackp - 1)->i);
+		if ((jumped = sigsetjmp(stack_overflow_env, 1)) != 0) {
+			if (jumped == STACK_OVERFLOW)
+				fprintf(stderr, "Stack overflow.\n");
+			eval_reset();
+			stack_trim();
+			global.prog.ip = global.prog.len - 1;
+		} else
+			eval(&global, &global.prog, &global_arena);
+		if (stackp != &stack[0]) {
+			printf("stackp = ");
+			print_value(stackp[-1]);
+			printf("\n");
+		}
 		global.prog.len--;
-	}
 
-	if (global_heap_start.data != NULL) {
-		free(global_heap_start.data);
-		clear_heap(global_heap_start.next);
+		/* Nothing refers to the code of an input once it has run. */
+		code_reset(&global.prog);
+		slab_free(code.items, code.cap * sizeof(struct value));
+		if (top_level_wants_collection())
+			collect_top_level(&global, stack, stackp);
 	}
 
+	arena_release(&global_arena);
+
 	return 0;
 }
@@ -189,7 +189,9 @@ resize:
 	old_size = mp->size;
 //	mp->size <<= 1;
 	mp->size = next_prime(mp->size);
-	mp->buckets = calloc(mp->size, sizeof(struct bucket));
+	mp->buckets = (mp->alloc != NULL)
+		? mp->alloc(sizeof(struct bucket) * mp->size)
+		: calloc(mp->size, sizeof(struct bucket));
 	if (mp->buckets == NULL)
 		/* Could not resize. */
 		return NULL;
@@ -199,7 +201,8 @@ resize:
 		for (i = 0; i < old_size; i++)
 			if (p[i].key != NULL)
 				*map_get(mp, p[i].key) = p[i].data;
-		free(p);
+		if (mp->alloc == NULL)
+			free(p);
 	}
 
 	/*
@@ -216,7 +219,9 @@ map_copy(struct map *src, struct map *dst)
 
 	dst->len = src->len;
 	dst->size = src->size;
-	dst->buckets = realloc(dst->buckets, sizeof(struct bucket) * dst->size);
+	dst->buckets = (dst->alloc != NULL)
+		? dst->alloc(sizeof(struct bucket) * dst->size)
+		: realloc(dst->buckets, sizeof(struct bucket) * dst->size);
 
 	for (i = 0; i < dst->size; i++)
 		dst->buckets[i] = src->buckets[i];
@@ -19,6 +19,12 @@ struct map {
 	struct bucket   *buckets;
 	int             (*compare)(void *, void *);
 	size_t          (*hash)(void *);
+
+	/*
+	 * Returns cleared buckets that are never freed. If NULL, buckets are
+	 * calloc()ed and freed as the map grows.
+	 */
+	void            *(*alloc)(size_t);
 };
 
 void **map_get(struct map *, void *);
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "matrix.h"
+#include "num.h"
+
+const size_t matrix_arity[Num_matrix_ops] = {
+	[Matrix_make] = 3,
+	[Matrix_from_vector] = 3,
+	[Matrix_to_vector] = 1,
+	[Matrix_rows] = 1,
+	[Matrix_cols] = 1,
+	[Matrix_ref] = 3,
+	[Matrix_set] = 4,
+	[Matrix_transpose] = 1,
+	[Matrix_mul] = 2,
+};
+
+/*
+ * Multiplication works on blocks of KC columns of A and rows of B, so that
+ * MC rows of A fit in the L2 cache and KC rows of NC columns of B in the L3
+ * cache, and it copies each block into a buffer where the items the kernel
+ * reads next are next to each other, whatever the strides. The kernel keeps
+ * an MR by NR block of C in registers while it goes down KC items.
+ */
+#define MR      4
+#define NR      4
+#define MC      64
+#define KC      256
+#define NC      1024
+
+/*
+ * Copy mc rows and kc columns of a from row i and column k to p, as panels
+ * of MR rows, each column after column. A panel past the last row is padded
+ * with zeros.
+ */
+static void
+pack_a(double *p, struct matrix *a, size_t i, size_t k, size_t mc, size_t kc)
+{
+	size_t ir, kk, r;
+
+	for (ir = 0; ir < mc; ir += MR)
+		for (kk = 0; kk < kc; kk++)
+			for (r = 0; r < MR; r++)
+				*p++ = (ir + r < mc) ?
+					*matrix_item(a, i + ir + r, k + kk) : 0;
+}
+
+/*
+ * The same with kc rows and nc columns of b, as panels of NR columns, each
+ * row after row.
+ */
+static void
+pack_b(double *p, struct matrix *b, size_t k, size_t j, size_t kc, size_t nc)
+{
+	size_t jr, kk, c;
+
+	for (jr = 0; jr < nc; jr += NR)
+		for (kk = 0; kk < kc; kk++)
+			for (c = 0; c < NR; c++)
+				*p++ = (jr + c < nc) ?
+					*matrix_item(b, k + kk, j + jr + c) : 0;
+}
+
+/*
+ * Add the product of a panel of a and one of b to the mr by nr block of c at
+ * d.
+ */
+static void
+kernel(size_t kc, const double *a, const double *b, struct matrix *c,
+       double *d, size_t mr, size_t nr)
+{
+	double acc[MR][NR] = { { 0 } };
+	size_t k, r, s;
+
+	for (k = 0; k < kc; k++, a += MR, b += NR)
+		for (r = 0; r < MR; r++)
+			for (s = 0; s < NR; s++)
+				acc[r][s] += a[r] * b[s];
+	for (r = 0; r < mr; r++)
+		for (s = 0; s < nr; s++)
+			d[r * c->row_stride + s * c->col_stride] += acc[r][s];
+}
+
+/*
+ * Add the product of a and b to c.
+ */
+static void
+multiply(struct matrix *c, struct matrix *a, struct matrix *b)
+{
+	size_t i, j, k, ir, jr, mc, nc, kc;
+	double *pa, *pb;
+
+	pa = slab_alloc(sizeof(double) * MC * KC);
+	pb = slab_alloc(sizeof(double) * KC * NC);
+	for (j = 0; j < c->cols; j += NC) {
+		nc = (c->cols - j < NC) ? c->cols - j : NC;
+		for (k = 0; k < a->cols; k += KC) {
+			kc = (a->cols - k < KC) ? a->cols - k : KC;
+			pack_b(pb, b, k, j, kc, nc);
+			for (i = 0; i < c->rows; i += MC) {
+				mc = (c->rows - i < MC) ? c->rows - i : MC;
+				pack_a(pa, a, i, k, mc, kc);
+				for (jr = 0; jr < nc; jr += NR)
+					for (ir = 0; ir < mc; ir += MR)
+						kernel(kc, pa + ir * kc,
+						       pb + jr * kc, c,
+						       matrix_item(c, i + ir,
+								   j + jr),
+						       (mc - ir < MR) ?
+						       mc - ir : MR,
+						       (nc - jr < NR) ?
+						       nc - jr : NR);
+			}
+		}
+	}
+	slab_free(pa, sizeof(double) * MC * KC);
+	slab_free(pb, sizeof(double) * KC * NC);
+}
+
+static struct matrix *
+matrix_arg(struct value v)
+{
+	if (type_of(v) != Matrix_type) {
+		fprintf(stderr, "type error: not matrix\n");
+		abort();
+	}
+	return matrix_of(v);
+}
+
+static size_t
+length_arg(struct value v)
+{
+	if (type_of(v) != Integer_type || int_of(v) < 0) {
+		fprintf(stderr, "type error: not length\n");
+		abort();
+	}
+	return int_of(v);
+}
+
+static size_t
+index_arg(struct value v, size_t len)
+{
+	if (type_of(v) != Integer_type || int_of(v) < 0 ||
+	    (size_t)int_of(v) >= len) {
+		fprintf(stderr, "Index out of range.\n");
+		abort();
+	}
+	return int_of(v);
+}
+
+/*
+ * A matrix of rows and cols over v, one row after the other.
+ */
+static struct matrix *
+view(struct arena *arena, struct vector *v, size_t rows, size_t cols)
+{
+	struct matrix *m;
+
+	m = alloc_matrix(arena);
+	m->rows = rows;
+	m->cols = cols;
+	m->row_stride = cols;
+	m->col_stride = 1;
+	m->start = v->f64;
+	m->data = v;
+	return m;
+}
+
+/*
+ * A new matrix of zeros.
+ */
+static struct matrix *
+new_matrix(struct arena *arena, size_t rows, size_t cols)
+{
+	struct vector *v;
+	size_t n;
+
+	if (__builtin_mul_overflow(rows, cols, &n)) {
+		fprintf(stderr, "Out of memory.\n");
+		abort();
+	}
+	v = alloc_typed_vector(arena, F64_elem, n);
+	v->len = n;
+	return view(arena, v, rows, cols);
+}
+
+struct value
+matrix_apply(struct arena *arena, enum matrix_op op, struct value *args)
+{
+	struct matrix *m, *t, *c;
+	struct vector *v;
+	size_t i, j, n;
+	double x;
+
+	switch (op) {
+	case Matrix_make:
+		m = new_matrix(arena, length_arg(args[0]), length_arg(args[1]));
+		if (!is_number(args[2])) {
+			fprintf(stderr, "type error: not a number\n");
+			abort();
+		}
+		x = to_real(args[2]);
+		for (i = 0; i < m->data->len; i++)
+			m->data->f64[i] = x;
+		return matrix_value(m);
+
+	case Matrix_from_vector:
+		if (type_of(args[0]) != Vector_type ||
+		    vector_of(args[0])->elem != F64_elem) {
+			fprintf(stderr, "type error: not f64vector\n");
+			abort();
+		}
+		v = vector_of(args[0]);
+		i = length_arg(args[1]);
+		j = length_arg(args[2]);
+		if (__builtin_mul_overflow(i, j, &n) || n != v->len) {
+			fprintf(stderr, "Matrix does not fit the vector.\n");
+			abort();
+		}
+		return matrix_value(view(arena, v, i, j));
+
+	case Matrix_to_vector:
+		m = matrix_arg(args[0]);
+		v = alloc_typed_vector(arena, F64_elem, m->rows * m->cols);
+		for (i = 0; i < m->rows; i++)
+			for (j = 0; j < m->cols; j++)
+				v->f64[v->len++] = *matrix_item(m, i, j);
+		return vector_value(v);
+
+	case Matrix_rows:
+		return int_value(matrix_arg(args[0])->rows);
+
+	case Matrix_cols:
+		return int_value(matrix_arg(args[0])->cols);
+
+	case Matrix_ref:
+		m = matrix_arg(args[0]);
+		i = index_arg(args[1], m->rows);
+		j = index_arg(args[2], m->cols);
+		return real_value(*matrix_item(m, i, j));
+
+	case Matrix_set:
+		m = matrix_arg(args[0]);
+		i = index_arg(args[1], m->rows);
+		j = index_arg(args[2], m->cols);
+		if (!is_number(args[3])) {
+			fprintf(stderr, "type error: not a number\n");
+			abort();
+		}
+		*matrix_item(m, i, j) = to_real(args[3]);
+		return args[0];
+
+	case Matrix_transpose:
+		m = matrix_arg(args[0]);
+		t = alloc_matrix(arena);
+		*t = *m;
+		t->rows = m->cols;
+		t->cols = m->rows;
+		t->row_stride = m->col_stride;
+		t->col_stride = m->row_stride;
+		return matrix_value(t);
+
+	case Matrix_mul:
+		m = matrix_arg(args[0]);
+		t = matrix_arg(args[1]);
+		if (m->cols != t->rows) {
+			fprintf(stderr, "Matrices do not conform.\n");
+			abort();
+		}
+		c = new_matrix(arena, m->rows, t->cols);
+		multiply(c, m, t);
+		return matrix_value(c);
+
+	default:
+		abort();
+	}
+}
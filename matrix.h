@@ -0,0 +1,39 @@
+#ifndef _MATRIX_H_
+#define _MATRIX_H_
+
+#include <stddef.h>
+
+#include "alloc.h"
+#include "types.h"
+
+/*
+ * Dense matrices of doubles (see struct matrix). Their items are set in
+ * place, and a transpose is a view that shares them, but multiplication and
+ * conversion to a vector make new items. Matrices multiply a block at a time
+ * (see matrix.c).
+ */
+enum matrix_op {
+	Matrix_make,            /* Rows, columns and fill. */
+	Matrix_from_vector,     /* An f64 vector, rows and columns. */
+	Matrix_to_vector,       /* Row after row. */
+	Matrix_rows,
+	Matrix_cols,
+	Matrix_ref,             /* A matrix, a row and a column. */
+	Matrix_set,             /* Then a number. Gives the matrix. */
+	Matrix_transpose,
+	Matrix_mul,
+
+	Num_matrix_ops,         /* Not really an op. */
+};
+
+/*
+ * The number of values each op takes.
+ */
+extern const size_t matrix_arity[Num_matrix_ops];
+
+/*
+ * Apply op to the values at args, making what it returns in the arena.
+ */
+struct value matrix_apply(struct arena *, enum matrix_op, struct value *args);
+
+#endif
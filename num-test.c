@@ -0,0 +1,204 @@
+/*
+ * Tests of what =, < and > make of their operands, which must not depend on
+ * how values are laid out. Each test runs its inputs at the top level as the
+ * interpreter would and checks what the last one gives, on the stack and in
+ * register mode, and the inputs in errors[] must report an error and go back
+ * to the top level. Run it from a default build and from one with NANBOX
+ * defined.
+ *
+ * Build it with the objects of ucalc other than main.o:
+ *
+ *	make && gcc -g3 num-test.c $(ls *.o | grep -v main.o) -lm \
+ *	    -lpthread -o num-test && ./num-test
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "types.h"
+#include "lex.h"
+#include "parse.h"
+#include "comp.h"
+#include "eval.h"
+#include "stack.h"
+#include "builtin.h"
+#include "simd.h"
+#include "parallel.h"
+#include "profile.h"
+#include "jit.h"
+
+#define MAX_INPUTS      4
+
+struct test {
+	const char      *name;
+	const char      *inputs[MAX_INPUTS];
+	int64_t         expect;         /* Of the last input. */
+};
+
+static const struct test tests[] = {
+	{ "end of a list is zero", {
+		"(= (cdr (list 1)) 0)",
+	}, 1 },
+
+	{ "zero is the end of a list", {
+		"(= 0 (cdr (list 1)))",
+	}, 1 },
+
+	{ "a list is not zero", {
+		"(= (list 1) 0)",
+	}, 0 },
+
+	{ "walk a list to its end", {
+		"(define (len l) (if (= l 0) 0 (+ 1 (len (cdr l)))))",
+		"(len (list 1 2 3))",
+	}, 3 },
+
+	{ "same symbol", {
+		"(= 'car 'car)",
+	}, 1 },
+
+	{ "symbol and number", {
+		"(= 'car 4)",
+	}, 0 },
+
+	{ "number and symbol", {
+		"(= 4 'car)",
+	}, 0 },
+
+	{ "symbol not in a list", {
+		"(define (find x l) (if (= l 0) 0 "
+		    "(if (= x (car l)) 1 (find x (cdr l)))))",
+		"(find 'zzz (list 1 2 58 'car))",
+	}, 0 },
+
+	{ "symbol in a list", {
+		"(find 'car (list 1 2 58 'car))",
+	}, 1 },
+
+	{ "integer and real", {
+		"(= 2 2.0)",
+	}, 1 },
+};
+
+static const char *const errors[] = {
+	"(< 'car 4)",
+	"(> (list 1) 0)",
+	"(/ 1 0)",
+	"(+ 'car 1)",
+	NULL,
+};
+
+struct func global;
+static struct context global_context;
+static struct source_mapping srcmap;
+static char *input;
+static int jumped;
+
+/*
+ * As the interpreter lexes its input, without reading more lines.
+ */
+static struct token
+next_token(void)
+{
+	size_t ws = 0;
+	char *prev = input;
+	struct token tok;
+
+	tok.id = lex_token(&input, &ws);
+	if (tok.id == Number_tok || tok.id == Identifier_tok) {
+		prev += ws;
+		tok.src = strndup(prev, input - prev);
+	}
+	return tok;
+}
+
+/*
+ * Run one input at the top level and return what it left on the stack, with
+ * what it jumped to the top level with, if anything, in jumped.
+ */
+static struct value
+run(const char *src)
+{
+	struct vector code;
+	struct value v;
+	char *line;
+
+	input = line = strdup(src);
+	code = parse(&next_token, &srcmap, &comp_arena);
+	global.rt_context->local_end = global.rt_context->local_start +
+		global.locals->len + global.args->len;
+	if (compile(&global.prog, vector_of(code.items[0])) == Error_type) {
+		fprintf(stderr, "Cannot compile %s\n", src);
+		exit(1);
+	}
+	code_inst(&global.prog, Halt_opcode);
+	if ((jumped = sigsetjmp(stack_overflow_env, 1)) != 0) {
+		eval_reset();
+		stack_trim();
+	} else
+		eval(&global, &global.prog, &global_arena);
+	v = (stackp != &stack[0]) ? stackp[-1] : type_value(Nil_type);
+	global.prog.len--;
+	code_reset(&global.prog);
+	slab_free(code.items, code.cap * sizeof(struct value));
+	if (top_level_wants_collection())
+		collect_top_level(&global, stack, stackp);
+	free(line);
+	return v;
+}
+
+static bool
+run_test(const struct test *t)
+{
+	struct value v;
+	size_t i;
+
+	for (i = 0; i < MAX_INPUTS && t->inputs[i + 1] != NULL; i++)
+		(void)run(t->inputs[i]);
+	v = run(t->inputs[i]);
+	return type_of(v) == Integer_type && int_of(v) == t->expect;
+}
+
+int
+main(void)
+{
+	static const char *const modes[] = { "stack", "registers" };
+	size_t i, m;
+	int failed = 0;
+
+	stack_init(STACK_DEFAULT_DEPTH);
+	global.args = alloc_vector(&global_arena, 1);
+	global.rt_context = &global_context;
+	global_context.local_start = &stack[0];
+	set_compiler_global_context(&global);
+	prof_register(&global.prog, "top level");
+	init_builtins();
+	simd_init();
+	parallel_init();
+#ifdef JIT
+	jit_init();
+#endif
+
+	for (m = 0; m < sizeof(modes) / sizeof(*modes); m++) {
+		compile_registers = (m == 1);
+		for (i = 0; i < sizeof(tests) / sizeof(*tests); i++) {
+			if (run_test(tests + i))
+				continue;
+			printf("FAIL: %s (%s)\n", tests[i].name, modes[m]);
+			failed = 1;
+		}
+		for (i = 0; errors[i] != NULL; i++) {
+			(void)run(errors[i]);
+			if (jumped == STACK_ERROR && int_of(run("(+ 1 2)")) == 3)
+				continue;
+			printf("FAIL: %s (%s)\n", errors[i], modes[m]);
+			failed = 1;
+		}
+	}
+	if (!failed)
+		printf("All tests passed.\n");
+	return failed;
+}
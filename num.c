@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "num.h"
+#include "stack.h"
+
+/*
+ * Report an error in the arithmetic of a program and go back to the top level.
+ */
+static void
+num_error(const char *msg)
+{
+	fprintf(stderr, "%s\n", msg);
+	siglongjmp(stack_overflow_env, STACK_ERROR);
+}
+
+struct value
+num_arith(enum arith_op op, struct value a, struct value b)
+{
+	double x, y;
+	int64_t i, j, k;
+
+	if (!is_number(a) || !is_number(b))
+		num_error("type error: not a number");
+
+	if (type_of(a) == Integer_type && type_of(b) == Integer_type) {
+		i = int_of(a);
+		j = int_of(b);
+		switch (op) {
+		case Arith_add:
+			if (!__builtin_add_overflow(i, j, &k) && int_fits(k))
+				return int_value(k);
+			break;
+
+		case Arith_sub:
+			if (!__builtin_sub_overflow(i, j, &k) && int_fits(k))
+				return int_value(k);
+			break;
+
+		case Arith_mul:
+			if (!__builtin_mul_overflow(i, j, &k) && int_fits(k))
+				return int_value(k);
+			break;
+
+		case Arith_div:
+			if (j == 0)
+				num_error("Division by zero.");
+			/* INT64_MIN / -1 overflows. */
+			if (!(i == INT64_MIN && j == -1) && i % j == 0 &&
+			    int_fits(i / j))
+				return int_value(i / j);
+			break;
+		}
+		/* Overflowed, or a division with a remainder. */
+	}
+
+	x = to_real(a);
+	y = to_real(b);
+	switch (op) {
+	case Arith_add:
+		return real_value(x + y);
+
+	case Arith_sub:
+		return real_value(x - y);
+
+	case Arith_mul:
+		return real_value(x * y);
+
+	case Arith_div:
+	default:
+		return real_value(x / y);
+	}
+}
+
+/*
+ * Whether a and b, which are not both numbers, are the same value. The empty
+ * list is also zero, so that (= l 0) finds the end of a list.
+ */
+static bool
+same_value(struct value a, struct value b)
+{
+	if (is_empty_list(a) || is_empty_list(b))
+		return is_empty_list(a)
+			? is_empty_list(b) || is_zero(b)
+			: is_zero(a);
+	return type_of(a) == type_of(b) && payload_of(a) == payload_of(b);
+}
+
+bool
+num_cmp(enum cmp_op op, struct value a, struct value b)
+{
+	double x, y;
+	int64_t i, j;
+
+	if (type_of(a) == Integer_type && type_of(b) == Integer_type) {
+		i = int_of(a);
+		j = int_of(b);
+	} else if (!is_number(a) || !is_number(b)) {
+		if (op == Cmp_eq)
+			return same_value(a, b);
+		if (op == Cmp_ne)
+			return !same_value(a, b);
+		num_error("type error: not a number");
+		return false;
+	} else {
+		x = to_real(a);
+		y = to_real(b);
+		switch (op) {
+		case Cmp_eq:
+			return x == y;
+		case Cmp_ne:
+			return x != y;
+		case Cmp_lt:
+			return x < y;
+		case Cmp_gt:
+			return x > y;
+		}
+		return false;
+	}
+
+	switch (op) {
+	case Cmp_eq:
+		return i == j;
+	case Cmp_ne:
+		return i != j;
+	case Cmp_lt:
+		return i < j;
+	case Cmp_gt:
+		return i > j;
+	}
+	return false;
+}
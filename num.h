@@ -0,0 +1,75 @@
+#ifndef _NUM_H_
+#define _NUM_H_
+
+#include <stdbool.h>
+
+#include "types.h"
+
+/*
+ * Integers are 64 bits, or 48 with NANBOX, and reals are doubles. Arithmetic
+ * on two integers gives an integer, unless it overflows or is a division with
+ * a remainder, in which case the result is real. Arithmetic involving a real
+ * is real.
+ * The evaluator handles two integers that do not overflow itself, and leaves
+ * everything else to num_arith().
+ */
+enum arith_op {
+	Arith_add,
+	Arith_sub,
+	Arith_mul,
+	Arith_div,
+};
+
+/*
+ * Numbers compare by value. Anything else is only equal to a value of the same
+ * type with the same payload: the same symbol or the same object. The empty
+ * list is the exception, as it is equal to zero as well. Only numbers can be
+ * ordered.
+ */
+enum cmp_op {
+	Cmp_eq,
+	Cmp_ne,
+	Cmp_lt,
+	Cmp_gt,
+};
+
+static inline bool
+is_number(struct value v)
+{
+	return type_of(v) == Integer_type || type_of(v) == Real_type;
+}
+
+static inline double
+to_real(struct value v)
+{
+	return (type_of(v) == Real_type) ? real_of(v) : (double)int_of(v);
+}
+
+static inline bool
+is_zero(struct value v)
+{
+	return is_number(v) && to_real(v) == 0;
+}
+
+/*
+ * The pair at NULL, which ends every list.
+ */
+static inline bool
+is_empty_list(struct value v)
+{
+	return type_of(v) == Pair_type && payload_of(v) == 0;
+}
+
+/*
+ * The truth of a value tested by a conditional branch.
+ */
+static inline bool
+is_true(struct value v)
+{
+	return (type_of(v) == Real_type) ? real_of(v) != 0 : payload_of(v) != 0;
+}
+
+struct value num_arith(enum arith_op, struct value, struct value);
+bool num_cmp(enum cmp_op, struct value, struct value);
+
+#endif
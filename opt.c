@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "opt.h"
+#include "bytecode.h"
+
+/*
+ * Optimizations that the compiler does not require live in here.
+ *
+ * For now this is a peephole optimizer that runs over each function once it
+ * has been compiled. It fuses common instruction sequences into
+ * superinstructions, saving a dispatch (and usually a push and a pop) for
+ * every instruction fused away.
+ */
+
+int opt_level = 1;
+
+/*
+ * A decoded instruction.
+ */
+struct inst {
+	enum opcode     op;
+	size_t          ip;             /* Address in the unoptimized code. */
+	union op_or_imm *imm;
+	bool            target;         /* Some branch jumps here. */
+	bool            reached;
+
+	/*
+	 * Bit n is set if the nth innermost scope the instruction runs in is a
+	 * let scope without variables, whose walks are ignored by the
+	 * evaluator. Only the 64 innermost scopes are tracked.
+	 */
+	uint64_t        ignored;
+};
+
+/*
+ * Branch destinations to patch once the new code has been laid out.
+ */
+struct fixups {
+	struct fixup {
+		size_t  at;             /* Immediate in the new code. */
+		size_t  dest;           /* Destination in the old code. */
+	}       *items;
+	size_t  len, cap;
+};
+
+/*
+ * Arithmetic instructions and their fused forms.
+ */
+static const struct arith {
+	enum opcode     stack, imm, local_imm, local_local;
+	bool            commutes;
+} arith_tab[] = {
+	{ Add2_opcode, Add_imm_si_opcode,
+	  Add_local_imm_si_opcode, Add_local_local_opcode, true },
+	{ Sub2_opcode, Sub_imm_si_opcode,
+	  Sub_local_imm_si_opcode, Sub_local_local_opcode, false },
+	{ Mul2_opcode, Mul_imm_si_opcode,
+	  Mul_local_imm_si_opcode, Mul_local_local_opcode, true },
+};
+
+#define NUM_ARITH (sizeof(arith_tab) / sizeof(arith_tab[0]))
+
+/*
+ * Conditional branches and their fused forms.
+ */
+static const struct cmp {
+	enum opcode     stack, imm, local_imm, local_local;
+} cmp_tab[] = {
+	{ Jmp_eq_opcode, Jmp_eq_imm_si_opcode,
+	  Jmp_eq_local_imm_si_opcode, Jmp_eq_local_local_opcode },
+	{ Jmp_gt_opcode, Jmp_gt_imm_si_opcode,
+	  Jmp_gt_local_imm_si_opcode, Jmp_gt_local_local_opcode },
+	{ Jmp_lt_opcode, Jmp_lt_imm_si_opcode,
+	  Jmp_lt_local_imm_si_opcode, Jmp_lt_local_local_opcode },
+	{ Jmp_ne_opcode, Jmp_ne_imm_si_opcode,
+	  Jmp_ne_local_imm_si_opcode, Jmp_ne_local_local_opcode },
+};
+
+#define NUM_CMP (sizeof(cmp_tab) / sizeof(cmp_tab[0]))
+
+static const struct arith *
+find_stack_arith(enum opcode op)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ARITH; i++)
+		if (arith_tab[i].stack == op)
+			return arith_tab + i;
+	return NULL;
+}
+
+static const struct arith *
+find_imm_arith(enum opcode op)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ARITH; i++)
+		if (arith_tab[i].imm == op)
+			return arith_tab + i;
+	return NULL;
+}
+
+static const struct cmp *
+find_stack_cmp(enum opcode op)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_CMP; i++)
+		if (cmp_tab[i].stack == op)
+			return cmp_tab + i;
+	return NULL;
+}
+
+static const struct cmp *
+find_imm_cmp(enum opcode op)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_CMP; i++)
+		if (cmp_tab[i].imm == op)
+			return cmp_tab + i;
+	return NULL;
+}
+
+static void
+add_fixup(struct fixups *fix, size_t at, size_t dest)
+{
+	if (fix->len + 1 >= fix->cap) {
+		fix->cap = fix->cap ? fix->cap << 1 : 8;
+		fix->items = realloc(fix->items,
+				     sizeof(struct fixup) * fix->cap);
+	}
+	fix->items[fix->len++] = (struct fixup){ at, dest };
+}
+
+static size_t
+code_branch(struct progm *out, enum opcode op, size_t dest,
+	    struct fixups *fix)
+{
+	size_t at;
+
+	code_inst(out, op);
+	at = code_offset(out, 0);
+	add_fixup(fix, at, dest);
+	return at;
+}
+
+static bool
+falls_through(enum opcode op)
+{
+	return op != Jmp_opcode && op != Ret_opcode && op != Halt_opcode;
+}
+
+/*
+ * Merge a scope state into an instruction. Returns true if the instruction's
+ * state changed.
+ */
+static bool
+merge_scopes(struct inst *p, uint64_t ignored)
+{
+	if (!p->reached) {
+		p->reached = true;
+		p->ignored = ignored;
+		return true;
+	}
+	if ((p->ignored & ignored) == p->ignored)
+		return false;
+	p->ignored &= ignored;
+	return true;
+}
+
+/*
+ * Find the scopes every reachable instruction runs in by following the flow of
+ * control through lets and yields.
+ */
+static void
+find_scopes(struct inst *insts, size_t n, size_t *index)
+{
+	size_t i;
+	bool changed;
+	uint64_t s;
+
+	insts[0].reached = true;
+	insts[0].ignored = 0;
+	do {
+		changed = false;
+		for (i = 0; i < n; i++) {
+			if (!insts[i].reached)
+				continue;
+			s = insts[i].ignored;
+			if (insts[i].op == Let_opcode)
+				s = (s << 1) | (insts[i].imm[0].symtab == NULL);
+			else if (insts[i].op == Yield_opcode)
+				s >>= 1;
+
+			if (falls_through(insts[i].op) && i + 1 < n)
+				changed |= merge_scopes(insts + i + 1, s);
+			if (inst_branches(insts[i].op))
+				changed |= merge_scopes(
+					insts + index[insts[i].imm[0].o], s);
+		}
+	} while (changed);
+}
+
+/*
+ * Returns true if every scope walked through is ignored, in which case the
+ * walk ends in the current frame.
+ */
+static bool
+walk_ignored(struct inst *p, size_t walk)
+{
+	uint64_t mask;
+
+	if (!p->reached || walk >= 64)
+		return false;
+	mask = ((uint64_t)1 << walk) - 1;
+	return (p->ignored & mask) == mask;
+}
+
+/*
+ * Returns true if the instruction pushes a variable of the current frame,
+ * storing the variable's offset.
+ */
+static bool
+loads_local(struct inst *p, size_t *offset)
+{
+	switch (p->op) {
+	case Load_imm_local_opcode:
+		*offset = p->imm[0].o;
+		return true;
+
+	case Load_imm_nonlocal_opcode:
+		if (!walk_ignored(p, p->imm[0].o))
+			return false;
+		*offset = p->imm[1].o;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/*
+ * Returns true if none of the n instructions following p are branched to, so
+ * that they may be fused with p.
+ */
+static bool
+fusable(struct inst *p, size_t left, size_t n)
+{
+	size_t i;
+
+	if (left < n)
+		return false;
+	for (i = 1; i < n; i++)
+		if (p[i].target)
+			return false;
+	return true;
+}
+
+/*
+ * Copy a single instruction.
+ */
+static void
+emit(struct progm *out, struct inst *p, struct fixups *fix)
+{
+	size_t i, at, offset;
+
+	if (p->op == Load_imm_nonlocal_opcode && loads_local(p, &offset)) {
+		code_inst(out, Load_imm_local_opcode);
+		code_offset(out, offset);
+		return;
+	}
+	if (p->op == Call_imm_nonlocal_opcode && walk_ignored(p, p->imm[1].o)) {
+		code_inst(out, Call_imm_local_opcode);
+		code_offset(out, p->imm[0].o);
+		code_offset(out, p->imm[2].o);
+		return;
+	}
+
+	code_inst(out, p->op);
+	for (i = 0; i < inst_imms(p->op); i++) {
+		at = code_offset(out, 0);
+		out->code[at] = p->imm[i];
+		if (i == 0 && inst_branches(p->op))
+			add_fixup(fix, at, p->imm[0].o);
+	}
+}
+
+/*
+ * Emit the instruction at p, fusing it with those following it if possible.
+ * Returns the number of instructions consumed.
+ */
+static size_t
+fuse(struct progm *out, struct inst *p, size_t left, struct fixups *fix)
+{
+	size_t a, b;
+	const struct cmp *cm;
+	const struct arith *ar;
+
+	if (loads_local(p, &a)) {
+		/* load a; op k */
+		if (fusable(p, left, 2) &&
+		    (ar = find_imm_arith(p[1].op)) != NULL) {
+			code_inst(out, ar->local_imm);
+			code_offset(out, a);
+			code_si(out, p[1].imm[0].si);
+			return 2;
+		}
+
+		/* load a; jmp_cmp d k */
+		if (fusable(p, left, 2) &&
+		    (cm = find_imm_cmp(p[1].op)) != NULL) {
+			code_branch(out, cm->local_imm, p[1].imm[0].o, fix);
+			code_offset(out, a);
+			code_si(out, p[1].imm[1].si);
+			return 2;
+		}
+
+		/* load a; push k; op2 */
+		if (fusable(p, left, 3) && p[1].op == Push_imm_si_opcode) {
+			if ((ar = find_stack_arith(p[2].op)) != NULL) {
+				code_inst(out, ar->local_imm);
+				code_offset(out, a);
+				code_si(out, p[1].imm[0].si);
+				return 3;
+			}
+			if ((cm = find_stack_cmp(p[2].op)) != NULL) {
+				code_branch(out, cm->local_imm, p[2].imm[0].o,
+					    fix);
+				code_offset(out, a);
+				code_si(out, p[1].imm[0].si);
+				return 3;
+			}
+		}
+
+		/* load a; load b; op2 */
+		if (fusable(p, left, 3) && loads_local(p + 1, &b)) {
+			if ((ar = find_stack_arith(p[2].op)) != NULL) {
+				code_inst(out, ar->local_local);
+				code_offset(out, a);
+				code_offset(out, b);
+				return 3;
+			}
+			if ((cm = find_stack_cmp(p[2].op)) != NULL) {
+				code_branch(out, cm->local_local, p[2].imm[0].o,
+					    fix);
+				code_offset(out, a);
+				code_offset(out, b);
+				return 3;
+			}
+		}
+	}
+
+	/* push k; load a; op2 */
+	if (p->op == Push_imm_si_opcode && fusable(p, left, 3) &&
+	    loads_local(p + 1, &a) &&
+	    (ar = find_stack_arith(p[2].op)) != NULL && ar->commutes) {
+		code_inst(out, ar->local_imm);
+		code_offset(out, a);
+		code_si(out, p->imm[0].si);
+		return 3;
+	}
+
+	/* sto a; jmp d */
+	if (p->op == Sto_imm_local_opcode && fusable(p, left, 2) &&
+	    p[1].op == Jmp_opcode) {
+		code_branch(out, Sto_imm_local_jmp_opcode, p[1].imm[0].o, fix);
+		code_offset(out, p->imm[0].o);
+		return 2;
+	}
+
+	/* yield; jmp d */
+	if (p->op == Yield_opcode && fusable(p, left, 2) &&
+	    p[1].op == Jmp_opcode) {
+		code_branch(out, Yield_jmp_opcode, p[1].imm[0].o, fix);
+		return 2;
+	}
+
+	emit(out, p, fix);
+	return 1;
+}
+
+/*
+ * Run the optimizer over a fully compiled program, replacing its code.
+ */
+void
+optimize(struct progm *prog)
+{
+	size_t i, n, ip;
+	size_t *index, *new_ip;
+	struct inst *insts;
+	struct fixups fix = { NULL, 0, 0 };
+	struct progm out = { NULL, 0, 0, 0 };
+
+	if (opt_level < 1 || prog->len == 0)
+		return;
+
+	/* Decode the program. */
+	for (ip = n = 0; ip < prog->len; n++)
+		ip += 1 + inst_imms(prog->code[ip].inst);
+	insts = calloc(n, sizeof(struct inst));
+	index = malloc(sizeof(size_t) * prog->len);
+	new_ip = malloc(sizeof(size_t) * n);
+	if (insts == NULL || index == NULL || new_ip == NULL)
+		goto done;
+	for (ip = i = 0; ip < prog->len; i++) {
+		insts[i].op = prog->code[ip].inst;
+		insts[i].ip = ip;
+		insts[i].imm = prog->code + ip + 1;
+		index[ip] = i;
+		ip += 1 + inst_imms(insts[i].op);
+	}
+	for (i = 0; i < n; i++)
+		if (inst_branches(insts[i].op))
+			insts[index[insts[i].imm[0].o]].target = true;
+
+	find_scopes(insts, n, index);
+
+	for (i = 0; i < n; ) {
+		new_ip[i] = out.len;
+		i += fuse(&out, insts + i, n - i, &fix);
+	}
+
+	for (i = 0; i < fix.len; i++)
+		out.code[fix.items[i].at].o = new_ip[index[fix.items[i].dest]];
+
+	free(prog->code);
+#ifdef PROFILE
+	free(prog->prof);
+#endif
+	*prog = out;
+
+done:
+	free(fix.items);
+	free(new_ip);
+	free(index);
+	free(insts);
+}
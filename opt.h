@@ -0,0 +1,14 @@
+#ifndef _OPT_H_
+#define _OPT_H_
+
+#include "bytecode.h"
+
+/*
+ * 0 disables all optimizations, 1 enables the peephole optimizer and the
+ * allocation of lists that do not escape in frames (see comp.c).
+ */
+extern int opt_level;
+
+void optimize(struct progm *);
+
+#endif
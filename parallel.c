@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "parallel.h"
+#include "eval.h"
+#include "global.h"
+#include "num.h"
+#include "stack.h"
+#include "bytecode.h"
+#include "profile.h"
+
+const size_t parallel_arity[Num_parallel_ops] = {
+	[Parallel_map] = 2,
+	[Parallel_reduce] = 3,
+	[Parallel_for_range] = 3,
+};
+
+size_t parallel_workers = 0;
+
+/*
+ * Each worker starts with an even share of the chunks, and there are several
+ * chunks for each worker, so that those that run out early have something
+ * left to take from the others.
+ */
+#define CHUNKS_PER_WORKER       8
+#define MAX_WORKERS             256
+
+/*
+ * The chunks a worker has yet to run are those from lo up to hi, kept in one
+ * word. The worker takes them one at a time from lo, while the others take
+ * the upper half of what is left, both with a compare and swap. A range only
+ * ever shrinks while its worker has work, so it cannot come back to a value
+ * a thief saw unless it is the same chunks.
+ */
+#define RANGE(lo, hi)           ((uint64_t)(hi) << 32 | (uint64_t)(lo))
+#define RANGE_LO(r)             ((size_t)((r) & 0xffffffff))
+#define RANGE_HI(r)             ((size_t)((r) >> 32))
+
+struct work {
+	enum parallel_op        op;
+	struct value            *args;
+	struct func             *f;
+	struct value            items;  /* Of a map or a reduction. */
+	size_t                  n, chunks, workers;
+	struct arena            *arena;
+
+	/* Shared between the workers. */
+	struct arena            **shared;       /* See eval_thread_begin(). */
+	size_t                  nshared;
+	uint64_t                *ranges;
+	struct value            *results;       /* Per chunk for reductions. */
+	struct arena            *arenas;        /* Of each worker's results. */
+	int                     jumped;         /* See run_thread(). */
+};
+
+/*
+ * The threads of the pool wait for a new job, and run it if they are among
+ * the first w->workers. The caller waits until none of them is running any
+ * more, takes the results and lets them release what they made.
+ */
+static pthread_t pool[MAX_WORKERS];
+static size_t pool_size;                /* Threads started. */
+static size_t pool_depth;               /* Of their stacks. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct work *pool_work;
+static size_t pool_job;                 /* Bumped for each job. */
+static size_t pool_running, pool_busy;  /* Of the workers of the job. */
+static bool pool_taken;                 /* The results are the caller's. */
+
+/*
+ * Whether the thread is one of the pool.
+ */
+static __thread bool in_pool;
+
+/*
+ * Calls from here are made in an environment without a runtime context, so
+ * that eval() leaves the stack alone.
+ */
+static struct func call_env;
+
+/*
+ * Call f with the nargs values on top of the stack and pop what it returns.
+ */
+static struct value
+call(struct func *f, size_t nargs, struct arena *arena)
+{
+	union op_or_imm code[4];
+	struct progm stub = { code, 0, 4, 4 };
+#ifdef PROFILE
+	/* Counted, but not registered, as the code is gone once it returns. */
+	static struct prof_count prof[4];
+
+	stub.prof = prof;
+#endif
+
+	code[0].inst = Call_imm_func_opcode;
+	code[1].o = nargs;
+	code[2].func = f;
+	code[3].inst = Halt_opcode;
+	eval(&call_env, &stub, arena);
+	return *--stackp;
+}
+
+static struct value
+item(struct work *w, size_t i)
+{
+	if (w->op == Parallel_for_range)
+		return int_value(int_of(w->args[0]) + (int64_t)i);
+	if (type_of(w->items) == Slice_type)
+		return slice_of(w->items)->start[i];
+	return vector_get(vector_of(w->items), i);
+}
+
+static void
+run_chunk(struct work *w, size_t c, struct arena *arena)
+{
+	size_t i, from, to;
+	struct value acc;
+
+	from = c * w->n / w->chunks;
+	to = (c + 1) * w->n / w->chunks;
+	if (w->op != Parallel_reduce) {
+		for (i = from; i < to; i++) {
+			*stackp++ = item(w, i);
+			w->results[i] = call(w->f, 1, arena);
+		}
+		return;
+	}
+
+	acc = w->args[1];
+	for (i = from; i < to; i++) {
+		*stackp++ = acc;
+		*stackp++ = item(w, i);
+		acc = call(w->f, 2, arena);
+	}
+	w->results[c] = acc;
+}
+
+static bool
+take(uint64_t *range, size_t *c)
+{
+	uint64_t r = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+
+	do {
+		if (RANGE_LO(r) >= RANGE_HI(r))
+			return false;
+	} while (!__atomic_compare_exchange_n(range, &r,
+					      RANGE(RANGE_LO(r) + 1,
+						    RANGE_HI(r)),
+					      true, __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+	*c = RANGE_LO(r);
+	return true;
+}
+
+/*
+ * Take the upper half of the chunks of the worker with the most left and
+ * make them the range of worker self, which has none left.
+ */
+static bool
+steal(struct work *w, size_t self)
+{
+	size_t i, victim, left, most, mid;
+	uint64_t r;
+
+	for (;;) {
+		most = 0;
+		victim = self;
+		for (i = 0; i < w->workers; i++) {
+			r = __atomic_load_n(w->ranges + i, __ATOMIC_ACQUIRE);
+			left = RANGE_HI(r) - RANGE_LO(r);
+			if (RANGE_LO(r) < RANGE_HI(r) && left > most) {
+				most = left;
+				victim = i;
+			}
+		}
+		if (victim == self)
+			return false;
+
+		r = __atomic_load_n(w->ranges + victim, __ATOMIC_ACQUIRE);
+		if (RANGE_LO(r) >= RANGE_HI(r))
+			continue;
+		mid = RANGE_LO(r) + (RANGE_HI(r) - RANGE_LO(r)) / 2;
+		if (__atomic_compare_exchange_n(w->ranges + victim, &r,
+						RANGE(RANGE_LO(r), mid), false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			__atomic_store_n(w->ranges + self,
+					 RANGE(mid, RANGE_HI(r)),
+					 __ATOMIC_RELEASE);
+			return true;
+		}
+	}
+}
+
+/*
+ * Run the chunks of worker self and then those it can take from the others,
+ * making what they return in arena, until there are none left or a worker
+ * has jumped to stack_overflow_env.
+ */
+static void
+run_worker(struct work *w, size_t self, struct arena *arena)
+{
+	size_t c;
+
+	do
+		while (__atomic_load_n(&w->jumped, __ATOMIC_RELAXED) == 0 &&
+		       take(w->ranges + self, &c))
+			run_chunk(w, c, arena);
+	while (__atomic_load_n(&w->jumped, __ATOMIC_RELAXED) == 0 &&
+	       steal(w, self));
+}
+
+/*
+ * Run worker self in a thread of the pool. One that jumps to
+ * stack_overflow_env has reported what went wrong, and makes the others stop;
+ * an error is what the caller jumps on with, over an overflow.
+ */
+static void
+run_thread(struct work *w, size_t self)
+{
+	int jumped, prev;
+
+	eval_thread_begin(w->arenas + self, w->shared, w->nshared);
+	if ((jumped = sigsetjmp(stack_overflow_env, 1)) == 0)
+		run_worker(w, self, w->arenas + self);
+	else {
+		eval_reset();
+		stack_trim();
+		prev = __atomic_load_n(&w->jumped, __ATOMIC_RELAXED);
+		do
+			if (prev == STACK_ERROR)
+				break;
+		while (!__atomic_compare_exchange_n(&w->jumped, &prev, jumped,
+						    true, __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED));
+	}
+	eval_thread_end();
+}
+
+static void *
+pool_thread(void *arg)
+{
+	size_t self = (uintptr_t)arg, job = 0;
+	struct work *w;
+
+	in_pool = true;
+	stack_init(pool_depth);
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (pool_job == job)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		job = pool_job;
+		if (self >= (w = pool_work)->workers)
+			continue;
+		pthread_mutex_unlock(&pool_lock);
+
+		run_thread(w, self);
+
+		pthread_mutex_lock(&pool_lock);
+		if (--pool_running == 0)
+			pthread_cond_broadcast(&pool_cond);
+		while (!pool_taken)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		pthread_mutex_unlock(&pool_lock);
+
+		arena_release(w->arenas + self);
+		alloc_stats_flush();
+
+		pthread_mutex_lock(&pool_lock);
+		if (--pool_busy == 0)
+			pthread_cond_broadcast(&pool_cond);
+	}
+	return NULL;
+}
+
+/*
+ * Run every chunk in the threads of the pool and copy what they returned
+ * into the arena of the caller, which waits meanwhile so that what it made
+ * stays where it is. If a worker jumped to stack_overflow_env, the caller
+ * jumps on to the top level once they have all stopped.
+ */
+static void
+run_pool(struct work *w)
+{
+	struct arena *from[MAX_WORKERS];
+	size_t i, nresults;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_depth = stack_depth;
+	for (; pool_size < w->workers; pool_size++)
+		if (pthread_create(pool + pool_size, NULL, &pool_thread,
+				   (void *)(uintptr_t)pool_size) != 0) {
+			fprintf(stderr, "Cannot start a parallel worker.\n");
+			abort();
+		}
+	pool_work = w;
+	pool_running = pool_busy = w->workers;
+	pool_taken = false;
+	pool_job++;
+	pthread_cond_broadcast(&pool_cond);
+	while (pool_running != 0)
+		pthread_cond_wait(&pool_cond, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+
+	if (w->jumped == 0) {
+		for (i = 0; i < w->workers; i++)
+			from[i] = w->arenas + i;
+		nresults = (w->op == Parallel_reduce) ? w->chunks : w->n;
+		for (i = 0; i < nresults; i++)
+			if (is_heap_allocated(w->results[i]))
+				w->results[i] = arena_evacuate_all(w->arena,
+					from, w->workers, w->results[i]);
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	pool_taken = true;
+	pthread_cond_broadcast(&pool_cond);
+	while (pool_busy != 0)
+		pthread_cond_wait(&pool_cond, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * Run every chunk, in the threads of the pool if there is more than one
+ * worker, or else in the caller.
+ */
+static void
+run(struct work *w)
+{
+	sigjmp_buf caller_env;
+	size_t i;
+
+	for (i = 0; i < w->workers; i++)
+		w->ranges[i] = RANGE(i * w->chunks / w->workers,
+				     (i + 1) * w->chunks / w->workers);
+	w->jumped = 0;
+	if (w->workers > 1)
+		run_pool(w);
+	else {
+		/* Free what the call holds before reaching the top level. */
+		memcpy(caller_env, stack_overflow_env, sizeof(sigjmp_buf));
+		if ((w->jumped = sigsetjmp(stack_overflow_env, 1)) == 0)
+			run_worker(w, 0, w->arena);
+		memcpy(stack_overflow_env, caller_env, sizeof(sigjmp_buf));
+	}
+	if (w->jumped != 0) {
+		free(w->ranges);
+		siglongjmp(stack_overflow_env, w->jumped);
+	}
+}
+
+void
+parallel_init(void)
+{
+	long n;
+
+	if (parallel_workers == 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		parallel_workers = (n > 0) ? n : 1;
+	}
+	if (parallel_workers > MAX_WORKERS)
+		parallel_workers = MAX_WORKERS;
+}
+
+/*
+ * A map of a numeric vector makes another like it if what the calls returned
+ * fits, one of reals if the items are integers and some of the results are
+ * not, and a vector of values if any result is not a number.
+ */
+static enum elem_type
+result_elem(enum elem_type items, const struct value *results, size_t n)
+{
+	enum elem_type elem = items;
+	size_t i;
+
+	for (i = 0; i < n && elem != Value_elem; i++) {
+		if (!is_number(results[i]))
+			elem = Value_elem;
+		else if (elem == I64_elem && type_of(results[i]) != Integer_type)
+			elem = F64_elem;
+	}
+	return elem;
+}
+
+struct value
+parallel_apply(struct arena *arena, enum parallel_op op, struct value *args)
+{
+	struct work w;
+	struct vector *v;
+	struct value acc;
+	enum elem_type elem;
+	size_t i, nresults;
+
+	w.op = op;
+	w.args = args;
+	w.arena = arena;
+	if (op == Parallel_for_range) {
+		if (type_of(args[0]) != Integer_type ||
+		    type_of(args[1]) != Integer_type) {
+			fprintf(stderr, "type error: not integer\n");
+			abort();
+		}
+		w.n = (int_of(args[1]) > int_of(args[0]))
+			? int_of(args[1]) - int_of(args[0]) : 0;
+	} else {
+		w.items = args[parallel_arity[op] - 1];
+		if (type_of(w.items) == Slice_type)
+			w.n = slice_of(w.items)->len;
+		else if (type_of(w.items) == Vector_type)
+			w.n = vector_of(w.items)->len;
+		else {
+			fprintf(stderr, "type error: not vector\n");
+			abort();
+		}
+	}
+	acc = args[op == Parallel_for_range ? 2 : 0];
+	if (type_of(acc) != Function_type) {
+		fprintf(stderr, "type error: not function\n");
+		abort();
+	}
+	w.f = func_of(acc);
+
+	/*
+	 * A profiled build counts where threads would race, and a worker runs
+	 * the parallel calls it makes itself.
+	 */
+	w.workers = parallel_workers;
+#ifdef PROFILE
+	w.workers = 1;
+#endif
+	if (in_pool)
+		w.workers = 1;
+	w.chunks = w.workers * CHUNKS_PER_WORKER;
+	if (w.chunks > w.n)
+		w.chunks = w.n;
+	if (w.workers > w.chunks)
+		w.workers = (w.chunks > 0) ? w.chunks : 1;
+
+	nresults = (op == Parallel_reduce) ? w.chunks : w.n;
+	w.ranges = malloc(sizeof(uint64_t) * w.workers +
+			  sizeof(struct value) * nresults +
+			  sizeof(struct arena) * w.workers);
+	if (w.ranges == NULL) {
+		fprintf(stderr, "Out of memory for %zu results.\n", nresults);
+		abort();
+	}
+	w.results = (struct value *)(w.ranges + w.workers);
+	w.arenas = (struct arena *)(w.results + nresults);
+	for (i = 0; i < w.workers; i++)
+		w.arenas[i] = (struct arena)ARENA_INIT;
+	if (w.workers > 1) {
+		global_reserve();
+		w.shared = eval_arenas(arena, &w.nshared);
+	}
+	run(&w);
+
+	if (op == Parallel_reduce) {
+		acc = args[1];
+		for (i = 0; i < w.chunks; i++) {
+			*stackp++ = acc;
+			*stackp++ = w.results[i];
+			acc = call(w.f, 2, arena);
+		}
+	} else {
+		elem = Value_elem;
+		if (op == Parallel_map && type_of(w.items) == Vector_type)
+			elem = result_elem(vector_of(w.items)->elem, w.results,
+					   w.n);
+		v = alloc_typed_vector(arena, elem, w.n);
+		for (i = 0; i < w.n; i++)
+			vector_put(v, i, w.results[i]);
+		v->len = w.n;
+		acc = vector_value(v);
+	}
+	free(w.ranges);
+	return acc;
+}
@@ -0,0 +1,49 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <stddef.h>
+
+#include "alloc.h"
+#include "types.h"
+
+/*
+ * Calls of a function over the items of a vector or over a range of integers,
+ * split into chunks that a pool of worker threads take from each other as
+ * they run out, while the caller waits. Every function carries the state of
+ * its calls, so each thread evaluates with a stack, frames and arenas of its
+ * own and calls clones of the functions (see eval.c). What the calls return is
+ * made in an arena of each thread, and copied into the arena of the caller
+ * once they are done. Stores into globals are made one at a time, but calls
+ * that store into the same globals, or into variables of the functions they
+ * were defined in, race with each other. An error in any call stops the
+ * others and returns to the top level. A profiled build runs the calls in
+ * the caller, as does a worker that makes a parallel call itself.
+ */
+enum parallel_op {
+	Parallel_map,           /* A function and a vector. */
+	Parallel_reduce,        /* A function, its identity and a vector. */
+	Parallel_for_range,     /* From, to and a function. */
+
+	Num_parallel_ops,       /* Not really an op. */
+};
+
+/*
+ * The number of values each op takes.
+ */
+extern const size_t parallel_arity[Num_parallel_ops];
+
+/*
+ * The number of threads that share the work. Unless it is set first,
+ * parallel_init() makes it the number of processors online.
+ */
+extern size_t parallel_workers;
+
+void parallel_init(void);
+
+/*
+ * Apply op to the values at args, making what it returns in the arena.
+ */
+struct value parallel_apply(struct arena *, enum parallel_op,
+			    struct value *args);
+
+#endif
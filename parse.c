@@ -1,11 +1,13 @@
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include "lex.h"
 #include "parse.h"
 #include "types.h"
 #include "ident.h"
 #include "alloc.h"
+#include "builtin.h"
 
 void
 newlines(struct source_mapping *srcmap, size_t lines, size_t voffset)
@@ -74,6 +76,23 @@ assignvect(struct source_mapping *srcmap, struct vector v)
 
 static struct value parse_num(char *);
 
+/*
+ * Wrap the last item of v in as many quote forms as there were quote marks
+ * before it: 'x is read as (' x).
+ */
+static void
+quote_last(struct vector *v, struct arena *arena, size_t *quotes)
+{
+	struct vector *q;
+
+	for (; *quotes > 0; --*quotes) {
+		q = alloc_vector(arena, 0);
+		append(q, sym_value(Quote_builtin));
+		append(q, v->items[v->len - 1]);
+		v->items[v->len - 1] = vector_value(q);
+	}
+}
+
 /*
  * parse a token stream into a nested list structure representative of the
  * syntax. You get how lisp works.
@@ -84,16 +103,18 @@ static struct value parse_num(char *);
  */
 struct vector
 parse_until(struct token (*next_token)(void), struct source_mapping *srcmap,
-	    enum token_id halt_token)
+	    struct arena *arena, enum token_id halt_token)
 {
 	struct value v;
 	struct token curr;
-	struct vector res;
-	struct vector nil_vect = { 0, 0, NULL };
+	struct vector res, *vp;
+	struct vector nil_vect = { 0, 0, { NULL } };
+	size_t quotes = 0;
 
 
 	res.items = NULL;
 	res.len = res.cap = 0;
+	res.elem = Value_elem;
 
 	for (curr = next_token();; curr = next_token()) {
 		size_t preceding_lines = 0;
@@ -125,39 +146,46 @@ parse_until(struct token (*next_token)(void), struct source_mapping *srcmap,
 		case Number_tok:
 			/* Parse number. */
 			v = parse_num(curr.src);
-			if (v.type != Nil_type) {
+			if (type_of(v) != Nil_type) {
 				free(curr.src);
 			}
 			/* Otherwise error parsing the number. */
 			append(&res, v);
+			quote_last(&res, arena, &quotes);
 			break;
 
 		case Identifier_tok:
-			v.type = Symbol_type;
-			v.sym = ident_get_number(curr.src);
+			v = sym_value(ident_get_number(curr.src));
 			/*
 			 * TODO: more parsing here.
 			 */
-			if (ident_strings[v.sym] != curr.src)
+			if (ident_strings[sym_of(v)] != curr.src)
 				/*
 				 * We should free curr.src only if it is not
 				 * owned by ident.c
 				 */
 				free(curr.src);
 			append(&res, v);
+			quote_last(&res, arena, &quotes);
 			break;
 
 		case Paren_op_tok:
 			srcmap->residual += preceding_lines;
 			newvect(srcmap);
-			v.type = Vector_type;
-			v.v = alloc_vector(&global_heap, 0);
-			*v.v = parse_until(next_token, srcmap, Paren_cl_tok);
-			append(&res, v);
-			assignvect(srcmap, *v.v);
+			vp = alloc_vector(arena, 0);
+			*vp = parse_until(next_token, srcmap, arena,
+					  Paren_cl_tok);
+			append(&res, vector_value(vp));
+			quote_last(&res, arena, &quotes);
+			assignvect(srcmap, *vp);
 			newvect(srcmap);
 			continue;
 
+		case Quote_tok:
+			quotes++;
+			curr = next_token();
+			goto repeat;
+
 		case Paren_cl_tok:
 			/*
 			 * There was an error, a closing parenthesis should
@@ -178,38 +206,37 @@ parse_until(struct token (*next_token)(void), struct source_mapping *srcmap,
 }
 
 struct vector
-parse(struct token (*next_token)(void), struct source_mapping *srcmap)
+parse(struct token (*next_token)(void), struct source_mapping *srcmap,
+      struct arena *arena)
 {
 	struct vector v;
 
 	newvect(srcmap);
-	v = parse_until(next_token, srcmap, Empty_tok);
+	v = parse_until(next_token, srcmap, arena, Empty_tok);
 	assignvect(srcmap, v);
 	return v;
 }
 
 /*
  * Parse a number and extract its value. Returns a value of nil type on error.
- * TODO: add support for real/complex/imaginary numbers.
+ * Integers too large for a value become reals.
+ * TODO: add support for complex/imaginary numbers.
  */
 static struct value
 parse_num(char *src)
 {
-	char c;
-	struct value v = {
-		.type = Integer_type,
-		.i = 0,
-	};
-
-	while ((c = *src) != '\0') {
-		if (!isdigit(c)) {
-			v.type = Nil_type;
-			return v;
-		}
-		v.i *= 10;
-		v.i += c - '0';
-		src++;
-	}
-
-	return v;
+	char *end;
+	long long i;
+	double r;
+
+	errno = 0;
+	i = strtoll(src, &end, 10);
+	if (*end == '\0' && errno == 0 && int_fits(i))
+		return int_value(i);
+
+	/* Not an integer, or too large for one. */
+	r = strtod(src, &end);
+	if (*end != '\0' || end == src)
+		return type_value(Nil_type);
+	return real_value(r);
 }
@@ -26,6 +26,9 @@ struct source_mapping {
 	size_t  residual;
 };
 
-struct vector parse(struct token (*)(void), struct source_mapping *);
+struct arena;
+
+struct vector parse(struct token (*)(void), struct source_mapping *,
+		    struct arena *);
 
 #endif
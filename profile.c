@@ -0,0 +1,97 @@
+#ifdef PROFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "profile.h"
+
+struct prof_count prof_insts[Num_opcodes];
+struct prof_count *prof_last = NULL;
+enum opcode prof_last_inst;
+uint64_t prof_last_time;
+
+/*
+ * Every program that has been compiled, for the report.
+ */
+static struct prof_prog {
+	struct progm    *prog;
+	const char      *name;
+	uint64_t        cycles;
+} *progs = NULL;
+static size_t num_progs = 0, cap_progs = 0;
+
+void
+prof_register(struct progm *prog, const char *name)
+{
+	if (num_progs == cap_progs) {
+		cap_progs = cap_progs ? cap_progs << 1 : 16;
+		progs = realloc(progs, sizeof(struct prof_prog) * cap_progs);
+		if (progs == NULL) {
+			fprintf(stderr, "Out of memory for the profiler.\n");
+			abort();
+		}
+	}
+	progs[num_progs].prog = prog;
+	progs[num_progs].name = name;
+	num_progs++;
+}
+
+static int
+cmp_insts(const void *a, const void *b)
+{
+	uint64_t ca = prof_insts[*(const enum opcode *)a].cycles;
+	uint64_t cb = prof_insts[*(const enum opcode *)b].cycles;
+
+	return (ca < cb) - (ca > cb);
+}
+
+static int
+cmp_progs(const void *a, const void *b)
+{
+	uint64_t ca = ((const struct prof_prog *)a)->cycles;
+	uint64_t cb = ((const struct prof_prog *)b)->cycles;
+
+	return (ca < cb) - (ca > cb);
+}
+
+void
+prof_report(void)
+{
+	size_t i, ip;
+	uint64_t total = 0;
+	enum opcode order[Num_opcodes];
+
+	for (i = 0; i < Num_opcodes; i++) {
+		order[i] = i;
+		total += prof_insts[i].cycles;
+	}
+	if (total == 0)
+		return;
+	qsort(order, Num_opcodes, sizeof(enum opcode), cmp_insts);
+
+	fprintf(stderr, "%-14s%-5s%14s%16s%8s%9s\n",
+		"inst", "args", "hits", "cycles", "time", "cyc/hit");
+	for (i = 0; i < Num_opcodes; i++) {
+		struct prof_count *c = prof_insts + order[i];
+
+		if (c->hits == 0)
+			break;
+		fprintf(stderr, "%-14s%-5s%14llu%16llu%7.2f%%%9.1f\n",
+			inst_name(order[i]), inst_args(order[i]),
+			(unsigned long long)c->hits,
+			(unsigned long long)c->cycles,
+			100.0 * c->cycles / total, (double)c->cycles / c->hits);
+	}
+
+	for (i = 0; i < num_progs; i++)
+		for (progs[i].cycles = ip = 0; ip < progs[i].prog->len; ip++)
+			progs[i].cycles += progs[i].prog->prof[ip].cycles;
+	qsort(progs, num_progs, sizeof(struct prof_prog), cmp_progs);
+	for (i = 0; i < num_progs && progs[i].cycles > 0; i++) {
+		fprintf(stderr, "\n%s: %.2f%%\n", progs[i].name,
+			100.0 * progs[i].cycles / total);
+		disassemble_profile(*progs[i].prog, total);
+	}
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+/*
+ * Profiling of the bytecode, enabled by building with -DPROFILE. Every
+ * instruction executed is counted and charged the cycles until the next one is
+ * dispatched, both per opcode and per instruction of every program. A report
+ * is printed to stderr at exit.
+ */
+
+#include "bytecode.h"
+
+#ifdef PROFILE
+
+#include <stdint.h>
+#ifdef __x86_64__
+# include <x86intrin.h>
+#else
+# include <time.h>
+#endif
+
+struct prof_count {
+	uint64_t        hits;
+	uint64_t        cycles;
+};
+
+extern struct prof_count prof_insts[Num_opcodes];
+extern struct prof_count *prof_last;
+extern enum opcode prof_last_inst;
+extern uint64_t prof_last_time;
+
+static inline uint64_t
+prof_clock(void)
+{
+#ifdef __x86_64__
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Charge the previous instruction and count the one at prog->ip.
+ */
+static inline void
+prof_next(struct progm *prog)
+{
+	uint64_t now = prof_clock();
+
+	if (prof_last != NULL) {
+		prof_last->cycles += now - prof_last_time;
+		prof_insts[prof_last_inst].cycles += now - prof_last_time;
+	}
+	prof_last = prog->prof + prog->ip;
+	prof_last_inst = prog->code[prog->ip].inst;
+	prof_last->hits++;
+	prof_insts[prof_last_inst].hits++;
+	/* Leave our own overhead out. */
+	prof_last_time = prof_clock();
+}
+
+/*
+ * Charge the last instruction when leaving the evaluator, as the program may
+ * be grown before it is run again.
+ */
+static inline void
+prof_stop(void)
+{
+	uint64_t now = prof_clock();
+
+	if (prof_last == NULL)
+		return;
+	prof_last->cycles += now - prof_last_time;
+	prof_insts[prof_last_inst].cycles += now - prof_last_time;
+	prof_last = NULL;
+}
+
+void prof_register(struct progm *, const char *name);
+void prof_report(void);
+
+#else
+
+#define prof_next(prog)                 ((void)0)
+#define prof_stop()                     ((void)0)
+#define prof_register(prog, name)       ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,286 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "simd.h"
+
+const size_t simd_arity[Num_simd_ops] = {
+	[Simd_add] = 2,
+	[Simd_sub] = 2,
+	[Simd_mul] = 2,
+	[Simd_div] = 2,
+	[Simd_min] = 2,
+	[Simd_max] = 2,
+	[Simd_fma] = 3,
+	[Simd_sum] = 1,
+	[Simd_dot] = 2,
+	[Simd_norm] = 1,
+};
+
+struct kernels {
+	/* Indexed by the elementwise ops of two vectors. */
+	void    (*binary[Simd_fma])(double *, const double *, const double *,
+				    size_t);
+	void    (*fma)(double *, const double *, const double *,
+		       const double *, size_t);
+	double  (*sum)(const double *, size_t);
+	double  (*dot)(const double *, const double *, size_t);
+};
+
+/*
+ * Each version is the kernels below instantiated with the operations of its
+ * instruction set on its vector type T of W doubles. Items past the last
+ * whole vector are left to the scalar operations, which min and max agree
+ * with when one of the items is a NaN: both give the second. MULADD may
+ * round twice, FMA only once.
+ */
+#define scalar_ATTR
+#define scalar_T                double
+#define scalar_W                1
+#define scalar_ZERO             0.0
+#define scalar_LOAD(p)          (*(p))
+#define scalar_STORE(p, v)      (*(p) = (v))
+#define scalar_ADD(a, b)        ((a) + (b))
+#define scalar_SUB(a, b)        ((a) - (b))
+#define scalar_MUL(a, b)        ((a) * (b))
+#define scalar_DIV(a, b)        ((a) / (b))
+#define scalar_MIN(a, b)        ((a) < (b) ? (a) : (b))
+#define scalar_MAX(a, b)        ((a) > (b) ? (a) : (b))
+#define scalar_FMA(a, b, c)     fma((a), (b), (c))
+#define scalar_MULADD(a, b, c)  ((a) * (b) + (c))
+
+#if defined(__x86_64__)
+
+#define sse2_ATTR               __attribute__((target("sse2")))
+#define sse2_T                  __m128d
+#define sse2_W                  2
+#define sse2_ZERO               _mm_setzero_pd()
+#define sse2_LOAD(p)            _mm_loadu_pd(p)
+#define sse2_STORE(p, v)        _mm_storeu_pd((p), (v))
+#define sse2_ADD(a, b)          _mm_add_pd((a), (b))
+#define sse2_SUB(a, b)          _mm_sub_pd((a), (b))
+#define sse2_MUL(a, b)          _mm_mul_pd((a), (b))
+#define sse2_DIV(a, b)          _mm_div_pd((a), (b))
+#define sse2_MIN(a, b)          _mm_min_pd((a), (b))
+#define sse2_MAX(a, b)          _mm_max_pd((a), (b))
+#define sse2_MULADD(a, b, c)    _mm_add_pd(_mm_mul_pd((a), (b)), (c))
+
+#define avx2_ATTR               __attribute__((target("avx2,fma")))
+#define avx2_T                  __m256d
+#define avx2_W                  4
+#define avx2_ZERO               _mm256_setzero_pd()
+#define avx2_LOAD(p)            _mm256_loadu_pd(p)
+#define avx2_STORE(p, v)        _mm256_storeu_pd((p), (v))
+#define avx2_ADD(a, b)          _mm256_add_pd((a), (b))
+#define avx2_SUB(a, b)          _mm256_sub_pd((a), (b))
+#define avx2_MUL(a, b)          _mm256_mul_pd((a), (b))
+#define avx2_DIV(a, b)          _mm256_div_pd((a), (b))
+#define avx2_MIN(a, b)          _mm256_min_pd((a), (b))
+#define avx2_MAX(a, b)          _mm256_max_pd((a), (b))
+#define avx2_FMA(a, b, c)       _mm256_fmadd_pd((a), (b), (c))
+#define avx2_MULADD(a, b, c)    _mm256_fmadd_pd((a), (b), (c))
+
+#define avx512_ATTR             __attribute__((target("avx512f")))
+#define avx512_T                __m512d
+#define avx512_W                8
+#define avx512_ZERO             _mm512_setzero_pd()
+#define avx512_LOAD(p)          _mm512_loadu_pd(p)
+#define avx512_STORE(p, v)      _mm512_storeu_pd((p), (v))
+#define avx512_ADD(a, b)        _mm512_add_pd((a), (b))
+#define avx512_SUB(a, b)        _mm512_sub_pd((a), (b))
+#define avx512_MUL(a, b)        _mm512_mul_pd((a), (b))
+#define avx512_DIV(a, b)        _mm512_div_pd((a), (b))
+#define avx512_MIN(a, b)        _mm512_min_pd((a), (b))
+#define avx512_MAX(a, b)        _mm512_max_pd((a), (b))
+#define avx512_FMA(a, b, c)     _mm512_fmadd_pd((a), (b), (c))
+#define avx512_MULADD(a, b, c)  _mm512_fmadd_pd((a), (b), (c))
+
+#endif
+
+#define BINARY_KERNEL(isa, name, OP)					\
+	static isa##_ATTR void						\
+	isa##_##name(double *d, const double *a, const double *b, size_t n) \
+	{								\
+		size_t i;						\
+									\
+		for (i = 0; i + isa##_W <= n; i += isa##_W)		\
+			isa##_STORE(d + i, isa##_##OP(isa##_LOAD(a + i), \
+						      isa##_LOAD(b + i))); \
+		for (; i < n; i++)					\
+			d[i] = scalar_##OP(a[i], b[i]);			\
+	}
+
+#define FMA_KERNEL(isa)							\
+	static isa##_ATTR void						\
+	isa##_fma(double *d, const double *a, const double *b,		\
+		  const double *c, size_t n)				\
+	{								\
+		size_t i;						\
+									\
+		for (i = 0; i + isa##_W <= n; i += isa##_W)		\
+			isa##_STORE(d + i, isa##_FMA(isa##_LOAD(a + i),	\
+						     isa##_LOAD(b + i),	\
+						     isa##_LOAD(c + i))); \
+		for (; i < n; i++)					\
+			d[i] = fma(a[i], b[i], c[i]);			\
+	}
+
+/*
+ * The reductions keep a sum in each lane of acc and add the lanes up at the
+ * end.
+ */
+#define REDUCTION_KERNELS(isa)						\
+	static isa##_ATTR double					\
+	isa##_lanes(isa##_T acc)					\
+	{								\
+		double lanes[isa##_W], r = 0;				\
+		size_t i;						\
+									\
+		isa##_STORE(lanes, acc);				\
+		for (i = 0; i < isa##_W; i++)				\
+			r += lanes[i];					\
+		return r;						\
+	}								\
+									\
+	static isa##_ATTR double					\
+	isa##_sum(const double *a, size_t n)				\
+	{								\
+		isa##_T acc = isa##_ZERO;				\
+		double r;						\
+		size_t i;						\
+									\
+		for (i = 0; i + isa##_W <= n; i += isa##_W)		\
+			acc = isa##_ADD(acc, isa##_LOAD(a + i));	\
+		for (r = isa##_lanes(acc); i < n; i++)			\
+			r += a[i];					\
+		return r;						\
+	}								\
+									\
+	static isa##_ATTR double					\
+	isa##_dot(const double *a, const double *b, size_t n)		\
+	{								\
+		isa##_T acc = isa##_ZERO;				\
+		double r;						\
+		size_t i;						\
+									\
+		for (i = 0; i + isa##_W <= n; i += isa##_W)		\
+			acc = isa##_MULADD(isa##_LOAD(a + i),		\
+					   isa##_LOAD(b + i), acc);	\
+		for (r = isa##_lanes(acc); i < n; i++)			\
+			r += a[i] * b[i];				\
+		return r;						\
+	}
+
+#define KERNELS(isa)							\
+	BINARY_KERNEL(isa, add, ADD)					\
+	BINARY_KERNEL(isa, sub, SUB)					\
+	BINARY_KERNEL(isa, mul, MUL)					\
+	BINARY_KERNEL(isa, div, DIV)					\
+	BINARY_KERNEL(isa, min, MIN)					\
+	BINARY_KERNEL(isa, max, MAX)					\
+	REDUCTION_KERNELS(isa)
+
+#define KERNEL_TABLE(isa, fma_kernel) {					\
+		{							\
+			isa##_add, isa##_sub, isa##_mul,		\
+			isa##_div, isa##_min, isa##_max,		\
+		},							\
+		fma_kernel, isa##_sum, isa##_dot,			\
+	}
+
+KERNELS(scalar)
+FMA_KERNEL(scalar)
+
+static const struct kernels scalar_kernels = KERNEL_TABLE(scalar, scalar_fma);
+
+#if defined(__x86_64__)
+
+KERNELS(sse2)
+KERNELS(avx2)
+FMA_KERNEL(avx2)
+KERNELS(avx512)
+FMA_KERNEL(avx512)
+
+/* SSE2 has no fused multiply-add. */
+static const struct kernels sse2_kernels = KERNEL_TABLE(sse2, scalar_fma);
+static const struct kernels avx2_kernels = KERNEL_TABLE(avx2, avx2_fma);
+static const struct kernels avx512_kernels =
+	KERNEL_TABLE(avx512, avx512_fma);
+
+#endif
+
+static const struct kernels *kernels = &scalar_kernels;
+
+const char *simd_isa = "scalar";
+
+void
+simd_init(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		kernels = &avx512_kernels;
+		simd_isa = "avx-512";
+	} else if (__builtin_cpu_supports("avx2") &&
+		   __builtin_cpu_supports("fma")) {
+		kernels = &avx2_kernels;
+		simd_isa = "avx2";
+	} else {
+		kernels = &sse2_kernels;
+		simd_isa = "sse2";
+	}
+#endif
+}
+
+static struct vector *
+f64vector_of(struct value v)
+{
+	if (type_of(v) != Vector_type || vector_of(v)->elem != F64_elem) {
+		fprintf(stderr, "type error: not f64vector\n");
+		abort();
+	}
+	return vector_of(v);
+}
+
+struct value
+simd_apply(struct arena *arena, enum simd_op op, struct value *args)
+{
+	struct vector *v[3], *d;
+	size_t i, n;
+
+	v[0] = f64vector_of(args[0]);
+	n = v[0]->len;
+	for (i = 1; i < simd_arity[op]; i++) {
+		v[i] = f64vector_of(args[i]);
+		if (v[i]->len != n) {
+			fprintf(stderr, "Vectors differ in length.\n");
+			abort();
+		}
+	}
+
+	switch (op) {
+	case Simd_sum:
+		return real_value(kernels->sum(v[0]->f64, n));
+
+	case Simd_dot:
+		return real_value(kernels->dot(v[0]->f64, v[1]->f64, n));
+
+	case Simd_norm:
+		return real_value(sqrt(kernels->dot(v[0]->f64, v[0]->f64, n)));
+
+	default:
+		break;
+	}
+
+	d = alloc_typed_vector(arena, F64_elem, n);
+	d->len = n;
+	if (op == Simd_fma)
+		kernels->fma(d->f64, v[0]->f64, v[1]->f64, v[2]->f64, n);
+	else
+		kernels->binary[op](d->f64, v[0]->f64, v[1]->f64, n);
+	return vector_value(d);
+}
@@ -0,0 +1,49 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include <stddef.h>
+
+#include "alloc.h"
+#include "types.h"
+
+/*
+ * Native kernels over f64 vectors: elementwise operations, which make a new
+ * vector, and reductions, which give a real. Each has an SSE2, an AVX2 and an
+ * AVX-512 version on x86-64 and a scalar one everywhere, and simd_init()
+ * picks the widest the processor runs. Reductions add up in a different
+ * order in each, so their last bits may differ between processors.
+ */
+enum simd_op {
+	Simd_add,
+	Simd_sub,
+	Simd_mul,
+	Simd_div,
+	Simd_min,
+	Simd_max,
+	Simd_fma,       /* a * b + c, rounded once. */
+	Simd_sum,
+	Simd_dot,
+	Simd_norm,      /* Euclidean. */
+
+	Num_simd_ops,   /* Not really an op. */
+};
+
+/*
+ * The number of vectors each op takes.
+ */
+extern const size_t simd_arity[Num_simd_ops];
+
+/*
+ * The name of the version simd_init() picked.
+ */
+extern const char *simd_isa;
+
+void simd_init(void);
+
+/*
+ * Apply op to the vectors at args, making the vector it returns in the
+ * arena.
+ */
+struct value simd_apply(struct arena *, enum simd_op, struct value *args);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "types.h"
+#include "stack.h"
+
+/*
+ * Let and calls bump stackp past all of the locals of a function before any
+ * of them is written, so the guard has to be larger than any frame could be.
+ */
+#define GUARD_SIZE      ((size_t)1 << 20)
+
+__thread struct value *stack = NULL;
+__thread struct value *stackp = NULL;
+__thread size_t stack_depth;
+__thread sigjmp_buf stack_overflow_env;
+
+static __thread uintptr_t guard_start, guard_end;
+
+static void
+segv_handler(int sig, siginfo_t *info, void *ucontext)
+{
+	uintptr_t addr = (uintptr_t)info->si_addr;
+
+	if (addr >= guard_start && addr < guard_end)
+		siglongjmp(stack_overflow_env, STACK_OVERFLOW);
+
+	/*
+	 * Not ours. Returning retries the faulting instruction, which now
+	 * gets the default action.
+	 */
+	signal(sig, SIG_DFL);
+}
+
+void
+stack_init(size_t depth)
+{
+	char *base;
+	size_t page, size;
+	stack_t ss;
+	struct sigaction sa;
+
+	page = sysconf(_SC_PAGESIZE);
+	size = (depth * sizeof(struct value) + page - 1) & ~(page - 1);
+	base = mmap(NULL, size + GUARD_SIZE, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED ||
+	    mprotect(base, size, PROT_READ | PROT_WRITE) != 0) {
+		fprintf(stderr, "Cannot reserve a stack of %zu values.\n",
+			depth);
+		abort();
+	}
+	stack = stackp = (struct value *)base;
+	stack_depth = size / sizeof(struct value);
+	guard_start = (uintptr_t)base + size;
+	guard_end = guard_start + GUARD_SIZE;
+
+	/* The handler may run because the C stack overflowed, too. */
+	ss.ss_size = SIGSTKSZ;
+	ss.ss_sp = malloc(ss.ss_size);
+	ss.ss_flags = 0;
+	if (ss.ss_sp == NULL || sigaltstack(&ss, NULL) != 0) {
+		fprintf(stderr, "Cannot set up a signal stack.\n");
+		abort();
+	}
+
+	sa.sa_sigaction = &segv_handler;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, NULL);
+}
+
+/*
+ * Give the pages above stackp back to the kernel, e.g. after an overflow.
+ */
+void
+stack_trim(void)
+{
+	uintptr_t page, start;
+
+	page = sysconf(_SC_PAGESIZE);
+	start = ((uintptr_t)stackp + page - 1) & ~(page - 1);
+	if (start < guard_start)
+		madvise((void *)start, guard_start - start, MADV_DONTNEED);
+}
@@ -0,0 +1,37 @@
+#ifndef _STACK_H_
+#define _STACK_H_
+
+#include <setjmp.h>
+#include <stddef.h>
+
+#include "types.h"
+
+/*
+ * The value stack of the evaluator. It is a reservation of stack_depth values
+ * that the kernel commits as it is touched, followed by an inaccessible guard
+ * region. Pushes are never bounds checked: running into the guard raises
+ * SIGSEGV, which is turned into a siglongjmp() to stack_overflow_env.
+ * Every thread that evaluates has a stack of its own, which it sets up with
+ * stack_init().
+ */
+#define STACK_DEFAULT_DEPTH     ((size_t)1 << 24)
+
+extern __thread struct value *stack;
+extern __thread struct value *stackp;
+extern __thread size_t stack_depth;
+
+/*
+ * Must be set with sigsetjmp() before anything is evaluated. An overflow jumps
+ * to it with STACK_OVERFLOW. Errors that leave the evaluator in no worse a
+ * state report themselves and jump to it with STACK_ERROR, so that the top
+ * level goes on to the next input.
+ */
+#define STACK_OVERFLOW          1
+#define STACK_ERROR             2
+
+extern __thread sigjmp_buf stack_overflow_env;
+
+void stack_init(size_t depth);
+void stack_trim(void);
+
+#endif
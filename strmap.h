@@ -9,13 +9,14 @@ typedef struct map strmap;
 int str_cmp(void *, void *);
 size_t str_hash(void *);
 
-#define STRMAP_INIT { 0, 0, NULL, str_cmp, str_hash }
+#define STRMAP_INIT { 0, 0, NULL, str_cmp, str_hash, NULL }
 
 static inline void
 strmap_init(strmap *p)
 {
 	p->compare = str_cmp;
 	p->hash = str_hash;
+	p->alloc = NULL;
 	p->len = p->size = 0;
 	p->buckets = NULL;
 }
@@ -18,6 +18,7 @@ symtab_init(symtab *p)
 {
 	p->compare = cmp;
 	p->hash = hash;
+	p->alloc = NULL;
 	p->len = p->size = 0;
 	p->buckets = NULL;
 }
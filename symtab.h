@@ -14,7 +14,8 @@ symtab_clear(symtab *p)
 {
 	if (p->buckets == NULL)
 		return;
-	free(p->buckets);
+	if (p->alloc == NULL)
+		free(p->buckets);
 	p->buckets = NULL;
 	p->len = p->size = 0;
 }
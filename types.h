@@ -1,6 +1,11 @@
 #ifndef _TYPES_H_
 #define _TYPES_H_
 
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "bytecode.h"
 
 /*
@@ -23,6 +28,7 @@ enum type {
 	Vector_type,
 	Slice_type,
 	Function_type,
+	Matrix_type,
 };
 
 static inline const char *
@@ -39,7 +45,7 @@ type_to_str(enum type id)
 		"vector",
 //		"list",         /* Slices are "lists". */
 		"function",
-		"???",
+		"matrix",
 		"???",
 		"???",
 	};
@@ -50,12 +56,106 @@ struct pair;
 struct vector;
 struct slice;
 struct func;
+struct matrix;
+struct arena;
+
+/*
+ * Values are a type and a payload, and are only accessed through the
+ * functions below. With NANBOX defined, they are packed into 64 bits: reals
+ * are stored as their bits offset by 2^51, which leaves the patterns below
+ * 2^51 free for every other type. Those hold the type in bits 48 to 50 and
+ * the payload in the low 48 bits. Integers are then limited to 48 bits, and
+ * pointers must fit in 48 bits, as they do on x86-64 and arm64. An all-zero
+ * value is an error in both representations.
+ *
+ * That leaves no tag for matrices. They share the tag of slices and set the
+ * lowest bit of their pointer, which is clear in every other pointer, as
+ * objects are aligned to 8 bytes.
+ */
+#ifdef NANBOX
+
+struct value {
+	uint64_t                bits;
+};
+
+#define NANBOX_PAYLOAD          (((uint64_t)1 << 48) - 1)
+#define NANBOX_REAL_OFFSET      ((uint64_t)1 << 51)
+
+#define VALUE_INT_MIN           (-((int64_t)1 << 47))
+#define VALUE_INT_MAX           (((int64_t)1 << 47) - 1)
+
+static inline enum type
+type_of(struct value v)
+{
+	uint64_t tag = v.bits >> 48;
+
+	if (tag > 7)
+		return Real_type;
+	if (tag == Slice_type - 1 && (v.bits & 1))
+		return Matrix_type;
+	return (tag < Real_type) ? (enum type)tag : (enum type)(tag + 1);
+}
+
+static inline struct value
+box(enum type type, uint64_t payload)
+{
+	uint64_t tag;
+	struct value v;
+
+	if (type == Matrix_type) {
+		type = Slice_type;
+		payload |= 1;
+	}
+	tag = (type < Real_type) ? type : type - 1;
+	v.bits = (tag << 48) | (payload & NANBOX_PAYLOAD);
+	return v;
+}
+
+static inline uint64_t
+payload_of(struct value v)
+{
+	return v.bits & NANBOX_PAYLOAD;
+}
+
+static inline int64_t
+int_of(struct value v)
+{
+	return (int64_t)(v.bits << 16) >> 16;
+}
+
+static inline double
+real_of(struct value v)
+{
+	double r;
+	uint64_t bits = v.bits - NANBOX_REAL_OFFSET;
+
+	memcpy(&r, &bits, sizeof(r));
+	return r;
+}
+
+static inline struct value
+real_value(double r)
+{
+	struct value v;
+
+	if (r != r)
+		v.bits = UINT64_C(0x7ff8000000000000);  /* One NaN for all. */
+	else
+		memcpy(&v.bits, &r, sizeof(r));
+	v.bits += NANBOX_REAL_OFFSET;
+	return v;
+}
+
+#define PTR_OF(v, ptr_type)						\
+	((ptr_type *)(uintptr_t)(payload_of(v) & ~(uint64_t)7))
+
+#else
 
 struct value {
 	enum type               type;
 	union {
-		int32_t         i;      /* integer      */
-		float           r;      /* real         */
+		int64_t         i;      /* integer      */
+		double          r;      /* real         */
 		size_t          sym;    /* symbol       */
 		size_t          o;      /* offset       */
 //		struct list     *l;     /* list         */
@@ -63,29 +163,266 @@ struct value {
 		struct vector   *v;     /* vector       */
 		struct slice    *slice; /* slice        */
 		struct func     *f;     /* function     */
+		struct matrix   *m;     /* matrix       */
+		uint64_t        payload;
 	};
 };
 
+#define VALUE_INT_MIN           INT64_MIN
+#define VALUE_INT_MAX           INT64_MAX
+
+static inline enum type
+type_of(struct value v)
+{
+	return v.type;
+}
+
+static inline struct value
+box(enum type type, uint64_t payload)
+{
+	struct value v = { .type = type, .payload = payload, };
+
+	return v;
+}
+
+static inline uint64_t
+payload_of(struct value v)
+{
+	return v.payload;
+}
+
+static inline int64_t
+int_of(struct value v)
+{
+	return v.i;
+}
+
+static inline double
+real_of(struct value v)
+{
+	return v.r;
+}
+
+static inline struct value
+real_value(double r)
+{
+	struct value v = { .type = Real_type, .r = r, };
+
+	return v;
+}
+
+#define PTR_OF(v, ptr_type)     ((ptr_type *)(v).payload)
+
+#endif
+
+/*
+ * True if an integer can be held by a value.
+ */
+static inline bool
+int_fits(int64_t i)
+{
+	return i >= VALUE_INT_MIN && i <= VALUE_INT_MAX;
+}
+
+static inline struct value
+int_value(int64_t i)
+{
+	return box(Integer_type, (uint64_t)i);
+}
+
+static inline struct value
+type_value(enum type type)
+{
+	return box(type, 0);
+}
+
+static inline struct value
+sym_value(size_t sym)
+{
+	return box(Symbol_type, sym);
+}
+
+static inline size_t
+sym_of(struct value v)
+{
+	return payload_of(v);
+}
+
+static inline struct value
+pair_value(struct pair *p)
+{
+	return box(Pair_type, (uintptr_t)p);
+}
+
+static inline struct pair *
+pair_of(struct value v)
+{
+	return PTR_OF(v, struct pair);
+}
+
+static inline struct value
+vector_value(struct vector *vp)
+{
+	return box(Vector_type, (uintptr_t)vp);
+}
+
+static inline struct vector *
+vector_of(struct value v)
+{
+	return PTR_OF(v, struct vector);
+}
+
+static inline struct value
+slice_value(struct slice *s)
+{
+	return box(Slice_type, (uintptr_t)s);
+}
+
+static inline struct slice *
+slice_of(struct value v)
+{
+	return PTR_OF(v, struct slice);
+}
+
+static inline struct value
+func_value(struct func *f)
+{
+	return box(Function_type, (uintptr_t)f);
+}
+
+static inline struct func *
+func_of(struct value v)
+{
+	return PTR_OF(v, struct func);
+}
+
+static inline struct value
+matrix_value(struct matrix *m)
+{
+	return box(Matrix_type, (uintptr_t)m);
+}
+
+static inline struct matrix *
+matrix_of(struct value v)
+{
+	return PTR_OF(v, struct matrix);
+}
+
+/*
+ * The object a heap allocated value points to.
+ */
+static inline void *
+ptr_of(struct value v)
+{
+	return PTR_OF(v, void);
+}
+
 struct pair {
 	struct value    car;
 	struct pair     *cdr;
 };
 
+/*
+ * The stack slots a pair takes when it is allocated in a frame.
+ */
+#define PAIR_SLOTS							\
+	((sizeof(struct pair) + sizeof(struct value) - 1) /		\
+	 sizeof(struct value))
+
+/*
+ * The items of a vector are values, or, in a numeric vector, bare numbers of
+ * one type packed one after the other. Numeric vectors appear as vectors to
+ * the program, but are only ever taken apart by vector-ref.
+ */
+enum elem_type {
+	Value_elem = 0,
+	F64_elem,
+	I64_elem,
+	F32_elem,
+};
+
 struct vector {
 	size_t          len, cap;
-	struct value    *items;
+	union {
+		struct value    *items;
+		double          *f64;
+		int64_t         *i64;
+		float           *f32;
+	};
+	enum elem_type  elem;
 };
 
+static inline size_t
+elem_size(enum elem_type elem)
+{
+	static const size_t sizes[] = {
+		[Value_elem] = sizeof(struct value),
+		[F64_elem] = sizeof(double),
+		[I64_elem] = sizeof(int64_t),
+		[F32_elem] = sizeof(float),
+	};
+
+	return sizes[elem];
+}
+
+/*
+ * The size of the items a vector has room for.
+ */
+static inline size_t
+items_size(struct vector *vp)
+{
+	return vp->cap * elem_size(vp->elem);
+}
+
 /*
  * Slices are an internal type and appear as vectors to the program. They
- * are immutable references to a portion of a vector. A slice must be
- * copied to a list before it may be modified.
+ * are immutable references to a portion of a vector, whose items they share
+ * and keep alive. The items of a vector never move, as vectors made at run
+ * time never grow. A slice must be copied to a vector before it may be
+ * modified.
  */
 struct slice {
 	size_t          len;
 	struct value    *start;
+	struct vector   *parent;
 };
 
+/*
+ * Matrices are views of the items of an f64 vector, which they keep alive,
+ * as rows and columns of doubles some number of items apart. A matrix is
+ * made with its rows one after the other, and its transpose is a view of
+ * the same items with the strides swapped.
+ */
+struct matrix {
+	size_t          rows, cols;
+	ptrdiff_t       row_stride, col_stride;
+	double          *start;
+	struct vector   *data;
+};
+
+static inline double *
+matrix_item(struct matrix *m, size_t i, size_t j)
+{
+	return m->start + (ptrdiff_t)i * m->row_stride +
+		(ptrdiff_t)j * m->col_stride;
+}
+
+/*
+ * The items of v, a vector or a slice.
+ */
+static inline struct slice
+items_of(struct value v)
+{
+	struct slice s;
+
+	if (type_of(v) == Slice_type)
+		return *slice_of(v);
+	s.len = vector_of(v)->len;
+	s.start = vector_of(v)->items;
+	s.parent = vector_of(v);
+	return s;
+}
+
 void append(struct vector *, struct value v);
 
 struct slice slice(struct vector *, size_t from, size_t to);
@@ -93,9 +430,17 @@ struct slice slice_to(struct vector *, size_t to);
 struct slice slice_from(struct vector *, size_t from);
 
 /*
- * Copy a slice into a new vector. Caller is responsible for cleaning up memory.
+ * Copy a slice into a new vector in the arena.
  */
-struct list *make_vector(struct slice);
+struct vector *make_vector(struct arena *, struct slice);
+
+/*
+ * Read and write the ith item of a vector of any type as a value. Numbers
+ * are converted to the type of the items; other values cannot be stored in
+ * a numeric vector.
+ */
+struct value vector_get(struct vector *, size_t i);
+void vector_put(struct vector *, size_t i, struct value);
 
 struct context;
 
@@ -117,10 +462,29 @@ struct func {
 		 * local_vars will be.
 		 */
 		unsigned int    closure : 1;
+		/*
+		 * A copy that a thread other than the first calls in place of
+		 * the function (see eval.c).
+		 */
+		unsigned int    clone : 1;
 	} flags;
 
 	enum type       return_type;
 
+	/*
+	 * Calls made by the interpreter, and the native code of the function
+	 * once it has been compiled (see jit.h).
+	 */
+	unsigned int    calls;
+	void            *native;
+
+	/*
+	 * The values a closure made by Lambda captured. They are allocated
+	 * along with the function, right after it.
+	 */
+	struct value    *captures;
+	size_t          ncaptures;
+
 	/*
 	 * Possible idea for clean up: keep track of every variable outside the
 	 * scope of the function that has been set at least once.
@@ -1,5 +1,9 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "alloc.h"
+#include "num.h"
 #include "types.h"
 
 /*
@@ -10,40 +14,103 @@
 void
 append(struct vector *vp, struct value v)
 {
+	size_t cap = vp->cap;
+
 	if (vp->cap == 0)
 		vp->cap = 1;
 	if (vp->len + 1 >= vp->cap) {
 		vp->cap <<= 1;
-		vp->items = realloc(vp->items,
-				    sizeof(struct value) * vp->cap);
+		vp->items = slab_realloc(vp->items,
+					 sizeof(struct value) * cap,
+					 sizeof(struct value) * vp->cap);
 	}
 
 	vp->items[vp->len++] = v;
 }
 
 /*
- * Create a slice of a list starting at 'from' and ending at 'to'.
+ * Create a slice of a vector starting at 'from' and ending before 'to'.
  */
 struct slice
 slice(struct vector *vp, size_t from, size_t to)
 {
-	struct slice f = { 0, NULL };
+	struct slice f = { to - from, vp->items + from, vp };
 	return f;
 }
 
 /*
- * Create a slice of a list ...
+ * Create a slice of the first 'to' items of a vector.
  */
 struct slice
 slice_to(struct vector *lp, size_t to)
 {
-	struct slice f = { 0, NULL };
-	return f;
+	return slice(lp, 0, to);
 }
 
 struct slice
 slice_from(struct vector *lp, size_t from)
 {
-	struct slice f = { 0, NULL };
-	return f;
+	return slice(lp, from, lp->len);
+}
+
+struct vector *
+make_vector(struct arena *a, struct slice s)
+{
+	struct vector *vp;
+
+	vp = alloc_vector(a, s.len);
+	memcpy(vp->items, s.start, s.len * sizeof(struct value));
+	vp->len = s.len;
+	return vp;
+}
+
+struct value
+vector_get(struct vector *vp, size_t i)
+{
+	switch (vp->elem) {
+	case F64_elem:
+		return real_value(vp->f64[i]);
+
+	case I64_elem:
+		/* Like arithmetic that overflows. */
+		if (!int_fits(vp->i64[i]))
+			return real_value(vp->i64[i]);
+		return int_value(vp->i64[i]);
+
+	case F32_elem:
+		return real_value(vp->f32[i]);
+
+	default:
+		return vp->items[i];
+	}
+}
+
+void
+vector_put(struct vector *vp, size_t i, struct value v)
+{
+	if (vp->elem != Value_elem && !is_number(v)) {
+		fprintf(stderr, "type error: not a number\n");
+		abort();
+	}
+	switch (vp->elem) {
+	case F64_elem:
+		vp->f64[i] = to_real(v);
+		break;
+
+	case I64_elem:
+		if (type_of(v) != Integer_type) {
+			fprintf(stderr, "type error: not an integer\n");
+			abort();
+		}
+		vp->i64[i] = int_of(v);
+		break;
+
+	case F32_elem:
+		vp->f32[i] = to_real(v);
+		break;
+
+	default:
+		vp->items[i] = v;
+		break;
+	}
 }